@@ -39,17 +39,16 @@
 
 /*
  *  The DatagramQueueEntry is a queue header for the in-kernel VMCI
- *  datagram queues. It is allocated in non-paged memory, as the
- *  content is accessed while holding a spinlock. The pending datagram
- *  itself may be allocated from paged memory. We shadow the size of
- *  the datagram in the non-paged queue entry as this size is used
- *  while holding the same spinlock as above.
+ *  datagram queues. The pending datagram is stored right behind it in
+ *  the same allocation (see VMCIContext_AllocDatagram), which is in
+ *  non-paged memory, as the content is accessed while holding a
+ *  spinlock.
  */
 
 typedef struct DatagramQueueEntry {
    VMCIListItem   listItem;  /* For queuing. */
    size_t         dgSize;    /* Size of datagram. */
-   VMCIDatagram   *dg;       /* Pending datagram. */
+   VMCIDatagram   *dg;       /* Pending datagram, following the entry. */
 } DatagramQueueEntry;
 
 
@@ -67,8 +66,24 @@ typedef struct VMCIFilterState {
 } VMCIFilterState;
 
 
+/*
+ * Doorbells registered by a context, hashed by resource ID so that
+ * notifying one does not scan the context's handle arrays.
+ */
+
+#define VMCI_CONTEXT_DOORBELL_HASH_SIZE 128
+
+typedef struct VMCIContextDoorbell {
+   struct VMCIContextDoorbell *next;    /* Hash chain. */
+   VMCIHandle                  handle;
+   Bool                        pending; /* In pendingDoorbellArray. */
+} VMCIContextDoorbell;
+
+
 struct VMCIContext {
    VMCIListItem       listItem;         /* For global VMCI list. */
+   struct VMCIContext *hashNext;        /* Next in CID hash chain, RCU. */
+   VMCIRcuHead        rcu;              /* Defers freeing past lookups. */
    VMCIId             cid;
    Atomic_uint32      refCount;
    VMCIList           datagramQueue;    /* Head of per VM queue. */
@@ -95,6 +110,12 @@ struct VMCIContext {
                                          */
    VMCIHandleArray    *doorbellArray;   /* Doorbells created by context. */
    VMCIHandleArray    *pendingDoorbellArray; /* Doorbells pending for context. */
+   VMCIHandleArray    *spareDoorbellArray; /*
+                                            * Empty array swapped in for
+                                            * pendingDoorbellArray when the
+                                            * notifications are received.
+                                            */
+   VMCIContextDoorbell *doorbellHash[VMCI_CONTEXT_DOORBELL_HASH_SIZE];
    VMCIHandleArray    *notifierArray;   /* Contexts current context is subscribing to. */
    VMCIHost           hostContext;
    VMCIPrivilegeFlags privFlags;
@@ -47,6 +47,7 @@
 #define LGPFX "VMCIContext: "
 
 static void VMCIContextFreeContext(VMCIContext *context);
+static void VMCIContextFreeDoorbells(VMCIContext *context);
 static Bool VMCIContextExists(VMCIId cid);
 static int VMCIContextFireNotification(VMCIId contextID,
                                        VMCIPrivilegeFlags privFlags);
@@ -69,16 +70,164 @@ static void VMCIContextInFilterCleanup(VMCIContext *context);
 #endif
 
 /*
- * List of current VMCI contexts.
+ * List of current VMCI contexts.  The contexts are also hashed by cid;
+ * lookups walk the hash chains under RCU where the platform has it and
+ * under the list lock otherwise.  Both are updated under the list lock.
  */
 
+#define VMCI_CONTEXT_HASH_SIZE 512
+
+/*
+ * Datagram queue entries of up to VMCI_DG_ENTRY_CACHED_SIZE bytes of
+ * datagram, which covers events, notifications and other control
+ * datagrams, come from a cache, so that entries freed after dequeuing
+ * are reused by the next enqueue.  Larger ones are allocated to size,
+ * as the queue limit counts datagram bytes rather than the memory the
+ * entries take.
+ */
+
+#define VMCI_DG_ENTRY_CACHED_SIZE 256
+
+static VMCIMemCache dgEntryCache;
+
 static struct {
-   VMCIList head;
-   VMCILock lock;
-   VMCILock firingLock;
+   VMCIList     head;
+   VMCIContext *hash[VMCI_CONTEXT_HASH_SIZE]; /* RCU protected chains. */
+   Atomic_uint32 rehashGen; /* Odd while a context changes chains. */
+   VMCILock     lock;
+   VMCILock     firingLock;
 } contextList;
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMCIContextHashInsert --
+ * VMCIContextHashRemove --
+ *
+ *      Add a context to or remove it from the cid hash.  Assumes the
+ *      contextList.lock is held.  A removed context keeps its hashNext
+ *      for lookups still walking past it.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VMCIContextHashInsert(VMCIContext *context) // IN
+{
+   VMCIContext **head =
+      &contextList.hash[VMCI_HashId(context->cid, VMCI_CONTEXT_HASH_SIZE)];
+
+   context->hashNext = *head;
+   VMCI_RcuAssignPointer(*head, context);
+}
+
+static void
+VMCIContextHashRemove(VMCIContext *context) // IN
+{
+   VMCIContext **link;
+
+   for (link = &contextList.hash[VMCI_HashId(context->cid,
+                                             VMCI_CONTEXT_HASH_SIZE)];
+        *link != NULL; link = &(*link)->hashNext) {
+      if (*link == context) {
+         VMCI_RcuAssignPointer(*link, context->hashNext);
+         return;
+      }
+   }
+   ASSERT(FALSE);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMCIContextHashLookup --
+ *
+ *      Finds the context with the given cid in the hash.  Caller is in
+ *      a VMCIContextReadLock() section or holds the contextList.lock.
+ *      A miss is retried if VMCIContext_SetId moved a context between
+ *      chains meanwhile, as the lookup may have followed it there.
+ *
+ * Results:
+ *      The context, or NULL.  Its reference count may already be 0.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static VMCIContext *
+VMCIContextHashLookup(VMCIId cid) // IN
+{
+   VMCIContext *context;
+   uint32 gen;
+
+   do {
+      gen = Atomic_Read(&contextList.rehashGen);
+      SMP_R_BARRIER_R();
+      for (context = VMCI_RcuDereference(
+              contextList.hash[VMCI_HashId(cid, VMCI_CONTEXT_HASH_SIZE)]);
+           context != NULL;
+           context = VMCI_RcuDereference(context->hashNext)) {
+         if (context->cid == cid) {
+            break;
+         }
+      }
+      SMP_R_BARRIER_R();
+   } while (context == NULL &&
+            ((gen & 1) || gen != Atomic_Read(&contextList.rehashGen)));
+
+   return context;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMCIContextReadLock --
+ * VMCIContextReadUnlock --
+ *
+ *      Enter or leave a lookup in the cid hash.  Lookups only exclude
+ *      updates when the platform has no RCU.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE void
+VMCIContextReadLock(VMCILockFlags *flags) // OUT
+{
+#ifdef VMCI_HAS_RCU
+   VMCI_RcuReadLock();
+#else
+   VMCI_GrabLock(&contextList.lock, flags);
+#endif
+}
+
+static INLINE void
+VMCIContextReadUnlock(VMCILockFlags flags) // IN
+{
+#ifdef VMCI_HAS_RCU
+   VMCI_RcuReadUnlock();
+#else
+   VMCI_ReleaseLock(&contextList.lock, flags);
+#endif
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -218,6 +367,7 @@ VMCIContext_Init(void)
    int err;
 
    VMCIList_Init(&contextList.head);
+   Atomic_Write(&contextList.rehashGen, 0);
 
    err = VMCI_InitLock(&contextList.lock, "VMCIContextListLock",
                        VMCI_LOCK_RANK_CONTEXTLIST);
@@ -229,6 +379,15 @@ VMCIContext_Init(void)
                        VMCI_LOCK_RANK_CONTEXTFIRE);
    if (err < VMCI_SUCCESS) {
       VMCI_CleanupLock(&contextList.lock);
+      return err;
+   }
+
+   err = VMCI_CreateMemCache(&dgEntryCache, "vmci_dg_entry",
+                             sizeof (DatagramQueueEntry) +
+                             VMCI_DG_ENTRY_CACHED_SIZE);
+   if (err < VMCI_SUCCESS) {
+      VMCI_CleanupLock(&contextList.firingLock);
+      VMCI_CleanupLock(&contextList.lock);
    }
 
    return err;
@@ -254,6 +413,9 @@ VMCIContext_Init(void)
 void
 VMCIContext_Exit(void)
 {
+   /* Let contexts released under lookups be freed. */
+   VMCI_RcuBarrier();
+   VMCI_DestroyMemCache(dgEntryCache);
    VMCI_CleanupLock(&contextList.firingLock);
    VMCI_CleanupLock(&contextList.lock);
 }
@@ -388,6 +550,7 @@ VMCIContext_InitContext(VMCIId cid,                   // IN
       context->user = *user;
    }
    VMCIList_Insert(&context->listItem, &contextList.head);
+   VMCIContextHashInsert(context);
    VMCI_ReleaseLock(&contextList.lock, flags);
 
 #ifdef VMKERNEL
@@ -448,12 +611,39 @@ VMCIContext_ReleaseContext(VMCIContext *context)   // IN
 
    VMCI_GrabLock(&contextList.lock, &flags);
    VMCIList_Remove(&context->listItem);
+   VMCIContextHashRemove(context);
    VMCI_ReleaseLock(&contextList.lock, flags);
 
    VMCIContext_Release(context);
 }
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * VMCIContextFreeRcu --
+ *
+ *      VMCI_CallRcu() callback freeing a context's memory once no lookup
+ *      can still see it.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+VMCIContextFreeRcu(VMCIRcuHead *rcu)  // IN
+{
+   VMCIContext *context = VMW_CONTAINER_OF(rcu, VMCIContext, rcu);
+
+   VMCI_FreeKernelMem(context, sizeof *context);
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -514,14 +704,17 @@ VMCIContextFreeContext(VMCIContext *context)  // IN
       VMCIList_Remove(curr);
       ASSERT(dqEntry && dqEntry->dg);
       ASSERT(dqEntry->dgSize == VMCI_DG_SIZE(dqEntry->dg));
-      VMCI_FreeKernelMem(dqEntry->dg, dqEntry->dgSize);
-      VMCI_FreeKernelMem(dqEntry, sizeof *dqEntry);
+      VMCIContext_FreeDatagram(dqEntry->dg);
    }
 
    VMCIHandleArray_Destroy(context->notifierArray);
    VMCIHandleArray_Destroy(context->queuePairArray);
    VMCIHandleArray_Destroy(context->doorbellArray);
    VMCIHandleArray_Destroy(context->pendingDoorbellArray);
+   if (context->spareDoorbellArray) {
+      VMCIHandleArray_Destroy(context->spareDoorbellArray);
+   }
+   VMCIContextFreeDoorbells(context);
    VMCI_CleanupLock(&context->lock);
 #if defined(VMKERNEL)
    VMCIContextInFilterCleanup(context);
@@ -534,7 +727,7 @@ VMCIContextFreeContext(VMCIContext *context)  // IN
    VMCIUnsetNotify(context);
 #  endif
 #endif
-   VMCI_FreeKernelMem(context, sizeof *context);
+   VMCI_CallRcu(&context->rcu, VMCIContextFreeRcu);
 }
 
 
@@ -579,13 +772,87 @@ VMCIContext_PendingDatagrams(VMCIId cid,      // IN
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMCIContext_AllocDatagram --
+ *
+ *      Allocates a datagram of the given size for
+ *      VMCIContext_EnqueueDatagram, together with its queue entry.
+ *
+ * Results:
+ *      The datagram, or NULL if out of memory.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+VMCIDatagram *
+VMCIContext_AllocDatagram(size_t dgSize) // IN: size of datagram
+{
+   DatagramQueueEntry *dqEntry;
+
+   ASSERT(dgSize <= VMCI_MAX_DG_SIZE);
+
+   if (dgSize <= VMCI_DG_ENTRY_CACHED_SIZE) {
+      dqEntry = VMCI_AllocFromMemCache(dgEntryCache, VMCI_MEMORY_NONPAGED);
+   } else {
+      dqEntry = VMCI_AllocKernelMem(sizeof *dqEntry + dgSize,
+                                    VMCI_MEMORY_NONPAGED);
+   }
+   if (dqEntry == NULL) {
+      return NULL;
+   }
+   VMCIList_InitEntry(&dqEntry->listItem);
+   dqEntry->dgSize = dgSize;
+   dqEntry->dg = (VMCIDatagram *)(dqEntry + 1);
+
+   return dqEntry->dg;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMCIContext_FreeDatagram --
+ *
+ *      Frees a datagram allocated with VMCIContext_AllocDatagram, e.g.
+ *      one returned by VMCIContext_DequeueDatagram.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+VMCIContext_FreeDatagram(VMCIDatagram *dg) // IN
+{
+   DatagramQueueEntry *dqEntry = (DatagramQueueEntry *)dg - 1;
+
+   ASSERT(dqEntry->dg == dg);
+
+   if (dqEntry->dgSize <= VMCI_DG_ENTRY_CACHED_SIZE) {
+      VMCI_FreeToMemCache(dgEntryCache, dqEntry);
+   } else {
+      VMCI_FreeKernelMem(dqEntry, sizeof *dqEntry + dqEntry->dgSize);
+   }
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
  * VMCIContext_EnqueueDatagram --
  *
  *      Queues a VMCI datagram for the appropriate target VM
- *      context.
+ *      context.  The datagram must come from VMCIContext_AllocDatagram;
+ *      on success the queue owns it, otherwise the caller still does.
  *
  * Results:
  *      Size of enqueued data on success, appropriate error code otherwise.
@@ -618,17 +885,10 @@ VMCIContext_EnqueueDatagram(VMCIId cid,         // IN: Target VM
       return VMCI_ERROR_INVALID_ARGS;
    }
 
-   /* Allocate guest call entry and add it to the target VM's queue. */
-   dqEntry = VMCI_AllocKernelMem(sizeof *dqEntry, VMCI_MEMORY_NONPAGED);
-   if (dqEntry == NULL) {
-      VMCI_WARNING((LGPFX"Failed to allocate memory for datagram.\n"));
-      VMCIContext_Release(context);
-      return VMCI_ERROR_NO_MEM;
-   }
-   dqEntry->dg = dg;
-   dqEntry->dgSize = vmciDgSize;
+   /* Add the datagram's guest call entry to the target VM's queue. */
+   dqEntry = (DatagramQueueEntry *)dg - 1;
+   ASSERT(dqEntry->dg == dg && dqEntry->dgSize == vmciDgSize);
    dgSrc = dg->src;
-   VMCIList_InitEntry(&dqEntry->listItem);
 
    VMCI_GrabLock(&context->lock, &flags);
 
@@ -637,7 +897,6 @@ VMCIContext_EnqueueDatagram(VMCIId cid,         // IN: Target VM
       if (VMCIFilterDenyDgIn(context->inFilters->filters, dg)) {
          VMCI_ReleaseLock(&context->lock, flags);
          VMCIContext_Release(context);
-         VMCI_FreeKernelMem(dqEntry, sizeof *dqEntry);
          return VMCI_ERROR_NO_ACCESS;
       }
    }
@@ -660,7 +919,6 @@ VMCIContext_EnqueueDatagram(VMCIId cid,         // IN: Target VM
          VMCI_MAX_DATAGRAM_AND_EVENT_QUEUE_SIZE)) {
       VMCI_ReleaseLock(&context->lock, flags);
       VMCIContext_Release(context);
-      VMCI_FreeKernelMem(dqEntry, sizeof *dqEntry);
       VMCI_DEBUG_LOG(10, (LGPFX"Context (ID=0x%x) receive queue is full.\n",
                           cid));
       return VMCI_ERROR_NO_RESOURCES;
@@ -705,18 +963,7 @@ VMCIContext_EnqueueDatagram(VMCIId cid,         // IN: Target VM
 static Bool
 VMCIContextExists(VMCIId cid)    // IN
 {
-   VMCIContext *context;
-   VMCIListItem *next;
-   Bool rv = FALSE;
-
-   VMCIList_Scan(next, &contextList.head) {
-      context = VMCIList_Entry(next, VMCIContext, listItem);
-      if (context->cid == cid) {
-         rv = TRUE;
-         break;
-      }
-   }
-   return rv;
+   return VMCIContextHashLookup(cid) != NULL;
 }
 
 
@@ -743,9 +990,9 @@ VMCIContext_Exists(VMCIId cid)    // IN
    VMCILockFlags flags;
    Bool rv;
 
-   VMCI_GrabLock(&contextList.lock, &flags);
+   VMCIContextReadLock(&flags);
    rv = VMCIContextExists(cid);
-   VMCI_ReleaseLock(&contextList.lock, flags);
+   VMCIContextReadUnlock(flags);
    return rv;
 }
 
@@ -769,40 +1016,37 @@ VMCIContext_Exists(VMCIId cid)    // IN
 VMCIContext *
 VMCIContext_Get(VMCIId cid)  // IN
 {
-   VMCIContext *context = NULL;
-   VMCIListItem *next;
+   VMCIContext *context;
    VMCILockFlags flags;
+   uint32 refCount;
 
    if (cid == VMCI_INVALID_ID) {
       return NULL;
    }
 
-   VMCI_GrabLock(&contextList.lock, &flags);
-   if (VMCIList_Empty(&contextList.head)) {
-      goto out;
-   }
-
-   VMCIList_Scan(next, &contextList.head) {
-      context = VMCIList_Entry(next, VMCIContext, listItem);
-      if (context->cid == cid) {
-         /*
-          * At this point, we are sure that the reference count is
-          * larger already than zero. When starting the destruction of
-          * a context, we always remove it from the context list
-          * before decreasing the reference count. As we found the
-          * context here, it hasn't been destroyed yet. This means
-          * that we are not about to increase the reference count of
-          * something that is in the process of being destroyed.
-          */
+   VMCIContextReadLock(&flags);
+   context = VMCIContextHashLookup(cid);
+   if (context != NULL) {
+      /*
+       * When starting the destruction of a context, we always remove it
+       * from the hash before decreasing the reference count, but a lookup
+       * under RCU may still find it after that.  The memory stays valid
+       * until we leave the read section; only take a reference if the
+       * count did not drop to zero yet.
+       */
 
-         Atomic_Inc(&context->refCount);
-         break;
-      }
+      do {
+         refCount = Atomic_Read(&context->refCount);
+         if (refCount == 0) {
+            context = NULL;
+            break;
+         }
+      } while (Atomic_ReadIfEqualWrite32(&context->refCount, refCount,
+                                         refCount + 1) != refCount);
    }
+   VMCIContextReadUnlock(flags);
 
-out:
-   VMCI_ReleaseLock(&contextList.lock, flags);
-   return (context && context->cid == cid) ? context : NULL;
+   return context;
 }
 
 
@@ -814,11 +1058,11 @@ out:
  *      Releases the VMCI context. If this is the last reference to
  *      the context it will be deallocated. A context is created with
  *      a reference count of one, and on destroy, it is removed from
- *      the context list before its reference count is
- *      decremented. Thus, if we reach zero, we are sure that nobody
- *      else are about to increment it (they need the entry in the
- *      context list for that). This function musn't be called with a
- *      lock held.
+ *      the context list and hash before its reference count is
+ *      decremented. Thus, if we reach zero, nobody can get a new
+ *      reference (VMCIContext_Get() does not increment a zero count),
+ *      and the memory is freed once lookups in progress are done.
+ *      This function musn't be called with a lock held.
  *
  * Results:
  *      None.
@@ -868,44 +1112,104 @@ int
 VMCIContext_DequeueDatagram(VMCIContext *context, // IN
                             size_t *maxSize,      // IN/OUT: max size of datagram caller can handle.
                             VMCIDatagram **dg)    // OUT:
+{
+   size_t size = *maxSize;
+   uint32 numDgs = 1;
+   int rv;
+
+   rv = VMCIContext_DequeueDatagrams(context, &size, dg, &numDgs);
+   if (rv == VMCI_ERROR_NO_MEM) {
+      *maxSize = size;
+   }
+   return rv;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMCIContext_DequeueDatagrams --
+ *
+ *      Dequeues as many of the pending datagrams as fit in the
+ *      caller's array and in a buffer of maxSize bytes, when packed at
+ *      8 byte aligned offsets, while holding the context lock once.
+ *      If not even the next datagram fits, maxSize is set to its size
+ *      and nothing is dequeued.
+ *
+ * Results:
+ *      On success:  0 if no more pending datagrams, otherwise the size of
+ *                   the next pending datagram.  maxSize is set to the
+ *                   bytes used and numDgs to the number dequeued.
+ *      On failure:  appropriate error code.  numDgs is set to 0.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+VMCIContext_DequeueDatagrams(VMCIContext *context, // IN
+                             size_t *maxSize,      // IN/OUT: buffer size
+                             VMCIDatagram **dgs,   // OUT: dequeued datagrams
+                             uint32 *numDgs)       // IN/OUT: array size
 {
    DatagramQueueEntry *dqEntry;
    VMCIListItem *listItem;
    VMCILockFlags flags;
+   size_t offset = 0;
+   size_t used = 0;
+   uint32 n = 0;
    int rv;
 
-   ASSERT(context && dg);
+   ASSERT(context && dgs && numDgs && *numDgs > 0);
 
-   /* Dequeue the next datagram entry. */
+   /* Dequeue the datagram entries that fit. */
    VMCI_GrabLock(&context->lock, &flags);
    if (context->pendingDatagrams == 0) {
       VMCIContextClearNotifyAndCall(context);
       VMCI_ReleaseLock(&context->lock, flags);
       VMCI_DEBUG_LOG(4, (LGPFX"No datagrams pending.\n"));
+      *numDgs = 0;
       return VMCI_ERROR_NO_MORE_DATAGRAMS;
    }
 
-   listItem = VMCIList_First(&context->datagramQueue);
-   ASSERT (listItem != NULL);
+   do {
+      listItem = VMCIList_First(&context->datagramQueue);
+      ASSERT (listItem != NULL);
 
-   dqEntry = VMCIList_Entry(listItem, DatagramQueueEntry, listItem);
+      dqEntry = VMCIList_Entry(listItem, DatagramQueueEntry, listItem);
 #if defined(_WIN32)
-   _Analysis_assume_(dqEntry != NULL);
+      _Analysis_assume_(dqEntry != NULL);
 #endif
-   ASSERT(dqEntry->dg);
+      ASSERT(dqEntry->dg);
+
+      /* Check size of caller's buffer. */
+      if (*maxSize - offset < dqEntry->dgSize) {
+         break;
+      }
 
-   /* Check size of caller's buffer. */
-   if (*maxSize < dqEntry->dgSize) {
+      VMCIList_Remove(listItem);
+      context->pendingDatagrams--;
+      context->datagramQueueSize -= dqEntry->dgSize;
+
+      /* Caller must free datagram with VMCIContext_FreeDatagram. */
+      ASSERT(dqEntry->dgSize == VMCI_DG_SIZE(dqEntry->dg));
+      dgs[n++] = dqEntry->dg;
+      used = offset + dqEntry->dgSize;
+      offset += VMCI_DG_SIZE_ALIGNED(dqEntry->dg);
+   } while (n < *numDgs && context->pendingDatagrams > 0 &&
+            offset < *maxSize);
+
+   if (n == 0) {
       *maxSize = dqEntry->dgSize;
       VMCI_ReleaseLock(&context->lock, flags);
       VMCI_DEBUG_LOG(4, (LGPFX"Caller's buffer should be at least "
                          "(size=%u bytes).\n", (uint32)*maxSize));
+      *numDgs = 0;
       return VMCI_ERROR_NO_MEM;
    }
 
-   VMCIList_Remove(listItem);
-   context->pendingDatagrams--;
-   context->datagramQueueSize -= dqEntry->dgSize;
    if (context->pendingDatagrams == 0) {
       VMCIContextClearNotifyAndCall(context);
       rv = VMCI_SUCCESS;
@@ -930,12 +1234,8 @@ VMCIContext_DequeueDatagram(VMCIContext *context, // IN
    }
    VMCI_ReleaseLock(&context->lock, flags);
 
-   /* Caller must free datagram. */
-   ASSERT(dqEntry->dgSize == VMCI_DG_SIZE(dqEntry->dg));
-   *dg = dqEntry->dg;
-   dqEntry->dg = NULL;
-   VMCI_FreeKernelMem(dqEntry, sizeof *dqEntry);
-
+   *maxSize = used;
+   *numDgs = n;
    return rv;
 }
 
@@ -1222,7 +1522,7 @@ VMCIContext_ClearDatagrams(VMCIContext *context) // IN
    while (pending > 0 &&
           VMCIContext_DequeueDatagram(context, &size, &dg) >= 0) {
       ASSERT(dg);
-      VMCI_FreeKernelMem(dg, VMCI_DG_SIZE(dg));
+      VMCIContext_FreeDatagram(dg);
       --pending;
    }
 }
@@ -1253,9 +1553,22 @@ VMCIContext_SetId(VMCIContext *context,         // IN
    if (!context) {
       return;
    }
-   VMCI_GrabLock(&context->lock, &flags);
+
+   /*
+    * The cid is the hash key, so move the context to its new chain.
+    * Relinking sends lookups standing on the context into the new chain,
+    * so they retry until the generation is even and unchanged.
+    */
+
+   VMCI_GrabLock(&contextList.lock, &flags);
+   Atomic_Inc(&contextList.rehashGen);
+   SMP_W_BARRIER_W();
+   VMCIContextHashRemove(context);
    context->cid = cid;
-   VMCI_ReleaseLock(&context->lock, flags);
+   VMCIContextHashInsert(context);
+   SMP_W_BARRIER_W();
+   Atomic_Inc(&contextList.rehashGen);
+   VMCI_ReleaseLock(&contextList.lock, flags);
 }
 
 
@@ -1935,6 +2248,115 @@ VMCIContext_SetCheckpointState(VMCIId contextID, // IN:
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMCIContextDoorbellLink --
+ *
+ *      Finds the hash chain link of a doorbell registered by the context,
+ *      or the end of the chain it would be on.  Assumes the context lock
+ *      is held.
+ *
+ * Results:
+ *      Pointer to the link; *link is NULL if the doorbell is not found.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static VMCIContextDoorbell **
+VMCIContextDoorbellLink(VMCIContext *context, // IN
+                        VMCIHandle handle)    // IN
+{
+   VMCIContextDoorbell **link;
+
+   link = &context->doorbellHash[VMCI_HashId(handle.resource,
+                                             VMCI_CONTEXT_DOORBELL_HASH_SIZE)];
+   while (*link != NULL && !VMCI_HANDLE_EQUAL((*link)->handle, handle)) {
+      link = &(*link)->next;
+   }
+   return link;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMCIContextFreeDoorbells --
+ *
+ *      Frees the doorbell hash entries of the context.  Assumes the
+ *      context lock is held or the context is being freed.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VMCIContextFreeDoorbells(VMCIContext *context) // IN
+{
+   uint32 i;
+
+   for (i = 0; i < VMCI_CONTEXT_DOORBELL_HASH_SIZE; i++) {
+      while (context->doorbellHash[i] != NULL) {
+         VMCIContextDoorbell *db = context->doorbellHash[i];
+
+         context->doorbellHash[i] = db->next;
+         VMCI_FreeKernelMem(db, sizeof *db);
+      }
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMCIContextMarkPendingDoorbells --
+ *
+ *      Sets the pending flag of the registered doorbells in a handle
+ *      array.  With 'pending' set, doorbells not yet pending are also
+ *      added to the context's pending array.  Assumes the context lock
+ *      is held.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VMCIContextMarkPendingDoorbells(VMCIContext *context,   // IN
+                                VMCIHandleArray *array, // IN
+                                Bool pending)           // IN
+{
+   uint32 i;
+
+   for (i = 0; i < VMCIHandleArray_GetSize(array); i++) {
+      VMCIContextDoorbell *db =
+         *VMCIContextDoorbellLink(context, VMCIHandleArray_GetEntry(array, i));
+
+      if (db == NULL || db->pending == pending) {
+         continue;
+      }
+      if (pending &&
+          VMCIHandleArray_AppendEntry(&context->pendingDoorbellArray,
+                                      db->handle) != VMCI_SUCCESS) {
+         continue;
+      }
+      db->pending = pending;
+   }
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -1972,13 +2394,25 @@ VMCIContext_ReceiveNotificationsGet(VMCIId contextID,                // IN
    }
    VMCI_GrabLock(&context->lock, &flags);
 
+   /*
+    * Hand out the pending array and swap in the spare one, which is only
+    * missing if another receive has not released its array yet.
+    */
+
    *dbHandleArray = context->pendingDoorbellArray;
-   context->pendingDoorbellArray =
-      VMCIHandleArray_Create(0, VMCI_MAX_GUEST_DOORBELL_COUNT);
+   if (context->spareDoorbellArray) {
+      context->pendingDoorbellArray = context->spareDoorbellArray;
+      context->spareDoorbellArray = NULL;
+   } else {
+      context->pendingDoorbellArray =
+         VMCIHandleArray_Create(0, VMCI_MAX_GUEST_DOORBELL_COUNT);
+   }
    if (!context->pendingDoorbellArray) {
       context->pendingDoorbellArray = *dbHandleArray;
       *dbHandleArray = NULL;
       result = VMCI_ERROR_NO_MEM;
+   } else {
+      VMCIContextMarkPendingDoorbells(context, *dbHandleArray, FALSE);
    }
    *qpHandleArray = NULL;
 
@@ -1997,7 +2431,8 @@ VMCIContext_ReceiveNotificationsGet(VMCIId contextID,                // IN
  *      Releases handle arrays with pending notifications previously
  *      retrieved using VMCIContext_ReceiveNotificationsGet. If the
  *      notifications were not successfully handed over to the guest,
- *      success must be false.
+ *      success must be false.  The doorbell array is kept as the
+ *      context's spare pending array.
  *
  * Results:
  *      None.
@@ -2021,29 +2456,22 @@ VMCIContext_ReceiveNotificationsRelease(VMCIId contextID,               // IN
 
       VMCI_GrabLock(&context->lock, &flags);
       if (!success) {
-         VMCIHandle handle;
-
          /*
           * New notifications may have been added while we were not
-          * holding the context lock, so we transfer any new pending
-          * doorbell notifications to the old array, and reinstate the
-          * old array.
+          * holding the context lock, so we add the old notifications
+          * that are not pending again, and still registered, to the
+          * current pending array.
           */
 
-         handle = VMCIHandleArray_RemoveTail(context->pendingDoorbellArray);
-         while (!VMCI_HANDLE_INVALID(handle)) {
-            ASSERT(VMCIHandleArray_HasEntry(context->doorbellArray, handle));
-            if (!VMCIHandleArray_HasEntry(dbHandleArray, handle)) {
-               VMCIHandleArray_AppendEntry(&dbHandleArray, handle);
-            }
-            handle = VMCIHandleArray_RemoveTail(context->pendingDoorbellArray);
-         }
-         VMCIHandleArray_Destroy(context->pendingDoorbellArray);
-         context->pendingDoorbellArray = dbHandleArray;
-         dbHandleArray = NULL;
+         VMCIContextMarkPendingDoorbells(context, dbHandleArray, TRUE);
       } else {
          VMCIContextClearNotifyAndCall(context);
       }
+      if (dbHandleArray && !context->spareDoorbellArray) {
+         VMCIHandleArray_Clear(dbHandleArray);
+         context->spareDoorbellArray = dbHandleArray;
+         dbHandleArray = NULL;
+      }
       VMCI_ReleaseLock(&context->lock, flags);
       VMCIContext_Release(context);
    } else {
@@ -2087,6 +2515,8 @@ VMCIContext_DoorbellCreate(VMCIId contextID,   // IN
                            VMCIHandle handle)  // IN
 {
    VMCIContext *context;
+   VMCIContextDoorbell *db;
+   VMCIContextDoorbell **link;
    VMCILockFlags flags;
    int result;
 
@@ -2099,15 +2529,32 @@ VMCIContext_DoorbellCreate(VMCIId contextID,   // IN
       return VMCI_ERROR_NOT_FOUND;
    }
 
+   db = VMCI_AllocKernelMem(sizeof *db, VMCI_MEMORY_NONPAGED);
+   if (db == NULL) {
+      VMCIContext_Release(context);
+      return VMCI_ERROR_NO_MEM;
+   }
+   db->handle = handle;
+   db->pending = FALSE;
+
    VMCI_GrabLock(&context->lock, &flags);
-   if (!VMCIHandleArray_HasEntry(context->doorbellArray, handle)) {
+   link = VMCIContextDoorbellLink(context, handle);
+   if (*link == NULL) {
       result = VMCIHandleArray_AppendEntry(&context->doorbellArray, handle);
+      if (result == VMCI_SUCCESS) {
+         db->next = NULL;
+         *link = db;
+         db = NULL;
+      }
    } else {
       result = VMCI_ERROR_DUPLICATE_ENTRY;
    }
    VMCI_ReleaseLock(&context->lock, flags);
 
    VMCIContext_Release(context);
+   if (db) {
+      VMCI_FreeKernelMem(db, sizeof *db);
+   }
 
    return result;
 }
@@ -2135,8 +2582,9 @@ VMCIContext_DoorbellDestroy(VMCIId contextID,   // IN
                             VMCIHandle handle)  // IN
 {
    VMCIContext *context;
+   VMCIContextDoorbell *db;
+   VMCIContextDoorbell **link;
    VMCILockFlags flags;
-   VMCIHandle removedHandle;
 
    if (contextID == VMCI_INVALID_ID || VMCI_HANDLE_INVALID(handle)) {
       return VMCI_ERROR_INVALID_ARGS;
@@ -2148,17 +2596,24 @@ VMCIContext_DoorbellDestroy(VMCIId contextID,   // IN
    }
 
    VMCI_GrabLock(&context->lock, &flags);
-   removedHandle = VMCIHandleArray_RemoveEntry(context->doorbellArray, handle);
-   VMCIHandleArray_RemoveEntry(context->pendingDoorbellArray, handle);
+   link = VMCIContextDoorbellLink(context, handle);
+   db = *link;
+   if (db != NULL) {
+      *link = db->next;
+      VMCIHandleArray_RemoveEntry(context->doorbellArray, handle);
+      if (db->pending) {
+         VMCIHandleArray_RemoveEntry(context->pendingDoorbellArray, handle);
+      }
+   }
    VMCI_ReleaseLock(&context->lock, flags);
 
    VMCIContext_Release(context);
 
-   if (VMCI_HANDLE_INVALID(removedHandle)) {
+   if (db == NULL) {
       return VMCI_ERROR_NOT_FOUND;
-   } else {
-      return VMCI_SUCCESS;
    }
+   VMCI_FreeKernelMem(db, sizeof *db);
+   return VMCI_SUCCESS;
 }
 
 
@@ -2202,6 +2657,7 @@ VMCIContext_DoorbellDestroyAll(VMCIId contextID) // IN
    do {
       removedHandle = VMCIHandleArray_RemoveTail(context->pendingDoorbellArray);
    } while(!VMCI_HANDLE_INVALID(removedHandle));
+   VMCIContextFreeDoorbells(context);
    VMCI_ReleaseLock(&context->lock, flags);
 
    VMCIContext_Release(context);
@@ -2239,6 +2695,7 @@ VMCIContext_NotifyDoorbell(VMCIId srcCID,                   // IN
                            VMCIPrivilegeFlags srcPrivFlags) // IN
 {
    VMCIContext *dstContext;
+   VMCIContextDoorbell *db;
    VMCILockFlags flags;
    int result;
 
@@ -2295,14 +2752,15 @@ VMCIContext_NotifyDoorbell(VMCIId srcCID,                   // IN
          result = VMCI_ERROR_NO_ACCESS;
       } else
 #endif // VMKERNEL
-      if (!VMCIHandleArray_HasEntry(dstContext->doorbellArray, handle)) {
+      if ((db = *VMCIContextDoorbellLink(dstContext, handle)) == NULL) {
          result = VMCI_ERROR_NOT_FOUND;
       } else {
-         if (!VMCIHandleArray_HasEntry(dstContext->pendingDoorbellArray, handle)) {
+         if (!db->pending) {
             result =
                VMCIHandleArray_AppendEntry(&dstContext->pendingDoorbellArray,
                                            handle);
             if (result == VMCI_SUCCESS) {
+               db->pending = TRUE;
                VMCIContextSignalNotify(dstContext);
 #if defined(VMKERNEL)
                VMCIHost_SignalBitmap(&dstContext->hostContext);
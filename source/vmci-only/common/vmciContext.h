@@ -73,9 +73,13 @@ void VMCIContext_SetPtr(VMCIContext *context, void **ptr, void *value);
 #endif
 Bool VMCIContext_SupportsHostQP(VMCIContext *context);
 void VMCIContext_ReleaseContext(VMCIContext *context);
+VMCIDatagram *VMCIContext_AllocDatagram(size_t dgSize);
+void VMCIContext_FreeDatagram(VMCIDatagram *dg);
 int VMCIContext_EnqueueDatagram(VMCIId cid, VMCIDatagram *dg, Bool notify);
 int VMCIContext_DequeueDatagram(VMCIContext *context, size_t *maxSize,
                                 VMCIDatagram **dg);
+int VMCIContext_DequeueDatagrams(VMCIContext *context, size_t *maxSize,
+                                 VMCIDatagram **dgs, uint32 *numDgs);
 int VMCIContext_PendingDatagrams(VMCIId cid, uint32 *pending);
 VMCIContext *VMCIContext_Get(VMCIId cid);
 void VMCIContext_Release(VMCIContext *context);
@@ -686,7 +686,7 @@ VMCIDatagramDispatchAsHost(VMCIId contextID,  // IN:
       }
 
       /* We make a copy to enqueue. */
-      newDG = VMCI_AllocKernelMem(dgSize, VMCI_MEMORY_NORMAL);
+      newDG = VMCIContext_AllocDatagram(dgSize);
       if (newDG == NULL) {
          VMCI_DEBUG_LOG(4, (LGPFX"No memory for datagram\n"));
          return VMCI_ERROR_NO_MEM;
@@ -694,7 +694,7 @@ VMCIDatagramDispatchAsHost(VMCIId contextID,  // IN:
       memcpy(newDG, dg, dgSize);
       retval = VMCIContext_EnqueueDatagram(dg->dst.context, newDG, TRUE);
       if (retval < VMCI_SUCCESS) {
-         VMCI_FreeKernelMem(newDG, dgSize);
+         VMCIContext_FreeDatagram(newDG);
          VMCI_DEBUG_LOG(4, (LGPFX"Enqueue failed\n"));
          return retval;
       }
@@ -24,6 +24,7 @@
 
 #include "vmci_kernel_if.h"
 #include "vm_assert.h"
+#include "vm_basic_asm.h"
 #include "vmci_defs.h"
 #include "vmci_infrastructure.h"
 #include "vmciCommonInt.h"
@@ -43,9 +44,20 @@
 
 #if !defined(__APPLE__)
 
-#define VMCI_DOORBELL_INDEX_TABLE_SIZE 64
+/*
+ * Notify indexes are handed out from 0 up, so hashing on their low bits
+ * spreads them evenly and keeps the index table chains short.
+ */
+
+#define VMCI_DOORBELL_INDEX_TABLE_SIZE 512
 #define VMCI_DOORBELL_HASH(_idx) \
-   VMCI_HashId((_idx), VMCI_DOORBELL_INDEX_TABLE_SIZE)
+   ((_idx) & (VMCI_DOORBELL_INDEX_TABLE_SIZE - 1))
+
+/* Notify indexes fired under one hold of the index table lock. */
+#define VMCI_DOORBELL_FIRE_BATCH 64
+
+/* Bit 0 of each byte in a 64-bit word of the notification bitmap. */
+#define VMCI_NOTIFY_BITMAP_FLAGS CONST64U(0x0101010101010101)
 
 
 /*
@@ -1085,7 +1097,7 @@ VMCI_RegisterNotificationBitmap(PPN bitmapPPN,     // IN
  *
  * VMCIDoorbellFireEntries --
  *
- *     Executes or schedules the handlers for a given notify index.
+ *     Executes or schedules the handlers for the given notify indexes.
  *
  * Result:
  *     Notification hash entry if found. NULL otherwise.
@@ -1097,40 +1109,45 @@ VMCI_RegisterNotificationBitmap(PPN bitmapPPN,     // IN
  */
 
 static void
-VMCIDoorbellFireEntries(uint32 notifyIdx) // IN
+VMCIDoorbellFireEntries(const uint32 *notifyIdx, // IN
+                        uint32 numIdx)           // IN
 {
-   uint32 bucket = VMCI_DOORBELL_HASH(notifyIdx);
    VMCIListItem *iter;
    VMCILockFlags flags;
+   uint32 i;
 
    ASSERT(VMCI_GuestPersonalityActive());
 
    VMCI_GrabLock_BH(&vmciDoorbellIT.lock, &flags);
 
-   VMCIList_Scan(iter, &vmciDoorbellIT.entries[bucket]) {
-      VMCIDoorbellEntry *cur =
-         VMCIList_Entry(iter, VMCIDoorbellEntry, idxListItem);
+   for (i = 0; i < numIdx; i++) {
+      uint32 bucket = VMCI_DOORBELL_HASH(notifyIdx[i]);
 
-      ASSERT(cur);
+      VMCIList_Scan(iter, &vmciDoorbellIT.entries[bucket]) {
+         VMCIDoorbellEntry *cur =
+            VMCIList_Entry(iter, VMCIDoorbellEntry, idxListItem);
+
+         ASSERT(cur);
 
-      if (cur->idx == notifyIdx && Atomic_Read(&cur->active) == 1) {
-         ASSERT(cur->notifyCB);
-         if (cur->runDelayed) {
-            int err;
+         if (cur->idx == notifyIdx[i] && Atomic_Read(&cur->active) == 1) {
+            ASSERT(cur->notifyCB);
+            if (cur->runDelayed) {
+               int err;
 
-            VMCIResource_Hold(&cur->resource);
-            err = VMCI_ScheduleDelayedWork(VMCIDoorbellDelayedDispatchCB, cur);
-            if (err != VMCI_SUCCESS) {
-               VMCIResource_Release(&cur->resource);
-               goto out;
+               VMCIResource_Hold(&cur->resource);
+               err = VMCI_ScheduleDelayedWork(VMCIDoorbellDelayedDispatchCB,
+                                              cur);
+               if (err != VMCI_SUCCESS) {
+                  VMCIResource_Release(&cur->resource);
+                  break;
+               }
+            } else {
+               cur->notifyCB(cur->clientData);
             }
-         } else {
-            cur->notifyCB(cur->clientData);
          }
       }
    }
 
-out:
    VMCI_ReleaseLock_BH(&vmciDoorbellIT.lock, flags);
 }
 
@@ -1155,17 +1172,42 @@ out:
 void
 VMCI_ScanNotificationBitmap(uint8 *bitmap)
 {
+   uint32 fired[VMCI_DOORBELL_FIRE_BATCH];
+   uint32 numFired = 0;
    uint32 idx;
 
    ASSERT(bitmap);
    ASSERT(VMCI_GuestPersonalityActive());
 
-   for (idx = 0; idx < maxNotifyIdx; idx++) {
-      if (bitmap[idx] & 0x1) {
-         bitmap[idx] &= ~1;
-         VMCIDoorbellFireEntries(idx);
+   /*
+    * Each notify index has a byte in the page aligned bitmap, flagged in
+    * bit 0.  Test eight indexes per 64-bit load and find the flagged ones
+    * by their lowest set bit, the first byte in memory on our
+    * little-endian hosts.
+    */
+
+   for (idx = 0; idx < maxNotifyIdx; idx += sizeof (uint64)) {
+      uint64 flags = *(uint64 *)(bitmap + idx) & VMCI_NOTIFY_BITMAP_FLAGS;
+
+      while (flags != 0) {
+         uint32 cur = idx + lssb64_0(flags) / 8;
+
+         flags &= flags - 1;
+         if (cur >= maxNotifyIdx) {
+            break;
+         }
+         bitmap[cur] &= ~1;
+         fired[numFired++] = cur;
+         if (numFired == ARRAYSIZE(fired)) {
+            VMCIDoorbellFireEntries(fired, numFired);
+            numFired = 0;
+         }
       }
    }
+
+   if (numFired > 0) {
+      VMCIDoorbellFireEntries(fired, numFired);
+   }
 }
 
 
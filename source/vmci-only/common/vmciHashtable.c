@@ -22,6 +22,12 @@
  *     Implementation of the VMCI Hashtable.
  *     TODO: Look into what is takes to use lib/misc/hashTable.c instead of
  *     our own implementation.
+ *
+ *     Lookups do not take the table lock: chains are RCU protected and
+ *     reference counts atomic.  The bucket array doubles when the table
+ *     gets twice as many entries as buckets.  Entries then move between
+ *     chains under a lookup's feet, so a lookup that finds nothing while
+ *     the table was grown retries.
  */
 
 #include "vmci_kernel_if.h"
@@ -42,9 +48,65 @@
 #define VMCI_HASHTABLE_HASH(_h, _sz) \
    VMCI_HashId(VMCI_HANDLE_TO_RESOURCE_ID(_h), (_sz))
 
+#define VMCI_HASHTABLE_MAX_SIZE  (1 << 16)
+#define VMCI_HASHTABLE_BUCKETS_SIZE(_sz) \
+   (offsetof(VMCIHashBuckets, entries) + sizeof (VMCIHashEntry *) * (_sz))
+
 static int HashTableUnlinkEntry(VMCIHashTable *table, VMCIHashEntry *entry);
-static Bool VMCIHashTableEntryExistsLocked(VMCIHashTable *table,
-                                           VMCIHandle handle);
+static VMCIHashEntry *VMCIHashTableLookup(VMCIHashTable *table,
+                                          VMCIHandle handle,
+                                          Bool anyContext, Bool hold);
+
+
+/*
+ *------------------------------------------------------------------------------
+ *
+ *  VMCIHashTableAllocBuckets --
+ *
+ *     Allocate an empty bucket array.
+ *
+ *  Result:
+ *     The array, or NULL if out of memory.
+ *
+ *------------------------------------------------------------------------------
+ */
+
+static VMCIHashBuckets *
+VMCIHashTableAllocBuckets(uint32 size,  // IN: power of 2
+                          int flags)    // IN: VMCI_MEMORY_xxx
+{
+   VMCIHashBuckets *buckets =
+      VMCI_AllocKernelMem(VMCI_HASHTABLE_BUCKETS_SIZE(size), flags);
+
+   if (buckets != NULL) {
+      memset(buckets, 0, VMCI_HASHTABLE_BUCKETS_SIZE(size));
+      buckets->size = size;
+   }
+   return buckets;
+}
+
+
+/*
+ *------------------------------------------------------------------------------
+ *
+ *  VMCIHashTableFreeBuckets --
+ *
+ *     VMCI_CallRcu() callback freeing a bucket array replaced by a larger
+ *     one.
+ *
+ *  Result:
+ *     None.
+ *
+ *------------------------------------------------------------------------------
+ */
+
+static void
+VMCIHashTableFreeBuckets(VMCIRcuHead *rcu)  // IN
+{
+   VMCIHashBuckets *buckets = (VMCIHashBuckets *)rcu;
+
+   VMCI_FreeKernelMem(buckets, VMCI_HASHTABLE_BUCKETS_SIZE(buckets->size));
+}
 
 
 /*
@@ -60,7 +122,7 @@ static Bool VMCIHashTableEntryExistsLocked(VMCIHashTable *table,
  */
 
 VMCIHashTable *
-VMCIHashTable_Create(int size)
+VMCIHashTable_Create(int size)  // IN: initial number of buckets, power of 2
 {
    VMCIHashTable *table = VMCI_AllocKernelMem(sizeof *table,
                                               VMCI_MEMORY_NONPAGED);
@@ -68,17 +130,16 @@ VMCIHashTable_Create(int size)
       return NULL;
    }
 
-   table->entries = VMCI_AllocKernelMem(sizeof *table->entries * size,
-                                        VMCI_MEMORY_NONPAGED);
-   if (table->entries == NULL) {
+   table->buckets = VMCIHashTableAllocBuckets(size, VMCI_MEMORY_NONPAGED);
+   if (table->buckets == NULL) {
       VMCI_FreeKernelMem(table, sizeof *table);
       return NULL;
    }
-   memset(table->entries, 0, sizeof *table->entries * size);
-   table->size = size;
+   table->numEntries = 0;
+   Atomic_Write(&table->resizeGen, 0);
    if (VMCI_InitLock(&table->lock, "VMCIHashTableLock",
                      VMCI_LOCK_RANK_HASHTABLE) < VMCI_SUCCESS) {
-      VMCI_FreeKernelMem(table->entries, sizeof *table->entries * size);
+      VMCI_FreeKernelMem(table->buckets, VMCI_HASHTABLE_BUCKETS_SIZE(size));
       VMCI_FreeKernelMem(table, sizeof *table);
       return NULL;
    }
@@ -106,31 +167,17 @@ void
 VMCIHashTable_Destroy(VMCIHashTable *table)
 {
    VMCILockFlags flags;
-#if 0
-   DEBUG_ONLY(int i;)
-   DEBUG_ONLY(int leakingEntries = 0;)
-#endif
 
    ASSERT(table);
 
    VMCI_GrabLock_BH(&table->lock, &flags);
-#if 0
-#ifdef VMX86_DEBUG
-   for (i = 0; i < table->size; i++) {
-      VMCIHashEntry *head = table->entries[i];
-      while (head) {
-         leakingEntries++;
-         head = head->next;
-      }
-   }
-   if (leakingEntries) {
-      VMCI_WARNING((LGPFX"Leaking entries (%d) for hash table (%p).\n",
-                    leakingEntries, table));
+   if (table->numEntries) {
+      VMCI_DEBUG_LOG(4, (LGPFX"Leaking entries (%u) for hash table (%p).\n",
+                         table->numEntries, table));
    }
-#endif // VMX86_DEBUG
-#endif
-   VMCI_FreeKernelMem(table->entries, sizeof *table->entries * table->size);
-   table->entries = NULL;
+   VMCI_FreeKernelMem(table->buckets,
+                      VMCI_HASHTABLE_BUCKETS_SIZE(table->buckets->size));
+   table->buckets = NULL;
    VMCI_ReleaseLock_BH(&table->lock, flags);
    VMCI_CleanupLock(&table->lock);
    VMCI_FreeKernelMem(table, sizeof *table);
@@ -154,7 +201,61 @@ VMCIHashTable_InitEntry(VMCIHashEntry *entry,  // IN
 {
    ASSERT(entry);
    entry->handle = handle;
-   entry->refCount = 0;
+   Atomic_Write(&entry->refCount, 0);
+   entry->next = NULL;
+}
+
+
+/*
+ *------------------------------------------------------------------------------
+ *
+ *  VMCIHashTableGrow --
+ *
+ *     Double the number of buckets.  Entries are moved one by one from the
+ *     old chains to the new ones, which are only published when complete;
+ *     a lookup walking a chain meanwhile may miss entries but always ends.
+ *     Assumes caller holds table lock.
+ *
+ *  Result:
+ *     None.  The table stays as it is if out of memory.
+ *
+ *------------------------------------------------------------------------------
+ */
+
+static void
+VMCIHashTableGrow(VMCIHashTable *table)  // IN
+{
+   VMCIHashBuckets *old = table->buckets;
+   VMCIHashBuckets *new;
+   uint32 i;
+
+   new = VMCIHashTableAllocBuckets(old->size * 2,
+                                   VMCI_MEMORY_NONPAGED | VMCI_MEMORY_ATOMIC);
+   if (new == NULL) {
+      return;
+   }
+
+   Atomic_Inc(&table->resizeGen);
+   SMP_W_BARRIER_W();
+
+   for (i = 0; i < old->size; i++) {
+      VMCIHashEntry *cur = old->entries[i];
+
+      while (cur) {
+         VMCIHashEntry *next = cur->next;
+         int idx = VMCI_HASHTABLE_HASH(cur->handle, new->size);
+
+         VMCI_RcuAssignPointer(cur->next, new->entries[idx]);
+         new->entries[idx] = cur;
+         cur = next;
+      }
+   }
+
+   VMCI_RcuAssignPointer(table->buckets, new);
+   SMP_W_BARRIER_W();
+   Atomic_Inc(&table->resizeGen);
+
+   VMCI_CallRcu(&old->rcu, VMCIHashTableFreeBuckets);
 }
 
 
@@ -174,7 +275,9 @@ int
 VMCIHashTable_AddEntry(VMCIHashTable *table,   // IN
                        VMCIHashEntry *entry)   // IN
 {
+   VMCIHashBuckets *buckets;
    int idx;
+   Bool exists;
    VMCILockFlags flags;
 
    ASSERT(entry);
@@ -188,20 +291,30 @@ VMCIHashTable_AddEntry(VMCIHashTable *table,   // IN
       return VMCI_ERROR_UNAVAILABLE;
    }
 
-   if (VMCIHashTableEntryExistsLocked(table, entry->handle)) {
+   VMCI_RcuReadLock();
+   exists = VMCIHashTableLookup(table, entry->handle, TRUE, FALSE) != NULL;
+   VMCI_RcuReadUnlock();
+   if (exists) {
       VMCI_DEBUG_LOG(4, (LGPFX"Entry (handle=0x%x:0x%x) already exists.\n",
                          entry->handle.context, entry->handle.resource));
       VMCI_ReleaseLock_BH(&table->lock, flags);
       return VMCI_ERROR_DUPLICATE_ENTRY;
    }
 
-   idx = VMCI_HASHTABLE_HASH(entry->handle, table->size);
-   ASSERT(idx < table->size);
+   buckets = table->buckets;
+   idx = VMCI_HASHTABLE_HASH(entry->handle, buckets->size);
+   ASSERT(idx < buckets->size);
 
    /* New entry is added to top/front of hash bucket. */
-   entry->refCount++;
-   entry->next = table->entries[idx];
-   table->entries[idx] = entry;
+   Atomic_Inc(&entry->refCount);
+   entry->next = buckets->entries[idx];
+   VMCI_RcuAssignPointer(buckets->entries[idx], entry);
+   table->numEntries++;
+
+   if (table->numEntries > 2 * buckets->size &&
+       buckets->size < VMCI_HASHTABLE_MAX_SIZE) {
+      VMCIHashTableGrow(table);
+   }
    VMCI_ReleaseLock_BH(&table->lock, flags);
 
    return VMCI_SUCCESS;
@@ -235,71 +348,157 @@ VMCIHashTable_RemoveEntry(VMCIHashTable *table, // IN
 
    /* First unlink the entry. */
    result = HashTableUnlinkEntry(table, entry);
+   VMCI_ReleaseLock_BH(&table->lock, flags);
    if (result != VMCI_SUCCESS) {
       /* We failed to find the entry. */
-      goto done;
+      return result;
    }
 
    /* Decrement refcount and check if this is last reference. */
-   entry->refCount--;
-   if (entry->refCount == 0) {
+   if (Atomic_ReadDec32(&entry->refCount) == 1) {
       result = VMCI_SUCCESS_ENTRY_DEAD;
-      goto done;
    }
 
-  done:
+   return result;
+}
+
+
+/*
+ *------------------------------------------------------------------------------
+ *
+ *  VMCIHashTableReadLock --
+ *  VMCIHashTableReadUnlock --
+ *
+ *       Enter or leave a lookup.  Lookups only exclude updates when the
+ *       platform has no RCU.
+ *
+ *  Result:
+ *       None.
+ *
+ *  Side effects:
+ *       None.
+ *
+ *------------------------------------------------------------------------------
+ */
+
+static INLINE void
+VMCIHashTableReadLock(VMCIHashTable *table,  // IN
+                      VMCILockFlags *flags)  // OUT
+{
+#ifdef VMCI_HAS_RCU
+   VMCI_RcuReadLock();
+#else
+   VMCI_GrabLock_BH(&table->lock, flags);
+#endif
+}
+
+static INLINE void
+VMCIHashTableReadUnlock(VMCIHashTable *table,  // IN
+                        VMCILockFlags flags)   // IN
+{
+#ifdef VMCI_HAS_RCU
+   VMCI_RcuReadUnlock();
+#else
    VMCI_ReleaseLock_BH(&table->lock, flags);
+#endif
+}
 
-   return result;
+
+/*
+ *------------------------------------------------------------------------------
+ *
+ *  VMCIHashTableTryHold --
+ *
+ *       Take a reference on an entry found by a lookup, unless its last
+ *       reference is already gone.
+ *
+ *  Result:
+ *       TRUE if a reference was taken.
+ *
+ *  Side effects:
+ *       None.
+ *
+ *------------------------------------------------------------------------------
+ */
+
+static INLINE Bool
+VMCIHashTableTryHold(VMCIHashEntry *entry)  // IN
+{
+   uint32 refCount;
+
+   do {
+      refCount = Atomic_Read(&entry->refCount);
+      if (refCount == 0) {
+         return FALSE;
+      }
+   } while (Atomic_ReadIfEqualWrite32(&entry->refCount, refCount,
+                                      refCount + 1) != refCount);
+   return TRUE;
 }
 
 
 /*
  *------------------------------------------------------------------------------
  *
- *  VMCIHashTableGetEntryLocked --
+ *  VMCIHashTableLookup --
  *
- *       Looks up an entry in the hash table, that is already locked.
+ *       Looks up an entry in the hash table.  An entry with an invalid
+ *       context ID matches any context, and so does an invalid context ID
+ *       in 'handle' if 'anyContext'.  Entries whose last reference is gone
+ *       are skipped.  Caller is in a VMCIHashTableReadLock() section or
+ *       holds the table lock.
  *
  *  Result:
  *       If the element is found, a pointer to the element is returned.
  *       Otherwise NULL is returned.
  *
  *  Side effects:
- *       The reference count of the returned element is increased.
+ *       The reference count of the returned element is increased if
+ *       'hold'.
  *
  *------------------------------------------------------------------------------
  */
 
 static VMCIHashEntry *
-VMCIHashTableGetEntryLocked(VMCIHashTable *table,  // IN
-                            VMCIHandle handle)     // IN
+VMCIHashTableLookup(VMCIHashTable *table,  // IN
+                    VMCIHandle handle,     // IN
+                    Bool anyContext,       // IN
+                    Bool hold)             // IN
 {
-   VMCIHashEntry *cur = NULL;
-   int idx;
+   VMCIHashEntry *cur;
+   uint32 gen;
 
-   ASSERT(!VMCI_HANDLE_EQUAL(handle, VMCI_INVALID_HANDLE));
    ASSERT(table);
 
-   idx = VMCI_HASHTABLE_HASH(handle, table->size);
+   do {
+      VMCIHashBuckets *buckets;
+      int idx;
 
-   cur = table->entries[idx];
-   while (TRUE) {
-      if (cur == NULL) {
-         break;
-      }
+      gen = Atomic_Read(&table->resizeGen);
+      SMP_R_BARRIER_R();
+      buckets = VMCI_RcuDereference(table->buckets);
+      idx = VMCI_HASHTABLE_HASH(handle, buckets->size);
 
-      if (VMCI_HANDLE_TO_RESOURCE_ID(cur->handle) ==
-          VMCI_HANDLE_TO_RESOURCE_ID(handle)) {
+      for (cur = VMCI_RcuDereference(buckets->entries[idx]); cur != NULL;
+           cur = VMCI_RcuDereference(cur->next)) {
+         if (VMCI_HANDLE_TO_RESOURCE_ID(cur->handle) !=
+             VMCI_HANDLE_TO_RESOURCE_ID(handle)) {
+            continue;
+         }
          if ((VMCI_HANDLE_TO_CONTEXT_ID(cur->handle) ==
               VMCI_HANDLE_TO_CONTEXT_ID(handle)) ||
+             (anyContext &&
+              VMCI_INVALID_ID == VMCI_HANDLE_TO_CONTEXT_ID(handle)) ||
              (VMCI_INVALID_ID == VMCI_HANDLE_TO_CONTEXT_ID(cur->handle))) {
-            cur->refCount++;
-            break;
+            if (hold ? VMCIHashTableTryHold(cur) :
+                       Atomic_Read(&cur->refCount) != 0) {
+               break;
+            }
          }
       }
-      cur = cur->next;
-   }
+      SMP_R_BARRIER_R();
+   } while (cur == NULL &&
+            ((gen & 1) || gen != Atomic_Read(&table->resizeGen)));
 
    return cur;
 }
@@ -331,9 +530,9 @@ VMCIHashTable_GetEntry(VMCIHashTable *table,  // IN
 
    ASSERT(table);
 
-   VMCI_GrabLock_BH(&table->lock, &flags);
-   entry = VMCIHashTableGetEntryLocked(table, handle);
-   VMCI_ReleaseLock_BH(&table->lock, flags);
+   VMCIHashTableReadLock(table, &flags);
+   entry = VMCIHashTableLookup(table, handle, FALSE, TRUE);
+   VMCIHashTableReadUnlock(table, flags);
 
    return entry;
 }
@@ -361,24 +560,21 @@ void
 VMCIHashTable_HoldEntry(VMCIHashTable *table, // IN
                         VMCIHashEntry *entry) // IN/OUT
 {
-   VMCILockFlags flags;
-
    ASSERT(table);
    ASSERT(entry);
+   ASSERT(Atomic_Read(&entry->refCount) > 0);
 
-   VMCI_GrabLock_BH(&table->lock, &flags);
-   entry->refCount++;
-   VMCI_ReleaseLock_BH(&table->lock, flags);
+   Atomic_Inc(&entry->refCount);
 }
 
 
 /*
  *------------------------------------------------------------------------------
  *
- *  VMCIHashTableReleaseEntryLocked --
+ *  VMCIHashTable_ReleaseEntry --
  *
  *       Releases an element previously obtained with
- *       VMCIHashTableGetEntryLocked.
+ *       VMCIHashTable_GetEntry or held.
  *
  *  Result:
  *       If the entry is removed from the hash table, VMCI_SUCCESS_ENTRY_DEAD
@@ -391,62 +587,34 @@ VMCIHashTable_HoldEntry(VMCIHashTable *table, // IN
  *------------------------------------------------------------------------------
  */
 
-static int
-VMCIHashTableReleaseEntryLocked(VMCIHashTable *table,  // IN
-                                VMCIHashEntry *entry)  // IN
+int
+VMCIHashTable_ReleaseEntry(VMCIHashTable *table,  // IN
+                           VMCIHashEntry *entry)  // IN
 {
-   int result = VMCI_SUCCESS;
+   VMCILockFlags flags;
 
    ASSERT(table);
    ASSERT(entry);
 
-   entry->refCount--;
    /* Check if this is last reference and report if so. */
-   if (entry->refCount == 0) {
-
-      /*
-       * Remove entry from hash table if not already removed. This could have
-       * happened already because VMCIHashTable_RemoveEntry was called to unlink
-       * it. We ignore if it is not found. Datagram handles will often have
-       * RemoveEntry called, whereas SharedMemory regions rely on ReleaseEntry
-       * to unlink the entry, since the creator does not call RemoveEntry when
-       * it detaches.
-       */
-
-      HashTableUnlinkEntry(table, entry);
-      result = VMCI_SUCCESS_ENTRY_DEAD;
+   if (Atomic_ReadDec32(&entry->refCount) != 1) {
+      return VMCI_SUCCESS;
    }
 
-   return result;
-}
-
-
-/*
- *------------------------------------------------------------------------------
- *
- *  VMCIHashTable_ReleaseEntry --
- *     XXX Factor out the hashtable code to shared amongst API and perhaps
- *     host and guest.
- *
- *  Result:
- *     None.
- *
- *------------------------------------------------------------------------------
- */
-
-int
-VMCIHashTable_ReleaseEntry(VMCIHashTable *table,  // IN
-                           VMCIHashEntry *entry)  // IN
-{
-   VMCILockFlags flags;
-   int result;
+   /*
+    * Remove entry from hash table if not already removed. This could have
+    * happened already because VMCIHashTable_RemoveEntry was called to unlink
+    * it. We ignore if it is not found. Datagram handles will often have
+    * RemoveEntry called, whereas SharedMemory regions rely on ReleaseEntry
+    * to unlink the entry, since the creator does not call RemoveEntry when
+    * it detaches.
+    */
 
-   ASSERT(table);
    VMCI_GrabLock_BH(&table->lock, &flags);
-   result = VMCIHashTableReleaseEntryLocked(table, entry);
+   HashTableUnlinkEntry(table, entry);
    VMCI_ReleaseLock_BH(&table->lock, flags);
 
-   return result;
+   return VMCI_SUCCESS_ENTRY_DEAD;
 }
 
 
@@ -475,67 +643,22 @@ VMCIHashTable_EntryExists(VMCIHashTable *table,  // IN
 
    ASSERT(table);
 
-   VMCI_GrabLock_BH(&table->lock, &flags);
-   exists = VMCIHashTableEntryExistsLocked(table, handle);
-   VMCI_ReleaseLock_BH(&table->lock, flags);
+   VMCIHashTableReadLock(table, &flags);
+   exists = VMCIHashTableLookup(table, handle, TRUE, FALSE) != NULL;
+   VMCIHashTableReadUnlock(table, flags);
 
    return exists;
 }
 
 
-/*
- *------------------------------------------------------------------------------
- *
- *  VMCIHashTableEntryExistsLocked --
- *
- *     Unlocked version of VMCIHashTable_EntryExists.
- *
- *  Result:
- *     TRUE if handle already in hashtable. FALSE otherwise.
- *
- *  Side effects:
- *     None.
- *
- *------------------------------------------------------------------------------
- */
-
-static Bool
-VMCIHashTableEntryExistsLocked(VMCIHashTable *table,   // IN
-                               VMCIHandle handle)      // IN
-
-{
-   VMCIHashEntry *entry;
-   int idx;
-
-   ASSERT(table);
-
-   idx = VMCI_HASHTABLE_HASH(handle, table->size);
-
-   entry = table->entries[idx];
-   while (entry) {
-      if (VMCI_HANDLE_TO_RESOURCE_ID(entry->handle) ==
-          VMCI_HANDLE_TO_RESOURCE_ID(handle)) {
-         if ((VMCI_HANDLE_TO_CONTEXT_ID(entry->handle) ==
-              VMCI_HANDLE_TO_CONTEXT_ID(handle)) ||
-             (VMCI_INVALID_ID == VMCI_HANDLE_TO_CONTEXT_ID(handle)) ||
-             (VMCI_INVALID_ID == VMCI_HANDLE_TO_CONTEXT_ID(entry->handle))) {
-            return TRUE;
-         }
-      }
-      entry = entry->next;
-   }
-
-   return FALSE;
-}
-
-
 /*
  *------------------------------------------------------------------------------
  *
  *  HashTableUnlinkEntry --
  *     XXX Factor out the hashtable code to shared amongst API and perhaps
  *     host and guest.
- *     Assumes caller holds table lock.
+ *     Assumes caller holds table lock.  The entry keeps its next pointer
+ *     for lookups still walking past it.
  *
  *  Result:
  *     None.
@@ -547,36 +670,21 @@ static int
 HashTableUnlinkEntry(VMCIHashTable *table, // IN
                      VMCIHashEntry *entry) // IN
 {
-   int result;
-   VMCIHashEntry *prev, *cur;
+   VMCIHashBuckets *buckets = table->buckets;
+   VMCIHashEntry **link;
    int idx;
 
-   idx = VMCI_HASHTABLE_HASH(entry->handle, table->size);
+   idx = VMCI_HASHTABLE_HASH(entry->handle, buckets->size);
 
-   prev = NULL;
-   cur = table->entries[idx];
-   while (TRUE) {
-      if (cur == NULL) {
-         result = VMCI_ERROR_NOT_FOUND;
-         break;
+   for (link = &buckets->entries[idx]; *link != NULL; link = &(*link)->next) {
+      if (*link == entry) {
+         /* Remove entry. */
+         VMCI_RcuAssignPointer(*link, entry->next);
+         table->numEntries--;
+         return VMCI_SUCCESS;
       }
-      if (VMCI_HANDLE_EQUAL(cur->handle, entry->handle)) {
-         ASSERT(cur == entry);
-
-         /* Remove entry and break. */
-         if (prev) {
-            prev->next = cur->next;
-         } else {
-            table->entries[idx] = cur->next;
-         }
-         cur->next = NULL;
-         result = VMCI_SUCCESS;
-         break;
-      }
-      prev = cur;
-      cur = cur->next;
    }
-   return result;
+   return VMCI_ERROR_NOT_FOUND;
 }
 
 
@@ -586,7 +694,7 @@ HashTableUnlinkEntry(VMCIHashTable *table, // IN
  * VMCIHashTable_Sync --
  *
  *      Use this as a synchronization point when setting globals, for example,
- *      during device shutdown.
+ *      during device shutdown.  Waits for lookups in progress, so may block.
  *
  * Results:
  *      None.
@@ -604,4 +712,5 @@ VMCIHashTable_Sync(VMCIHashTable *table)
    ASSERT(table);
    VMCI_GrabLock_BH(&table->lock, &flags);
    VMCI_ReleaseLock_BH(&table->lock, flags);
+   VMCI_SynchronizeRcu();
 }
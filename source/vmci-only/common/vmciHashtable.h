@@ -31,19 +31,34 @@
 #define INCLUDE_ALLOW_VMKERNEL
 #include "includeCheck.h"
 
+#include "vm_atomic.h"
 #include "vmci_kernel_if.h"
 #include "vmci_defs.h"
 
+/*
+ * Lookups walk the chains under VMCI_RcuReadLock() and take a reference
+ * only on entries whose count is not yet 0; updates hold the lock.  An
+ * entry may still be read by lookups until a grace period after it was
+ * unlinked, so its owner must free it with VMCI_CallRcu().
+ */
+
 typedef struct VMCIHashEntry {
    VMCIHandle            handle;
-   int                   refCount;
-   struct VMCIHashEntry *next;
+   Atomic_uint32         refCount;
+   struct VMCIHashEntry *next;     // RCU protected
 } VMCIHashEntry;
 
+typedef struct VMCIHashBuckets {
+   VMCIRcuHead           rcu;      // must be first
+   uint32                size;     // power of 2
+   VMCIHashEntry        *entries[1];
+} VMCIHashBuckets;
+
 typedef struct VMCIHashTable {
-   VMCIHashEntry **entries;
-   int             size; // Number of buckets in above array.
-   VMCILock        lock;
+   VMCIHashBuckets *buckets;     // RCU protected, replaced when grown
+   uint32           numEntries;
+   Atomic_uint32    resizeGen;   // odd while entries move between buckets
+   VMCILock         lock;        // serializes updates
 } VMCIHashTable;
 
 VMCIHashTable *VMCIHashTable_Create(int size);
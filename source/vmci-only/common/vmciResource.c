@@ -111,6 +111,9 @@ VMCIResource_Exit(void)
    /* Cleanup resources.*/
    VMCI_CleanupLock(&resourceIdLock);
 
+   /* Let deferred frees of resources and buckets finish. */
+   VMCI_RcuBarrier();
+
    if (resourceTable) {
       VMCIHashTable_Destroy(resourceTable);
    }
@@ -342,6 +345,30 @@ VMCIResourceDoRemove(VMCIResource *resource)
 }
 
 
+/*
+ *------------------------------------------------------------------------------
+ *
+ * VMCIResourceFreeRcu --
+ *
+ *      VMCI_CallRcu() callback removing a resource once no lookup can
+ *      still see it.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Same as VMCIResourceDoRemove.
+ *
+ *------------------------------------------------------------------------------
+ */
+
+static void
+VMCIResourceFreeRcu(VMCIRcuHead *rcu)  // IN
+{
+   VMCIResourceDoRemove(RESOURCE_CONTAINER(rcu, VMCIResource, rcu));
+}
+
+
 /*
  *------------------------------------------------------------------------------
  *
@@ -351,7 +378,8 @@ VMCIResourceDoRemove(VMCIResource *resource)
  *      None.
  *
  * Side effects:
- *      resource's containerFreeCB will get called if last reference.
+ *      resource's containerFreeCB will get called if last reference, after
+ *      lookups that may still see the resource are done.
  *
  *------------------------------------------------------------------------------
  */
@@ -365,7 +393,7 @@ VMCIResource_Release(VMCIResource *resource)
 
    result = VMCIHashTable_ReleaseEntry(resourceTable, &resource->hashEntry);
    if (result == VMCI_SUCCESS_ENTRY_DEAD) {
-      VMCIResourceDoRemove(resource);
+      VMCI_CallRcu(&resource->rcu, VMCIResourceFreeRcu);
    }
 
    /*
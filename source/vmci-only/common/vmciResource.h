@@ -55,6 +55,8 @@ typedef struct VMCIResource {
    VMCIResourceFreeCB    containerFreeCB;    // Callback to free container
                                              // object when refCount is 0.
    void                  *containerObject;   // Container object reference.
+   VMCIRcuHead           rcu;                // Defers containerFreeCB past
+                                             // lookups in progress.
 } VMCIResource;
 
 
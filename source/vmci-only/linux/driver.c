@@ -881,7 +881,7 @@ LinuxDriver_Ioctl(struct inode *inode,
          ASSERT(dg);
          retval = copy_to_user((void *) ((uintptr_t) recvInfo.addr), dg,
                                VMCI_DG_SIZE(dg));
-         VMCI_FreeKernelMem(dg, VMCI_DG_SIZE(dg));
+         VMCIContext_FreeDatagram(dg);
          if (retval != 0) {
             break;
          }
@@ -1283,6 +1283,130 @@ LinuxDriver_Ioctl(struct inode *inode,
       break;
    }
 
+   case IOCTL_VMCI_DATAGRAM_SEND_BATCH: {
+      VMCIDatagramBatchInfo batchInfo;
+      uint8 *buf;
+      size_t offset;
+      uint32 i;
+      VMCIId cid;
+
+      if (vmciLinux->ctType != VMCIOBJ_CONTEXT) {
+         Warning(LGPFX"Ioctl only valid for context handle (iocmd=%d).\n", iocmd);
+         retval = -EINVAL;
+         break;
+      }
+
+      retval = copy_from_user(&batchInfo, (void *)ioarg, sizeof batchInfo);
+      if (retval) {
+         Warning(LGPFX"copy_from_user failed.\n");
+         retval = -EFAULT;
+         break;
+      }
+
+      if (batchInfo.len > VMCI_MAX_DG_SIZE ||
+          batchInfo.len < sizeof (VMCIDatagram)) {
+         Warning(LGPFX"Invalid datagram batch (size=%d).\n", batchInfo.len);
+         retval = -EINVAL;
+         break;
+      }
+
+      /* One copy in for the whole batch. */
+      buf = VMCI_AllocKernelMem(batchInfo.len, VMCI_MEMORY_NORMAL);
+      if (buf == NULL) {
+         Log(LGPFX"Cannot allocate memory to dispatch datagrams.\n");
+         retval = -ENOMEM;
+         break;
+      }
+
+      retval = copy_from_user(buf, (char *)(VA)batchInfo.addr, batchInfo.len);
+      if (retval != 0) {
+         Log(LGPFX"Error getting datagrams (err=%d).\n", retval);
+         VMCI_FreeKernelMem(buf, batchInfo.len);
+         retval = -EFAULT;
+         break;
+      }
+
+      ASSERT(vmciLinux->context);
+      cid = VMCIContext_GetId(vmciLinux->context);
+      ASSERT(cid != VMCI_INVALID_ID);
+
+      /* Dispatch in order; stop at the first datagram that fails. */
+      batchInfo.result = VMCI_SUCCESS;
+      for (i = 0, offset = 0; i < batchInfo.count; i++) {
+         VMCIDatagram *dg = (VMCIDatagram *)(buf + offset);
+
+         if (offset > batchInfo.len ||
+             batchInfo.len - offset < sizeof *dg ||
+             dg->payloadSize > batchInfo.len - offset - sizeof *dg) {
+            batchInfo.result = VMCI_ERROR_INVALID_ARGS;
+            break;
+         }
+         batchInfo.result = VMCIDatagram_Dispatch(cid, dg, TRUE);
+         if (batchInfo.result < VMCI_SUCCESS) {
+            break;
+         }
+         offset += VMCI_DG_SIZE_ALIGNED(dg);
+      }
+      if (batchInfo.result > VMCI_SUCCESS) {
+         batchInfo.result = VMCI_SUCCESS;
+      }
+      batchInfo.count = i;
+      VMCI_FreeKernelMem(buf, batchInfo.len);
+      retval = copy_to_user((void *)ioarg, &batchInfo, sizeof batchInfo);
+      break;
+   }
+
+   case IOCTL_VMCI_DATAGRAM_RECEIVE_BATCH: {
+      VMCIDatagramBatchInfo batchInfo;
+      VMCIDatagram *dgs[32];
+      uint32 numDgs;
+      size_t size;
+      size_t offset;
+      uint32 i;
+
+      if (vmciLinux->ctType != VMCIOBJ_CONTEXT) {
+         Warning(LGPFX"Ioctl only valid for context handle (iocmd=%d).\n",
+                 iocmd);
+         retval = -EINVAL;
+         break;
+      }
+
+      retval = copy_from_user(&batchInfo, (void *)ioarg, sizeof batchInfo);
+      if (retval) {
+         Warning(LGPFX"copy_from_user failed.\n");
+         retval = -EFAULT;
+         break;
+      }
+
+      numDgs = batchInfo.count;
+      if (numDgs == 0 || numDgs > ARRAYSIZE(dgs)) {
+         numDgs = ARRAYSIZE(dgs);
+      }
+      size = batchInfo.len;
+      ASSERT(vmciLinux->context);
+      batchInfo.result = VMCIContext_DequeueDatagrams(vmciLinux->context,
+                                                      &size, dgs, &numDgs);
+
+      /* The datagrams are gone from the queue; free them even on error. */
+      retval = 0;
+      for (i = 0, offset = 0; i < numDgs; i++) {
+         if (retval == 0 &&
+             copy_to_user((void *)((uintptr_t)batchInfo.addr + offset),
+                          dgs[i], VMCI_DG_SIZE(dgs[i])) != 0) {
+            retval = -EFAULT;
+         }
+         offset += VMCI_DG_SIZE_ALIGNED(dgs[i]);
+         VMCIContext_FreeDatagram(dgs[i]);
+      }
+      if (retval != 0) {
+         break;
+      }
+      batchInfo.len = size;
+      batchInfo.count = numDgs;
+      retval = copy_to_user((void *)ioarg, &batchInfo, sizeof batchInfo);
+      break;
+   }
+
    case IOCTL_VMCI_NOTIFY_RESOURCE: {
       VMCINotifyResourceInfo info;
       VMCIId cid;
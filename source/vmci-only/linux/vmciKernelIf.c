@@ -79,6 +79,7 @@ struct VMCIQueueKernelIf {
       struct {
          struct page **headerPage;  /* Guest queue header pages. */
          struct page **page;        /* Guest queue pages. */
+         void *va;                  /* Whole queue mapping, if any. */
       } h;                          /* Host. */
    } u;
 };
@@ -492,6 +493,89 @@ VMCI_FreeKernelMem(void *ptr,   // IN:
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMCI_CreateMemCache --
+ *
+ *      Create a slab cache of objects of the given size.  The objects
+ *      may be copied to and from user space.
+ *
+ * Results:
+ *      VMCI_SUCCESS or VMCI_ERROR_NO_MEM.
+ *
+ * Side effects:
+ *      None.
+ *----------------------------------------------------------------------
+ */
+
+int
+VMCI_CreateMemCache(VMCIMemCache *cache, // OUT:
+                    const char *name,    // IN: name of the slab
+                    size_t size)         // IN: object size
+{
+   *cache = compat_kmem_cache_create_usercopy(name, size, 0,
+                                              SLAB_HWCACHE_ALIGN, NULL);
+   return *cache != NULL ? VMCI_SUCCESS : VMCI_ERROR_NO_MEM;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMCI_DestroyMemCache --
+ *
+ *      Destroy a cache created by VMCI_CreateMemCache.  All objects must
+ *      have been freed.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *----------------------------------------------------------------------
+ */
+
+void
+VMCI_DestroyMemCache(VMCIMemCache cache) // IN:
+{
+   kmem_cache_destroy(cache);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMCI_AllocFromMemCache --
+ * VMCI_FreeToMemCache --
+ *
+ *      Allocate an object from a cache or return it there.  Objects freed
+ *      are handed out again first.
+ *
+ * Results:
+ *      The object or NULL on error; none.
+ *
+ * Side effects:
+ *      None.
+ *----------------------------------------------------------------------
+ */
+
+void *
+VMCI_AllocFromMemCache(VMCIMemCache cache, // IN:
+                       int flags)          // IN: VMCI_MEMORY_xxx
+{
+   return kmem_cache_alloc(cache, (flags & VMCI_MEMORY_ATOMIC) != 0 ?
+                                  GFP_ATOMIC : GFP_KERNEL);
+}
+
+void
+VMCI_FreeToMemCache(VMCIMemCache cache, // IN:
+                    void *ptr)          // IN:
+{
+   kmem_cache_free(cache, ptr);
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -1171,9 +1255,11 @@ VMCI_PopulatePPNList(uint8 *callBuf,       // OUT:
  *
  * __VMCIMemcpyToQueue --
  *
- *      Copies from a given buffer or iovector to a VMCI Queue.  Uses
- *      kmap()/kunmap() to dynamically map/unmap required portions of the queue
- *      by traversing the offset -> page translation structure for the queue.
+ *      Copies from a given buffer or iovector to a VMCI Queue.  Host queues
+ *      mapped as a whole by VMCIHost_MapQueues are copied to directly,
+ *      otherwise kmap()/kunmap() are used to dynamically map/unmap required
+ *      portions of the queue by traversing the offset -> page translation
+ *      structure for the queue.
  *      Assumes that offset + size does not wrap around in the queue.
  *
  * Results:
@@ -1195,6 +1281,19 @@ __VMCIMemcpyToQueue(VMCIQueue *queue,   // OUT:
    VMCIQueueKernelIf *kernelIf = queue->kernelIf;
    size_t bytesCopied = 0;
 
+   if (kernelIf->host && kernelIf->u.h.va != NULL) {
+      uint8 *va = (uint8 *)kernelIf->u.h.va + PAGE_SIZE + queueOffset;
+
+      if (isIovec) {
+         if (memcpy_fromiovec(va, (struct iovec *)src, size) != 0) {
+            return VMCI_ERROR_INVALID_ARGS;
+         }
+      } else {
+         memcpy(va, src, size);
+      }
+      return VMCI_SUCCESS;
+   }
+
    while (bytesCopied < size) {
       const uint64 pageIndex = (queueOffset + bytesCopied) / PAGE_SIZE;
       const size_t pageOffset = (queueOffset + bytesCopied) & (PAGE_SIZE - 1);
@@ -1246,9 +1345,11 @@ __VMCIMemcpyToQueue(VMCIQueue *queue,   // OUT:
  *
  * __VMCIMemcpyFromQueue --
  *
- *      Copies to a given buffer or iovector from a VMCI Queue.  Uses
- *      kmap()/kunmap() to dynamically map/unmap required portions of the queue
- *      by traversing the offset -> page translation structure for the queue.
+ *      Copies to a given buffer or iovector from a VMCI Queue.  Host queues
+ *      mapped as a whole by VMCIHost_MapQueues are copied from directly,
+ *      otherwise kmap()/kunmap() are used to dynamically map/unmap required
+ *      portions of the queue by traversing the offset -> page translation
+ *      structure for the queue.
  *      Assumes that offset + size does not wrap around in the queue.
  *
  * Results:
@@ -1270,6 +1371,19 @@ __VMCIMemcpyFromQueue(void *dest,             // OUT:
    VMCIQueueKernelIf *kernelIf = queue->kernelIf;
    size_t bytesCopied = 0;
 
+   if (kernelIf->host && kernelIf->u.h.va != NULL) {
+      const uint8 *va = (uint8 *)kernelIf->u.h.va + PAGE_SIZE + queueOffset;
+
+      if (isIovec) {
+         if (memcpy_toiovec((struct iovec *)dest, va, size) != 0) {
+            return VMCI_ERROR_INVALID_ARGS;
+         }
+      } else {
+         memcpy(dest, va, size);
+      }
+      return VMCI_SUCCESS;
+   }
+
    while (bytesCopied < size) {
       const uint64 pageIndex = (queueOffset + bytesCopied) / PAGE_SIZE;
       const size_t pageOffset = (queueOffset + bytesCopied) & (PAGE_SIZE - 1);
@@ -1588,6 +1702,7 @@ VMCIHost_AllocQueue(uint64 size) // IN:
       queue->kernelIf->u.h.headerPage =
          (struct page **)((uint8*)queue + queueSize);
       queue->kernelIf->u.h.page = &queue->kernelIf->u.h.headerPage[1];
+      queue->kernelIf->u.h.va = NULL;
       memset(queue->kernelIf->u.h.headerPage, 0,
              (sizeof *queue->kernelIf->u.h.headerPage *
               queue->kernelIf->numPages));
@@ -1949,6 +2064,11 @@ VMCIHost_UnregisterUserMemory(VMCIQueue *produceQ,         // IN/OUT
  *       VMCIHost_UnmapQueues prior to calling
  *       VMCIHost_UnregisterUserMemory.
  *
+ *       Each queue is mapped whole, header and data pages, into one
+ *       contiguous kernel range so that copies to and from it need no
+ *       per page mapping.  If the vmalloc space for that cannot be had,
+ *       only the two headers are mapped and copies fall back to kmap().
+ *
  * Results:
  *       VMCI_SUCCESS if pages are mapped, appropriate error code otherwise.
  *
@@ -1967,6 +2087,8 @@ VMCIHost_MapQueues(VMCIQueue *produceQ,  // IN/OUT
 
    if (!produceQ->qHeader || !consumeQ->qHeader) {
       struct page *headers[2];
+      void *produceVA;
+      void *consumeVA = NULL;
 
       if (produceQ->qHeader != consumeQ->qHeader) {
          return VMCI_ERROR_QUEUEPAIR_MISMATCH;
@@ -1980,18 +2102,35 @@ VMCIHost_MapQueues(VMCIQueue *produceQ,  // IN/OUT
       ASSERT(*produceQ->kernelIf->u.h.headerPage &&
              *consumeQ->kernelIf->u.h.headerPage);
 
-      headers[0] = *produceQ->kernelIf->u.h.headerPage;
-      headers[1] = *consumeQ->kernelIf->u.h.headerPage;
-
-      produceQ->qHeader = vmap(headers, 2, VM_MAP, PAGE_KERNEL);
-      if (produceQ->qHeader != NULL) {
-         consumeQ->qHeader =
-            (VMCIQueueHeader *)((uint8 *)produceQ->qHeader + PAGE_SIZE);
+      produceVA = vmap(produceQ->kernelIf->u.h.headerPage,
+                       produceQ->kernelIf->numPages, VM_MAP, PAGE_KERNEL);
+      if (produceVA != NULL) {
+         consumeVA = vmap(consumeQ->kernelIf->u.h.headerPage,
+                          consumeQ->kernelIf->numPages, VM_MAP, PAGE_KERNEL);
+         if (consumeVA == NULL) {
+            vunmap(produceVA);
+         }
+      }
+      if (consumeVA != NULL) {
+         produceQ->kernelIf->u.h.va = produceVA;
+         consumeQ->kernelIf->u.h.va = consumeVA;
+         produceQ->qHeader = produceVA;
+         consumeQ->qHeader = consumeVA;
          result = VMCI_SUCCESS;
       } else {
-         Log("vmap failed\n");
-         result = VMCI_ERROR_NO_MEM;
-     }
+         headers[0] = *produceQ->kernelIf->u.h.headerPage;
+         headers[1] = *consumeQ->kernelIf->u.h.headerPage;
+
+         produceQ->qHeader = vmap(headers, 2, VM_MAP, PAGE_KERNEL);
+         if (produceQ->qHeader != NULL) {
+            consumeQ->qHeader =
+               (VMCIQueueHeader *)((uint8 *)produceQ->qHeader + PAGE_SIZE);
+            result = VMCI_SUCCESS;
+         } else {
+            Log("vmap failed\n");
+            result = VMCI_ERROR_NO_MEM;
+         }
+      }
    } else {
       result = VMCI_SUCCESS;
    }
@@ -2024,7 +2163,13 @@ VMCIHost_UnmapQueues(VMCIGuestMemID gid,   // IN
    if (produceQ->qHeader) {
       ASSERT(consumeQ->qHeader);
 
-      if (produceQ->qHeader < consumeQ->qHeader) {
+      if (produceQ->kernelIf->u.h.va != NULL) {
+         ASSERT(consumeQ->kernelIf->u.h.va);
+         vunmap(produceQ->kernelIf->u.h.va);
+         vunmap(consumeQ->kernelIf->u.h.va);
+         produceQ->kernelIf->u.h.va = NULL;
+         consumeQ->kernelIf->u.h.va = NULL;
+      } else if (produceQ->qHeader < consumeQ->qHeader) {
          vunmap(produceQ->qHeader);
       } else {
          vunmap(consumeQ->qHeader);
@@ -82,4 +82,16 @@ typedef void compat_kmem_cache_ctor(void *);
 #define COMPAT_KMEM_CACHE_CTOR_ARGS(arg) void *arg
 #endif
 
+/*
+ * Since 4.16 hardened usercopy only lets copy_{to,from}_user() touch slab
+ * objects within a region whitelisted when the cache is created.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+#define compat_kmem_cache_create_usercopy(name, size, align, flags, ctor) \
+		kmem_cache_create_usercopy(name, size, align, flags, 0, size, ctor)
+#else
+#define compat_kmem_cache_create_usercopy(name, size, align, flags, ctor) \
+		compat_kmem_cache_create(name, size, align, flags, ctor)
+#endif
+
 #endif /* __COMPAT_SLAB_H__ */
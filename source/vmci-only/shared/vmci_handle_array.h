@@ -248,6 +248,30 @@ VMCIHandleArray_RemoveTail(VMCIHandleArray *array)
 }
 
 
+/*
+ *-----------------------------------------------------------------------------------
+ *
+ * VMCIHandleArray_Clear --
+ *
+ *      Removes all handles, keeping the array's capacity for reuse.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *-----------------------------------------------------------------------------------
+ */
+
+static INLINE void
+VMCIHandleArray_Clear(VMCIHandleArray *array)
+{
+   ASSERT(array);
+   array->size = 0;
+}
+
+
 /*
  *-----------------------------------------------------------------------------------
  *
@@ -313,6 +313,8 @@ enum IOCTLCmd_VMCI {
 
    IOCTLCMD(FIRST2),
    IOCTLCMD(SET_NOTIFY) = IOCTLCMD(FIRST2), /* 1995 on Linux. */
+   IOCTLCMD(DATAGRAM_SEND_BATCH),
+   IOCTLCMD(DATAGRAM_RECEIVE_BATCH),
    IOCTLCMD(LAST2),
 };
 
@@ -589,6 +591,19 @@ typedef struct VMCIDatagramSendRecvInfo {
    int32  result;
 } VMCIDatagramSendRecvInfo;
 
+/*
+ * Used to send or receive several datagrams in one call.  The datagrams
+ * are packed in the buffer at 8 byte aligned offsets, see
+ * VMCI_DG_SIZE_ALIGNED.
+ */
+typedef struct VMCIDatagramBatchInfo {
+   VA64   addr;
+   uint32 len;    /* Buffer size; on receive, bytes used or needed on return. */
+   uint32 count;  /* Datagrams to send or max to receive; done on return. */
+   int32  result;
+   uint32 _pad;
+} VMCIDatagramBatchInfo;
+
 /* Used to add/remove well-known datagram mappings. */
 typedef struct VMCIDatagramMapInfo {
    VMCIId      wellKnownID;
@@ -45,6 +45,7 @@
 #  include "compat_semaphore.h"
 #  include "compat_spinlock.h"
 #  include "compat_version.h"
+#  include <linux/rcupdate.h>
 #  include <linux/wait.h>
 #endif // linux
 
@@ -238,6 +239,37 @@ void VMCI_ReleaseLock(VMCILock *lock, VMCILockFlags flags);
 void VMCI_GrabLock_BH(VMCILock *lock, VMCILockFlags *flags);
 void VMCI_ReleaseLock_BH(VMCILock *lock, VMCILockFlags flags);
 
+/*
+ * Read-copy-update.  Where the platform has it (VMCI_HAS_RCU), readers
+ * of RCU protected pointers may run concurrently with updaters holding
+ * the lock, and memory they can reach is reclaimed with VMCI_CallRcu.
+ * Elsewhere readers take the updaters' lock, the read side is empty and
+ * VMCI_CallRcu calls back at once.
+ */
+
+#if defined(__linux__) && !defined(VMKERNEL)
+#  define VMCI_HAS_RCU
+  typedef struct rcu_head VMCIRcuHead;
+#  define VMCI_RcuReadLock()           rcu_read_lock()
+#  define VMCI_RcuReadUnlock()         rcu_read_unlock()
+#  define VMCI_RcuDereference(_p)      rcu_dereference(_p)
+#  define VMCI_RcuAssignPointer(_p, _v) rcu_assign_pointer(_p, _v)
+#  define VMCI_CallRcu(_head, _fn)     call_rcu(_head, _fn)
+#  define VMCI_SynchronizeRcu()        synchronize_rcu()
+#  define VMCI_RcuBarrier()            rcu_barrier()
+#else
+  typedef struct VMCIRcuHead {
+     void *unused;
+  } VMCIRcuHead;
+#  define VMCI_RcuReadLock()           do { } while (0)
+#  define VMCI_RcuReadUnlock()         do { } while (0)
+#  define VMCI_RcuDereference(_p)      (_p)
+#  define VMCI_RcuAssignPointer(_p, _v) ((_p) = (_v))
+#  define VMCI_CallRcu(_head, _fn)     (_fn)(_head)
+#  define VMCI_SynchronizeRcu()        do { } while (0)
+#  define VMCI_RcuBarrier()            do { } while (0)
+#endif
+
 void VMCIHost_InitContext(VMCIHost *hostContext, uintptr_t eventHnd);
 void VMCIHost_ReleaseContext(VMCIHost *hostContext);
 void VMCIHost_SignalCall(VMCIHost *hostContext);
@@ -276,6 +308,28 @@ void *VMCI_AllocKernelMem(size_t size, int flags);
 #endif // _WIN32
 void VMCI_FreeKernelMem(void *ptr, size_t size);
 
+/*
+ * Caches of equally sized objects, for allocations on hot paths.  Where
+ * the platform has no object cache, the objects come from
+ * VMCI_AllocKernelMem.
+ */
+
+#if defined(__linux__) && !defined(VMKERNEL)
+  typedef struct kmem_cache *VMCIMemCache;
+int VMCI_CreateMemCache(VMCIMemCache *cache, const char *name, size_t size);
+void VMCI_DestroyMemCache(VMCIMemCache cache);
+void *VMCI_AllocFromMemCache(VMCIMemCache cache, int flags);
+void VMCI_FreeToMemCache(VMCIMemCache cache, void *ptr);
+#else
+  typedef size_t VMCIMemCache;
+#  define VMCI_CreateMemCache(_cache, _name, _size) \
+      (*(_cache) = (_size), VMCI_SUCCESS)
+#  define VMCI_DestroyMemCache(_cache)          do { } while (0)
+#  define VMCI_AllocFromMemCache(_cache, _flags) \
+      VMCI_AllocKernelMem((_cache), (_flags) | VMCI_MEMORY_NONPAGED)
+#  define VMCI_FreeToMemCache(_cache, _ptr)     VMCI_FreeKernelMem((_ptr), (_cache))
+#endif
+
 int VMCI_CopyToUser(VA64 dst, const void *src, size_t len);
 Bool VMCIWellKnownID_AllowMap(VMCIId wellKnownID,
                               VMCIPrivilegeFlags privFlags);
@@ -21,6 +21,7 @@
 #define EXPORT_SYMTAB
 
 #include <linux/kernel.h>
+#include "compat_module.h"
 #include <linux/version.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
@@ -32,6 +33,7 @@
 #include "compat_skbuff.h"
 #include <linux/sockios.h>
 #include <linux/spinlock.h>
+#include <linux/hash.h>
 #include "compat_sock.h"
 
 #define __KERNEL_SYSCALLS__
@@ -52,8 +54,16 @@
 #include "compat_netdevice.h"
 #include "vnetInt.h"
 #include "smac.h"
+#include "vnetTrace.h"
+#include "vnetFilter.h"
 
-#define VNET_BRIDGE_HISTORY    48
+/*
+ * Frames sent up to the host are remembered in a small hash set keyed on
+ * their shared data buffer so that the copy the host hands back to us can
+ * be recognized in O(1).  Must be a power of two.
+ */
+
+#define VNET_BRIDGE_HISTORY    64
 
 /*
  * Bytes reserved before start of packet.  As Ethernet header has 14 bytes,
@@ -71,6 +81,22 @@ static struct timeval vnetTime;
 
 typedef struct VNetBridge VNetBridge;
 
+enum {
+   BRIDGE_STAT_FROM_VNET,
+   BRIDGE_STAT_FROM_VNET_BYTES,
+   BRIDGE_STAT_FROM_DEV,
+   BRIDGE_STAT_FROM_DEV_BYTES,
+   BRIDGE_STAT_SEGMENTED,
+   BRIDGE_STAT_SEGMENTS,
+   BRIDGE_STAT_FILTERED,
+   BRIDGE_STAT_NUM
+};
+
+static const char * const vnetBridgeStatNames[BRIDGE_STAT_NUM] = {
+   "fromVNet", "fromVNet.bytes", "fromDev", "fromDev.bytes", "segmented",
+   "segments", "filtered",
+};
+
 struct VNetBridge {
    struct notifier_block    notifier;       // for device state changes
    char                     name[VNET_NAME_LEN]; // name of net device (e.g., "eth0")
@@ -79,12 +105,13 @@ struct VNetBridge {
    struct packet_type       pt;             // used to add packet handler
    Bool                     enabledPromisc; // track if promisc enabled
    Bool                     forceSmac;      // whether to use smac unconditionally
-   struct sk_buff          *history[VNET_BRIDGE_HISTORY];  // avoid duplicate packets
-   spinlock_t		    historyLock;    // protects 'history'
+   Bool                     gsoPassthrough; // send GSO packets to vnet intact
+   struct sk_buff          *history[VNET_BRIDGE_HISTORY];  // avoid duplicate packets, xchg only
    VNetPort                 port;           // connection to virtual hub
    Bool                     wirelessAdapter; // connected to wireless adapter?
    struct SMACState        *smac;           // device structure for wireless
    VNetEvent_Sender        *eventSender;    // event sender
+   VNetStats                stats;          // BRIDGE_STAT_xxx
 };
 
 typedef PacketStatus (* SMACINT SMACFunc)(struct SMACState *, SMACPackets *);
@@ -100,6 +127,7 @@ static int VNetBridgeReceiveFromDev(struct sk_buff *skb,
                                     struct net_device *real_dev);
 
 static void VNetBridgeFree(VNetJack *this);
+static void VNetBridgeHistoryFlush(VNetBridge *bridge);
 static void VNetBridgeReceiveFromVNet(VNetJack *this, struct sk_buff *skb);
 static Bool VNetBridgeCycleDetect(VNetJack *this, int generation);
 static Bool VNetBridgeIsDeviceWireless(struct net_device *dev);
@@ -109,9 +137,14 @@ static int  VNetBridgeProcRead(char *page, char **start, off_t off,
                                int count, int *eof, void *data);
 static void VNetBridgeComputeHeaderPosIPv6(struct sk_buff *skb);
 static PacketStatus VNetCallSMACFunc(struct SMACState *state,
-                                     struct sk_buff **skb, void *startOfData,
+                                     struct sk_buff **skb, int offset,
                                      SMACFunc func, unsigned int len);
 
+static uint vnet_smac_capacity = SMAC_DEFAULT_CAPACITY;
+module_param(vnet_smac_capacity, uint, 0);
+MODULE_PARM_DESC(vnet_smac_capacity, "Maximum number of IP/MAC pairs "
+                 "remembered by each wireless bridge, default is 256");
+
 
 /*
  *----------------------------------------------------------------------
@@ -273,7 +306,7 @@ VNetBridge_Create(const char *devName, // IN:  name of device (e.g., "eth0")
    }
 
    /* complain about unknown/unsupported flags */
-   if (flags & ~VNET_BRFLAG_FORCE_SMAC) {
+   if (flags & ~(VNET_BRFLAG_FORCE_SMAC | VNET_BRFLAG_GSO)) {
       retval = -EINVAL;
       goto out;
    }
@@ -288,7 +321,6 @@ VNetBridge_Create(const char *devName, // IN:  name of device (e.g., "eth0")
       goto out;
    }
    memset(bridge, 0, sizeof *bridge);
-   spin_lock_init(&bridge->historyLock);
    memcpy(bridge->name, devName, sizeof bridge->name);
    NULL_TERMINATE_STRING(bridge->name);
 
@@ -311,6 +343,13 @@ VNetBridge_Create(const char *devName, // IN:  name of device (e.g., "eth0")
    bridge->port.jack.cycleDetect = VNetBridgeCycleDetect;
    bridge->port.jack.portsChanged = VNetBridgePortsChanged;
    bridge->port.jack.isBridged = VNetBridgeIsBridged;
+   bridge->port.jack.gsoTypes = 0;
+
+   retval = VNetStats_Alloc(&bridge->stats, vnetBridgeStatNames,
+                            BRIDGE_STAT_NUM);
+   if (retval) {
+      goto out;
+   }
 
    /*
     * Make proc entry for this jack.
@@ -332,6 +371,7 @@ VNetBridge_Create(const char *devName, // IN:  name of device (e.g., "eth0")
     */
 
    bridge->port.flags = IFF_RUNNING;
+   bridge->port.devPromisc = FALSE;
 
    memset(bridge->port.paddr, 0, sizeof bridge->port.paddr);
    memset(bridge->port.ladrf, 0, sizeof bridge->port.ladrf);
@@ -347,6 +387,7 @@ VNetBridge_Create(const char *devName, // IN:  name of device (e.g., "eth0")
 
    /* misc. configuration */
    bridge->forceSmac = (flags & VNET_BRFLAG_FORCE_SMAC) ? TRUE : FALSE;
+   bridge->gsoPassthrough = (flags & VNET_BRFLAG_GSO) ? TRUE : FALSE;
 
    /* create event sender */
    retval = VNetHub_CreateSender(hubJack, &bridge->eventSender);
@@ -370,6 +411,8 @@ VNetBridge_Create(const char *devName, // IN:  name of device (e.g., "eth0")
    bridge->notifier.priority = 0;
    register_netdevice_notifier(&bridge->notifier);
 
+   VNetStats_Register(&bridge->stats, bridge->port.jack.name);
+
    /* return bridge */
    *ret = &bridge->port;
    LOG(1, (KERN_DEBUG "bridge-%s: attached\n", bridge->name));
@@ -377,6 +420,7 @@ VNetBridge_Create(const char *devName, // IN:  name of device (e.g., "eth0")
 
 out:
    if (bridge != NULL) {
+      VNetStats_Free(&bridge->stats);
       kfree(bridge);
    }
    return retval;
@@ -437,6 +481,9 @@ VNetBridgeFree(VNetJack *this) // IN: jack to free
       SMAC_CleanupState(&(bridge->smac));
    }
 
+   VNetBridgeHistoryFlush(bridge);
+   VNetStats_Free(&bridge->stats);
+
    /* free bridge */
    LOG(1, (KERN_DEBUG "bridge-%s: detached\n", bridge->name));
    kfree(bridge);
@@ -448,14 +495,16 @@ VNetBridgeFree(VNetJack *this) // IN: jack to free
  *
  * VNetCallSMACFunc --
  *
- *      Wrapper for SMAC functions. The skb must be linear.
+ *      Wrapper for SMAC functions.  The skb need not be linear: SMAC
+ *      copies out the headers it inspects, and its clone only gets a
+ *      private copy of the headers it rewrites.
  *
  * Results:
  *      Packet Status.
  *
  * Side effects:
- *      The skb buffer is freed if not successful otherwise it points to
- *      the clone.
+ *      The skb buffer (and any clone) is freed if not successful
+ *      otherwise it points to the clone.
  *
  *----------------------------------------------------------------------
  */
@@ -463,21 +512,22 @@ VNetBridgeFree(VNetJack *this) // IN: jack to free
 static PacketStatus
 VNetCallSMACFunc(struct SMACState *state, // IN: pointer to state
                  struct sk_buff **skb,    // IN/OUT: packet to process
-                 void *startOfData,       // IN: points to start of data
+                 int offset,              // IN: ETH header offset from data
                  SMACFunc func,           // IN: function to be called
                  unsigned int len)        // IN: length including ETH header
 {
    SMACPackets packets = { {0} };
    PacketStatus status;
 
-   SKB_LINEAR_ASSERT(*skb);
-
    packets.orig.skb = *skb;
-   packets.orig.startOfData = startOfData;
+   packets.orig.offset = offset;
    packets.orig.len = len;
 
    status = func(state, &packets);
    if (status != PacketStatusForwardPacket) {
+      if (packets.clone.skb) {
+         dev_kfree_skb(packets.clone.skb);
+      }
       dev_kfree_skb(*skb);
       return status;
    }
@@ -490,6 +540,144 @@ VNetCallSMACFunc(struct SMACState *state, // IN: pointer to state
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetBridgeHistorySlot --
+ *
+ *      Map a packet to its history slot.  Clones share the data buffer,
+ *      so a frame and every clone of it land in the same slot.
+ *
+ * Results:
+ *      Pointer to the slot.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE struct sk_buff **
+VNetBridgeHistorySlot(VNetBridge *bridge,   // IN: bridge
+                      struct sk_buff *skb)  // IN: packet
+{
+   return &bridge->history[hash_ptr(skb->head, ilog2(VNET_BRIDGE_HISTORY))];
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetBridgeHistoryAdd --
+ *
+ *      Remember a packet sent up to the host.  The history takes over
+ *      the caller's reference.  A packet already occupying the slot is
+ *      evicted; at worst its echo is bridged back to the vnet, which
+ *      is what happened before when the old linear history overflowed.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      May free an older history entry.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetBridgeHistoryAdd(VNetBridge *bridge,   // IN: bridge
+                     struct sk_buff *skb)  // IN: packet, reference donated
+{
+   struct sk_buff *old = xchg(VNetBridgeHistorySlot(bridge, skb), skb);
+
+   if (old != NULL) {
+      LOG(3, (KERN_DEBUG "bridge-%s: history collision\n", bridge->name));
+      dev_kfree_skb_any(old);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetBridgeHistoryClaim --
+ *
+ *      Check whether a packet received from the host device is one
+ *      that we sent up ourselves, and if so forget it.  No lock is
+ *      taken: the slot is emptied with xchg so the entry is owned
+ *      while it is compared, and it is put back if it did not match.
+ *
+ * Results:
+ *      TRUE if the packet is ours and should be dropped.
+ *
+ * Side effects:
+ *      May free a history entry.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+VNetBridgeHistoryClaim(VNetBridge *bridge,   // IN: bridge
+                       struct sk_buff *skb)  // IN: received packet
+{
+   struct sk_buff **slot = VNetBridgeHistorySlot(bridge, skb);
+   struct sk_buff *s;
+
+   if (READ_ONCE(*slot) == NULL) {
+      return FALSE;
+   }
+   s = xchg(slot, NULL);
+   if (s == NULL) {
+      return FALSE;
+   }
+   if (s == skb || SKB_IS_CLONE_OF(skb, s)) {
+      dev_kfree_skb_any(s);
+      return TRUE;
+   }
+
+   /*
+    * Someone else's frame hashed here.  Put it back unless the slot has
+    * been refilled meanwhile, in which case the newer entry wins.
+    */
+
+   if (cmpxchg(slot, NULL, s) != NULL) {
+      dev_kfree_skb_any(s);
+   }
+   return FALSE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetBridgeHistoryFlush --
+ *
+ *      Release every packet held in the history.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Frees history entries.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetBridgeHistoryFlush(VNetBridge *bridge)  // IN: bridge
+{
+   int i;
+
+   for (i = 0; i < VNET_BRIDGE_HISTORY; i++) {
+      struct sk_buff *s = xchg(&bridge->history[i], NULL);
+
+      if (s != NULL) {
+         dev_kfree_skb_any(s);
+      }
+   }
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -502,7 +690,7 @@ VNetCallSMACFunc(struct SMACState *state, // IN: pointer to state
  *      satisfies the host's packet filter.
  *
  *      When the function sends up it keeps a reference to the
- *      packet in a history list so that we can avoid handing
+ *      packet in a history set so that we can avoid handing
  *      a VM a copy of its own packet.
  *
  * Results:
@@ -532,6 +720,15 @@ VNetBridgeReceiveFromVNet(VNetJack        *this, // IN: jack
       return;
    }
 
+   VNetStats_Inc(&bridge->stats, BRIDGE_STAT_FROM_VNET);
+   VNetStats_Add(&bridge->stats, BRIDGE_STAT_FROM_VNET_BYTES, skb->len);
+
+   if (VNetFilter_Drop(skb, VNET_FILTER_DIRECTION_OUT)) {
+      VNetStats_Inc(&bridge->stats, BRIDGE_STAT_FILTERED);
+      dev_kfree_skb(skb);
+      return;
+   }
+
    /*
     * skb might be freed by wireless code, so need to keep
     * a local copy of the MAC rather than a pointer to it.
@@ -556,17 +753,11 @@ VNetBridgeReceiveFromVNet(VNetJack        *this, // IN: jack
 #endif
 
    /*
-    * SMAC processing. SMAC interfaces that the skb is linear, so ensure that
-    * this is the case prior to calling out.
+    * SMAC processing.
     */
 
    if (bridge->smac) {
-      if (compat_skb_is_nonlinear(skb) && compat_skb_linearize(skb)) {
-         LOG(4, (KERN_NOTICE "bridge-%s: couldn't linearize, packet dropped\n",
-                 bridge->name));
-         return;
-      }
-      if (VNetCallSMACFunc(bridge->smac, &skb, skb->data,
+      if (VNetCallSMACFunc(bridge->smac, &skb, 0,
                            SMAC_CheckPacketToHost, skb->len) !=
           PacketStatusForwardPacket) {
          LOG(4, (KERN_NOTICE "bridge-%s: packet dropped\n", bridge->name));
@@ -627,62 +818,14 @@ VNetBridgeReceiveFromVNet(VNetJack        *this, // IN: jack
     * We save it so we can recognize it (and its clones) again.
     */
 
-   if (VNetPacketMatch(dest, dev->dev_addr, NULL, 0, allMultiFilter, dev->flags)) {
+   if (VNetPacketMatch(dest, dev->dev_addr, allMultiFilter, dev->flags)) {
       clone = skb_clone(skb, GFP_ATOMIC);
       if (clone) {
-	 unsigned long flags;
-	 int i;
-
 	 clone = skb_get(clone);
 
 	 clone->dev = dev;
 	 clone->protocol = eth_type_trans(clone, dev);
-	 spin_lock_irqsave(&bridge->historyLock, flags);
-	 for (i = 0; i < VNET_BRIDGE_HISTORY; i++) {
-	    if (bridge->history[i] == NULL) {
-	       bridge->history[i] = clone;
-#	       if LOGLEVEL >= 3
-	       {
-		  int j;
-		  int count = 0;
-		  for (j = 0; j < VNET_BRIDGE_HISTORY; j++) {
-		     if (bridge->history[j] != NULL) {
-			count++;
-		     }
-		  }
-		  LOG(3, (KERN_DEBUG "bridge-%s: host slot %d history %d\n",
-			  bridge->name, i, count));
-	       }
-#	       endif
-	       break;
-	    }
-	 }
-	 if (i >= VNET_BRIDGE_HISTORY) {
-	    LOG(1, (KERN_NOTICE "bridge-%s: history full\n",
-		    bridge->name));
-
-	    for (i = 0; i < VNET_BRIDGE_HISTORY; i++) {
-	       struct sk_buff *s = bridge->history[i];
-
-	       /*
-		* We special case 0 to avoid races with another thread on
-		* another cpu wanting to use the 0 entry. This could happen
-		* when we release the lock to free the former entry.
-		* See bug 11231 for details.
-		*/
-	       if (i == 0) {
-		  bridge->history[0] = clone;
-	       } else {
-		  bridge->history[i] = NULL;
-	       }
-	       if (s) {
-	       	  spin_unlock_irqrestore(&bridge->historyLock, flags);
-		  dev_kfree_skb(s);
-		  spin_lock_irqsave(&bridge->historyLock, flags);
-	       }
-	    }
-	 }
-         spin_unlock_irqrestore(&bridge->historyLock, flags);
+	 VNetBridgeHistoryAdd(bridge, clone);
 
          /*
           * We used to cli() before calling netif_rx() here. It was probably
@@ -954,6 +1097,7 @@ VNetBridgeUp(VNetBridge *bridge, // IN: bridge struct
           */
 
          SMAC_SetMac(bridge->smac, bridge->dev->dev_addr);
+         SMAC_SetCapacity(bridge->smac, vnet_smac_capacity);
       }
    }
 
@@ -1400,7 +1544,7 @@ VNetBridgeComputeHeaderPos(struct sk_buff *skb) // IN: buffer to examine
  *
  * Side effects:
  *      The incoming packet is split into multiple packets and sent to the
- *      vnet.
+ *      vnet.  Counted in BRIDGE_STAT_SEGMENTED/SEGMENTS.
  *
  *----------------------------------------------------------------------
  */
@@ -1410,6 +1554,10 @@ VNetBridgeSendLargePacket(struct sk_buff *skb,        // IN: packet to split
                           VNetBridge *bridge)         // IN: bridge
 {
    struct sk_buff *segs;
+   struct sk_buff *s;
+   unsigned int len = skb->len;
+   unsigned int gsoSize = skb_shinfo(skb)->gso_size;
+   unsigned int numSegs = 0;
 
    segs = skb_gso_segment(skb, 0);
    dev_kfree_skb(skb);
@@ -1419,6 +1567,13 @@ VNetBridgeSendLargePacket(struct sk_buff *skb,        // IN: packet to split
       return;
    }
 
+   for (s = segs; s != NULL; s = s->next) {
+      numSegs++;
+   }
+   VNetStats_Inc(&bridge->stats, BRIDGE_STAT_SEGMENTED);
+   VNetStats_Add(&bridge->stats, BRIDGE_STAT_SEGMENTS, numSegs);
+   trace_vmnet_bridge_segment(bridge->name, len, gsoSize, numSegs);
+
    while (segs) {
       struct sk_buff *newSkb;
 
@@ -1457,8 +1612,6 @@ VNetBridgeReceiveFromDev(struct sk_buff *skb,         // IN: packet to receive
                          struct net_device *real_dev) // IN: real device, unused
 {
    VNetBridge *bridge = list_entry(pt, VNetBridge, pt);
-   int i;
-   unsigned long flags;
 
    if (bridge->dev == NULL) {
       LOG(3, (KERN_DEBUG "bridge-%s: received %d closed\n",
@@ -1472,21 +1625,12 @@ VNetBridgeReceiveFromDev(struct sk_buff *skb,         // IN: packet to receive
     * so then don't bother to receive the packet.
     */
 
-   spin_lock_irqsave(&bridge->historyLock, flags);
-   for (i = 0; i < VNET_BRIDGE_HISTORY; i++) {
-      struct sk_buff *s = bridge->history[i];
-      if (s != NULL &&
-	  (s == skb || SKB_IS_CLONE_OF(skb, s))) {
-	 bridge->history[i] = NULL;
-	 spin_unlock_irqrestore(&bridge->historyLock, flags);
-	 dev_kfree_skb(s);
-	 LOG(3, (KERN_DEBUG "bridge-%s: receive %d self %d\n",
-		 bridge->name, (int) skb->len, i));
-	 dev_kfree_skb(skb);
-	 return 0;
-      }
+   if (VNetBridgeHistoryClaim(bridge, skb)) {
+      LOG(3, (KERN_DEBUG "bridge-%s: receive %d self\n",
+	      bridge->name, (int) skb->len));
+      dev_kfree_skb(skb);
+      return 0;
    }
-   spin_unlock_irqrestore(&bridge->historyLock, flags);
 
 #  if LOGLEVEL >= 4
    {
@@ -1500,8 +1644,8 @@ VNetBridgeReceiveFromDev(struct sk_buff *skb,         // IN: packet to receive
 #  endif
 
    /*
-    * SMAC might linearize the skb, but linearizing a shared skb is a no-no,
-    * so check for sharing before calling out to SMAC.
+    * SMAC may replace the skb with its clone and the code below adjusts
+    * the skb, neither of which is allowed for a shared skb.
     */
    skb = skb_share_check(skb, GFP_ATOMIC);
    if (!skb) {
@@ -1514,15 +1658,9 @@ VNetBridgeReceiveFromDev(struct sk_buff *skb,         // IN: packet to receive
        * and the length is reduced by the amount. We need the raw ethernet
        * packet length hence add the ethernet header length for incoming
        * packets.
-       *
-       * Note that SMAC interfaces assume skb linearity.
        */
-      if (compat_skb_is_nonlinear(skb) && compat_skb_linearize(skb)) {
-         LOG(4, (KERN_NOTICE "bridge-%s: couldn't linearize, packet dropped\n",
-                 bridge->name));
-         return 0;
-      }
-      if (VNetCallSMACFunc(bridge->smac, &skb, compat_skb_mac_header(skb),
+      if (VNetCallSMACFunc(bridge->smac, &skb,
+                           compat_skb_mac_header(skb) - skb->data,
                            SMAC_CheckPacketFromHost, skb->len + ETH_HLEN) !=
           PacketStatusForwardPacket) {
          LOG(4, (KERN_NOTICE "bridge-%s: packet dropped\n", bridge->name));
@@ -1539,10 +1677,21 @@ VNetBridgeReceiveFromDev(struct sk_buff *skb,         // IN: packet to receive
    LOG(3, (KERN_DEBUG "bridge-%s: receive %d\n",
 	   bridge->name, (int) skb->len));
 
+   VNetStats_Inc(&bridge->stats, BRIDGE_STAT_FROM_DEV);
+   VNetStats_Add(&bridge->stats, BRIDGE_STAT_FROM_DEV_BYTES, skb->len);
+
+   if (VNetFilter_Drop(skb, VNET_FILTER_DIRECTION_IN)) {
+      VNetStats_Inc(&bridge->stats, BRIDGE_STAT_FILTERED);
+      dev_kfree_skb(skb);
+      return 0;
+   }
+
    /*
-    * If this is a large packet, chop chop chop (if supported)...
+    * If this is a large packet, chop chop chop (if supported)...  In GSO
+    * passthrough mode VNetSend segments it only for the ports that
+    * need it.
     */
-   if (skb_shinfo(skb)->gso_size) {
+   if (skb_shinfo(skb)->gso_size && !bridge->gsoPassthrough) {
       VNetBridgeSendLargePacket(skb, bridge);
    } else {
       VNetSend(&bridge->port.jack, skb);
@@ -1587,6 +1736,25 @@ VNetBridgeProcRead(char    *page,   // IN/OUT: buffer to write into
 
    len += sprintf(page+len, "dev %s ", bridge->name);
 
+   len += sprintf(page+len, "fromVNet %llu fromVNet.bytes %llu "
+                  "fromDev %llu fromDev.bytes %llu ",
+                  VNetStats_Read(&bridge->stats, BRIDGE_STAT_FROM_VNET),
+                  VNetStats_Read(&bridge->stats, BRIDGE_STAT_FROM_VNET_BYTES),
+                  VNetStats_Read(&bridge->stats, BRIDGE_STAT_FROM_DEV),
+                  VNetStats_Read(&bridge->stats, BRIDGE_STAT_FROM_DEV_BYTES));
+
+   if (bridge->smac) {
+      SMACStats smacStats;
+
+      SMAC_GetStats(bridge->smac, &smacStats);
+      len += sprintf(page+len, "smac.entries %u smac.capacity %u "
+                     "smac.hits %llu smac.misses %llu smac.evictions %llu ",
+                     smacStats.entries, smacStats.capacity,
+                     (unsigned long long)smacStats.lookupHits,
+                     (unsigned long long)smacStats.lookupMisses,
+                     (unsigned long long)smacStats.evictions);
+   }
+
    len += sprintf(page+len, "\n");
 
    *start = 0;
@@ -216,8 +216,21 @@ static inline int compat_unregister_netdevice_notifier(struct notifier_block *nb
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 24) || defined(__VMKLNX__)
 
-#   define compat_netif_napi_add(dev, napi, poll, quota) \
-      netif_napi_add(dev, napi, poll, quota)
+/* Since 6.1 netif_napi_add() always uses NAPI_POLL_WEIGHT. */
+#   if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0)
+#      define compat_netif_napi_add(dev, napi, poll, quota) \
+         netif_napi_add_weight(dev, napi, poll, quota)
+#   else
+#      define compat_netif_napi_add(dev, napi, poll, quota) \
+         netif_napi_add(dev, napi, poll, quota)
+#   endif
+
+/* napi_complete_done() appeared in 3.19. */
+#   if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
+#      define compat_napi_complete_done(napi, done) napi_complete_done(napi, done)
+#   else
+#      define compat_napi_complete_done(napi, done) napi_complete(napi)
+#   endif
 
 #   if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 30) || \
        defined VMW_NETIF_SINGLE_NAPI_PARM
@@ -34,10 +34,12 @@
 #include <linux/mm.h>
 #include "compat_skbuff.h"
 #include <linux/if_ether.h>
+#include <linux/crc32.h>
 #include <linux/sockios.h>
 #include "compat_sock.h"
 #include <linux/kdev_t.h>
 #include <linux/mutex.h>
+#include <linux/rcupdate.h>
 
 #define __KERNEL_SYSCALLS__
 #include <asm/io.h>
@@ -82,24 +84,15 @@ const uint8 allMultiFilter[VNET_LADRF_LEN] = { 0xff, 0xff, 0xff, 0xff,
 /* broadcast MAC */
 const uint8 broadcast[ETH_ALEN] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
 
-/*
- * All jack->peer accesses are guarded by this lock.
- *
- * This lock is acquired for read from interrupt context:
- * use write_lock_irqsave() to gain write access.
- *
- * If you are acquiring this lock for write, and you do
- * not have vnetStructureMutex already acquired,
- * it is most certainly a bug.
- */
-static DEFINE_RWLOCK(vnetPeerLock);
-
 /*
  * All concurrent changes to the network structure are
  * guarded by this mutex.
  *
- * For change to peer field you must own both
- * vnetStructureMutex and vnetPeerLock for write.
+ * jack->peer is published with rcu_assign_pointer() while holding
+ * this mutex.  The packet path reads it under rcu_read_lock() only,
+ * and VNetKrefRelease() waits for a grace period before a jack is
+ * freed, so a peer seen by a reader stays valid until the reader
+ * leaves its read-side critical section.
  */
 DEFINE_MUTEX(vnetStructureMutex);
 
@@ -155,6 +148,16 @@ module_param(vnet_max_qlen, uint, 0);
 MODULE_PARM_DESC(vnet_max_qlen, "Maximum queue length of the vmnet, default is"
                  " 1024, maximum is 1024");
 
+uint vnet_instrument = 0;
+module_param(vnet_instrument, uint, 0);
+MODULE_PARM_DESC(vnet_instrument, "Collect latency histograms and EtherType "
+                 "counts on vmnet ports (SIOCGPORTSTATS), default is 0 (off)");
+
+uint vnet_netif_queues = 0;
+module_param(vnet_netif_queues, uint, 0);
+MODULE_PARM_DESC(vnet_netif_queues, "Number of queues of host adapters, default "
+                 "is 0 (one per CPU), maximum is 16");
+
 /*
  *----------------------------------------------------------------------
  *
@@ -312,6 +315,16 @@ init_module(void)
       return -ENOENT;
    }
 
+   retval = VNetStats_ProcInit();
+   if (retval) {
+      goto err_stats;
+   }
+
+   retval = VNetFilter_Init();
+   if (retval) {
+      goto err_filter;
+   }
+
    retval = VNetProtoRegister();
    if (retval) {
       goto err_proto;
@@ -350,6 +363,10 @@ init_module(void)
 err_chrdev:
    VNetProtoUnregister();
 err_proto:
+   VNetFilter_Cleanup();
+err_filter:
+   VNetStats_ProcCleanup();
+err_stats:
    VNetProc_Cleanup();
    return retval;
 }
@@ -379,6 +396,8 @@ cleanup_module(void)
 {
    unregister_chrdev(VNET_MAJOR_NUMBER, "vmnet");
    VNetProtoUnregister();
+   VNetFilter_Cleanup();
+   VNetStats_ProcCleanup();
    VNetProc_Cleanup();
 }
 
@@ -642,9 +661,20 @@ VNetFileOpPoll(struct file *filp, // IN:
  *      SIOCSPEER - set bridge peer interface       - ioarg IN:  8 bytes
  *      SIOCSPEER2 - set bridge peer interface      - ioarg IN: 32 bytes
  *      SIOCSBIND - bind to a particular vnet/PVN   - ioarg IN: VNet_Bind
- *      SIOCSFILTERRULES - set host filter rules    - ioarg IN: VNet_Filter
+ *      SIOCSFILTERRULES - set host filter rules    - ioarg IN: VNet_RuleHeader
  *      SIOCBRIDGE - (legacy see SIOCSPEER)
  *      SIOCSUSERLISTENER - set user listener - ioarg IN: VNet_SetUserListener
+ *      SIOCREADBATCH - read many frames         - ioarg IN/OUT: VNet_Batch
+ *      SIOCWRITEBATCH - write many frames       - ioarg IN/OUT: VNet_Batch
+ *      SIOCRINGKICK - send frames posted to TX ring - no ioarg
+ *      SIOCSETQUEUES - set number of RX queues  - ioarg IN: VNet_Queues
+ *      SIOCGETQUEUEFD - open an RX queue        - ioarg IN: 4 bytes,
+ *         returns a file descriptor
+ *      SIOCSETQLIMITS - set RX backlog limits   - ioarg IN: VNet_QueueLimits
+ *      SIOCSETVNETHDR - prefix read frames with a VNet_VirtioNetHdr
+ *                                               - ioarg IN: 4 bytes
+ *      SIOCGPORTSTATS - instrumentation snapshot - ioarg IN/OUT:
+ *                                                  VNet_PortStats
  *
  *      Supported flags are (taken from if.h):
  *
@@ -830,16 +860,15 @@ VNetFileOpUnlockedIoctl(struct file    *filp,  // IN:
       break;
 
    case SIOCSFILTERRULES:
-      LOG(0, (KERN_NOTICE "/dev/vmnet: kernel doesn't support netfilter\n"));
-      return -EINVAL;
+      return VNetFilter_Ioctl(ioarg);
 
    case SIOCGBRSTATUS:
       {
          uint32 flags;
 
-         read_lock(&vnetPeerLock);
+         rcu_read_lock();
          flags = VNetIsBridged(&port->jack);
-         read_unlock(&vnetPeerLock);
+         rcu_read_unlock();
 
          retval = put_user(flags, (uint32 *)ioarg) ? -EFAULT : 0;
       }
@@ -869,8 +898,7 @@ VNetFileOpUnlockedIoctl(struct file    *filp,  // IN:
          }
 
          mutex_lock(&vnetIoctlMutex);
-         memcpy(port->ladrf, ladrf, sizeof port->ladrf);
-         port->exactFilterLen = 0;
+         VNetSetMulticastFilter(port, ladrf, NULL, 0);
          mutex_unlock(&vnetIoctlMutex);
 
          retval = 0;
@@ -951,10 +979,9 @@ VNetFileOpUnlockedIoctl(struct file    *filp,  // IN:
 
          mutex_lock(&vnetIoctlMutex);
 
-         memcpy(port->ladrf, vnetMcastFilter.ladrf, sizeof port->ladrf);
-         memcpy(port->exactFilter, vnetMcastFilter.exactFilter,
-                vnetMcastFilter.exactFilterLen * ETHER_ADDR_LEN);
-         port->exactFilterLen = vnetMcastFilter.exactFilterLen;
+         VNetSetMulticastFilter(port, (const uint8 *)vnetMcastFilter.ladrf,
+                                &vnetMcastFilter.exactFilter[0][0],
+                                vnetMcastFilter.exactFilterLen);
 
          mutex_unlock(&vnetIoctlMutex);
 
@@ -977,6 +1004,19 @@ VNetFileOpUnlockedIoctl(struct file    *filp,  // IN:
       retval = put_user(VNET_API_VERSION, (uint32 *)ioarg) ?  -EFAULT : 0;
       break;
 
+   case SIOCREADBATCH:
+   case SIOCWRITEBATCH:
+   case SIOCRINGKICK:
+      /*
+       * These are data path operations, like read and write, so they do
+       * not serialize on vnetIoctlMutex.
+       */
+      if (!port->fileOpIoctl) {
+         return -ENOIOCTLCMD;
+      }
+      retval = port->fileOpIoctl(port, filp, iocmd, ioarg);
+      break;
+
    default:
       if (!port->fileOpIoctl) {
          return -ENOIOCTLCMD;
@@ -1094,6 +1134,34 @@ VNetSwitchToDifferentPeer(VNetJack *jack,              // IN: jack whose peer is
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetMulticastHash --
+ *
+ *      Compute the 6-bit logical address filter hash of a MAC
+ *      (like the one on the lance chipset): the 6 most significant
+ *      bits of the little-endian Ethernet CRC of the address.
+ *
+ *      (This is in the green AMD "Ethernet Controllers" book,
+ *      page 1-53.)
+ *
+ * Results:
+ *      Hash value, 0 .. VNET_MCAST_HASH_SIZE - 1.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE unsigned
+VNetMulticastHash(const uint8 *addr) // IN: MAC
+{
+   return ether_crc_le(ETH_ALEN, addr) >> 26;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -1103,13 +1171,13 @@ VNetSwitchToDifferentPeer(VNetJack *jack,              // IN: jack whose peer is
  *      to a 64-bit logical address filter (like the one on the
  *      lance chipset).  AllMultiFilter lets all packets through.
  *
- *      We generate a hash value from the destination MAC address
- *      and see if it's in our filter.  Broadcast packets have
- *      already OK'd by PacketMatch, so we don't have to worry
- *      about that.
+ *      If the port has an exact multicast filter, it is used instead
+ *      of the logical address filter.  Its entries are chained by
+ *      their logical address filter hash, so only addresses hashing
+ *      to the same bucket are compared.
  *
- *      (This is in the green AMD "Ethernet Controllers" book,
- *      page 1-53.)
+ *      Broadcast packets have already OK'd by PacketMatch, so we
+ *      don't have to worry about that.
  *
  * Results:
  *      TRUE if packet is in filter, FALSE if not.
@@ -1120,28 +1188,23 @@ VNetSwitchToDifferentPeer(VNetJack *jack,              // IN: jack whose peer is
  *----------------------------------------------------------------------
  */
 
-#define CRC_POLYNOMIAL_BE 0x04c11db7UL  /* Ethernet CRC, big endian */
-
-static INLINE_SINGLE_CALLER Bool
-VNetMulticastFilter(const uint8 *destAddr,        // IN: multicast MAC
-                    const uint8 *exactFilter,     // IN: exact mc filter
-                    const uint32 exactFilterLen,  // IN: length of exact mc filter
-		    const uint8 *ladrf)           // IN: logical addr filter
+static INLINE Bool
+VNetMulticastFilter(const uint8 *destAddr,  // IN: multicast MAC
+                    const VNetPort *port,   // IN: port with exact filter or NULL
+		    const uint8 *ladrf)     // IN: logical addr filter
 {
-   uint16 hashcode;
-   int32 crc;
-   int32 poly = CRC_POLYNOMIAL_BE;
-   int j;
-   int bit;
-   int byte;
-
-   /*  first check exact multicast filter */
-   if (exactFilterLen) {
-      uint32 i;
-      for (i = 0; i < exactFilterLen; i++) {
-         if (MAC_EQ(destAddr, exactFilter + i * ETHER_ADDR_LEN)){
+   unsigned hashcode;
+
+   if (port != NULL && port->exactFilterLen) {
+      uint32 len = port->exactFilterLen;
+      unsigned i = port->exactFilterHash[VNetMulticastHash(destAddr)];
+      int n;
+
+      for (n = 0; i < len && n < VNET_MAX_EXACT_FILTER_LEN; n++) {
+         if (MAC_EQ(destAddr, port->exactFilter[i])) {
             return TRUE;
          }
+         i = port->exactFilterNext[i];
       }
       /*
        * Do not need to further compute and check ladrf if no match
@@ -1150,36 +1213,67 @@ VNetMulticastFilter(const uint8 *destAddr,        // IN: multicast MAC
        */
       return FALSE;
    }
-   
-
-   crc = 0xffffffff;                  /* init CRC for each address */
-   for (byte = 0; byte < ETH_ALEN; byte++) { /* for each address byte */
-      /* process each address bit */
-      for (bit = *destAddr++, j = 0;
-	   j < VNET_LADRF_LEN;
-	   j++, bit >>= 1) {
-	 crc = (crc << 1) ^ ((((crc<0?1:0) ^ bit) & 0x01) ? poly : 0);
-      }
-   }
-   hashcode = (crc & 1);              /* hashcode is 6 LSb of CRC ... */
-   for (j = 0; j < 5; j++) {                /* ... in reverse order. */
-      hashcode = (hashcode << 1) | ((crc>>=1) & 1);
-   }
 
-   byte = hashcode >> 3;              /* bit[3-5] -> byte in filter */
-   bit = 1 << (hashcode & 0x07);      /* bit[0-2] -> bit in byte */
-   if (ladrf[byte] & bit) {
+   if (!memcmp(ladrf, allMultiFilter, VNET_LADRF_LEN)) {
       return TRUE;
-   } else {
-      return FALSE;
    }
+
+   hashcode = VNetMulticastHash(destAddr);
+   /* bit[3-5] -> byte in filter, bit[0-2] -> bit in byte */
+   return (ladrf[hashcode >> 3] & (1 << (hashcode & 0x07))) != 0;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * VNetPacketMatch --
+ * VNetSetMulticastFilter --
+ *
+ *      Set the logical address filter and the exact multicast filter
+ *      of a port, and rebuild the hash chains of the exact filter.
+ *      Caller must own vnetIoctlMutex.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+VNetSetMulticastFilter(VNetPort    *port,           // IN: port
+                       const uint8 *ladrf,          // IN: logical addr filter
+                       const uint8 *exactFilter,    // IN: exact mc filter
+                       uint32       exactFilterLen) // IN: entries in exactFilter
+{
+   uint32 i;
+
+   /* Readers ignore the chains while exactFilterLen is 0. */
+   port->exactFilterLen = 0;
+   smp_wmb();
+
+   memcpy(port->ladrf, ladrf, sizeof port->ladrf);
+   memcpy(port->exactFilter, exactFilter, exactFilterLen * ETHER_ADDR_LEN);
+   memset(port->exactFilterHash, VNET_EXACT_FILTER_NONE,
+          sizeof port->exactFilterHash);
+   for (i = 0; i < exactFilterLen; i++) {
+      unsigned hash = VNetMulticastHash(port->exactFilter[i]);
+
+      port->exactFilterNext[i] = port->exactFilterHash[hash];
+      port->exactFilterHash[hash] = i;
+   }
+
+   smp_wmb();
+   port->exactFilterLen = exactFilterLen;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetPacketMatchInt --
  *
  *      Determines whether the packet should be given to the interface.
  *
@@ -1192,13 +1286,12 @@ VNetMulticastFilter(const uint8 *destAddr,        // IN: multicast MAC
  *----------------------------------------------------------------------
  */
 
-Bool
-VNetPacketMatch(const uint8   *destAddr,        // IN: destination MAC
-                const uint8   *ifAddr,          // IN: MAC of interface
-                const uint8   *exactFilter,     // IN: exact mc filter
-                const uint32  exactFilterLen,   // IN: size of exact mc filter
-		const uint8   *ladrf,           // IN: multicast filter
-                uint32        flags)            // IN: filter flags
+static INLINE Bool
+VNetPacketMatchInt(const uint8    *destAddr,        // IN: destination MAC
+                   const uint8    *ifAddr,          // IN: MAC of interface
+                   const VNetPort *port,            // IN: port with exact filter or NULL
+                   const uint8    *ladrf,           // IN: multicast filter
+                   uint32          flags)           // IN: filter flags
 {
    /*
     * Return TRUE if promiscuous requested, or unicast destined
@@ -1211,7 +1304,60 @@ VNetPacketMatch(const uint8   *destAddr,        // IN: destination MAC
 	   ((flags & IFF_BROADCAST) && MAC_EQ(destAddr, broadcast)) ||
 	   ((destAddr[0] & 0x1) && (flags & IFF_ALLMULTI ||
 	     (flags & IFF_MULTICAST &&
-	      VNetMulticastFilter(destAddr, exactFilter, exactFilterLen, ladrf)))));
+	      VNetMulticastFilter(destAddr, port, ladrf)))));
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetPacketMatch --
+ *
+ *      Determines whether the packet should be given to an interface
+ *      that has no exact multicast filter.
+ *
+ * Results:
+ *      TRUE if the pasket is OK for this interface, FALSE otherwise.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+Bool
+VNetPacketMatch(const uint8   *destAddr,        // IN: destination MAC
+                const uint8   *ifAddr,          // IN: MAC of interface
+		const uint8   *ladrf,           // IN: multicast filter
+                uint32        flags)            // IN: filter flags
+{
+   return VNetPacketMatchInt(destAddr, ifAddr, NULL, ladrf, flags);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetPortPacketMatch --
+ *
+ *      Determines whether the packet should be given to the port,
+ *      using the port's address, filters and flags.
+ *
+ * Results:
+ *      TRUE if the pasket is OK for this port, FALSE otherwise.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+Bool
+VNetPortPacketMatch(const VNetPort *port,     // IN: port
+                    const uint8    *destAddr) // IN: destination MAC
+{
+   return VNetPacketMatchInt(destAddr, port->paddr, port, port->ladrf,
+                             port->flags);
 }
 
 
@@ -1281,7 +1427,6 @@ VNetConnect(VNetJack *jack1, // IN: jack
 {
    static int vnetGeneration = 0;
    Bool foundCycle;
-   unsigned long flags;
 
    vnetGeneration++;
 
@@ -1299,17 +1444,15 @@ VNetConnect(VNetJack *jack1, // IN: jack
    VNetFreeInterfaceList();
 
    /*
-    * Synchronize with peer readers
+    * Publish to peer readers.  Both jacks are fully initialized by now.
     */
 
-   write_lock_irqsave(&vnetPeerLock, flags);
-   jack1->peer = jack2;
-   jack2->peer = jack1;
-   jack1->state = TRUE;
-   jack2->state = TRUE;
    kref_init(&jack1->kref);
    kref_init(&jack2->kref);
-   write_unlock_irqrestore(&vnetPeerLock, flags);
+   rcu_assign_pointer(jack1->peer, jack2);
+   rcu_assign_pointer(jack2->peer, jack1);
+   jack1->state = TRUE;
+   jack2->state = TRUE;
 
    if (jack2->numPorts) {
       VNetPortsChanged(jack1);
@@ -1344,17 +1487,13 @@ VNetJack *
 VNetDisconnect(VNetJack *jack) // IN: jack
 {
    VNetJack *peer;
-   unsigned long flags;
 
-   write_lock_irqsave(&vnetPeerLock, flags);
    peer = jack->peer;
    if (!peer) {
-      write_unlock_irqrestore(&vnetPeerLock, flags);
       return NULL;
    }
    jack->state = FALSE;
    peer->state = FALSE;
-   write_unlock_irqrestore(&vnetPeerLock, flags);
 
    if (peer->numPorts) {
       VNetPortsChanged(jack);
@@ -1454,13 +1593,15 @@ VNetFreeInterfaceList()
  *
  * VNetKrefRelease --
  *
- *      Free the VNetJack if no reference.
+ *      Free the VNetJack if no reference.  Packet path readers may
+ *      still hold the jack as a peer, so wait for them to finish first.
+ *      Called from process context only.
  *
  * Results:
  *      None.
  *
  * Side effects:
- *      None.
+ *      Waits for an RCU grace period.
  *
  *----------------------------------------------------------------------
  */
@@ -1471,11 +1612,54 @@ VNetKrefRelease(struct kref *kref)
    struct VNetJack *jack = container_of(kref, struct VNetJack, kref);
 
    jack->state = FALSE;
+   synchronize_rcu();
    jack->peer = NULL;
    VNetFree(jack);
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetSendSegments --
+ *
+ *      Software segment a GSO packet for a peer that cannot take it
+ *      whole, and hand it the segments.  Segmenting also fills in the
+ *      checksums of the segments.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      The skb is no longer owned by us.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+VNetSendSegments(VNetJack *peer,       // IN: receiving jack
+                 struct sk_buff *skb)  // IN: GSO packet
+{
+   struct sk_buff *segs;
+
+   segs = skb_gso_segment(skb, 0);
+   dev_kfree_skb(skb);
+   if (IS_ERR_OR_NULL(segs)) {
+      LOG(1, (KERN_DEBUG "vmnet: cannot segment packet for %s: error %ld\n",
+              peer->name, PTR_ERR(segs)));
+      return;
+   }
+
+   while (segs) {
+      struct sk_buff *next = segs->next;
+
+      segs->next = NULL;
+      peer->rcv(peer, segs);
+      segs = next;
+   }
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -1484,6 +1668,12 @@ VNetKrefRelease(struct kref *kref)
  *      Send a packet through this jack. Note, the packet goes to the
  *      jacks peer.
  *
+ *      Lockless: the peer is looked up under rcu_read_lock() and is
+ *      kept alive by the grace period in VNetKrefRelease().
+ *
+ *      GSO packets are segmented here if the peer does not accept
+ *      their GSO type.
+ *
  * Results:
  *      None.
  *
@@ -1497,20 +1687,23 @@ void
 VNetSend(VNetJack *jack, // IN: jack
          struct sk_buff *skb)  // IN: packet
 {
-   VNetJack *peer;
+   VNetJack *peer = NULL;
 
-   read_lock(&vnetPeerLock);
-   if (jack && jack->peer && jack->peer->rcv) {
-      peer = jack->peer;
-      kref_get(&(peer->kref));
-      read_unlock(&vnetPeerLock);
-
-      peer->rcv(peer, skb);
-      kref_put(&(peer->kref), VNetKrefRelease);
+   rcu_read_lock();
+   if (jack) {
+      peer = rcu_dereference(jack->peer);
+   }
+   if (peer && peer->rcv) {
+      if (skb_is_gso(skb) &&
+          (skb_shinfo(skb)->gso_type & ~READ_ONCE(peer->gsoTypes))) {
+         VNetSendSegments(peer, skb);
+      } else {
+         peer->rcv(peer, skb);
+      }
    } else {
-      read_unlock(&vnetPeerLock);
       dev_kfree_skb(skb);
    }
+   rcu_read_unlock();
 }
 
 
@@ -1573,15 +1766,17 @@ int
 VNetPrintJack(const VNetJack *jack, // IN: jack
               char           *buf)  // OUT: info about jack
 {
+   const VNetJack *peer;
    int len = 0;
 
-   read_lock(&vnetPeerLock);
-   if (!jack->peer) {
+   rcu_read_lock();
+   peer = rcu_dereference(jack->peer);
+   if (!peer) {
       len += sprintf(buf+len, "connected not ");
    } else {
-      len += sprintf(buf+len, "connected %s ", jack->peer->name);
+      len += sprintf(buf+len, "connected %s ", peer->name);
    }
-   read_unlock(&vnetPeerLock);
+   rcu_read_unlock();
 
    return len;
 }
@@ -21,10 +21,13 @@
 #define EXPORT_SYMTAB
 
 #include <linux/kernel.h>
+#include "compat_module.h"
 #include <linux/version.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/poll.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
 
 #include <linux/netdevice.h>
 #include <linux/etherdevice.h>
@@ -41,13 +44,50 @@
 #include <linux/file.h>
 
 #include "vnetInt.h"
+#include "vnetTrace.h"
 
 #define HUB_TYPE_VNET         0x1
 #define HUB_TYPE_PVN          0x2
 
-typedef struct VNetHubStats {
-   unsigned      tx;
-} VNetHubStats;
+/*
+ * MAC learning.  When enabled, the hub behaves like a learning switch:
+ * source addresses are remembered per jack and known unicast frames are
+ * forwarded to that jack, and to jacks whose port is in promiscuous mode.
+ * Unknown unicast, broadcast and multicast frames are still flooded to
+ * every jack.  The table is a direct-mapped
+ * cache, so a collision simply evicts the older entry and its traffic
+ * falls back to flooding.
+ */
+
+#define VNET_HUB_MAC_TABLE_SIZE   256       // must be a power of 2
+#define VNET_HUB_MAC_AGE          (300 * HZ)
+
+typedef struct VNetHubMacEntry {
+   uint8         addr[ETH_ALEN];
+   int           jackIndex;                // -1 if entry is empty
+   unsigned long lastSeen;                 // jiffies of last learn
+} VNetHubMacEntry;
+
+enum {
+   HUB_STAT_TX,
+   HUB_STAT_TX_BYTES,
+   HUB_STAT_NUM
+};
+
+static const char * const vnetHubStatNames[HUB_STAT_NUM] = {
+   "tx", "tx.bytes",
+};
+
+enum {
+   HUB_MAC_STAT_LEARN,                     // new or moved addresses
+   HUB_MAC_STAT_HIT,                       // unicast sent to a single jack
+   HUB_MAC_STAT_FLOOD,                     // frames sent to every jack
+   HUB_MAC_STAT_NUM
+};
+
+static const char * const vnetHubMacStatNames[HUB_MAC_STAT_NUM] = {
+   "learn", "hit", "flood",
+};
 
 typedef struct VNetHub {
    uint32        hubType;                  // HUB_TYPE_xxx
@@ -57,11 +97,16 @@ typedef struct VNetHub {
    } id;
    Bool		 used[NUM_JACKS_PER_HUB];  // tracks which jacks in use
    VNetJack      jack[NUM_JACKS_PER_HUB];  // jacks for the hub
-   VNetHubStats  stats[NUM_JACKS_PER_HUB]; // stats for the jacks
+   VNetStats     stats[NUM_JACKS_PER_HUB]; // stats for the jacks
    int           totalPorts;               // num devices reachable from hub
    int           myGeneration;             // used for cycle detection
    struct VNetHub *next;                   // next hub in linked list
    VNetEvent_Mechanism *eventMechanism;    // event notification mechanism
+   char          name[VNET_MAX_JACK_NAME_LEN];
+   Bool          learning;                 // TRUE if MAC learning enabled
+   spinlock_t    macTableLock;             // guards macTable
+   VNetHubMacEntry macTable[VNET_HUB_MAC_TABLE_SIZE];
+   VNetStats     macStats;
 } VNetHub;
 
 static VNetJack *VNetHubAlloc(Bool allocPvn, int hubNum,
@@ -77,6 +122,12 @@ static int  VNetHubProcRead(char *page, char **start, off_t off,
 static VNetHub *vnetHub;
 static DEFINE_SPINLOCK(vnetHubLock);
 
+static uint vnet_learning = 0;
+module_param(vnet_learning, uint, 0);
+MODULE_PARM_DESC(vnet_learning, "Forward known unicast frames only to the "
+                 "jack that owns the destination MAC and to promiscuous "
+                 "ports, default is 0 (flood)");
+
 
 /*
  *----------------------------------------------------------------------
@@ -195,6 +246,34 @@ VNetHubRemoveHubFromList(VNetHub *hub) // IN: hub to remove from list
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetHubFreeStats --
+ *
+ *      Free the statistics of a hub and its jacks.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetHubFreeStats(VNetHub *hub) // IN: hub
+{
+   int i;
+
+   for (i = 0; i < NUM_JACKS_PER_HUB; i++) {
+      VNetStats_Free(&hub->stats[i]);
+   }
+   VNetStats_Free(&hub->macStats);
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -275,7 +354,7 @@ VNetHubAlloc(Bool allocPvn, // IN: TRUE for PVN, FALSE for vnet
       LOG(1, (KERN_DEBUG "/dev/vmnet: hub %d does not exist, allocating memory.\n",
               hubNum));
 
-      hub = kmalloc(sizeof *hub, GFP_KERNEL);
+      hub = kzalloc(sizeof *hub, GFP_KERNEL);
       if (hub == NULL) {
          LOG(1, (KERN_DEBUG "/dev/vmnet: no memory to allocate hub %d\n", hubNum));
          return NULL;
@@ -305,8 +384,7 @@ VNetHubAlloc(Bool allocPvn, // IN: TRUE for PVN, FALSE for vnet
          jack->cycleDetect = VNetHubCycleDetect;
          jack->portsChanged = VNetHubPortsChanged;
          jack->isBridged = VNetHubIsBridged;
-
-         memset(&hub->stats[i], 0, sizeof hub->stats[i]);
+         jack->gsoTypes = ~0U;  /* VNetSend checks each destination */
 
 	 hub->used[i] = FALSE;
       }
@@ -314,19 +392,41 @@ VNetHubAlloc(Bool allocPvn, // IN: TRUE for PVN, FALSE for vnet
       if (allocPvn) {
 	 hub->hubType = HUB_TYPE_PVN;
          memcpy(hub->id.pvnID, id, sizeof hub->id.pvnID);
+	 VNetSnprintf(hub->name, sizeof hub->name, "pvn%d", pvnInstance);
 	 ++pvnInstance;
       } else {
 	 hub->hubType = HUB_TYPE_VNET;
 	 hub->id.vnetNum = hubNum;
+	 VNetSnprintf(hub->name, sizeof hub->name, "hub%d", hubNum);
       }
       hub->next = NULL;
       hub->totalPorts = 0;
       hub->myGeneration = 0;
 
+      hub->learning = vnet_learning != 0;
+      spin_lock_init(&hub->macTableLock);
+      for (i = 0; i < VNET_HUB_MAC_TABLE_SIZE; i++) {
+         hub->macTable[i].jackIndex = -1;
+      }
+
+      retval = VNetStats_Alloc(&hub->macStats, vnetHubMacStatNames,
+                               HUB_MAC_STAT_NUM);
+      for (i = 0; retval == 0 && i < NUM_JACKS_PER_HUB; i++) {
+         retval = VNetStats_Alloc(&hub->stats[i], vnetHubStatNames,
+                                  HUB_STAT_NUM);
+      }
+      if (retval != 0) {
+         LOG(1, (KERN_DEBUG "/dev/vmnet: no memory for hub %d stats\n", hubNum));
+         VNetHubFreeStats(hub);
+         kfree(hub);
+         return NULL;
+      }
+
       /* create event mechanism */
       retval = VNetEvent_CreateMechanism(&hub->eventMechanism);
       if (retval != 0) {
          LOG(1, (KERN_DEBUG "can't create event mechanism (%d)\n", retval));
+         VNetHubFreeStats(hub);
          kfree(hub);
          return NULL;
       }
@@ -338,10 +438,15 @@ VNetHubAlloc(Bool allocPvn, // IN: TRUE for PVN, FALSE for vnet
 	  * and use already present hub.
 	  */
 
+	 VNetEvent_DestroyMechanism(hub->eventMechanism);
+	 VNetHubFreeStats(hub);
 	 kfree(hub);
 	 hub = allocPvn ? VNetHubFindHubByID(id) : VNetHubFindHubByNum(hubNum);
       } else {
 	 VNetHubAddHubToList(hub);
+	 if (hub->learning) {
+	    VNetStats_Register(&hub->macStats, hub->name);
+	 }
       }
    }
 
@@ -373,6 +478,7 @@ VNetHubAlloc(Bool allocPvn, // IN: TRUE for PVN, FALSE for vnet
          jack->numPorts = hub->totalPorts;
          jack->peer = NULL;
          jack->private = hub;
+         VNetStats_Register(&hub->stats[i], jack->name);
 
          return jack;
       }
@@ -418,6 +524,17 @@ VNetHubFree(VNetJack *this)
    }
 
    this->private = NULL;
+   VNetStats_Unregister(&hub->stats[this->index]);
+
+   if (hub->learning) {
+      spin_lock_irqsave(&hub->macTableLock, flags);
+      for (i = 0; i < VNET_HUB_MAC_TABLE_SIZE; i++) {
+         if (hub->macTable[i].jackIndex == this->index) {
+            hub->macTable[i].jackIndex = -1;
+         }
+      }
+      spin_unlock_irqrestore(&hub->macTableLock, flags);
+   }
 
    spin_lock_irqsave(&vnetHubLock, flags);
 
@@ -440,6 +557,7 @@ VNetHubFree(VNetJack *this)
    }
    hub->eventMechanism = NULL;
 
+   VNetHubFreeStats(hub);
    kfree(hub);
 }
 
@@ -509,46 +627,271 @@ VNetHub_CreateListener(VNetJack *jack,         // IN: a jack to a hub
 /*
  *----------------------------------------------------------------------
  *
- * VNetHubReceive --
+ * VNetHubMacHash --
  *
- *      This jack is receiving a packet. Take appropriate action.
+ *      Hash a MAC address into the hub's forwarding table.  The low
+ *      order bytes carry the most entropy for generated addresses.
+ *
+ * Results:
+ *      Index into macTable.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE unsigned
+VNetHubMacHash(const uint8 *addr) // IN: MAC address
+{
+   return (addr[5] ^ (addr[4] << 3) ^ (addr[3] << 5) ^ addr[2]) &
+          (VNET_HUB_MAC_TABLE_SIZE - 1);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetHubJackCanReceive --
+ *
+ *      Check whether a hub jack can currently be handed a packet.
+ *
+ *      Called from the packet path, i.e. under rcu_read_lock().
  *
  * Results:
+ *      TRUE if jack is allocated, connected and enabled.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE Bool
+VNetHubJackCanReceive(const VNetJack *jack) // IN: hub jack
+{
+   const VNetJack *peer = rcu_dereference(jack->peer);
+
+   return jack->private &&      /* allocated */
+          peer &&               /* and connected */
+          jack->state &&        /* and enabled */
+          peer->state &&        /* and enabled */
+          peer->rcv;            /* and has a receiver */
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetHubJackIsPromisc --
+ *
+ *      Check whether the port connected to a hub jack is in promiscuous
+ *      mode.  Hub jacks are only ever connected to ports.  Must be called
+ *      under rcu_read_lock() on a jack that VNetHubJackCanReceive.
+ *
+ * Results:
+ *      TRUE if the peer port has IFF_PROMISC set, or is a host interface
+ *      in promiscuous mode.
+ *
+ * Side effects:
  *      None.
  *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE Bool
+VNetHubJackIsPromisc(const VNetJack *jack) // IN: hub jack
+{
+   const VNetPort *port = (const VNetPort *)rcu_dereference(jack->peer);
+
+   return (READ_ONCE(port->flags) & IFF_PROMISC) != 0 ||
+          READ_ONCE(port->devPromisc);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetHubLearn --
+ *
+ *      Learn the source MAC of a packet entering the hub through jack
+ *      'this', and look up the jack owning its destination MAC.
+ *
+ * Results:
+ *      Index of the jack to forward to, or -1 if the packet should be
+ *      flooded.
+ *
+ * Side effects:
+ *      May update the forwarding table and learning statistics.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VNetHubLearn(VNetHub        *hub,  // IN: hub
+             VNetJack       *this, // IN: ingress jack
+             struct sk_buff *skb)  // IN: packet
+{
+   const uint8 *src = SKB_2_SRCMAC(skb);
+   const uint8 *dest = SKB_2_DESTMAC(skb);
+   VNetHubMacEntry *entry;
+   unsigned long flags;
+   int jackIndex = -1;
+
+   if (skb->len < sizeof (struct ethhdr)) {
+      return -1;
+   }
+
+   spin_lock_irqsave(&hub->macTableLock, flags);
+
+   if (!(src[0] & 0x1)) {
+      entry = &hub->macTable[VNetHubMacHash(src)];
+      if (entry->jackIndex != this->index || !MAC_EQ(entry->addr, src)) {
+         memcpy(entry->addr, src, ETH_ALEN);
+         entry->jackIndex = this->index;
+         VNetStats_Inc(&hub->macStats, HUB_MAC_STAT_LEARN);
+      }
+      entry->lastSeen = jiffies;
+   }
+
+   if (!(dest[0] & 0x1)) {
+      entry = &hub->macTable[VNetHubMacHash(dest)];
+      if (entry->jackIndex >= 0 && MAC_EQ(entry->addr, dest)) {
+         if (time_after(jiffies, entry->lastSeen + VNET_HUB_MAC_AGE)) {
+            entry->jackIndex = -1;
+         } else {
+            jackIndex = entry->jackIndex;
+         }
+      }
+   }
+
+   spin_unlock_irqrestore(&hub->macTableLock, flags);
+
+   VNetStats_Inc(&hub->macStats, jackIndex >= 0 ? HUB_MAC_STAT_HIT :
+                                                  HUB_MAC_STAT_FLOOD);
+
+   return jackIndex;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetHubForward --
+ *
+ *      Deliver a packet received on jack 'this' to the other jacks.
+ *
+ *      With MAC learning enabled, unicast packets for a known
+ *      destination go to the owning jack and to promiscuous ports only.
+ *      Everything else is flooded to all other jacks.
+ *
+ * Results:
+ *      Number of jacks the packet was sent to.
+ *
  * Side effects:
  *      Frees skb.
  *
  *----------------------------------------------------------------------
  */
 
-void
-VNetHubReceive(VNetJack       *this, // IN:
+static int
+VNetHubForward(VNetJack       *this, // IN:
                struct sk_buff *skb)  // IN:
 {
    VNetHub *hub = (VNetHub*)this->private;
    VNetJack *jack;
    struct sk_buff *clone;
+   int numDest = 0;
    int i;
 
-   hub->stats[this->index].tx++;
+   VNetStats_Inc(&hub->stats[this->index], HUB_STAT_TX);
+   VNetStats_Add(&hub->stats[this->index], HUB_STAT_TX_BYTES, skb->len);
+
+   if (hub->learning) {
+      int dest = VNetHubLearn(hub, this, skb);
+
+      if (dest >= 0 &&
+          (&hub->jack[dest] == this ||
+           VNetHubJackCanReceive(&hub->jack[dest]))) {
+         /* Promiscuous ports still see every frame. */
+         for (i = 0; i < NUM_JACKS_PER_HUB; i++) {
+            jack = &hub->jack[i];
+            if (i != dest && jack != this &&
+                VNetHubJackCanReceive(jack) && VNetHubJackIsPromisc(jack)) {
+               clone = skb_clone(skb, GFP_ATOMIC);
+               if (clone) {
+                  VNetSend(jack, clone);
+                  numDest++;
+               }
+            }
+         }
+
+         jack = &hub->jack[dest];
+         if (jack == this) {
+            /* Destination is on the segment the packet came from. */
+            dev_kfree_skb(skb);
+            return numDest;
+         }
+         VNetSend(jack, skb);
+         return numDest + 1;
+      }
+
+      /*
+       * Unknown destination, or the owning jack went away since we
+       * learned it; flood until the address is learned again.
+       */
+   }
 
    for (i = 0; i < NUM_JACKS_PER_HUB; i++) {
       jack = &hub->jack[i];
-      if (jack->private &&   /* allocated */
-          jack->peer &&      /* and connected */
-          jack->state &&     /* and enabled */
-          jack->peer->state && /* and enabled */
-          jack->peer->rcv && /* and has a receiver */
+      if (VNetHubJackCanReceive(jack) &&
           (jack != this)) {  /* and not a loop */
          clone = skb_clone(skb, GFP_ATOMIC);
          if (clone) {
             VNetSend(jack, clone);
+            numDest++;
          }
       }
    }
 
    dev_kfree_skb(skb);
+   return numDest;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetHubReceive --
+ *
+ *      This jack is receiving a packet. Take appropriate action.
+ *      The fan-out is timed only while the vmnet_hub_fanout
+ *      tracepoint is enabled.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Frees skb.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+VNetHubReceive(VNetJack       *this, // IN:
+               struct sk_buff *skb)  // IN:
+{
+   if (trace_vmnet_hub_fanout_enabled()) {
+      VNetHub *hub = (VNetHub*)this->private;
+      unsigned int len = skb->len;
+      s64 start = ktime_to_ns(ktime_get());
+      int numDest = VNetHubForward(this, skb);
+
+      trace_vmnet_hub_fanout(hub->name, this->index, len, numDest,
+                             ktime_to_ns(ktime_get()) - start);
+   } else {
+      VNetHubForward(this, skb);
+   }
 }
 
 
@@ -723,7 +1066,16 @@ VNetHubProcRead(char    *page,   // IN/OUT: buffer to write into
 
    len += VNetPrintJack(jack, page+len);
 
-   len += sprintf(page+len, "tx %u ", hub->stats[jack->index].tx);
+   len += sprintf(page+len, "tx %llu tx.bytes %llu ",
+                  VNetStats_Read(&hub->stats[jack->index], HUB_STAT_TX),
+                  VNetStats_Read(&hub->stats[jack->index], HUB_STAT_TX_BYTES));
+
+   if (hub->learning) {
+      len += sprintf(page+len, "learn %llu hit %llu flood %llu ",
+                     VNetStats_Read(&hub->macStats, HUB_MAC_STAT_LEARN),
+                     VNetStats_Read(&hub->macStats, HUB_MAC_STAT_HIT),
+                     VNetStats_Read(&hub->macStats, HUB_MAC_STAT_FLOOD));
+   }
 
    len += sprintf(page+len, "\n");
 
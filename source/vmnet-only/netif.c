@@ -61,12 +61,50 @@
 #endif
 #endif /* RHEL_RELEASE_CODE */
 
+/* Offloads of the host adapter; VNetSend segments for peers that need it. */
+#define VNET_NETIF_FEATURES (NETIF_F_SG | NETIF_F_HW_CSUM | NETIF_F_TSO | \
+                             NETIF_F_TSO6 | NETIF_F_TSO_ECN)
+#define VNET_NETIF_GSO_TYPES (SKB_GSO_TCPV4 | SKB_GSO_TCPV6 | \
+                              SKB_GSO_TCP_ECN | SKB_GSO_DODGY)
+
+enum {
+   NETIF_STAT_RX,
+   NETIF_STAT_RX_BYTES,
+   NETIF_STAT_RX_DROPPED,
+   NETIF_STAT_TX,
+   NETIF_STAT_TX_BYTES,
+   NETIF_STAT_NUM
+};
+
+static const char * const vnetNetIfStatNames[NETIF_STAT_NUM] = {
+   "rx", "rx.bytes", "rxDropped", "tx", "tx.bytes",
+};
+
+struct VNetNetIF;
+
+/*
+ * Receive queue.  Frames from the virtual network are queued by flow
+ * hash and handed to the host stack by a NAPI poll loop, through GRO.
+ */
+
+typedef struct VNetNetIfQueue {
+   struct napi_struct      napi;
+   struct sk_buff_head     rxQueue;    // frames waiting for VNetNetIfPoll
+   struct VNetNetIF       *netIf;
+} VNetNetIfQueue;
+
 typedef struct VNetNetIF {
    VNetPort                port;
    struct net_device      *dev;
-   struct net_device_stats stats;
+   struct net_device_stats stats;      // filled from 'counters'
+   VNetStats               counters;   // NETIF_STAT_xxx
+   unsigned                numQueues;
+   VNetNetIfQueue          queues[VNET_MAX_QUEUES];
 } VNetNetIF;
 
+extern unsigned int vnet_max_qlen;
+extern unsigned int vnet_netif_queues;
+
 
 static void VNetNetIfFree(VNetJack *this);
 static void VNetNetIfReceive(VNetJack *this, struct sk_buff *skb);
@@ -81,6 +119,7 @@ static int  VNetNetifSetMAC(struct net_device *dev, void *addr);
 static void VNetNetifSetMulticast(struct net_device *dev);
 static int  VNetNetIfProcRead(char *page, char **start, off_t off,
                               int count, int *eof, void *data);
+static int  VNetNetIfPoll(struct napi_struct *napi, int budget);
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(4, 10, 0)) && \
     (defined(HAVE_NET_DEVICE_OPS) || defined(HAVE_CHANGE_MTU))
 static int VNetNetifChangeMtu(struct net_device *dev, int new_mtu);
@@ -133,6 +172,14 @@ VNetNetIfSetup(struct net_device *dev)  // IN:
    dev->max_mtu = VMNET_MAX_MTU;
 #endif
 
+   dev->hw_features = VNET_NETIF_FEATURES;
+   dev->features |= VNET_NETIF_FEATURES | NETIF_F_HIGHDMA;
+   dev->vlan_features = dev->features;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 3, 0)
+   /* Transmit never blocks, a qdisc would only add latency. */
+   dev->priv_flags |= IFF_NO_QUEUE;
+#endif
+
 #ifdef HAVE_NET_DEVICE_OPS
    dev->netdev_ops = &vnetNetifOps;
 #else
@@ -179,13 +226,20 @@ VNetNetIf_Create(char *devName,  // IN:
    int retval;
    static unsigned id = 0;
    char deviceName[VNET_NAME_LEN];
+   unsigned numQueues;
+   unsigned i;
 
    memcpy(deviceName, devName, sizeof deviceName);
    NULL_TERMINATE_STRING(deviceName);
 
+   numQueues = vnet_netif_queues ? vnet_netif_queues : num_online_cpus();
+   numQueues = min_t(unsigned, numQueues, VNET_MAX_QUEUES);
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 18, 0)
-   dev = alloc_netdev(sizeof *netIf, deviceName, NET_NAME_USER, VNetNetIfSetup);
+   dev = alloc_netdev_mqs(sizeof *netIf, deviceName, NET_NAME_USER,
+                          VNetNetIfSetup, numQueues, numQueues);
 #else
+   numQueues = 1;
    dev = alloc_netdev(sizeof *netIf, deviceName, VNetNetIfSetup);
 #endif
    if (!dev) {
@@ -196,6 +250,14 @@ VNetNetIf_Create(char *devName,  // IN:
    netIf = netdev_priv(dev);
 
    netIf->dev = dev;
+   netIf->numQueues = numQueues;
+   for (i = 0; i < numQueues; i++) {
+      VNetNetIfQueue *q = &netIf->queues[i];
+
+      q->netIf = netIf;
+      skb_queue_head_init(&q->rxQueue);
+      compat_netif_napi_add(dev, &q->napi, VNetNetIfPoll, NAPI_POLL_WEIGHT);
+   }
 
    netIf->port.id = id++;
    netIf->port.next = NULL;
@@ -212,8 +274,15 @@ VNetNetIf_Create(char *devName,  // IN:
    netIf->port.jack.cycleDetect = VNetNetIfCycleDetect;
    netIf->port.jack.portsChanged = NULL;
    netIf->port.jack.isBridged = NULL;
+   netIf->port.jack.gsoTypes = VNET_NETIF_GSO_TYPES;
    netIf->port.exactFilterLen = 0;
 
+   retval = VNetStats_Alloc(&netIf->counters, vnetNetIfStatNames,
+                            NETIF_STAT_NUM);
+   if (retval) {
+      goto outFreeDev;
+   }
+
    /*
     * Make proc entry for this jack.
     */
@@ -223,7 +292,7 @@ VNetNetIf_Create(char *devName,  // IN:
    if (retval) {
       netIf->port.jack.procEntry = NULL;
       if (retval != -ENXIO) {
-         goto outFreeDev;
+         goto outFreeStats;
       }
    }
 
@@ -232,6 +301,7 @@ VNetNetIf_Create(char *devName,  // IN:
     */
 
    netIf->port.flags = IFF_RUNNING;
+   netIf->port.devPromisc = FALSE;
 
    memset(netIf->port.paddr, 0, sizeof netIf->port.paddr);
    memset(netIf->port.ladrf, 0, sizeof netIf->port.ladrf);
@@ -262,6 +332,8 @@ VNetNetIf_Create(char *devName,  // IN:
       goto outRemoveProc;
    }
 
+   VNetStats_Register(&netIf->counters, netIf->port.jack.name);
+
    *ret = &netIf->port;
    return 0;
 
@@ -269,6 +341,8 @@ outRemoveProc:
    if (netIf->port.jack.procEntry) {
       VNetProc_RemoveEntry(netIf->port.jack.procEntry);
    }
+outFreeStats:
+   VNetStats_Free(&netIf->counters);
 outFreeDev:
    free_netdev(dev);
 out:
@@ -296,12 +370,17 @@ void
 VNetNetIfFree(VNetJack *this) // IN: jack
 {
    VNetNetIF *netIf = container_of(this, VNetNetIF, port.jack);
+   unsigned i;
 
    if (this->procEntry) {
       VNetProc_RemoveEntry(this->procEntry);
    }
 
    unregister_netdev(netIf->dev);
+   for (i = 0; i < netIf->numQueues; i++) {
+      skb_queue_purge(&netIf->queues[i].rxQueue);
+   }
+   VNetStats_Free(&netIf->counters);
    free_netdev(netIf->dev);
 }
 
@@ -313,11 +392,15 @@ VNetNetIfFree(VNetJack *this) // IN: jack
  *
  *      This jack is receiving a packet. Take appropriate action.
  *
+ *      The packet is queued on the receive queue selected by its flow
+ *      hash, so a flow stays in order, and that queue's poll loop is
+ *      scheduled.  Called in process or softirq context.
+ *
  * Results: 
  *      None.
  *
  * Side effects:
- *      Frees skb.
+ *      Queues or frees skb.
  *
  *----------------------------------------------------------------------
  */
@@ -328,6 +411,8 @@ VNetNetIfReceive(VNetJack        *this, // IN: jack
 {
    VNetNetIF *netIf = this->private;
    uint8 *dest = SKB_2_DESTMAC(skb);
+   VNetNetIfQueue *q;
+   unsigned index = 0;
  
    if (!NETDEV_UP_AND_RUNNING(netIf->dev)) {
       goto drop_packet;
@@ -335,26 +420,84 @@ VNetNetIfReceive(VNetJack        *this, // IN: jack
 
    if (!VNetPacketMatch(dest,
                         netIf->dev->dev_addr,
-                        NULL,
-                        0,
                         allMultiFilter,
                         netIf->dev->flags)) {
-      goto drop_packet;
+      goto free_packet;
    }
    
    /* send to the host interface */
    skb->dev = netIf->dev;
    skb->protocol = eth_type_trans(skb, netIf->dev);
-   netif_rx_ni(skb);
-   netIf->stats.rx_packets++;
+   if (netIf->numQueues > 1) {
+      index = ((uint64)skb_get_hash(skb) * netIf->numQueues) >> 32;
+   }
+   skb_record_rx_queue(skb, index);
+
+   q = &netIf->queues[index];
+   if (skb_queue_len(&q->rxQueue) >= vnet_max_qlen) {
+      goto drop_packet;
+   }
+   skb_queue_tail(&q->rxQueue, skb);
 
+   /* Like netif_rx_ni(), run the poll loop now if in process context. */
+   local_bh_disable();
+   napi_schedule(&q->napi);
+   local_bh_enable();
    return;
    
  drop_packet:
+   VNetStats_Inc(&netIf->counters, NETIF_STAT_RX_DROPPED);
+ free_packet:
    dev_kfree_skb(skb);
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetNetIfPoll --
+ *
+ *      NAPI poll loop of a receive queue: hand up to 'budget' frames to
+ *      the host stack through GRO.
+ *
+ * Results:
+ *      Number of frames handed up.
+ *
+ * Side effects:
+ *      Completes NAPI if the queue was drained.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VNetNetIfPoll(struct napi_struct *napi, // IN
+              int budget)               // IN
+{
+   VNetNetIfQueue *q = container_of(napi, VNetNetIfQueue, napi);
+   VNetNetIF *netIf = q->netIf;
+   struct sk_buff *skb;
+   int done = 0;
+
+   while (done < budget && (skb = skb_dequeue(&q->rxQueue)) != NULL) {
+      VNetStats_Inc(&netIf->counters, NETIF_STAT_RX);
+      VNetStats_Add(&netIf->counters, NETIF_STAT_RX_BYTES,
+                    skb->len + ETH_HLEN);
+      napi_gro_receive(napi, skb);
+      done++;
+   }
+
+   if (done < budget) {
+      compat_napi_complete_done(napi, done);
+
+      /* VNetNetIfReceive may have queued a frame before we completed. */
+      if (!skb_queue_empty(&q->rxQueue)) {
+         napi_schedule(napi);
+      }
+   }
+   return done;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -410,7 +553,13 @@ VNetNetifOpen(struct net_device *dev) // IN:
     *  if so return -EBUSY;
     */
 
-   netif_start_queue(dev);
+   VNetNetIF *netIf = netdev_priv(dev);
+   unsigned i;
+
+   for (i = 0; i < netIf->numQueues; i++) {
+      napi_enable(&netIf->queues[i].napi);
+   }
+   netif_tx_start_all_queues(dev);
    // xxx need to change flags
    return 0;
 }
@@ -458,7 +607,14 @@ VNetNetifProbe(struct net_device *dev) // IN: unused
 int
 VNetNetifClose(struct net_device *dev) // IN:
 {
-   netif_stop_queue(dev);
+   VNetNetIF *netIf = netdev_priv(dev);
+   unsigned i;
+
+   netif_tx_stop_all_queues(dev);
+   for (i = 0; i < netIf->numQueues; i++) {
+      napi_disable(&netIf->queues[i].napi);
+      skb_queue_purge(&netIf->queues[i].rxQueue);
+   }
    // xxx need to change flags
    return 0;
 }
@@ -469,7 +625,13 @@ VNetNetifClose(struct net_device *dev) // IN:
  *
  * VNetNetifStartXmit --
  *
- *      The virtual network's start xmit dev operation. 
+ *      The virtual network's start xmit dev operation.  Called
+ *      concurrently for different transmit queues; VNetSend is lockless.
+ *
+ *      Frames may be GSO and have partial checksums.  VNetSend segments
+ *      them for peers that cannot take them, and marking them outgoing
+ *      makes readers without offloads complete the checksum on copy,
+ *      as for host frames seen by a bridge.
  *
  * Results: 
  *      ???, 0.
@@ -490,15 +652,15 @@ VNetNetifStartXmit(struct sk_buff    *skb, // IN:
       return 0;
    }
 
-   /*
-    * Block a timer-based transmit from overlapping.  This could better be
-    * done with atomic_swap(1, dev->tbusy), but set_bit() works as well.
-    * If this ever occurs the queue layer is doing something evil!
-    */
+   if (skb->ip_summed == VM_TX_CHECKSUM_PARTIAL) {
+      skb->pkt_type = PACKET_OUTGOING;
+   }
+
+   VNetStats_Inc(&netIf->counters, NETIF_STAT_TX);
+   VNetStats_Add(&netIf->counters, NETIF_STAT_TX_BYTES, skb->len);
 
    VNetSend(&netIf->port.jack, skb);
 
-   netIf->stats.tx_packets++;
    compat_netif_trans_update(dev);
 
    return 0;
@@ -549,6 +711,11 @@ VNetNetifSetMAC(struct net_device *dev, // IN:
  *      Since host-only network ifaces can't be bridged, it's debatable
  *      whether this is at all useful, but at least now you can turn it 
  *      on from ifconfig without getting an ioctl error.
+ *
+ *      The interface's promiscuous mode is mirrored into the port's
+ *      devPromisc, so that a learning hub keeps copying unicast frames
+ *      to it.  It is kept apart from the port flags, which the
+ *      SIOCSIFFLAGS ioctl sets under a different lock.
  * Results: 
  *      Void.
  *
@@ -559,8 +726,11 @@ VNetNetifSetMAC(struct net_device *dev, // IN:
  */
 
 void
-VNetNetifSetMulticast(struct net_device *dev) // IN: unused
+VNetNetifSetMulticast(struct net_device *dev) // IN:
 {
+   VNetNetIF *netIf = netdev_priv(dev);
+
+   WRITE_ONCE(netIf->port.devPromisc, (dev->flags & IFF_PROMISC) != 0);
 }
 
 
@@ -617,6 +787,14 @@ VNetNetifGetStats(struct net_device *dev) // IN:
 {
    VNetNetIF *netIf = netdev_priv(dev);
 
+   netIf->stats.rx_packets = VNetStats_Read(&netIf->counters, NETIF_STAT_RX);
+   netIf->stats.rx_bytes = VNetStats_Read(&netIf->counters,
+                                          NETIF_STAT_RX_BYTES);
+   netIf->stats.rx_dropped = VNetStats_Read(&netIf->counters,
+                                            NETIF_STAT_RX_DROPPED);
+   netIf->stats.tx_packets = VNetStats_Read(&netIf->counters, NETIF_STAT_TX);
+   netIf->stats.tx_bytes = VNetStats_Read(&netIf->counters,
+                                          NETIF_STAT_TX_BYTES);
    return &netIf->stats;
 }
 
@@ -655,6 +833,8 @@ VNetNetIfProcRead(char   *page,  // IN/OUT: buffer to write into
    len += VNetPrintPort(&netIf->port, page+len);
 
    len += sprintf(page+len, "dev %s ", netIf->dev->name);
+
+   len += sprintf(page+len, "queues %u ", netIf->numQueues);
    
    len += sprintf(page+len, "\n");
 
@@ -47,7 +47,7 @@
 
 static int VNetProcMakeEntryInt(VNetProcEntry *parent, char *name, int mode,
                                 void *data, VNetProcReadFn *fn,
-                                VNetProcEntry **ret);
+                                VNetProcShowFn *show, VNetProcEntry **ret);
 static void VNetProcRemoveEntryInt(VNetProcEntry *node, VNetProcEntry *parent);
 
 static VNetProcEntry *base = NULL;
@@ -72,7 +72,8 @@ static VNetProcEntry *base = NULL;
 int
 VNetProc_Init(void)
 {
-   return VNetProcMakeEntryInt(NULL, "vmnet", S_IFDIR, NULL, NULL, &base);
+   return VNetProcMakeEntryInt(NULL, "vmnet", S_IFDIR, NULL, NULL, NULL,
+                               &base);
 }
 
 
@@ -108,7 +109,7 @@ VNetProc_Cleanup(void)
  *
  *      Show the contents of this procfs node.  We bounce through this
  *      into the read function callback that was given to us when the
- *      entry was created.
+ *      entry was created, or the seq_file callback if there is one.
  *
  * Results:
  *      errno.
@@ -123,9 +124,15 @@ static int
 VNetProcShow(struct seq_file *p, // IN:
              void *v)            // IN:
 {
-   char *buf = (char *)__get_free_page(GFP_KERNEL);
+   VNetProcEntry *ent = p->private;
+   char *buf;
+
+   if (ent->show != NULL) {
+      return ent->show(p, ent->data);
+   }
+
+   buf = (char *)__get_free_page(GFP_KERNEL);
    if (buf != NULL) {
-      VNetProcEntry *ent = p->private;
       char *start;
       int eof;
       buf[ent->fn(buf, &start, 0, PAGE_SIZE, &eof, ent->data)] = '\0';
@@ -195,6 +202,7 @@ VNetProcMakeEntryInt(VNetProcEntry   *parent,   // IN:
                      int              mode,     // IN:
                      void            *data,     // IN:
                      VNetProcReadFn  *fn,       // IN:
+                     VNetProcShowFn  *show,     // IN:
                      VNetProcEntry  **ret)      // OUT:
 {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 10, 0)
@@ -205,6 +213,7 @@ VNetProcMakeEntryInt(VNetProcEntry   *parent,   // IN:
       } else {
          ent->data   = data;
          ent->fn     = fn;
+         ent->show   = show;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 18, 0)
          ent->pde    = proc_create_single_data(name, mode, parent->pde,
                                                VNetProcShow, ent);
@@ -220,7 +229,12 @@ VNetProcMakeEntryInt(VNetProcEntry   *parent,   // IN:
    }
    return -ENOMEM;
 #else
-   VNetProcEntry *ent = create_proc_entry(name, mode, parent);
+   VNetProcEntry *ent;
+
+   if (show != NULL) {
+      return -ENXIO;
+   }
+   ent = create_proc_entry(name, mode, parent);
    if (ent != NULL) {
       ent->data      = data;
       ent->read_proc = fn;
@@ -287,7 +301,37 @@ VNetProc_MakeEntry(char              *name,  // IN:
                    VNetProcReadFn    *fn,    // IN:
                    VNetProcEntry    **ret)   // OUT:
 {
-   return VNetProcMakeEntryInt(base, name, mode, data, fn, ret);
+   return VNetProcMakeEntryInt(base, name, mode, data, fn, NULL, ret);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetProc_MakeSeqEntry --
+ *
+ *      Make an entry in the vnets proc file system whose contents are
+ *      produced by a seq_file show callback, so they are not limited
+ *      to one page.
+ *
+ * Results: 
+ *      errno. If errno is 0 and ret is non NULL then ret is filled
+ *      in with the resulting proc entry.  -ENXIO if not supported.
+ *      
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+VNetProc_MakeSeqEntry(char              *name,  // IN:
+                      int                mode,  // IN:
+                      void              *data,  // IN:
+                      VNetProcShowFn    *fn,    // IN:
+                      VNetProcEntry    **ret)   // OUT:
+{
+   return VNetProcMakeEntryInt(base, name, mode, data, NULL, fn, ret);
 }
 
 
@@ -390,6 +434,33 @@ VNetProc_MakeEntry(char              *name,
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetProc_MakeSeqEntry --
+ *
+ *      Make an entry in the vnets proc file system.
+ *
+ * Results: 
+ *      -ENXIO.
+ *      
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+VNetProc_MakeSeqEntry(char              *name,
+                      int                mode,
+                      void              *data,
+                      VNetProcShowFn    *fn,
+                      VNetProcEntry    **ret)
+{
+   return -ENXIO;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
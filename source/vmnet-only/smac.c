@@ -81,6 +81,9 @@
 #define FREESPINLOCK(a)     do { NdisFreeSpinLock( (a) ); } while(0)
 #define ASSERTLOCKHELD()    ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL)
 #define SNPRINTF(a)            (RtlStringCbPrintfA a)
+#define RCUDEREFERENCE(p)      (p)
+#define RCUASSIGNPOINTER(p, v) do { (p) = (v); } while (0)
+#define FREEMEMORYRCU(a)       FREEMEMORY((a))
 
 #elif defined __linux__ || defined __APPLE__
 
@@ -134,6 +137,9 @@
 #define RELEASESPINLOCK(a)  SMACL_ReleaseSpinlock( (a), &flags)
 extern int VNetSnprintf(char *str, size_t size, const char *format, ...);
 #define SNPRINTF(a)         (VNetSnprintf a)
+#define RCUDEREFERENCE(p)   SMACL_RcuDereference((void **)&(p))
+#define RCUASSIGNPOINTER(p, v) SMACL_RcuAssignPointer((void **)&(p), (v))
+#define FREEMEMORYRCU(a)    SMACL_FreeRcu(&(a)->rcuHead)
 #else /* __APPLE__ */
 #define FREEMEMORY(a)       SMACL_Free((a), sizeof *(a))
 #define SPINLOCKINIT()      do { } while (0)
@@ -141,6 +147,9 @@ extern int VNetSnprintf(char *str, size_t size, const char *format, ...);
 #define ACQUIRESPINLOCK(a)  SMACL_AcquireSpinlock( *(a) )
 #define RELEASESPINLOCK(a)  SMACL_ReleaseSpinlock( *(a) )
 #define SNPRINTF(a)         (snprintf a)
+#define RCUDEREFERENCE(p)   (p)
+#define RCUASSIGNPOINTER(p, v) do { (p) = (v); } while (0)
+#define FREEMEMORYRCU(a)    FREEMEMORY((a))
 #endif
 
 #else
@@ -267,14 +276,6 @@ extern int VNetSnprintf(char *str, size_t size, const char *format, ...);
  * IP corresonds to which MAC
  */
 
-#ifdef _WIN32
-typedef uint64 SmacLastAccess;
-#define LAST_ACCESS_FORMAT "%"FMT64"u" // format of lastAccess for printf()
-#else
-typedef unsigned long SmacLastAccess;
-#define LAST_ACCESS_FORMAT "%lu"      // format of lastAccess for printf()
-#endif /* _WIN32 */
-
 typedef union IPAddrUnion {
    uint32 ipv4Addr;
    IPv6Addr ipv6Addr;
@@ -286,10 +287,15 @@ typedef struct IPAddrContainer {
 } IPAddrContainer;
 
 typedef struct IPmacLookupEntry {
+#ifdef __linux__
+   SMACL_RcuHead rcuHead;             // for deferred free, must be first
+#endif
    struct IPmacLookupEntry *ipNext;   // pointer to next item in bucket in IP hash table
    IPAddrContainer addrContainer;     // Struct holding the v4/v6 address
    uint8 mac[ETH_ALEN];               // ethernet MAC address
-   SmacLastAccess lastAccess;         // estimated time of entry's last use
+   Bool referenced;                   // used since last considered for eviction
+   struct IPmacLookupEntry *lruPrev;  // more recently used entry
+   struct IPmacLookupEntry *lruNext;  // less recently used entry
 } IPmacLookupEntry;
 
 /*
@@ -325,8 +331,46 @@ typedef enum {
  * SMACState: encapsulates all wireless state for a specific host adapter
  */
 
-#define SMAC_HASH_TABLE_SIZE 256 // length of table, must be power of 2
-#define SMAC_HASH_MASK       (SMAC_HASH_TABLE_SIZE - 1) // hash bits
+#define SMAC_HASH_TABLE_SIZE     256  // initial length of table, power of 2
+#define SMAC_HASH_TABLE_MAX_SIZE 4096 // table stops growing here
+#define SMAC_LRU_SECOND_CHANCES  8    // referenced entries skipped per eviction
+
+/*
+ * SMACHashTable: IP->MAC hash table.  On Linux, lookups walk the table
+ * under RCU; a table is replaced (never resized in place) when it grows.
+ */
+
+typedef struct SMACHashTable {
+#ifdef __linux__
+   SMACL_RcuHead rcuHead;                 // for deferred free, must be first
+#endif
+   uint32 mask;                           // number of buckets - 1
+   struct IPmacLookupEntry * buckets[1];  // variable length
+} SMACHashTable;
+
+#ifdef __linux__
+/*
+ * SMACCpuCache: per-CPU copy of the last IP->MAC lookup hit and of the
+ * last IP/MAC pair added, plus this CPU's lookup counters.  Entries are
+ * only valid while their generation matches SMACState->generation, which
+ * is bumped whenever an entry is removed from the table or its MAC
+ * changes; while valid, the cached entry pointers may be dereferenced
+ * under RCU.
+ */
+
+typedef struct SMACCpuCache {
+   IPAddrContainer lookupIP;     // last IP found by LookupByIP()
+   uint8  lookupMAC[ETH_ALEN];   // MAC found for lookupIP
+   uint32 lookupGeneration;      // generation when lookupIP was found
+   struct IPmacLookupEntry *lookupEntry; // entry found for lookupIP
+   IPAddrContainer addIP;        // last IP passed to AddIPandMACcombo()
+   uint8  addMAC[ETH_ALEN];      // MAC the table holds for addIP
+   uint32 addGeneration;         // generation when addIP was added
+   struct IPmacLookupEntry *addEntry; // entry holding addIP
+   uint64 lookupHits;            // LookupByIP() found the IP
+   uint64 lookupMisses;          // LookupByIP() did not find the IP
+} SMACCpuCache;
+#endif
 
 typedef struct SMACState {
 #ifdef _WIN32
@@ -334,12 +378,21 @@ typedef struct SMACState {
 #else /* _WIN32 */
    void            	 *smacSpinLock;       // spinlock that protects wireless state
 #endif /* _WIN32 */
-   SmacLastAccess	 lastUptimeRead;     // used to track uptime counter overflow
-   struct IPmacLookupEntry * IPlookupTable[SMAC_HASH_TABLE_SIZE];  // IP hash table IP->MAC
+   SMACHashTable *IPlookupTable;             // IP hash table IP->MAC
    uint32 numberOfIPandMACEntries;	     // # of hash table entries
+   uint32 capacity;                          // max # of hash table entries
+   struct IPmacLookupEntry * lruHead;        // most recently used entry
+   struct IPmacLookupEntry * lruTail;        // least recently used entry
+   uint64 evictions;                         // entries dropped for capacity
+#ifdef __linux__
+   void   *cpuCache;                         // per-CPU SMACCpuCache (or NULL)
+   uint32 generation;                        // validates cpuCache contents
+#else
+   uint64 lookupHits;                        // LookupByIP() found the IP
+   uint64 lookupMisses;                      // LookupByIP() did not find it
+#endif
    IPAddrContainer lastIPadded;		     // last IP added to hash
    uint8  lastMACadded[ETH_ALEN];	     // last MAC added to hash
-   struct IPmacLookupEntry * lastEntryAdded; // ptr to cache entry (to update timestamp)
    Bool	  smacForwardUnknownPackets;         // forward "all" packets? (typically doesn't)
    uint8  macAddress[ETH_ALEN];              // pointer to host MAC address
 } SMACState;
@@ -362,7 +415,17 @@ static INLINE Bool LookupByIPv4(SMACState *state, uint32 ipv4Addr,
 
 static INLINE Bool RemoveIPfromHashTableNoAcquireLock(SMACState *state,
 						      IPmacLookupEntry *entryToRemove);
+static Bool ReplaceIPinHashTableNoAcquireLock(SMACState *state,
+                                              IPmacLookupEntry *entryToRemove,
+                                              IPmacLookupEntry *replacement);
+
+static INLINE void LruUnlink(SMACState *state, IPmacLookupEntry *entry);
+static INLINE void LruPushHead(SMACState *state, IPmacLookupEntry *entry);
+static INLINE void LruReplace(SMACState *state, IPmacLookupEntry *entry,
+                              IPmacLookupEntry *replacement);
 
+static SMACHashTable *AllocLookupTable(uint32 size);
+static void GrowLookupTableIfNecessary(SMACState *state);
 static void TrimLookupTableIfNecessary(SMACState *state);
 
 static INLINE void SetCacheEntry(SMACState *state, IPmacLookupEntry *entry);
@@ -386,7 +449,6 @@ PatchMacAddrFixChecksum(SMACPacket *packet, const uint32 packetLen,
 static void ProcessIncomingIPv4Packet(SMACPacket *packet, 
 				      Bool knownMacForIp);
 #endif
-static SmacLastAccess GetSystemUptime(SMACState *state);
 
 /* get information from packet */
 static INLINE uint32 GetPacketLength(SMACPacket *packet);
@@ -426,11 +488,11 @@ static void LookupTypeName(uint16 typeValue, char *type, size_t typeLen);
  * IPv4Hash --
  * IPv6Hash -- 
  *
- *      Returns a one byte hash of an IPv4 (IPv6) address by adding
- *      all the octets in the address.
+ *      Returns a 32-bit multiplicative hash of an IPv4 (IPv6) address.
+ *      Callers mask the result with the size of the current table.
  *
  * Results:
- *      One byte hash value.
+ *      Hash value.
  *
  * Side effects:
  *      None.
@@ -438,24 +500,20 @@ static void LookupTypeName(uint16 typeValue, char *type, size_t typeLen);
  *----------------------------------------------------------------------
  */
 
-static INLINE uint8
+static INLINE uint32
 IPv4Hash(uint32 addr) // IN:
 {
-   return ((addr >> 24 & 0xff) + (addr >> 16 & 0xff) + (addr >> 8 & 0xff) +
-           (addr & 0xff)) & SMAC_HASH_MASK;
+   uint32 hash = addr * 0x9e3779b1;  // 2^32 / golden ratio
+
+   return hash ^ hash >> 16;
 }
 
-static INLINE uint8
+static INLINE uint32
 IPv6Hash(const IPv6Addr *addr) // IN:
 {
-   int i;
-   uint8 hash = (uint8)(addr->addrLo & 0xff) + (uint8)(addr->addrHi & 0xff);
+   uint64 fold = addr->addrLo ^ addr->addrHi;
 
-   for (i = 1; i < 4; i++) {
-      hash += (uint8)(addr->addrLo >> (i * 8) & 0xff) +
-              (uint8)(addr->addrHi >> (i * 8) & 0xff);
-   }
-   return hash & SMAC_HASH_MASK;
+   return IPv4Hash((uint32)fold ^ (uint32)(fold >> 32));
 }
 
 
@@ -622,7 +680,7 @@ LookupEntrySetIPAddrContainer(IPmacLookupEntry *entry,              // OUT:
  *      entry) structure.
  *
  * Results:
- *      One byte hash of the IP address.
+ *      32-bit hash of the IP address.
  *
  * Side effects:
  *      None.
@@ -630,7 +688,7 @@ LookupEntrySetIPAddrContainer(IPmacLookupEntry *entry,              // OUT:
  *----------------------------------------------------------------------
  */
 
-static INLINE uint8
+static INLINE uint32
 IPAddrContainerHash(const IPAddrContainer *addrContainer) // IN:
 {
    return IsIPAddrContainerV4(addrContainer) ?
@@ -638,7 +696,7 @@ IPAddrContainerHash(const IPAddrContainer *addrContainer) // IN:
       IPv6Hash(ContainerGetIPv6Addr(addrContainer));
 }
 
-static INLINE uint8
+static INLINE uint32
 LookupEntryIPAddrHash(const IPmacLookupEntry *entry) // IN:
 {
    return IPAddrContainerHash(&entry->addrContainer);
@@ -844,16 +902,19 @@ PrintMACAddrToString(char *str,        // OUT:
 
 /*
  * IP hash table routines: the following routines pertain to operations
- * on the IP hash table. SMACState->smacSpinLock should be held when reading or
- * writing data in the hash table.  A read/write lock might be better
- * but the locks are usually held for a brief period of time.  
+ * on the IP hash table. SMACState->smacSpinLock should be held when writing
+ * data in the hash table.  On Linux, lookups only need an RCU read-side
+ * section: an entry's IP and MAC are never modified once published (a MAC
+ * change replaces the entry), and removed entries and outgrown tables are freed
+ * after a grace period.  Other platforms still hold the lock for lookups.
  *
  * 'lastIPadded' and 'lastMACadded' are used to cache the last entry that
  * was added to the hash table.  For most packets we attempt to add IP/MAC
  * information from that packet to the hash table.  In most cases (especially
  * during file transfers) the entry will already be added to the table so we
- * cache the last addition to minimize overhead.  The cache information is
- * not used for lookups, only to make adds more efficient.
+ * cache the last addition to minimize overhead.  On Linux the same check is
+ * made against a per-CPU copy (SMACCpuCache), which also remembers the last
+ * lookup hit, so that neither direction takes the lock for a known flow.
  */
 
 
@@ -869,6 +930,13 @@ PrintMACAddrToString(char *str,        // OUT:
  *      table entry, while the locking version only returns the 
  *      actual MAC address (to avoid reference counting).
  *
+ *      The non-locking version must be called with the lock held or,
+ *      on Linux, from an RCU read-side section.  On Linux the locking
+ *      version does not take the lock at all: it checks this CPU's
+ *      last hit, then walks the table under RCU.  The locking version
+ *      marks the entry found as referenced for the LRU and counts hits
+ *      and misses.
+ *
  * Results:
  *      Nonlocking: pointer to entry (if found), otherwise NULL
  *      Locking: TRUE if MAC found, otherwise FALSE
@@ -883,16 +951,16 @@ static INLINE IPmacLookupEntry *
 LookupByIPNoAcquireLock(SMACState *state,                     // IN: state
                         const IPAddrContainer *addrContainer) // IN: v4/v6 addr
 {
-   uint8 hash = IPAddrContainerHash(addrContainer);
+   SMACHashTable *table = RCUDEREFERENCE(state->IPlookupTable);
+   uint32 hash = IPAddrContainerHash(addrContainer) & table->mask;
    IPmacLookupEntry *curr;
 
-   ASSERT(SMAC_HASH_TABLE_SIZE == 256);
-
    /*
     * Search thru bucket for match.
     */
 
-   for (curr = state->IPlookupTable[hash]; curr; curr = curr->ipNext) {
+   for (curr = RCUDEREFERENCE(table->buckets[hash]); curr;
+        curr = RCUDEREFERENCE(curr->ipNext)) {
       if (AddrContainersMatch(&curr->addrContainer, addrContainer)) {
          break;
       }
@@ -909,18 +977,68 @@ LookupByIP(SMACState *state,                     // IN: adapter
 {
    IPmacLookupEntry *entry;
    WW_DEVEL_ONLY(char ipStr[IP_STRING_SIZE];)
+#ifdef __linux__
+   SMACCpuCache *cache;
+   uint32 generation;
+   unsigned long flags;
+#else
    SPINLOCKINIT();
+#endif
 
    WW_VNETKdPrint((MODULE_NAME "LookupByIP: told to find %s\n",
                    ContainerPrintIPAddrToString(ipStr, sizeof ipStr,
                                                 addrContainer)));
 
+#ifdef __linux__
+   cache = SMACL_GetCpuPtr(state->cpuCache, &flags);
+   SMACL_RcuReadLock();
+   generation = SMACL_ReadGeneration(&state->generation);
+   if (cache != NULL && cache->lookupGeneration == generation &&
+       AddrContainersMatch(&cache->lookupIP, addrContainer)) {
+      entry = cache->lookupEntry;
+      if (macAddress != NULL) {
+         MEMCPY(macAddress, cache->lookupMAC, ETH_ALEN);
+      }
+   } else {
+      entry = LookupByIPNoAcquireLock(state, addrContainer);
+      if (entry != NULL) {
+         if (macAddress != NULL) {
+            MEMCPY(macAddress, entry->mac, ETH_ALEN);
+         }
+         if (cache != NULL) {
+            cache->lookupIP = *addrContainer;
+            MEMCPY(cache->lookupMAC, entry->mac, ETH_ALEN);
+            cache->lookupGeneration = generation;
+            cache->lookupEntry = entry;
+         }
+      }
+   }
+   if (entry != NULL && !entry->referenced) {
+      entry->referenced = TRUE;
+   }
+   SMACL_RcuReadUnlock();
+   if (cache != NULL) {
+      if (entry != NULL) {
+         cache->lookupHits++;
+      } else {
+         cache->lookupMisses++;
+      }
+   }
+   SMACL_PutCpuPtr(&flags);
+#else
    ACQUIRESPINLOCK(&state->smacSpinLock);
    entry = LookupByIPNoAcquireLock(state, addrContainer);
-   if (entry != NULL && macAddress != NULL) {
-      MEMCPY(macAddress, entry->mac, ETH_ALEN);
+   if (entry != NULL) {
+      if (macAddress != NULL) {
+         MEMCPY(macAddress, entry->mac, ETH_ALEN);
+      }
+      entry->referenced = TRUE;
+      state->lookupHits++;
+   } else {
+      state->lookupMisses++;
    }
    RELEASESPINLOCK(&state->smacSpinLock);
+#endif
    return entry != NULL;
 }
 
@@ -958,24 +1076,26 @@ LookupByIPv4(SMACState *state,  // IN:
  *
  * RemoveIPfromHashTable --
  * RemoveIPfromHashTableNoAcquireLock --
+ * ReplaceIPinHashTableNoAcquireLock --
  *
- *      Removed specified entry from the IP hash table.  Function
+ *      Removed specified entry from the IP hash table, or substitute
+ *      replacement for it in the same position.  Function
  *      presumes that specified table entry still contains the IP 
- *      address that was used to add the entry to the hash table.
+ *      address that was used to add the entry to the hash table,
+ *      and that a replacement holds the same IP address.
  *      Locking and no-locking version of function are provided
  *
- *      This function doesn't check whether the cached entry is
- *      being removed (and thus won't reset the cached entry). This
- *      code is primarily used to remove the oldest entry, and by
- *      definition the cached entry is the newest (i.e., it's never
- *      the oldest and thus won't be removed).
+ *      This function doesn't touch the LRU list; callers unlink or
+ *      replace the entry there themselves.
  *
  * Results:
  *      TRUE if entry removed, FALSE otherwise.
  *
  * Side effects:
  *      May remove entry from IP hash table.  Actual entry is not
- *      modified nor deallocated by this function.
+ *      modified nor deallocated by this function; lockless readers
+ *      may still see it until an RCU grace period has passed.
+ *      Invalidates the per-CPU caches.
  *
  *----------------------------------------------------------------------
  */
@@ -984,51 +1104,138 @@ static INLINE Bool
 RemoveIPfromHashTableNoAcquireLock(SMACState *state,                 // IN: state
 				   IPmacLookupEntry * entryToRemove) // IN: packet
 {
-   uint8 ipHashToRemove;
-   IPmacLookupEntry * prev = NULL, *entry;
+   return ReplaceIPinHashTableNoAcquireLock(state, entryToRemove, NULL);
+}
+
+static Bool
+ReplaceIPinHashTableNoAcquireLock(SMACState *state,               // IN: state
+                                  IPmacLookupEntry *entryToRemove, // IN: entry
+                                  IPmacLookupEntry *replacement)   // IN: or NULL
+{
+   SMACHashTable *table = state->IPlookupTable;
+   IPmacLookupEntry **link, *entry;
 
    ASSERT(entryToRemove);
-   ASSERT(SMAC_HASH_TABLE_SIZE == 256);
+   ASSERT(!replacement ||
+          AddrContainersMatch(&replacement->addrContainer,
+                              &entryToRemove->addrContainer));
+
+   link = &table->buckets[LookupEntryIPAddrHash(entryToRemove) & table->mask];
 
-   ipHashToRemove = LookupEntryIPAddrHash(entryToRemove);
-   entry = state->IPlookupTable[ipHashToRemove]; // get bucket
-      
    /*
     * locate and remove old IP entry from bucket
     */
 
-   while (entry) {
+   while ((entry = *link) != NULL) {
       if (entry == entryToRemove) {
-	 if (prev) {
-	    W_VNETKdPrint((MODULE_NAME "RemoveIPfromHashTable: removed IP "
-			   "entry from middle of bucket\n"));
-	    prev->ipNext = entry->ipNext;
+	 W_VNETKdPrint((MODULE_NAME "RemoveIPfromHashTable: %s IP entry\n",
+			replacement ? "replaced" : "removed"));
+	 if (replacement) {
+	    replacement->ipNext = entry->ipNext;
+	    RCUASSIGNPOINTER(*link, replacement);
 	 } else {
-	    W_VNETKdPrint((MODULE_NAME "RemoveIPfromHashTable: removed IP "
-			   "entry from front of bucket\n"));
-	    state->IPlookupTable[ipHashToRemove] = entry->ipNext;
+	    RCUASSIGNPOINTER(*link, entry->ipNext);
 	 }
+#ifdef __linux__
+	 SMACL_BumpGeneration(&state->generation);
+#endif
 	 return TRUE;
-      } else {
-	 prev = entry;
-	 entry = entry->ipNext;
       }
+      link = &entry->ipNext;
    }
    return FALSE;
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * LruUnlink --
+ * LruPushHead --
+ * LruReplace --
+ *
+ *      Maintain the LRU list of IP hash table entries: unlink an
+ *      entry, insert an unlinked entry as the most recently used, or
+ *      put a replacement (a copy, see ReplaceIPinHashTableNoAcquireLock)
+ *      in an entry's place.
+ *
+ *      Functions presume that state lock is held.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Modifies the LRU list.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE void
+LruUnlink(SMACState *state,        // IN: smac state
+          IPmacLookupEntry *entry) // IN: entry to unlink
+{
+   if (entry->lruPrev) {
+      entry->lruPrev->lruNext = entry->lruNext;
+   } else {
+      state->lruHead = entry->lruNext;
+   }
+   if (entry->lruNext) {
+      entry->lruNext->lruPrev = entry->lruPrev;
+   } else {
+      state->lruTail = entry->lruPrev;
+   }
+   entry->lruPrev = entry->lruNext = NULL;
+}
+
+static INLINE void
+LruPushHead(SMACState *state,        // IN: smac state
+            IPmacLookupEntry *entry) // IN: unlinked entry
+{
+   entry->lruPrev = NULL;
+   entry->lruNext = state->lruHead;
+   if (state->lruHead) {
+      state->lruHead->lruPrev = entry;
+   } else {
+      state->lruTail = entry;
+   }
+   state->lruHead = entry;
+}
+
+static INLINE void
+LruReplace(SMACState *state,              // IN: smac state
+           IPmacLookupEntry *entry,       // IN: linked entry
+           IPmacLookupEntry *replacement) // IN: takes entry's place
+{
+   replacement->lruPrev = entry->lruPrev;
+   replacement->lruNext = entry->lruNext;
+   if (replacement->lruPrev) {
+      replacement->lruPrev->lruNext = replacement;
+   } else {
+      state->lruHead = replacement;
+   }
+   if (replacement->lruNext) {
+      replacement->lruNext->lruPrev = replacement;
+   } else {
+      state->lruTail = replacement;
+   }
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
  * TrimLookupTableIfNecessary --
  *
- *      If the number of entries in the IP and MAC tables exceeds a
- *      specified value (currently 20), then we remove and deallocate
- *      an entry--ideally the entry which has been used least recently
- *      is removed.  The code presumes that this function will be called
- *      anytime a new entry is added, thus we should never need to
- *      remove more than one entry per function call.
+ *      While the number of entries in the IP hash table exceeds the
+ *      configured capacity, remove and deallocate the least recently
+ *      used entry.
+ *
+ *      Entries move to the head of the LRU list only when an add takes
+ *      the lock; lockless lookups and cached adds merely set the
+ *      entry's referenced flag.  So a referenced entry at the tail gets
+ *      a second chance: it is moved to the head and the next one is
+ *      considered.  At most SMAC_LRU_SECOND_CHANCES entries are passed
+ *      over per eviction, which keeps eviction O(1).
  *
  *      Function presumes that state lock is held while this function
  *      is called.
@@ -1037,8 +1244,7 @@ RemoveIPfromHashTableNoAcquireLock(SMACState *state,                 // IN: stat
  *      None.
  *
  * Side effects:
- *      May remove and deallocates an entry from the IP and MAC hash
- *      tables.
+ *      May remove and deallocate entries from the IP hash table.
  *
  *----------------------------------------------------------------------
  */
@@ -1046,108 +1252,176 @@ RemoveIPfromHashTableNoAcquireLock(SMACState *state,                 // IN: stat
 static void
 TrimLookupTableIfNecessary(SMACState *state) // IN: smac state
 {
-   IPmacLookupEntry * oldestEntry = NULL;      // oldest entry found
-   SmacLastAccess oldestUpdate = (uint64)~0;	  // age of oldest entry
-   SmacLastAccess currentUptime = 0;           // time since the system was booted
-   int i;
-
    VNETKdPrintCall(("TrimLookupTableIfNecessary"));
    ASSERT(state);
-   ASSERT(SMAC_HASH_TABLE_SIZE == 256);
    ASSERTLOCKHELD();
 
-   if (state->numberOfIPandMACEntries <= 20) { // if not too many entries
-      VNETKdPrint((MODULE_NAME "TrimLookupTableIfNeccessary: number of "
-                   "entries is small: %u.\n", state->numberOfIPandMACEntries));
-      return;
+   while (state->numberOfIPandMACEntries > state->capacity) {
+      IPmacLookupEntry *victim = state->lruTail;
+      int chances = SMAC_LRU_SECOND_CHANCES;
+      DEVEL_ONLY(char ipStr[IP_STRING_SIZE];)
+
+      while (victim->referenced && chances-- > 0) {
+         victim->referenced = FALSE;
+         LruUnlink(state, victim);
+         LruPushHead(state, victim);
+         victim = state->lruTail;
+      }
+
+      VNETKdPrint((MODULE_NAME "TrimLookupTableIfNecessary: evicting %s\n",
+                   LookupEntryPrintIPAddrToString(ipStr, sizeof ipStr,
+                                                  victim)));
+      LruUnlink(state, victim);
+      if (!RemoveIPfromHashTableNoAcquireLock(state, victim)) {
+	 VNETKdPrint((MODULE_NAME "TrimLookupTableIfNecessary: could not "
+		      "find entry in IP table\n"));
+	 ASSERT(0); // should never occur
+      } else {
+	 FREEMEMORYRCU(victim);
+      }
+      --state->numberOfIPandMACEntries;
+      ++state->evictions;
    }
 
-   VNETKdPrint((MODULE_NAME "TrimLookupTableIfNecessary: "
-		 "reducing # of entries\n"));
-   
-   currentUptime = GetSystemUptime(state); /* must be called with lock held */
-   
-   VNETKdPrint((MODULE_NAME "TrimLookupTableIfNecessary: current uptime is "
-		LAST_ACCESS_FORMAT "\n", currentUptime));
+   VNETKdPrintReturn(("TrimLookupTableIfNecessary"));   
+}
 
-   /*
-    * NOTE: this code presumes that no system will ever be up long enough
-    * for the uptime to wrap.  To get around this assumption we could try to
-    * determine "oldest" by computing which entry has the largest difference
-    * from the current updtime.  However, there are no guarantees that this
-    * metric is any more accurate.  Given that we never expect more than 20
-    * entries to ever exist, I won't implement a more sophisiticated 
-    * mechanism at this time.
-    */
 
-   /*
-    * Search thru entire table to find oldest uptime, and remove it
-    */
+/*
+ *----------------------------------------------------------------------
+ *
+ * AllocLookupTable --
+ *
+ *      Allocates an empty IP hash table with the specified number of
+ *      buckets, which must be a power of 2.
+ *
+ * Results:
+ *      Pointer to the table if successful, NULL otherwise.
+ *
+ * Side effects:
+ *      Allocates memory.
+ *
+ *----------------------------------------------------------------------
+ */
 
-   for (i = 0; i < SMAC_HASH_TABLE_SIZE; ++i) {
-      IPmacLookupEntry *currentEntry = state->IPlookupTable[i];
-      while (currentEntry) {
-	 if (currentEntry->lastAccess < oldestUpdate) { // if older than candidate
+static SMACHashTable *
+AllocLookupTable(uint32 size) // IN: number of buckets
+{
+   SMACHashTable *table;
+   uint32 bytes = sizeof *table + (size - 1) * sizeof table->buckets[0];
 
-	    /* 
-	     * Skip cached entry since the entry was used most recently, but its
-	     * timestamp might be old since the timestamp is only updated after
-	     * the entry is no longer cached (i.e., something else is now the newest)
-	     *
-	     * This code will only be executed if at least 20 entries exist, so there
-	     * must be some much better candidates elsewhere in the table.
-	     */
+   ASSERT(size && (size & (size - 1)) == 0);
 
-	    if (currentEntry == state->lastEntryAdded) {
-	       VNETKdPrint((MODULE_NAME "TrimLookupTableIfNecessary: oldest "
-		  "candidate is the cached entry, so skipping\n"));
-	    } else {
-	       DEVEL_ONLY(char ipStr[IP_STRING_SIZE];)
-
-	       VNETKdPrint((MODULE_NAME "TrimLookupTableIfNecessary: current "
-	                    "oldest candidate: %s time " LAST_ACCESS_FORMAT "\n",
-	                    LookupEntryPrintIPAddrToString(ipStr, sizeof ipStr,
-	                                                   currentEntry),
-	                    currentEntry->lastAccess));
-	       oldestEntry = currentEntry;
-	       oldestUpdate = currentEntry->lastAccess;
-	    }
-	 }
-	 if (currentEntry->lastAccess > currentUptime) {
-	    VNETKdPrint((MODULE_NAME "TrimLookupTableIfNecessary: "
-			 "ERROR: last access " LAST_ACCESS_FORMAT 
-			 " > current uptime " LAST_ACCESS_FORMAT "\n", 
-			 currentEntry->lastAccess, currentUptime));
-	 }
-	 
-	 currentEntry = currentEntry->ipNext;
-      }
+   table = ALLOCATEMEMORY(bytes, REORDER_TAG('SMht'));
+   if (table) {
+      MEMSET(table, 0, bytes);
+      table->mask = size - 1;
    }
+   return table;
+}
 
-   if (oldestEntry) {
-      DEVEL_ONLY(char ipStr[IP_STRING_SIZE];)
 
-      VNETKdPrint((MODULE_NAME "TrimLookupTableIfNecessary: found oldest "
-                   "candidate: %s time " LAST_ACCESS_FORMAT "\n",
-                   LookupEntryPrintIPAddrToString(ipStr, sizeof ipStr,
-                                                  oldestEntry),
-                   oldestEntry->lastAccess));
-      if (!RemoveIPfromHashTableNoAcquireLock(state, oldestEntry)) {
-	 VNETKdPrint((MODULE_NAME "TrimLookupTableIfNecessary: could not "
-		      "find entry in IP table\n"));
-	 ASSERT(0); // should never occur
-      } else {
-	 FREEMEMORY(oldestEntry);
-	 --state->numberOfIPandMACEntries;
+/*
+ *----------------------------------------------------------------------
+ *
+ * GrowLookupTableIfNecessary --
+ *
+ *      If the IP hash table holds more entries than buckets, replace it
+ *      with one twice the size (up to SMAC_HASH_TABLE_MAX_SIZE).
+ *
+ *      Lockless readers may still be walking the old table, so its
+ *      chains cannot be relinked; instead every entry is copied into
+ *      the new table, which is then published, and the old table and
+ *      entries are freed after a grace period.  Growth is rare and the
+ *      table small, so the copy is cheaper than a resize algorithm that
+ *      can relink entries under readers.  The copies are allocated up
+ *      front; if any allocation fails the old table is kept and growth
+ *      is retried on the next add.
+ *
+ *      Function presumes that state lock is held while this function
+ *      is called.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      May replace the IP hash table and every entry in it (in the
+ *      LRU list too), invalidating the per-CPU caches.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+GrowLookupTableIfNecessary(SMACState *state) // IN: smac state
+{
+   SMACHashTable *oldTable = state->IPlookupTable;
+   SMACHashTable *newTable;
+   IPmacLookupEntry *entry, *next, *spares = NULL;
+   uint32 size = oldTable->mask + 1;
+   uint32 i;
+
+   ASSERTLOCKHELD();
+
+   if (state->numberOfIPandMACEntries <= size ||
+       size >= SMAC_HASH_TABLE_MAX_SIZE) {
+      return;
+   }
+
+   newTable = AllocLookupTable(size * 2);
+   if (!newTable) {
+      VNETKdPrint((MODULE_NAME "GrowLookupTableIfNecessary: failed to "
+                   "allocate table of %u buckets\n", size * 2));
+      return;
+   }
+
+   for (i = 0; i < state->numberOfIPandMACEntries; ++i) {
+      entry = ALLOCATEMEMORY(sizeof *entry, REORDER_TAG('SMle'));
+      if (!entry) {
+         VNETKdPrint((MODULE_NAME "GrowLookupTableIfNecessary: failed "
+                      "to allocate entry copies\n"));
+         for (; spares; spares = next) {
+            next = spares->ipNext;
+            FREEMEMORY(spares);
+         }
+         FREEMEMORY(newTable);
+         return;
       }
+      entry->ipNext = spares;
+      spares = entry;
    }
-   else {
-      VNETKdPrint((MODULE_NAME "TrimLookupTableIfNecessary: "
-		   "found no entry to remove!!\n"));
+
+   for (i = 0; i < size; ++i) {
+      for (entry = oldTable->buckets[i]; entry; entry = entry->ipNext) {
+         IPmacLookupEntry *copy = spares;
+         uint32 hash;
+
+         ASSERT(copy);
+         spares = copy->ipNext;
+         *copy = *entry;
+         hash = LookupEntryIPAddrHash(copy) & newTable->mask;
+         copy->ipNext = newTable->buckets[hash];
+         newTable->buckets[hash] = copy;
+         LruReplace(state, entry, copy);
+      }
    }
+   ASSERT(!spares);
 
-   VNETKdPrintReturn(("TrimLookupTableIfNecessary"));   
-   return;
+   VNETKdPrint((MODULE_NAME "GrowLookupTableIfNecessary: %u entries, "
+                "%u -> %u buckets\n", state->numberOfIPandMACEntries, size,
+                size * 2));
+
+   RCUASSIGNPOINTER(state->IPlookupTable, newTable);
+#ifdef __linux__
+   SMACL_BumpGeneration(&state->generation);
+#endif
+
+   for (i = 0; i < size; ++i) {
+      for (entry = oldTable->buckets[i]; entry; entry = next) {
+         next = entry->ipNext;
+         FREEMEMORYRCU(entry);
+      }
+   }
+   FREEMEMORYRCU(oldTable);
 }
 
 
@@ -1156,20 +1430,22 @@ TrimLookupTableIfNecessary(SMACState *state) // IN: smac state
  *
  * SetCacheEntry --
  *
- *      Sets the cached MAC/IP entry for an adapter, and updates the
- *      access time for the previous cache entry (if any).  The cache
+ *      Sets the cached MAC/IP entry for an adapter, and makes the entry
+ *      the most recently used one.  The cache
  *      is used to avoid the overhead of checking for the existance of,
  *      for the purposes of adding, a MAC/IP entry that has already
- *      been added recently.
+ *      been added recently.  On Linux this CPU's copy of the cache is
+ *      updated as well.
  *
- *      Function is called with state->smacSpinLock held.
+ *      Function is called with state->smacSpinLock held, and the entry
+ *      must be on the LRU list.
  *
  * Results:
  *      None.
  *
  * Side effects:
- *      Modified the cached entry for the adapter, and updates the
- *      access time for the previous cache entry (if any)
+ *      Modified the cached entry for the adapter, and moves the entry
+ *      to the head of the LRU list.
  *
  *----------------------------------------------------------------------
  */
@@ -1181,19 +1457,29 @@ SetCacheEntry(SMACState *state,         // IN: smac state
    ASSERT(state);
    ASSERT(entry);
 
-   /* 
-    * Set new cached entry, but first set the current cache entry's
-    * access time to the current time
-    */
-
-   if (state->lastEntryAdded) {
-      state->lastEntryAdded->lastAccess = GetSystemUptime(state);
+   if (state->lruHead != entry) {
+      LruUnlink(state, entry);
+      LruPushHead(state, entry);
    }
+   entry->referenced = FALSE;
 
    state->lastIPadded = entry->addrContainer;
    MEMCPY(state->lastMACadded, entry->mac, ETH_ALEN);
-   state->lastEntryAdded = entry;
-   entry->lastAccess = GetSystemUptime(state);
+
+#ifdef __linux__
+   {
+      unsigned long flags;
+      SMACCpuCache *cache = SMACL_GetCpuPtr(state->cpuCache, &flags);
+
+      if (cache != NULL) {
+         cache->addIP = entry->addrContainer;
+         MEMCPY(cache->addMAC, entry->mac, ETH_ALEN);
+         cache->addGeneration = state->generation;
+         cache->addEntry = entry;
+      }
+      SMACL_PutCpuPtr(&flags);
+   }
+#endif
 }
 
 
@@ -1237,13 +1523,35 @@ AddIPandMACcombo(SMACState *state,                     // IN: smac state
                 PrintMACAddrToString(macStr, sizeof macStr, mac)));
 
    ASSERTLOCKHELD();
-   ASSERT(SMAC_HASH_TABLE_SIZE == 256);
 
+#ifdef __linux__
+   {
+      unsigned long flags;
+      SMACCpuCache *cache = SMACL_GetCpuPtr(state->cpuCache, &flags);
+      Bool cached;
+
+      SMACL_RcuReadLock();
+      cached = cache != NULL &&
+         cache->addGeneration == SMACL_ReadGeneration(&state->generation) &&
+         AddrContainersMatch(&cache->addIP, addrContainer) &&
+         MAC_EQ(mac, cache->addMAC);
+      if (cached && !cache->addEntry->referenced) {
+         cache->addEntry->referenced = TRUE;
+      }
+      SMACL_RcuReadUnlock();
+      SMACL_PutCpuPtr(&flags);
+      if (cached) {
+         VNETKdPrint((MODULE_NAME "AddIPMAC: cache says already present\n"));
+         return TRUE;
+      }
+   }
+#else
    if (AddrContainersMatch(&state->lastIPadded, addrContainer) &&
        MAC_EQ(mac, state->lastMACadded)) {
       VNETKdPrint((MODULE_NAME "AddIPMAC: cache says already present\n"));
       return TRUE;
    }
+#endif
 
    if (IsIPAddrContainerV4(addrContainer)) {
       uint32 addr = ContainerGetIPv4Addr(addrContainer);
@@ -1307,7 +1615,8 @@ AddIPandMACcombo(SMACState *state,                     // IN: smac state
     */
 
    if (!entryIP) {
-      uint8 ipHash = IPAddrContainerHash(addrContainer);
+      SMACHashTable *table = state->IPlookupTable;
+      uint32 ipHash = IPAddrContainerHash(addrContainer) & table->mask;
       
       IPmacLookupEntry *entry = ALLOCATEMEMORY(sizeof *entry,
                                                REORDER_TAG('SMle'));
@@ -1329,24 +1638,29 @@ AddIPandMACcombo(SMACState *state,                     // IN: smac state
 
       // initialize the contents of the table entry
       LookupEntrySetIPAddrContainer(entry, addrContainer);
-      entry->lastAccess = 0; /* initialize to 0 for sanity, although it's not vital */
+      entry->referenced = FALSE;
 
       MEMCPY(entry->mac, mac, ETH_ALEN);
 
-      // add entry to IP hash table
-      entry->ipNext = state->IPlookupTable[ipHash];
-      state->IPlookupTable[ipHash] = entry;
+      // add entry to IP hash table and LRU list
+      entry->ipNext = table->buckets[ipHash];
+      RCUASSIGNPOINTER(table->buckets[ipHash], entry);
+      LruPushHead(state, entry);
 
       VNETKdPrint((MODULE_NAME "AddIPMACnew: entry allocated, and added\n"));
       SetCacheEntry(state, entry);
       TrimLookupTableIfNecessary(state);
+      GrowLookupTableIfNecessary(state);
 
    } else {
+      IPmacLookupEntry *entry;
 
       /*
        * If table entry was found for IP, but the MACs don't match, then this means
        * that a new/different ethernet device/MAC is using the IP address.  We need
-       * to update the contents of the table entry to specify the new MAC
+       * to update the contents of the table entry to specify the new MAC.
+       * Lookups may be reading the entry without the lock, so a copy
+       * with the new MAC replaces it rather than modifying it in place.
        */
 
       VNETKdPrint((MODULE_NAME "AddIPMACmacmod: IP has changed from known "
@@ -1358,11 +1672,23 @@ AddIPandMACcombo(SMACState *state,                     // IN: smac state
 		   mac[0]&0xff, mac[1]&0xff, mac[2]&0xff, mac[3]&0xff, 
 		   mac[4]&0xff, mac[5]&0xff));
 
-      // update MAC in the table entry
-      MEMCPY(entryIP->mac, mac, ETH_ALEN);
+      entry = ALLOCATEMEMORY(sizeof *entry, REORDER_TAG('SMle'));
+      if (!entry) {
+	 VNETKdPrint((MODULE_NAME "AddIPMACmacmod: Failed to allocate "
+		      " MAC/IP entry\n"));
+	 result = FALSE;
+	 goto exit;
+      }
+
+      // replace the table entry with one holding the new MAC
+      *entry = *entryIP;
+      MEMCPY(entry->mac, mac, ETH_ALEN);
+      ReplaceIPinHashTableNoAcquireLock(state, entryIP, entry);
+      LruReplace(state, entryIP, entry);
       
       // update which was the last IP/MAC combo to be added
-      SetCacheEntry(state, entryIP);
+      SetCacheEntry(state, entry);
+      FREEMEMORYRCU(entryIP);
       // no new entry added, so no need to call TrimLookupTableIfNecessary()
    }
 
@@ -2430,9 +2756,11 @@ SMAC_CheckPacketToHost(SMACState *state,     // IN: pointer to state
             return PacketStatusDropPacket;
          }
 
-         CopyDataToClonedPacket(packets, state->macAddress, 
-                                ETH_ALEN /* offset for source MAC */, 
-                                ETH_ALEN /* length */);
+         if (!CopyDataToClonedPacket(packets, state->macAddress, 
+                                     ETH_ALEN /* offset for source MAC */, 
+                                     ETH_ALEN /* length */)) {
+            return PacketStatusDropPacket;
+         }
          return PacketStatusForwardPacket;
       } else {
 
@@ -2612,9 +2940,11 @@ SMAC_CheckPacketToHost(SMACState *state,     // IN: pointer to state
             return PacketStatusForwardPacket;
          }
       }
-      CopyDataToClonedPacket(packets, state->macAddress, 
-                             ETH_ALEN /* offset for source MAC */, 
-                             ETH_ALEN /* length */);
+      if (!CopyDataToClonedPacket(packets, state->macAddress, 
+                                  ETH_ALEN /* offset for source MAC */, 
+                                  ETH_ALEN /* length */)) {
+         return PacketStatusDropPacket;
+      }
       return PacketStatusForwardPacket;
    } 
 
@@ -2840,8 +3170,11 @@ SMAC_CheckPacketToHost(SMACState *state,     // IN: pointer to state
 			state->macAddress[2]&0xff, state->macAddress[3]&0xff, 
 			state->macAddress[4]&0xff, state->macAddress[5]&0xff));
 	 
-	    CopyDataToClonedPacket(packets, state->macAddress, ETH_ALEN /* offset */,
-				   ETH_ALEN /* length */);
+	    if (!CopyDataToClonedPacket(packets, state->macAddress,
+					ETH_ALEN /* offset */,
+					ETH_ALEN /* length */)) {
+	       return PacketStatusDropPacket;
+	    }
 
 	    /* 
 	     * Modify ARP source MAC
@@ -2897,7 +3230,10 @@ SMAC_CheckPacketToHost(SMACState *state,     // IN: pointer to state
 			      state->macAddress[4], state->macAddress[5]));
             }
 #endif
-	    CopyDataToClonedPacket(packets, state->macAddress, offset, ETH_ALEN);
+	    if (!CopyDataToClonedPacket(packets, state->macAddress, offset,
+					ETH_ALEN)) {
+	       return PacketStatusDropPacket;
+	    }
 	    return PacketStatusForwardPacket;
 	 }
       }
@@ -2912,9 +3248,11 @@ SMAC_CheckPacketToHost(SMACState *state,     // IN: pointer to state
       }
 
       /* For wireless, send EAPOL packets to host side. */
-      CopyDataToClonedPacket(packets, state->macAddress,
-                             ETH_ALEN /* offset for source MAC */,
-                             ETH_ALEN /* length */);
+      if (!CopyDataToClonedPacket(packets, state->macAddress,
+                                  ETH_ALEN /* offset for source MAC */,
+                                  ETH_ALEN /* length */)) {
+         return PacketStatusDropPacket;
+      }
 
       return PacketStatusForwardPacket;
    }
@@ -4083,11 +4421,36 @@ SMAC_InitState(SMACState **ptr) // OUT: pointer to alloced/inited state
 
    VNETKdPrint((MODULE_NAME "SMAC_InitState: state %p\n", state));
 
+   state->capacity = SMAC_DEFAULT_CAPACITY;
+   state->IPlookupTable = AllocLookupTable(SMAC_HASH_TABLE_SIZE);
+   if (state->IPlookupTable == NULL) {
+      VNETKdPrint((MODULE_NAME "SMAC_InitState: couldn't allocate hash "
+                   "table. Freeing state.\n"));
+      FREEMEMORY(state);
+      *ptr = NULL;
+      return;
+   }
+
+#ifdef __linux__
+   /*
+    * The per-CPU caches are an optimization only; without them every
+    * lookup walks the table.  Generation 0 is never current, so the
+    * zeroed caches start out invalid.
+    */
+
+   state->cpuCache = SMACL_AllocPerCpu(sizeof (SMACCpuCache));
+   state->generation = 1;
+#endif
+
    INITSPINLOCK(&(state->smacSpinLock));
 #ifndef _WIN32
    if (state->smacSpinLock == NULL) {
       VNETKdPrint((MODULE_NAME "SMAC_InitState: coudln't initialize spinlock."
                    "Freeing state.\n"));
+#ifdef __linux__
+      SMACL_FreePerCpu(state->cpuCache);
+#endif
+      FREEMEMORY(state->IPlookupTable);
       FREEMEMORY(state);
       state = NULL;
    }
@@ -4176,6 +4539,111 @@ SMAC_SetForwardUnknownPackets(SMACState *state,    // IN: pointer to smac state
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * SMAC_SetCapacity --
+ *
+ *      Set the maximum number of IP/MAC entries kept in SMAC state,
+ *      clamped to [SMAC_MIN_CAPACITY, SMAC_MAX_CAPACITY].
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Evicts least recently used entries above the new capacity.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void SMACINT
+SMAC_SetCapacity(SMACState *state, // IN: pointer to smac state
+                 uint32 capacity)  // IN: max number of entries
+{
+#ifdef _WIN32
+   KIRQL irql;
+#endif
+   SPINLOCKINIT();
+
+   VNETKdPrintCall(("SMAC_SetCapacity"));
+   ASSERT(state);
+
+   if (capacity < SMAC_MIN_CAPACITY) {
+      capacity = SMAC_MIN_CAPACITY;
+   } else if (capacity > SMAC_MAX_CAPACITY) {
+      capacity = SMAC_MAX_CAPACITY;
+   }
+
+   RAISEIRQL();
+   ACQUIRESPINLOCK(&state->smacSpinLock);
+   state->capacity = capacity;
+   TrimLookupTableIfNecessary(state);
+   RELEASESPINLOCK(&state->smacSpinLock);
+   LOWERIRQL();
+   VNETKdPrintReturn(("SMAC_SetCapacity"));
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SMAC_GetStats --
+ *
+ *      Report the size of the IP/MAC table and its lookup and eviction
+ *      counters.  On Linux the lookup counters are kept per CPU and are
+ *      missing if per-CPU memory could not be allocated.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void SMACINT
+SMAC_GetStats(SMACState *state, // IN: pointer to smac state
+              SMACStats *stats) // OUT: statistics
+{
+#ifdef _WIN32
+   KIRQL irql;
+#endif
+#ifdef __linux__
+   int cpu;
+#endif
+   SPINLOCKINIT();
+
+   ASSERT(state);
+   ASSERT(stats);
+
+   MEMSET(stats, 0, sizeof *stats);
+
+   RAISEIRQL();
+   ACQUIRESPINLOCK(&state->smacSpinLock);
+   stats->entries = state->numberOfIPandMACEntries;
+   stats->capacity = state->capacity;
+   stats->evictions = state->evictions;
+#ifndef __linux__
+   stats->lookupHits = state->lookupHits;
+   stats->lookupMisses = state->lookupMisses;
+#endif
+   RELEASESPINLOCK(&state->smacSpinLock);
+   LOWERIRQL();
+
+#ifdef __linux__
+   if (state->cpuCache != NULL) {
+      for (cpu = SMACL_NextCpu(-1); cpu >= 0; cpu = SMACL_NextCpu(cpu)) {
+         const SMACCpuCache *cache = SMACL_PerCpuPtr(state->cpuCache, cpu);
+
+         stats->lookupHits += cache->lookupHits;
+         stats->lookupMisses += cache->lookupMisses;
+      }
+   }
+#endif
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -4214,8 +4682,8 @@ SMAC_CleanupState(SMACState **ptr) // IN: state to dealloc
    RAISEIRQL();
    ACQUIRESPINLOCK(&state->smacSpinLock);
 
-   for (i = 0; i < SMAC_HASH_TABLE_SIZE; ++i) {
-      IPmacLookupEntry * entry = state->IPlookupTable[i];
+   for (i = 0; i <= state->IPlookupTable->mask; ++i) {
+      IPmacLookupEntry * entry = state->IPlookupTable->buckets[i];
       while (entry) {
 	 IPmacLookupEntry * next = entry->ipNext;
 	 VNETKdPrintCall(("--deleted entry\n"));
@@ -4234,6 +4702,17 @@ SMAC_CleanupState(SMACState **ptr) // IN: state to dealloc
    RELEASESPINLOCK(&state->smacSpinLock);
    FREESPINLOCK(&state->smacSpinLock);
    LOWERIRQL();
+
+#ifdef __linux__
+   /*
+    * The bridge no longer calls into SMAC, but entries and tables
+    * retired by earlier adds may still be waiting on a grace period.
+    */
+
+   SMACL_RcuBarrier();
+   SMACL_FreePerCpu(state->cpuCache);
+#endif
+   FREEMEMORY(state->IPlookupTable);
    FREEMEMORY(state);
 
    VNETKdPrintReturn(("SMAC_CleanupState"));
@@ -4527,77 +5006,6 @@ UpdateSum(uint16 oricheck, // IN: old checksum
 }
 
 
-/*
- *----------------------------------------------------------------------
- *
- * GetSystemUptime --
- *
- *      Return current uptime of system, this is essentially a wrapper
- *      that checks for overflow.  When 
- *      overflow occurs the existing last used times reduced by half.
- *      As part of the solution, the returned value always has the 
- *      highest bit turned on.
- *
- *      Previously, this was a wrapper for NdisGetSystemUptime().
- *      Recent updates to the DDK/WDK have confused this function - there
- *      is now a depricated 32-bit version and a 64-bit version only 
- *      available on newer version of the OS.  Rather than trying to be
- *      clever, we will use KeQueryTickCount instead.
- *
- *      This function should only be called with the lock held.
- *
- * Results:
- *      Returns uptime of system (skewed so always in upper half 
- *      of numeric range for 32-bits)
- *
- * Side effects:
- *      Updates the "last uptime" stored in adapter struct, and may
- *      modify the uptimes of all entries in the hash table.
- *
- *----------------------------------------------------------------------
- */
-
-static SmacLastAccess 
-GetSystemUptime(SMACState *state) // IN: smac state
-{
-   SmacLastAccess currentUptime;
-
-#ifdef _WIN32
-   {
-      LARGE_INTEGER arg;
-      KeQueryTickCount(&arg);
-      currentUptime = arg.QuadPart;
-   }
-#else
-   currentUptime = SMACL_GetUptime();
-#endif
-   /*
-    * Force on the highest bit.  This basically means that recent 
-    * values have the high bit turned on, while values that were 
-    * obtained prior to the last overflow will have the highest bit
-    * (and potentially other neighboring bits) turned off.
-    */
-
-   currentUptime |= (SmacLastAccess)1 << (sizeof currentUptime * 8 - 1);
-
-   /* If overflow occurred, then reduce all existing values by half */
-   if (currentUptime < state->lastUptimeRead) {
-      uint32 i;
-      VNETKdPrint((MODULE_NAME "GetSystemUptime: overflow detected, "
-		   "adjusting counters\n"));
-      for (i = 0; i < SMAC_HASH_TABLE_SIZE; ++i) {
-	 IPmacLookupEntry *entry = state->IPlookupTable[i];
-	 while (entry) {
-	    entry->lastAccess >>= 1; /* reduce value by half */
-	    entry = entry->ipNext;
-	 }
-      }
-   }
-   state->lastUptimeRead = currentUptime;
-   return currentUptime;
-}
-
-
 /*
  *----------------------------------------------------------------------
  *
@@ -4691,7 +5099,10 @@ GetPacketData(SMACPacket *packet, // IN: packet to copy from
 
 #elif __linux__
 
-   MEMCPY(data, packet->startOfData + offset, length);
+   if (!SMACL_CopyDataFromPkt(packet->skb, packet->offset + offset, data,
+                              length)) {
+      return FALSE;
+   }
 
 #else /* __APPLE__ */
 
@@ -4710,7 +5121,9 @@ GetPacketData(SMACPacket *packet, // IN: packet to copy from
  *
  *      Makes a private copy of the incoming packet.  This modified
  *      copy is private and can be modified at will.  Caller is
- *      responsible for freeing the cloned packet.
+ *      responsible for freeing the cloned packet.  On Linux the copy
+ *      is an skb clone: headers are only copied once they are written
+ *      (see CopyDataToClonedPacket), and the payload never is.
  *
  * Results:
  *      TRUE if clone was successful, otherwise FALSE.
@@ -4754,11 +5167,9 @@ ClonePacket(SMACPackets *packets)   // IN: struct in which to clone packet
 
 #elif defined __linux__
 
-   packets->clone.skb = SMACL_DupPacket(packets->orig.skb);
+   packets->clone.skb = SMACL_ClonePacket(packets->orig.skb);
    if (packets->clone.skb) {
-      packets->clone.startOfData = (packets->orig.startOfData - 
-				    SMACL_PacketData(packets->orig.skb)) + 
- 	                            SMACL_PacketData(packets->clone.skb);
+      packets->clone.offset = packets->orig.offset;
       packets->clone.len = packets->orig.len;
    }
    return packets->clone.skb != NULL;
@@ -4822,8 +5233,12 @@ CopyDataToClonedPacket(SMACPackets *packets, // IN: packets
    ASSERT(packets);
    ASSERT(packets->clone.skb);
 
-   MEMCPY((uint8 *)(packets->clone.startOfData) + offset, 
-	  source, length);
+   if (!SMACL_CopyDataToPkt(packets->clone.skb,
+                            packets->clone.offset + offset, source, length)) {
+      VNETKdPrint((MODULE_NAME "CopyDataToClonedPacket: couldn't write "
+                   "%u bytes at %u\n", length, offset));
+      return FALSE;
+   }
 
 #else /* __APPLE __ */
 
@@ -4880,7 +5295,9 @@ SetPacketByte(SMACPacket *packet, // IN: packet
    ASSERT(packet);
    ASSERT(packet->skb);
 
-   ((uint8*)packet->startOfData)[offset] = data;
+   if (!SMACL_CopyDataToPkt(packet->skb, packet->offset + offset, &data, 1)) {
+      return FALSE;
+   }
 
 #else
 
@@ -4933,6 +5350,7 @@ CopyDataForPacketFromHost(SMACPackets *packets,    // IN/OUT: packets struct
       MEMCPY(table->mac, macAddress, ETH_ALEN);
    }
    table->offsets[table->numOfOffsets++] = offset;
+   return TRUE;
 
 #else /* _WIN32 */
 
@@ -4941,8 +5359,6 @@ CopyDataForPacketFromHost(SMACPackets *packets,    // IN/OUT: packets struct
       VNETKdPrint((MODULE_NAME "FromHostIP: couldn't clone packet\n"));
       return FALSE;
    }	     
-   CopyDataToClonedPacket(packets, macAddress, offset, ETH_ALEN); 
+   return CopyDataToClonedPacket(packets, macAddress, offset, ETH_ALEN); 
 #endif /* _WIN32 */
-
-   return TRUE;
 }
@@ -65,6 +65,23 @@ typedef struct IPv6Addr {
 
 struct SMACState;
 
+/*
+ * Bounds on the number of IP/MAC entries SMAC remembers per bridge; the
+ * least recently used entry is evicted beyond the capacity.
+ */
+
+#define SMAC_DEFAULT_CAPACITY 256
+#define SMAC_MIN_CAPACITY     16
+#define SMAC_MAX_CAPACITY     16384
+
+typedef struct SMACStats {
+   uint32 entries;      // IP/MAC entries in the table
+   uint32 capacity;     // max IP/MAC entries
+   uint64 lookupHits;   // IP lookups that found a MAC
+   uint64 lookupMisses; // IP lookups that did not
+   uint64 evictions;    // entries evicted to stay within capacity
+} SMACStats;
+
 #if defined(_WIN32) && NDIS_SUPPORT_NDIS6
 Bool BridgeIPv6MatchAddrMAC(const IPv6Addr *addr, const uint8 *mac);
 Bool BridgeIPv4MatchAddrMAC(const ULONG ipAddr, const uint8 *mac);
@@ -88,8 +105,8 @@ SMAC_CleanupState(struct SMACState **ptr);        // IN: state to cleanup/deallo
 /* non-WIN32 versions of these structs */
 typedef struct SMACPacket {
 #ifdef __linux__
-   struct sk_buff *skb;  // packet
-   void *startOfData;    // handles non-uniform start of data in sk_buff
+   struct sk_buff *skb;  // packet, need not be linear
+   int offset;           // offset of ethernet header from skb->data
    unsigned int len;     // compensates for ethernet header for inbound packets
 #else
    mbuf_t m;             // packet
@@ -114,6 +131,14 @@ void SMACINT
 SMAC_SetForwardUnknownPackets(struct SMACState *state, // IN: pointer to smac state
 			      Bool forwardUnknown);    // IN: T/F to forward
 
+void SMACINT
+SMAC_SetCapacity(struct SMACState *state, // IN: pointer to smac state
+                 uint32 capacity);        // IN: max number of entries
+
+void SMACINT
+SMAC_GetStats(struct SMACState *state, // IN: pointer to smac state
+              SMACStats *stats);       // OUT: statistics
+
 #endif // _SMAC_H_
 
 
@@ -34,6 +34,8 @@
 #include <linux/version.h>
 #include <linux/sched.h>
 #include <linux/spinlock.h>       // for spinlock_t
+#include <linux/rcupdate.h>
+#include <linux/percpu.h>
 
 #include <linux/slab.h>
 #include <linux/poll.h>
@@ -67,27 +69,6 @@
 
 
 
-/*
- *----------------------------------------------------------------------
- * SMACL_GetUptime --
- *
- *      Wrapper for jiffies.
- *
- * Results:
- *      Uptime in ticks
- *
- * Side effects:
- *      None
- *
- *----------------------------------------------------------------------
- */
-
-unsigned long SMACINT
-SMACL_GetUptime()
-{
-   return jiffies;
-}
-
 /*
  *----------------------------------------------------------------------
  * SMACL_Memcpy --
@@ -279,6 +260,306 @@ SMACL_ReleaseSpinlock(void **s,             // IN: spinlock
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ * SMACL_RcuReadLock --
+ * SMACL_RcuReadUnlock --
+ *
+ *      Wrappers for rcu_read_lock() and rcu_read_unlock().
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Enters/leaves an RCU read-side critical section.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void SMACINT
+SMACL_RcuReadLock(void)
+{
+   rcu_read_lock();
+}
+
+void SMACINT
+SMACL_RcuReadUnlock(void)
+{
+   rcu_read_unlock();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ * SMACL_RcuDereference --
+ *
+ *      Wrapper for rcu_dereference().  SMAC reads its table both from
+ *      RCU read-side sections and with its spinlock held, so the raw
+ *      variant is used.
+ *
+ * Results:
+ *      Pointer stored at p.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void* SMACINT
+SMACL_RcuDereference(void **p) // IN: RCU-protected pointer
+{
+   return rcu_dereference_raw(*p);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ * SMACL_RcuAssignPointer --
+ *
+ *      Wrapper for rcu_assign_pointer().
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Publishes v at p.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void SMACINT
+SMACL_RcuAssignPointer(void **p, // OUT: RCU-protected pointer
+                       void *v)  // IN: new value
+{
+   rcu_assign_pointer(*p, v);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ * SMACL_FreeRcu --
+ *
+ *      Frees, after an RCU grace period, memory obtained from
+ *      SMACL_Alloc() whose first member is head.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Queues an RCU callback.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+SMACLFreeRcuCallback(struct rcu_head *head) // IN: head of object to free
+{
+   kfree(head);
+}
+
+void SMACINT
+SMACL_FreeRcu(SMACL_RcuHead *head) // IN: head of object to free
+{
+   BUILD_BUG_ON(sizeof (SMACL_RcuHead) != sizeof (struct rcu_head));
+   call_rcu((struct rcu_head *)head, SMACLFreeRcuCallback);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ * SMACL_RcuBarrier --
+ *
+ *      Wrapper for rcu_barrier().  May sleep.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Waits for all outstanding SMACL_FreeRcu() callbacks.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void SMACINT
+SMACL_RcuBarrier(void)
+{
+   rcu_barrier();
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ * SMACL_AllocPerCpu --
+ *
+ *      Allocates zeroed per-CPU memory.  SMAC state is created under
+ *      dev_base_lock, so the allocation must not sleep; kernels that
+ *      cannot allocate per-CPU memory atomically get NULL.
+ *
+ * Results:
+ *      Per-CPU pointer if successful, NULL otherwise.
+ *
+ * Side effects:
+ *      Allocates memory.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void* SMACINT
+SMACL_AllocPerCpu(size_t size) // IN: size of each CPU's copy
+{
+#if COMPAT_LINUX_VERSION_CHECK_LT(3, 18, 0)
+   return NULL;
+#else
+   return (void __force *)__alloc_percpu_gfp(size, __alignof__(unsigned long),
+                                             GFP_ATOMIC);
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ * SMACL_FreePerCpu --
+ *
+ *      Wrapper for free_percpu().
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Frees memory.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void SMACINT
+SMACL_FreePerCpu(void *p) // IN: per-CPU pointer (may be NULL)
+{
+   free_percpu((void __percpu __force *)p);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ * SMACL_GetCpuPtr --
+ * SMACL_PutCpuPtr --
+ *
+ *      Disable local interrupts and return this CPU's copy of a per-CPU
+ *      allocation; restore interrupts when done with it.  SMAC is
+ *      entered from both process and interrupt context, so disabling
+ *      interrupts is what keeps the copy private.
+ *
+ * Results:
+ *      This CPU's copy, or NULL if p is NULL.
+ *
+ * Side effects:
+ *      Disables/restores local interrupts.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void* SMACINT
+SMACL_GetCpuPtr(void *p,              // IN: per-CPU pointer (may be NULL)
+                unsigned long *flags) // OUT: saved interrupt state
+{
+   unsigned long f;
+
+   local_irq_save(f);
+   *flags = f;
+   return p == NULL ? NULL : this_cpu_ptr((void __percpu __force *)p);
+}
+
+void SMACINT
+SMACL_PutCpuPtr(unsigned long *flags) // IN: saved interrupt state
+{
+   unsigned long f = *flags;
+
+   local_irq_restore(f);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ * SMACL_PerCpuPtr --
+ *
+ *      Wrapper for per_cpu_ptr().
+ *
+ * Results:
+ *      The given CPU's copy of a per-CPU allocation.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void* SMACINT
+SMACL_PerCpuPtr(void *p, // IN: per-CPU pointer
+                int cpu) // IN: cpu
+{
+   return per_cpu_ptr((void __percpu __force *)p, cpu);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ * SMACL_NextCpu --
+ *
+ *      Iterates over possible CPUs; start with -1.
+ *
+ * Results:
+ *      Next possible CPU after cpu, or -1 if there is none.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int SMACINT
+SMACL_NextCpu(int cpu) // IN: previous cpu, or -1
+{
+   cpu = cpumask_next(cpu, cpu_possible_mask);
+   return cpu < nr_cpu_ids ? cpu : -1;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ * SMACL_ReadGeneration --
+ * SMACL_BumpGeneration --
+ *
+ *      Read or advance a generation counter that guards lockless caches
+ *      of RCU-protected data.  Updates to the data must be published
+ *      before the bump, and a reader must sample the generation before
+ *      it looks at the data.
+ *
+ * Results:
+ *      Current generation (read).
+ *
+ * Side effects:
+ *      Advances the generation (bump).
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint32 SMACINT
+SMACL_ReadGeneration(const uint32 *g) // IN: generation counter
+{
+   uint32 v = READ_ONCE(*g);
+
+   smp_rmb();
+   return v;
+}
+
+void SMACINT
+SMACL_BumpGeneration(uint32 *g) // IN/OUT: generation counter
+{
+   smp_wmb();
+   WRITE_ONCE(*g, *g + 1);
+}
+
+
 #ifdef DBG
 /*
  *----------------------------------------------------------------------
@@ -314,35 +595,38 @@ SMACL_Print(const char * msg, // IN: format message
 
 /*
  *----------------------------------------------------------------------
- * SMACL_DupPacket --
+ * SMACL_ClonePacket --
  *
- *      Wrapper for skb_copy().
+ *      Wrapper for skb_clone().  The clone shares packet data with the
+ *      original; SMACL_CopyDataToPkt() gives it a private copy of the
+ *      headers it writes to.
  *
  * Results:
  *      Pointer to packet if successful, NULL otherwise
  *
  * Side effects:
- *      Creates a private duplicate of packet
+ *      Creates a clone of the packet
  *
  *----------------------------------------------------------------------
  */
 
 struct sk_buff* SMACINT
-SMACL_DupPacket(struct sk_buff *skb) // IN: packet to duplicate
+SMACL_ClonePacket(struct sk_buff *skb) // IN: packet to clone
 {
-   return skb_copy(skb, GFP_ATOMIC);
+   return skb_clone(skb, GFP_ATOMIC);
 }
 
+
 /*
  *----------------------------------------------------------------------
- * SMACL_PacketData --
+ * SMACL_CopyDataFromPkt --
  *
- *      Wrapper to get data from sk_buff.  This function might be
- *      a bit extreme, but it's good to be able to handle changes
- *      to the layout of the sk_buff struct.
+ *      Wrapper for skb_copy_bits().  Works on nonlinear skbs; offset is
+ *      relative to skb->data and may be negative to reach the link
+ *      layer header of a received packet.
  *
  * Results:
- *      Pointer to data in sk_buff.
+ *      Non zero if the data was copied, 0 if out of range.
  *
  * Side effects:
  *      None.
@@ -350,10 +634,62 @@ SMACL_DupPacket(struct sk_buff *skb) // IN: packet to duplicate
  *----------------------------------------------------------------------
  */
 
-void* SMACINT
-SMACL_PacketData(struct sk_buff *skb) // IN: pointer to packet buffer
+int SMACINT
+SMACL_CopyDataFromPkt(struct sk_buff *skb, // IN: packet
+                      int offset,          // IN: offset from skb->data
+                      void *data,          // OUT: buffer
+                      uint32 len)          // IN: bytes to copy
+{
+   if (offset < 0 && skb->data + offset < skb->head) {
+      return 0;
+   }
+   return skb_copy_bits(skb, offset, data, len) == 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ * SMACL_CopyDataToPkt --
+ *
+ *      Writes into a packet.  Only the bytes up to the end of the
+ *      write are pulled into the linear area, and the header is copied
+ *      first if it is shared with a clone (as after SMACL_ClonePacket),
+ *      so paged payload is never copied.  offset is relative to
+ *      skb->data and may be negative.  Writes past skb->data void a
+ *      CHECKSUM_COMPLETE checksum.
+ *
+ * Results:
+ *      Non zero if the data was written, 0 otherwise.
+ *
+ * Side effects:
+ *      May reallocate the skb header.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int SMACINT
+SMACL_CopyDataToPkt(struct sk_buff *skb, // IN: packet
+                    int offset,          // IN: offset from skb->data
+                    const void *data,    // IN: bytes to write
+                    uint32 len)          // IN: number of bytes
 {
-   return skb->data;
+   int end = offset + len;
+
+   if (offset < 0 && skb->data + offset < skb->head) {
+      return 0;
+   }
+   if (end > 0 && !pskb_may_pull(skb, end)) {
+      return 0;
+   }
+   if (skb_cloned(skb) && !skb_clone_writable(skb, max(end, 0)) &&
+       pskb_expand_head(skb, 0, 0, GFP_ATOMIC)) {
+      return 0;
+   }
+   if (end > 0 && skb->ip_summed == CHECKSUM_COMPLETE) {
+      skb->ip_summed = CHECKSUM_NONE;
+   }
+   memcpy(skb->data + offset, data, len);
+   return 1;
 }
 
 
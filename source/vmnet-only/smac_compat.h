@@ -41,15 +41,43 @@ void   SMACINT SMACL_Memset(void *p1, int val, size_t l);
 void*  SMACINT SMACL_Alloc(size_t s);
 void   SMACINT SMACL_Free(void *p);
 
-unsigned long SMACINT SMACL_GetUptime(void);
-
 void   SMACINT SMACL_InitSpinlock(void **s);
 void   SMACINT SMACL_AcquireSpinlock(void **s, unsigned long *flags);
 void   SMACINT SMACL_ReleaseSpinlock(void  **s, unsigned long *flags);
 
+/*
+ * Stand-in for struct rcu_head, which smac.c cannot see.  It must be the
+ * first member of any object handed to SMACL_FreeRcu().
+ */
+
+typedef struct SMACL_RcuHead {
+   void *next;
+   void *func;
+} SMACL_RcuHead;
+
+void   SMACINT SMACL_RcuReadLock(void);
+void   SMACINT SMACL_RcuReadUnlock(void);
+void*  SMACINT SMACL_RcuDereference(void **p);
+void   SMACINT SMACL_RcuAssignPointer(void **p, void *v);
+void   SMACINT SMACL_FreeRcu(SMACL_RcuHead *head);
+void   SMACINT SMACL_RcuBarrier(void);
+
+void*  SMACINT SMACL_AllocPerCpu(size_t s);
+void   SMACINT SMACL_FreePerCpu(void *p);
+void*  SMACINT SMACL_GetCpuPtr(void *p, unsigned long *flags);
+void   SMACINT SMACL_PutCpuPtr(unsigned long *flags);
+void*  SMACINT SMACL_PerCpuPtr(void *p, int cpu);
+int    SMACINT SMACL_NextCpu(int cpu);
+
+uint32 SMACINT SMACL_ReadGeneration(const uint32 *g);
+void   SMACINT SMACL_BumpGeneration(uint32 *g);
+
 
-struct sk_buff* SMACINT SMACL_DupPacket(struct sk_buff *skb);
-void*  SMACINT SMACL_PacketData(struct sk_buff *skb);
+struct sk_buff* SMACINT SMACL_ClonePacket(struct sk_buff *skb);
+int    SMACINT SMACL_CopyDataFromPkt(struct sk_buff *skb, int offset,
+                                     void *data, uint32 len);
+int    SMACINT SMACL_CopyDataToPkt(struct sk_buff *skb, int offset,
+                                   const void *data, uint32 len);
 int    SMACINT SMACL_IsSkbHostBound(struct sk_buff *skb);
 #ifdef DBG
 void   SMACINT SMACL_Print(const char *m, ...);
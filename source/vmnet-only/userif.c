@@ -23,58 +23,201 @@
 #define __KERNEL_SYSCALLS__
 
 #include <linux/file.h>
+#include <linux/anon_inodes.h>
 #include <linux/highmem.h>
+#include <linux/hrtimer.h>
 #include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/jhash.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 #include <linux/netdevice.h>
 #include <linux/etherdevice.h>
 #include <linux/mm.h>
 #include <linux/poll.h>
 #include <linux/proc_fs.h>
+#include <linux/random.h>
 #include <linux/sockios.h>
+#include <linux/tcp.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/version.h>
+#include <linux/vmalloc.h>
 #include <linux/wait.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+#include <linux/sched/mm.h>
+#endif
 #include <linux/taskstats_kern.h>  // For <linux/sched/signal.h> without version dependency
 
 #include <net/checksum.h>
+#include <net/ip.h>
 #include <net/sock.h>
 
 #include <asm/io.h>
 
 #include "vnetInt.h"
+#include "vnetTrace.h"
 #include "compat_skbuff.h"
 #include "vmnetInt.h"
 #include "vm_atomic.h"
 #include "vm_assert.h"
 
-typedef struct VNetUserIFStats {
-   unsigned    read;
-   unsigned    written;
-   unsigned    queued;
-   unsigned    droppedDown;
-   unsigned    droppedMismatch;
-   unsigned    droppedOverflow;
-   unsigned    droppedLargePacket;
-} VNetUserIFStats;
+enum {
+   USERIF_STAT_READ,
+   USERIF_STAT_READ_BYTES,
+   USERIF_STAT_WRITTEN,
+   USERIF_STAT_WRITTEN_BYTES,
+   USERIF_STAT_QUEUED,
+   USERIF_STAT_QUEUED_BYTES,
+   USERIF_STAT_DROPPED_DOWN,
+   USERIF_STAT_DROPPED_MISMATCH,
+   USERIF_STAT_DROPPED_OVERFLOW,
+   USERIF_STAT_DROPPED_LARGE_PACKET,
+   USERIF_STAT_READ_BATCHES,
+   USERIF_STAT_WRITTEN_BATCHES,
+   USERIF_STAT_WAKEUPS,
+   USERIF_STAT_DROPPED_BYTES,
+   USERIF_STAT_NUM
+};
+
+static const char * const vnetUserIfStatNames[USERIF_STAT_NUM] = {
+   "read", "read.bytes", "written", "written.bytes", "queued", "queued.bytes",
+   "dropped.down", "dropped.mismatch", "dropped.overflow",
+   "dropped.largePacket", "read.batches", "written.batches", "wakeups",
+   "dropped.bytes",
+};
+
+/*
+ * Instrumentation counters (vnet_instrument), see VNet_PortStats.  Each
+ * histogram is VNET_HIST_BUCKETS counters.
+ */
+
+enum {
+   USERIF_INSTR_FANOUT_NS,
+   USERIF_INSTR_READ_BATCH   = USERIF_INSTR_FANOUT_NS + VNET_HIST_BUCKETS,
+   USERIF_INSTR_WRITE_BATCH  = USERIF_INSTR_READ_BATCH + VNET_HIST_BUCKETS,
+   USERIF_INSTR_RX_ETYPE     = USERIF_INSTR_WRITE_BATCH + VNET_HIST_BUCKETS,
+   USERIF_INSTR_TX_ETYPE     = USERIF_INSTR_RX_ETYPE + VNET_ETYPE_NUM,
+   USERIF_INSTR_NUM          = USERIF_INSTR_TX_ETYPE + VNET_ETYPE_NUM
+};
+
+/*
+ * Per queue backlog limits and CoDel state (see SIOCSETQLIMITS).
+ * Protected by the lock of the queue it belongs to.
+ */
+
+typedef struct VNetUserIfBacklog {
+   uint32                 maxPackets;     // 0: vnet_max_qlen
+   uint32                 maxBytes;       // 0: no byte limit
+   uint32                 bytes;          // bytes queued
+   uint32                 highPackets;    // high watermarks
+   uint32                 highBytes;
+   s64                    codelTargetNs;  // 0: CoDel off
+   s64                    codelIntervalNs;
+   s64                    firstAboveTime;
+   s64                    dropNext;
+   uint32                 dropCount;
+   Bool                   dropping;
+   uint64                 codelDrops;
+   uint32                 portId;         // for tracing
+   uint32                 queueIndex;
+   uint64                 sojournNs[VNET_HIST_BUCKETS]; // if vnet_instrument
+} VNetUserIfBacklog;
+
+/* Queued frames remember when they were queued (CoDel, sojourn times). */
+typedef struct VNetUserIfSkbCb {
+   s64                    enqueueNs;
+} VNetUserIfSkbCb;
+
+#define VNET_USERIF_CB(skb) ((VNetUserIfSkbCb *)(skb)->cb)
+
+/* GSO packets a port with VNet_VirtioNetHdr can take unsegmented. */
+#if COMPAT_LINUX_VERSION_CHECK_LT(4, 6, 0)
+#define VNET_USERIF_GSO_TYPES (SKB_GSO_TCPV4 | SKB_GSO_TCPV6 | \
+                               SKB_GSO_TCP_ECN | SKB_GSO_DODGY)
+#else
+#define VNET_USERIF_GSO_TYPES (SKB_GSO_TCPV4 | SKB_GSO_TCPV6 | \
+                               SKB_GSO_TCP_ECN | SKB_GSO_DODGY | \
+                               SKB_GSO_TCP_FIXEDID)
+#endif
+
+/*
+ * Kernel side of a shared memory ring area registered with SIOCSETRING.
+ * rxProd and txCons are the authoritative copies of the driver owned
+ * indices; the ones in the shared header are only published to the user.
+ */
+
+typedef struct VNetUserIfRing {
+   VNet_RingHeader       *hdr;     // kernel mapping of the whole area
+   VNet_RingDesc         *rxDesc;
+   VNet_RingDesc         *txDesc;
+   uint8                 *rxData;
+   uint8                 *txData;
+   uint32                 numRxSlots;
+   uint32                 numTxSlots;
+   uint32                 slotSize;
+   uint32                 rxProd;   // published to the user
+   uint32                 rxReserved; // rxProd .. rxReserved being filled
+   Bool                  *rxFilled; // per RX slot, filled but unpublished
+   uint32                 txCons;
+   struct page          **pages;
+   unsigned               numPages;
+   struct mm_struct      *mm;      // charged for the pinned pages, or NULL
+   unsigned long          numLocked; // pages charged to mm
+} VNetUserIfRing;
+
+/*
+ * Extra receive queue 1 .. numQueues - 1 (see SIOCSETQUEUES).  It is
+ * referenced by the port and by its file descriptor; the port's
+ * reference is dropped when the port is freed or the slot is reused.
+ */
+
+typedef struct VNetUserIfQueue {
+   struct sk_buff_head    packetQueue;
+   VNetUserIfBacklog      backlog;  // protected by packetQueue.lock
+   wait_queue_head_t      waitQueue;
+   struct kref            kref;
+   Bool                   vnetHdr;  // prepend VNet_VirtioNetHdr to reads
+   Bool                   closed;   // descriptor closed, no more frames
+   Bool                   detached; // port gone, EOF once drained
+} VNetUserIfQueue;
 
 typedef struct VNetUserIF {
    VNetPort               port;
    struct sk_buff_head    packetQueue;
+   VNetUserIfBacklog      backlog;  // protected by packetQueue.lock
    Atomic_uint32         *pollPtr;
    uint32                 pollMask;
    uint32*                recvClusterCount;
    wait_queue_head_t      waitQueue;
    struct page*           pollPage;
    struct page*           recvClusterPage;
-   VNetUserIFStats        stats;
+   VNetStats              stats;   // USERIF_STAT_xxx
+   VNetStats              instr;   // USERIF_INSTR_xxx, if vnet_instrument
    VNetEvent_Sender      *eventSender;
+   VNetUserIfRing        *ring;    // protected by packetQueue.lock
+   struct mutex           ringMutex; // serializes ring setup and TX kicks
+   uint32                 coalesceFrames; // 0: use *recvClusterCount
+   uint32                 coalesceUs;     // 0: wake on every packet
+   struct hrtimer         wakeTimer;
+   uint32                 numQueues;      // 1: no receive side scaling
+   uint32                 rssSeed;
+   VNetUserIfQueue       *queues[VNET_MAX_QUEUES]; // RCU, [0] unused
+   struct mutex           queueMutex;     // serializes queues[] updates
+   VNet_QueueLimits       queueLimits;    // protected by queueMutex
+   Bool                   vnetHdr;        // SIOCSETVNETHDR, under ringMutex
 } VNetUserIF;
 
 static void VNetUserIfUnsetupNotify(VNetUserIF *userIf);
+static int  VNetUserIfUnsetupRing(VNetUserIF *userIf);
 static int  VNetUserIfSetupNotify(VNetUserIF *userIf, VNet_Notify *vn);
 static int  VNetUserIfSetUplinkState(VNetPort *port, uint8 linkUp);
+static int  VNetCopyFrameToUser(const struct sk_buff *skb, char *buf,
+                                size_t count, Bool vnetHdr);
+static void VNetUserIfFillVnetHdr(const struct sk_buff *skb,
+                                  VNet_VirtioNetHdr *hdr);
 extern unsigned int  vnet_max_qlen;
 
 #if COMPAT_LINUX_VERSION_CHECK_LT(3, 2, 0)
@@ -84,6 +227,9 @@ extern unsigned int  vnet_max_qlen;
 #if COMPAT_LINUX_VERSION_CHECK_LT(5, 4, 0)
 #   define skb_frag_off(frag) (frag)->page_offset
 #endif
+#if COMPAT_LINUX_VERSION_CHECK_LT(4, 11, 0)
+#   define mmgrab(mm) atomic_inc(&(mm)->mm_count)
+#endif
 
 /*
  *-----------------------------------------------------------------------------
@@ -301,315 +447,2049 @@ VNetUserIfUnsetupNotify(VNetUserIF *userIf) // IN
 /*
  *----------------------------------------------------------------------
  *
- * VNetUserIfFree --
+ * VNetUserIfAccountLockedVm --
  *
- *      Free the user interface port.
+ *      Charge pages pinned on behalf of a process to its locked_vm, or
+ *      uncharge them, like account_locked_vm does on newer kernels.
  *
- * Results: 
- *      None.
+ * Results:
+ *      0 on success, -ENOMEM if charging would exceed RLIMIT_MEMLOCK
+ *      and the process lacks CAP_IPC_LOCK.
  *
  * Side effects:
+ *      Updates mm->locked_vm.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VNetUserIfAccountLockedVm(struct mm_struct *mm,    // IN
+                          unsigned long numPages,  // IN
+                          Bool inc)                // IN: charge or uncharge
+{
+#if COMPAT_LINUX_VERSION_CHECK_LT(5, 2, 0)
+   unsigned long limit = rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT;
+   int retval = 0;
+
+   down_write(&mm->mmap_sem);
+   if (!inc) {
+      mm->locked_vm -= min(numPages, mm->locked_vm);
+   } else if (mm->locked_vm + numPages > limit && !capable(CAP_IPC_LOCK)) {
+      retval = -ENOMEM;
+   } else {
+      mm->locked_vm += numPages;
+   }
+   up_write(&mm->mmap_sem);
+   return retval;
+#else
+   return account_locked_vm(mm, numPages, inc);
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfRingFree --
+ *
+ *      Unmap and unpin a shared memory ring area, marking its pages
+ *      dirty.
+ *
+ * Results:
  *      None.
  *
+ * Side effects:
+ *      Frees ring.
+ *
  *----------------------------------------------------------------------
  */
 
 static void
-VNetUserIfFree(VNetJack *this) // IN
+VNetUserIfRingFree(VNetUserIfRing *ring) // IN
 {
-   VNetUserIF *userIf = (VNetUserIF*)this;
-   struct sk_buff *skb;
+   unsigned i;
 
-   for (;;) {
-      skb = skb_dequeue(&userIf->packetQueue);
-      if (skb == NULL) {
-	 break;
-      }
-      dev_kfree_skb(skb);
-   }
-   
-   if (userIf->pollPtr) {
-      VNetUserIfUnsetupNotify(userIf);
+   if (ring->hdr) {
+      vunmap(ring->hdr);
    }
-
-   if (userIf->eventSender) {
-      VNetEvent_DestroySender(userIf->eventSender);
+   for (i = 0; i < ring->numPages; i++) {
+      /* The driver wrote received frames and ring indices to the page. */
+      set_page_dirty_lock(ring->pages[i]);
+      put_page(ring->pages[i]);
    }
-
-   if (this->procEntry) {
-      VNetProc_RemoveEntry(this->procEntry);
+   if (ring->mm) {
+      VNetUserIfAccountLockedVm(ring->mm, ring->numLocked, FALSE);
+      mmdrop(ring->mm);
    }
-
-   kfree(userIf);
+   kfree(ring->rxFilled);
+   kfree(ring->pages);
+   kfree(ring);
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * VNetUserIfReceive --
+ * VNetUserIfUpdateGso --
  *
- *      This jack is receiving a packet. Take appropriate action.
+ *      Recompute which GSO packets the port takes unsegmented: TCP GSO
+ *      when the reader gets a VNet_VirtioNetHdr and no ring is active.
+ *      ringMutex must be held.
  *
- * Results: 
+ * Results:
  *      None.
  *
  * Side effects:
- *      Frees skb.
+ *      VNetSend starts or stops segmenting for this port.
  *
  *----------------------------------------------------------------------
  */
 
 static void
-VNetUserIfReceive(VNetJack       *this, // IN
-                  struct sk_buff *skb)  // IN
+VNetUserIfUpdateGso(VNetUserIF *userIf) // IN
 {
-   VNetUserIF *userIf = (VNetUserIF*)this->private;
-   uint8 *dest = SKB_2_DESTMAC(skb);
+   WRITE_ONCE(userIf->port.jack.gsoTypes,
+              userIf->vnetHdr && userIf->ring == NULL ?
+              VNET_USERIF_GSO_TYPES : 0);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * VNetUserIfSetupRing --
+ *
+ *    Pins the user area described by 'vr' and maps it contiguously into
+ *    the kernel, switching the port to ring mode.  The pinned pages are
+ *    charged against the caller's RLIMIT_MEMLOCK.
+ *
+ * Results:
+ *    0 on success
+ *    < 0 on failure: the actual value determines the type of failure
+ *
+ * Side effects:
+ *    Received packets are written to the ring instead of packetQueue.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+VNetUserIfSetupRing(VNetUserIF *userIf, // IN
+                    VNet_Ring *vr)      // IN
+{
+   VNetUserIfRing *ring;
    unsigned long flags;
+   uint64 size;
+   unsigned numPages;
+   uint8 *va;
+   int n;
+   int retval;
 
-   if (!UP_AND_RUNNING(userIf->port.flags)) {
-      userIf->stats.droppedDown++;
-      goto drop_packet;
+   if (vr->numRxSlots == 0 || vr->numRxSlots > VNET_RING_MAX_SLOTS ||
+       (vr->numRxSlots & (vr->numRxSlots - 1)) != 0 ||
+       vr->numTxSlots == 0 || vr->numTxSlots > VNET_RING_MAX_SLOTS ||
+       (vr->numTxSlots & (vr->numTxSlots - 1)) != 0 ||
+       vr->slotSize < ETHERNET_MTU || vr->slotSize > 65536 ||
+       (vr->slotSize & (VNET_RING_SLOT_ALIGN - 1)) != 0) {
+      return -EINVAL;
    }
 
-   if (!VNetPacketMatch(dest,
-                        userIf->port.paddr,
-                        (const uint8 *)userIf->port.exactFilter,
-                        userIf->port.exactFilterLen,
-                        userIf->port.ladrf,
-                        userIf->port.flags)) {
-      userIf->stats.droppedMismatch++;
-      goto drop_packet;
+   size = VNET_RING_AREA_SIZE(vr->numRxSlots, vr->numTxSlots, vr->slotSize);
+   if ((vr->addr & (PAGE_SIZE - 1)) != 0 || vr->len < size ||
+       size > VNET_RING_MAX_SIZE) {
+      return -EINVAL;
    }
+   numPages = PAGE_ALIGN(size) >> PAGE_SHIFT;
 
-   if (skb_queue_len(&userIf->packetQueue) >= vnet_max_qlen) {
-      userIf->stats.droppedOverflow++;
-      goto drop_packet;
+   ring = kzalloc(sizeof *ring, GFP_KERNEL);
+   if (!ring) {
+      return -ENOMEM;
+   }
+   ring->pages = kcalloc(numPages, sizeof *ring->pages, GFP_KERNEL);
+   ring->rxFilled = kcalloc(vr->numRxSlots, sizeof *ring->rxFilled,
+                            GFP_KERNEL);
+   if (!ring->pages || !ring->rxFilled) {
+      retval = -ENOMEM;
+      goto error_free;
    }
 
-   /*
-    * The check would be more accurate if based on the current MTU value
-    * of the corresponding vmnet interface. PR 2267716 is filed to track this.
-    */
-   if (skb->len > ETHER_MAX_JUMBO_FRAME_LEN) {
-      userIf->stats.droppedLargePacket++;
-      goto drop_packet;
+   retval = VNetUserIfAccountLockedVm(current->mm, numPages, TRUE);
+   if (retval) {
+      goto error_free;
+   }
+   ring->mm = current->mm;
+   mmgrab(ring->mm);
+   ring->numLocked = numPages;
+
+   n = get_user_pages_fast(vr->addr, numPages, FOLL_WRITE, ring->pages);
+   if (n > 0) {
+      ring->numPages = n;
+   }
+   if (n != numPages) {
+      retval = n < 0 ? n : -EFAULT;
+      goto error_free;
    }
 
-   userIf->stats.queued++;
+   va = vmap(ring->pages, numPages, VM_MAP, PAGE_KERNEL);
+   if (!va) {
+      retval = -ENOMEM;
+      goto error_free;
+   }
 
+   ring->hdr = (VNet_RingHeader *)va;
+   ring->rxDesc = (VNet_RingDesc *)(va + VNET_RING_DESC_OFFSET);
+   ring->txDesc = ring->rxDesc + vr->numRxSlots;
+   ring->rxData = va + VNET_RING_DATA_OFFSET(vr->numRxSlots, vr->numTxSlots);
+   ring->txData = ring->rxData + (size_t)vr->numRxSlots * vr->slotSize;
+   ring->numRxSlots = vr->numRxSlots;
+   ring->numTxSlots = vr->numTxSlots;
+   ring->slotSize = vr->slotSize;
+   memset(ring->hdr, 0, sizeof *ring->hdr);
+
+   mutex_lock(&userIf->ringMutex);
    spin_lock_irqsave(&userIf->packetQueue.lock, flags);
-   /*
-    * __skb_dequeue_tail does not take any locks so must be used with
-    * appropriate locks held only.
-    */
-   __skb_queue_tail(&userIf->packetQueue, skb);
-   if (userIf->pollPtr) {
-      Atomic_Or(userIf->pollPtr, userIf->pollMask);
-#if 0
-      /* Potential optimization: avoid waking based on cluster size */
-      if (skb_queue_len(&userIf->packetQueue) >= (*userIf->recvClusterCount)) {
-         // TODO
-      }
-#endif
+   if (userIf->ring) {
+      spin_unlock_irqrestore(&userIf->packetQueue.lock, flags);
+      mutex_unlock(&userIf->ringMutex);
+      LOG(0, (KERN_DEBUG "vmnet: Ring already active\n"));
+      retval = -EBUSY;
+      goto error_free;
    }
+   userIf->ring = ring;
    spin_unlock_irqrestore(&userIf->packetQueue.lock, flags);
+   VNetUserIfUpdateGso(userIf);
+   mutex_unlock(&userIf->ringMutex);
+   return 0;
 
-   wake_up(&userIf->waitQueue);
-   return;
-   
- drop_packet:
-   dev_kfree_skb(skb);
+ error_free:
+   VNetUserIfRingFree(ring);
+   return retval;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * VNetUserIfProcRead --
+ * VNetUserIfUnsetupRing --
  *
- *      Callback for read operation on this userif entry in vnets proc fs.
+ *      Leave ring mode and release the shared memory area.
  *
- * Results: 
- *      Length of read operation.
+ * Results:
+ *      0 on success, -EINVAL if no ring was set up.
  *
  * Side effects:
- *      None.
+ *      Received packets go to packetQueue again.
  *
  *----------------------------------------------------------------------
  */
 
 static int
-VNetUserIfProcRead(char    *page,  // IN/OUT: buffer to write into
-                   char   **start, // OUT: 0 if file < 4k, else offset into
-                                   //      page
-                   off_t    off,   // IN: offset of read into the file
-                   int      count, // IN: maximum number of bytes to read
-                   int     *eof,   // OUT: TRUE if there is nothing more to
-                                   //      read
-                   void    *data)  // IN: client data - not used
+VNetUserIfUnsetupRing(VNetUserIF *userIf) // IN
 {
-   VNetUserIF *userIf = (VNetUserIF*)data; 
-   int len = 0;
-   
-   if (!userIf) {
-      return len;
-   }
-   
-   len += VNetPrintPort(&userIf->port, page+len);
-   
-   len += sprintf(page+len, "read %u written %u queued %u ",
-                  userIf->stats.read,
-                  userIf->stats.written,
-                  userIf->stats.queued);
-   
-   len += sprintf(page+len, 
-		  "dropped.down %u dropped.mismatch %u "
-		  "dropped.overflow %u dropped.largePacket %u",
-                  userIf->stats.droppedDown,
-                  userIf->stats.droppedMismatch,
-                  userIf->stats.droppedOverflow,
-		  userIf->stats.droppedLargePacket);
+   VNetUserIfRing *ring;
+   unsigned long flags;
 
-   len += sprintf(page+len, "\n");
-   
-   *start = 0;
-   *eof   = 1;
-   return len;
+   mutex_lock(&userIf->ringMutex);
+   spin_lock_irqsave(&userIf->packetQueue.lock, flags);
+   ring = userIf->ring;
+   userIf->ring = NULL;
+   spin_unlock_irqrestore(&userIf->packetQueue.lock, flags);
+   VNetUserIfUpdateGso(userIf);
+   mutex_unlock(&userIf->ringMutex);
+
+   if (!ring) {
+      return -EINVAL;
+   }
+   /* Receivers fill reserved slots outside the lock, under RCU. */
+   synchronize_rcu();
+   VNetUserIfRingFree(ring);
+   return 0;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * VNetCopyDatagram --
+ * VNetUserIfRingReserve --
  *
- *      Copy part of datagram to userspace.
+ *      Claim the next free RX slot for a packet, preceded by a
+ *      VNet_VirtioNetHdr if 'vnetHdr'.  packetQueue.lock must be held.
  *
- * Results: 
- *	zero    on success,
- *	-EFAULT if buffer is an invalid area
+ * Results:
+ *      0 and the slot index in 'prod' on success,
+ *      -EMSGSIZE if the packet does not fit in a slot,
+ *      -ENOBUFS if the ring is full.
  *
  * Side effects:
- *      Data copied to the buffer.
+ *      The slot must be filled and published.
  *
  *----------------------------------------------------------------------
  */
 
 static int
-VNetCopyDatagram(const struct sk_buff *skb,	// IN: skb to copy
-		 char *buf,			// OUT: where to copy data
-		 int len)			// IN: length
+VNetUserIfRingReserve(VNetUserIfRing *ring,      // IN
+                      const struct sk_buff *skb, // IN
+                      Bool vnetHdr,              // IN: prepend header
+                      uint32 *prod)              // OUT: free running index
 {
-   struct iovec iov = {
-      .iov_base = buf,
-      .iov_len  = len,
-   };
-#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 19, 0)
-   return skb_copy_datagram_iovec(skb, 0, &iov, len);
-#else
-   struct iov_iter ioviter;
+   size_t hdrLen = vnetHdr ? sizeof (VNet_VirtioNetHdr) : 0;
 
-   iov_iter_init(&ioviter, READ, &iov, 1, len);
-   return skb_copy_datagram_iter(skb, 0, &ioviter, len);
-#endif
+   if (hdrLen + skb->len > ring->slotSize) {
+      return -EMSGSIZE;
+   }
+   if (ring->rxReserved - READ_ONCE(ring->hdr->rxCons) >= ring->numRxSlots) {
+      return -ENOBUFS;
+   }
+   /* Do not overwrite the slot until the user is done reading it. */
+   smp_mb();
+
+   *prod = ring->rxReserved++;
+   return 0;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * VNetCsumCopyDatagram --
+ * VNetUserIfRingFill --
  *
- *      Copy part of datagram to userspace doing checksum at same time.
+ *      Copy a packet into a reserved RX slot.  With 'vnetHdr' the slot
+ *      starts with a VNet_VirtioNetHdr and a partial checksum is left to
+ *      the reader; otherwise it is filled in while copying.  Runs without
+ *      packetQueue.lock, as the slot is owned by the caller until it is
+ *      published.
  *
- *	Do not mark this function INLINE, it is recursive! With all gcc's 
- *	released up to now (<= gcc-3.3.1) inlining this function just
- *	consumes 120 more bytes of code and goes completely mad on
- *	register allocation, storing almost everything in the memory.
+ * Results:
+ *      None.
  *
- * Results: 
- *	folded checksum (non-negative value) on success,
- *	-EINVAL if offset is too big,
- *	-EFAULT if buffer is an invalid area
+ * Side effects:
+ *      None, skb is still owned by the caller.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetUserIfRingFill(VNetUserIfRing *ring, // IN
+                   uint32 prod,          // IN: reserved slot
+                   struct sk_buff *skb,  // IN
+                   Bool vnetHdr)         // IN: prepend header
+{
+   size_t hdrLen = vnetHdr ? sizeof (VNet_VirtioNetHdr) : 0;
+   uint32 slot = prod & (ring->numRxSlots - 1);
+   uint8 *data = ring->rxData + (size_t)slot * ring->slotSize;
+
+   /* skb_copy_bits cannot fail, the slot was reserved for skb->len. */
+   if (vnetHdr) {
+      VNet_VirtioNetHdr hdr;
+
+      VNetUserIfFillVnetHdr(skb, &hdr);
+      memcpy(data, &hdr, sizeof hdr);
+      skb_copy_bits(skb, 0, data + sizeof hdr, skb->len);
+   } else if (skb->pkt_type == PACKET_OUTGOING &&
+              skb->ip_summed == VM_TX_CHECKSUM_PARTIAL) {
+      skb_copy_and_csum_dev(skb, data);
+   } else {
+      skb_copy_bits(skb, 0, data, skb->len);
+   }
+   ring->rxDesc[slot].len = hdrLen + skb->len;
+   ring->rxDesc[slot].flags = 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfRingPublish --
+ *
+ *      Mark a filled RX slot ready and publish every slot up to the
+ *      first one still being filled, so the user sees them in order.
+ *      packetQueue.lock must be held.
+ *
+ * Results:
+ *      None.
  *
  * Side effects:
- *      Data copied to the buffer.
+ *      Advances the shared rxProd.
  *
  *----------------------------------------------------------------------
  */
 
-static int
-VNetCsumCopyDatagram(const struct sk_buff *skb,	// IN: skb to copy
-		     unsigned int offset,	// IN: how many bytes skip
-		     char *buf)			// OUT: where to copy data
+static void
+VNetUserIfRingPublish(VNetUserIfRing *ring, // IN
+                      uint32 prod)          // IN: filled slot
 {
-   unsigned int csum;
-   int err = 0;
-   int len = skb_headlen(skb) - offset;
-   char *curr = buf;
-   const skb_frag_t *frag;
+   uint32 mask = ring->numRxSlots - 1;
 
-   /* 
-    * Something bad happened. We skip only up to skb->nh.raw, and skb->nh.raw
-    * must be in the header, otherwise we are in the big troubles.
-    */
-   if (len < 0) {
-      return -EINVAL;
+   ring->rxFilled[prod & mask] = TRUE;
+   if (prod != ring->rxProd) {
+      return;
    }
-
-   csum = csum_and_copy_to_user(skb->data + offset, curr, len, 0, &err);
-   if (err) {
-      return err;
+   while (ring->rxProd != ring->rxReserved &&
+          ring->rxFilled[ring->rxProd & mask]) {
+      ring->rxFilled[ring->rxProd & mask] = FALSE;
+      ring->rxProd++;
    }
-   curr += len;
 
-   for (frag = skb_shinfo(skb)->frags;
-	frag != skb_shinfo(skb)->frags + skb_shinfo(skb)->nr_frags;
+   smp_wmb();
+   WRITE_ONCE(ring->hdr->rxProd, ring->rxProd);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfCountBatch --
+ *
+ *      Count the number of frames moved by one read or write call in
+ *      the instrumentation histogram at 'base'.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE void
+VNetUserIfCountBatch(VNetUserIF *userIf, // IN
+                     unsigned base,      // IN: USERIF_INSTR_xxx_BATCH
+                     uint32 numFrames)   // IN
+{
+   if (userIf->instr.counters != NULL) {
+      VNetStats_Hist(&userIf->instr, base, numFrames);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfSend --
+ *
+ *      Send a frame written by the user to the network.  On an
+ *      instrumented port, count its EtherType and time how long the
+ *      delivery to the other ports takes.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Consumes skb.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetUserIfSend(VNetUserIF *userIf,   // IN
+               struct sk_buff *skb)  // IN
+{
+   s64 start;
+
+   if (userIf->instr.counters == NULL) {
+      VNetSend(&userIf->port.jack, skb);
+      return;
+   }
+
+   VNetStats_Inc(&userIf->instr,
+                 USERIF_INSTR_TX_ETYPE + VNetStats_EtherType(skb));
+   start = ktime_to_ns(ktime_get());
+   VNetSend(&userIf->port.jack, skb);
+   VNetStats_Hist(&userIf->instr, USERIF_INSTR_FANOUT_NS,
+                  ktime_to_ns(ktime_get()) - start);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfRingKick --
+ *
+ *      Send all frames the user has posted to the TX ring.
+ *
+ * Results:
+ *      Number of frames consumed on success, else -errno.
+ *
+ * Side effects:
+ *      Advances txCons.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VNetUserIfRingKick(VNetUserIF *userIf) // IN
+{
+   VNetUserIfRing *ring;
+   struct sk_buff *skb;
+   uint32 prod;
+   uint32 cons;
+   int consumed = 0;
+   int retval = 0;
+
+   mutex_lock(&userIf->ringMutex);
+   ring = userIf->ring;
+   if (!ring) {
+      mutex_unlock(&userIf->ringMutex);
+      return -EINVAL;
+   }
+
+   prod = READ_ONCE(ring->hdr->txProd);
+   cons = ring->txCons;
+   if (prod - cons > ring->numTxSlots) {
+      mutex_unlock(&userIf->ringMutex);
+      return -EINVAL;
+   }
+   smp_rmb();
+
+   while (cons != prod) {
+      uint32 slot = cons & (ring->numTxSlots - 1);
+      uint32 len = READ_ONCE(ring->txDesc[slot].len);
+
+      if (len < sizeof (struct ethhdr) || len > ring->slotSize ||
+          len > ETHER_MAX_JUMBO_FRAME_LEN) {
+         retval = -EINVAL;
+         break;
+      }
+
+      if (!UP_AND_RUNNING(userIf->port.flags)) {
+         VNetStats_Inc(&userIf->stats, USERIF_STAT_DROPPED_DOWN);
+      } else {
+         skb = dev_alloc_skb(len + 7);
+         if (skb == NULL) {
+            retval = -ENOBUFS;
+            break;
+         }
+         skb_reserve(skb, 2);
+         memcpy(skb_put(skb, len),
+                ring->txData + (size_t)slot * ring->slotSize, len);
+         VNetStats_Inc(&userIf->stats, USERIF_STAT_WRITTEN);
+         VNetStats_Add(&userIf->stats, USERIF_STAT_WRITTEN_BYTES, len);
+         VNetUserIfSend(userIf, skb);
+      }
+      cons++;
+      consumed++;
+   }
+
+   /* Slots may be reused by the user as soon as txCons moves. */
+   smp_mb();
+   ring->txCons = cons;
+   WRITE_ONCE(ring->hdr->txCons, cons);
+   mutex_unlock(&userIf->ringMutex);
+
+   if (consumed > 0) {
+      VNetUserIfCountBatch(userIf, USERIF_INSTR_WRITE_BATCH, consumed);
+   }
+
+   return consumed > 0 ? consumed : retval;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfWakeTimer --
+ *
+ *      Coalescing deadline expired, wake the reader.
+ *
+ * Results:
+ *      HRTIMER_NORESTART.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static enum hrtimer_restart
+VNetUserIfWakeTimer(struct hrtimer *timer) // IN
+{
+   VNetUserIF *userIf = container_of(timer, VNetUserIF, wakeTimer);
+
+   VNetStats_Inc(&userIf->stats, USERIF_STAT_WAKEUPS);
+   wake_up(&userIf->waitQueue);
+   return HRTIMER_NORESTART;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfShouldWake --
+ *
+ *      Decide whether a newly queued packet warrants waking the reader
+ *      now.  If not, make sure the coalescing timer is armed so that
+ *      the reader is woken by the deadline.
+ *      packetQueue.lock must be held.
+ *
+ * Results:
+ *      TRUE if the caller should wake the reader.
+ *
+ * Side effects:
+ *      May start or cancel wakeTimer.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+VNetUserIfShouldWake(VNetUserIF *userIf) // IN
+{
+   uint32 threshold;
+   uint32 pending;
+
+   if (userIf->coalesceUs == 0) {
+      return TRUE;
+   }
+
+   threshold = userIf->coalesceFrames;
+   if (threshold == 0 && userIf->recvClusterCount) {
+      threshold = READ_ONCE(*userIf->recvClusterCount);
+   }
+
+   if (userIf->ring) {
+      pending = userIf->ring->rxProd - READ_ONCE(userIf->ring->hdr->rxCons);
+   } else {
+      pending = skb_queue_len(&userIf->packetQueue);
+   }
+
+   if (pending >= threshold) {
+      hrtimer_try_to_cancel(&userIf->wakeTimer);
+      return TRUE;
+   }
+
+   if (!hrtimer_is_queued(&userIf->wakeTimer)) {
+      hrtimer_start(&userIf->wakeTimer,
+                    ns_to_ktime((u64)userIf->coalesceUs * NSEC_PER_USEC),
+                    HRTIMER_MODE_REL);
+   }
+   return FALSE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfBacklogSetLimits --
+ *
+ *      Apply VNet_QueueLimits to a backlog.  The queue lock must be held.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Resets the CoDel state and the high watermarks.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetUserIfBacklogSetLimits(VNetUserIfBacklog *bl,         // IN/OUT
+                           const VNet_QueueLimits *limits) // IN
+{
+   bl->maxPackets = limits->maxPackets;
+   bl->maxBytes = limits->maxBytes;
+   bl->codelTargetNs = (s64)limits->codelTargetUs * NSEC_PER_USEC;
+   bl->codelIntervalNs = (s64)(limits->codelIntervalUs ?
+                               limits->codelIntervalUs :
+                               VNET_QLIMITS_DEFAULT_INTERVAL_US) *
+                         NSEC_PER_USEC;
+   bl->firstAboveTime = 0;
+   bl->dropNext = 0;
+   bl->dropCount = 0;
+   bl->dropping = FALSE;
+   bl->highPackets = 0;
+   bl->highBytes = 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfBacklogEnqueue --
+ *
+ *      Queue a frame if the packet and byte limits allow it.  The queue
+ *      lock must be held.
+ *
+ * Results:
+ *      0 on success, -ENOBUFS if the packet limit is reached, -ENOSPC
+ *      if the byte limit is reached.
+ *
+ * Side effects:
+ *      Updates the high watermarks and stamps the frame for CoDel.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VNetUserIfBacklogEnqueue(VNetUserIfBacklog *bl,   // IN/OUT
+                         struct sk_buff_head *q,  // IN/OUT
+                         struct sk_buff *skb)     // IN
+{
+   uint32 maxPackets = bl->maxPackets ? bl->maxPackets : vnet_max_qlen;
+
+   if (skb_queue_len(q) >= maxPackets) {
+      return -ENOBUFS;
+   }
+   if (bl->maxBytes && bl->bytes + skb->len > bl->maxBytes) {
+      return -ENOSPC;
+   }
+
+   VNET_USERIF_CB(skb)->enqueueNs = ktime_to_ns(ktime_get());
+   __skb_queue_tail(q, skb);
+   bl->bytes += skb->len;
+
+   if (skb_queue_len(q) > bl->highPackets) {
+      bl->highPackets = skb_queue_len(q);
+   }
+   if (bl->bytes > bl->highBytes) {
+      bl->highBytes = bl->bytes;
+   }
+   return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfBacklogUnlink --
+ *
+ *      Remove a frame from the queue.  The queue lock must be held.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE void
+VNetUserIfBacklogUnlink(VNetUserIfBacklog *bl,  // IN/OUT
+                        struct sk_buff_head *q, // IN/OUT
+                        struct sk_buff *skb)    // IN
+{
+   __skb_unlink(skb, q);
+   bl->bytes -= skb->len;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfBacklogRequeue --
+ *
+ *      Put frames taken off the queue back at its head, in order.  The
+ *      queue lock must be held.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Empties 'frames'.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetUserIfBacklogRequeue(VNetUserIfBacklog *bl,       // IN/OUT
+                         struct sk_buff_head *q,      // IN/OUT
+                         struct sk_buff_head *frames) // IN/OUT
+{
+   struct sk_buff *skb;
+
+   skb_queue_walk(frames, skb) {
+      bl->bytes += skb->len;
+   }
+   skb_queue_splice_init(frames, q);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfCodelOkToDrop --
+ * VNetUserIfCodelControlLaw --
+ *
+ *      CoDel helpers (RFC 8289).  A frame may be dropped once the
+ *      sojourn time of the head frame has stayed above the target for
+ *      a whole interval.  While dropping, the drop rate increases with
+ *      the square root of the number of drops.
+ *
+ * Results:
+ *      Whether the head frame may be dropped; time of the next drop.
+ *
+ * Side effects:
+ *      VNetUserIfCodelOkToDrop updates firstAboveTime.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+VNetUserIfCodelOkToDrop(VNetUserIfBacklog *bl,     // IN/OUT
+                        const struct sk_buff *skb, // IN: head frame
+                        s64 now)                   // IN
+{
+   s64 sojourn = now - VNET_USERIF_CB(skb)->enqueueNs;
+
+   if (sojourn < bl->codelTargetNs || bl->bytes <= ETH_FRAME_LEN) {
+      bl->firstAboveTime = 0;
+      return FALSE;
+   }
+   if (bl->firstAboveTime == 0) {
+      bl->firstAboveTime = now + bl->codelIntervalNs;
+      return FALSE;
+   }
+   return now >= bl->firstAboveTime;
+}
+
+static INLINE s64
+VNetUserIfCodelControlLaw(const VNetUserIfBacklog *bl, // IN
+                          s64 t)                       // IN
+{
+   return t + div_u64(bl->codelIntervalNs, int_sqrt(bl->dropCount));
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfBacklogDropHead --
+ *
+ *      Move the head frame to the list of frames dropped by CoDel.
+ *      The queue lock must be held.
+ *
+ * Results:
+ *      The new head frame, or NULL.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static struct sk_buff *
+VNetUserIfBacklogDropHead(VNetUserIfBacklog *bl,        // IN/OUT
+                          struct sk_buff_head *q,       // IN/OUT
+                          struct sk_buff *skb,          // IN: head frame
+                          struct sk_buff_head *dropped) // IN/OUT
+{
+   VNetUserIfBacklogUnlink(bl, q, skb);
+   __skb_queue_tail(dropped, skb);
+   bl->codelDrops++;
+   return skb_peek(q);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfBacklogPeek --
+ *
+ *      Return the next frame to hand to the reader.  With CoDel
+ *      enabled, frames that waited too long are first dropped from the
+ *      head of the queue.  The queue lock must be held; the caller
+ *      frees 'dropped' after releasing it.
+ *
+ * Results:
+ *      The head frame, or NULL if the queue is empty.
+ *
+ * Side effects:
+ *      May move frames to 'dropped'.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static struct sk_buff *
+VNetUserIfBacklogPeek(VNetUserIfBacklog *bl,        // IN/OUT
+                      struct sk_buff_head *q,       // IN/OUT
+                      struct sk_buff_head *dropped) // IN/OUT
+{
+   struct sk_buff *skb = skb_peek(q);
+   Bool okToDrop;
+   s64 now;
+
+   if (bl->codelTargetNs == 0) {
+      return skb;
+   }
+   if (skb == NULL) {
+      bl->firstAboveTime = 0;
+      bl->dropping = FALSE;
+      return NULL;
+   }
+
+   now = ktime_to_ns(ktime_get());
+   okToDrop = VNetUserIfCodelOkToDrop(bl, skb, now);
+   if (bl->dropping) {
+      if (!okToDrop) {
+         bl->dropping = FALSE;
+      }
+      while (bl->dropping && now >= bl->dropNext) {
+         skb = VNetUserIfBacklogDropHead(bl, q, skb, dropped);
+         bl->dropCount++;
+         if (skb == NULL || !VNetUserIfCodelOkToDrop(bl, skb, now)) {
+            bl->dropping = FALSE;
+         } else {
+            bl->dropNext = VNetUserIfCodelControlLaw(bl, bl->dropNext);
+         }
+      }
+   } else if (okToDrop) {
+      skb = VNetUserIfBacklogDropHead(bl, q, skb, dropped);
+      bl->dropping = TRUE;
+      if (bl->dropCount > 2 &&
+          now - bl->dropNext < 16 * bl->codelIntervalNs) {
+         bl->dropCount -= 2;
+      } else {
+         bl->dropCount = 1;
+      }
+      bl->dropNext = VNetUserIfCodelControlLaw(bl, now);
+   }
+   return skb;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfBacklogSojourn --
+ *
+ *      Account for the time a frame handed to the reader spent in the
+ *      queue.  Only done with vnet_instrument set or the
+ *      vmnet_userif_dequeue tracepoint enabled.  The queue lock must
+ *      be held.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE void
+VNetUserIfBacklogSojourn(VNetUserIfBacklog *bl,     // IN/OUT
+                         const struct sk_buff *skb) // IN: dequeued frame
+{
+   s64 sojourn;
+
+   if (!vnet_instrument && !trace_vmnet_userif_dequeue_enabled()) {
+      return;
+   }
+   sojourn = ktime_to_ns(ktime_get()) - VNET_USERIF_CB(skb)->enqueueNs;
+   if (vnet_instrument) {
+      bl->sojournNs[VNetStats_HistBucket(sojourn)]++;
+   }
+   trace_vmnet_userif_dequeue(bl->portId, bl->queueIndex, skb->len, sojourn);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfBacklogPurge --
+ *
+ *      Drop all queued frames.  Takes the queue lock.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetUserIfBacklogPurge(VNetUserIfBacklog *bl,  // IN/OUT
+                       struct sk_buff_head *q) // IN/OUT
+{
+   struct sk_buff_head frames;
+   unsigned long flags;
+
+   __skb_queue_head_init(&frames);
+   spin_lock_irqsave(&q->lock, flags);
+   skb_queue_splice_init(q, &frames);
+   bl->bytes = 0;
+   spin_unlock_irqrestore(&q->lock, flags);
+   __skb_queue_purge(&frames);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfBacklogPrint --
+ *
+ *      Print backlog limits and statistics.  The queue lock must be held.
+ *
+ * Results:
+ *      Length of the write.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VNetUserIfBacklogPrint(const VNetUserIfBacklog *bl,  // IN
+                       const struct sk_buff_head *q, // IN
+                       char *buf)                    // OUT
+{
+   return sprintf(buf, "qlen %u qbytes %u hw.qlen %u hw.qbytes %u "
+                  "dropped.codel %llu ",
+                  skb_queue_len(q), bl->bytes, bl->highPackets,
+                  bl->highBytes, (unsigned long long)bl->codelDrops);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfFlowHash --
+ *
+ *      Hash the IPv4/IPv6 addresses and TCP/UDP ports of a frame.
+ *      Fragments and other protocols are hashed on addresses only, so
+ *      all frames of a flow land on the same queue.
+ *
+ * Results:
+ *      The flow hash, or 0 for non-IP frames.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static uint32
+VNetUserIfFlowHash(const struct sk_buff *skb, // IN
+                   uint32 seed)               // IN
+{
+   unsigned int offset = ETH_HLEN;
+   uint32 saddr, daddr, ports = 0;
+   __be16 proto;
+   uint8 l4proto;
+   const __be16 *protoPtr;
+   __be16 protoBuf;
+
+   protoPtr = skb_header_pointer(skb, offsetof(struct ethhdr, h_proto),
+                                 sizeof protoBuf, &protoBuf);
+   if (protoPtr == NULL) {
+      return 0;
+   }
+   proto = *protoPtr;
+   if (proto == htons(ETH_P_8021Q)) {
+      protoPtr = skb_header_pointer(skb, ETH_HLEN + 2, sizeof protoBuf,
+                                    &protoBuf);
+      if (protoPtr == NULL) {
+         return 0;
+      }
+      proto = *protoPtr;
+      offset += 4;
+   }
+
+   if (proto == htons(ETH_P_IP)) {
+      const struct iphdr *iph;
+      struct iphdr iphBuf;
+
+      iph = skb_header_pointer(skb, offset, sizeof iphBuf, &iphBuf);
+      if (iph == NULL || iph->ihl < 5) {
+         return 0;
+      }
+      saddr = (__force uint32)iph->saddr;
+      daddr = (__force uint32)iph->daddr;
+      l4proto = iph->protocol;
+      if (iph->frag_off & htons(IP_MF | IP_OFFSET)) {
+         l4proto = 0;
+      }
+      offset += iph->ihl * 4;
+   } else if (proto == htons(ETH_P_IPV6)) {
+      const struct ipv6hdr *ip6h;
+      struct ipv6hdr ip6hBuf;
+
+      ip6h = skb_header_pointer(skb, offset, sizeof ip6hBuf, &ip6hBuf);
+      if (ip6h == NULL) {
+         return 0;
+      }
+      saddr = (__force uint32)(ip6h->saddr.s6_addr32[0] ^
+                               ip6h->saddr.s6_addr32[1] ^
+                               ip6h->saddr.s6_addr32[2] ^
+                               ip6h->saddr.s6_addr32[3]);
+      daddr = (__force uint32)(ip6h->daddr.s6_addr32[0] ^
+                               ip6h->daddr.s6_addr32[1] ^
+                               ip6h->daddr.s6_addr32[2] ^
+                               ip6h->daddr.s6_addr32[3]);
+      l4proto = ip6h->nexthdr;
+      offset += sizeof *ip6h;
+   } else {
+      return 0;
+   }
+
+   if (l4proto == IPPROTO_TCP || l4proto == IPPROTO_UDP) {
+      const uint32 *portsPtr;
+      uint32 portsBuf;
+
+      /* Source and destination port are the first 4 bytes of both. */
+      portsPtr = skb_header_pointer(skb, offset, sizeof portsBuf, &portsBuf);
+      if (portsPtr != NULL) {
+         ports = *portsPtr;
+      }
+   }
+
+   return jhash_3words(saddr, daddr, ports, seed ^ l4proto) | 1;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfRssReceive --
+ *
+ *      Hand a frame to the extra receive queue selected by its flow
+ *      hash.  Called from VNetUserIfReceive, so under rcu_read_lock().
+ *
+ * Results:
+ *      TRUE if the frame was consumed (queued or dropped), FALSE if it
+ *      belongs on queue 0.
+ *
+ * Side effects:
+ *      May queue or free skb.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+VNetUserIfRssReceive(VNetUserIF *userIf,   // IN
+                     struct sk_buff *skb)  // IN
+{
+   VNetUserIfQueue *q;
+   unsigned long flags;
+   uint32 hash;
+   uint32 index;
+   int retval;
+
+   hash = VNetUserIfFlowHash(skb, userIf->rssSeed);
+   if (hash == 0) {
+      return FALSE;
+   }
+   index = ((uint64)hash * userIf->numQueues) >> 32;
+   if (index == 0) {
+      return FALSE;
+   }
+   q = rcu_dereference(userIf->queues[index]);
+   if (q == NULL) {
+      return FALSE;
+   }
+
+   spin_lock_irqsave(&q->packetQueue.lock, flags);
+   if (q->closed) {
+      spin_unlock_irqrestore(&q->packetQueue.lock, flags);
+      return FALSE;
+   }
+   retval = VNetUserIfBacklogEnqueue(&q->backlog, &q->packetQueue, skb);
+   spin_unlock_irqrestore(&q->packetQueue.lock, flags);
+   if (retval < 0) {
+      VNetStats_Inc(&userIf->stats, retval == -ENOSPC ?
+                                    USERIF_STAT_DROPPED_BYTES :
+                                    USERIF_STAT_DROPPED_OVERFLOW);
+      dev_kfree_skb(skb);
+      return TRUE;
+   }
+   VNetStats_Inc(&userIf->stats, USERIF_STAT_QUEUED);
+   VNetStats_Add(&userIf->stats, USERIF_STAT_QUEUED_BYTES, skb->len);
+
+   wake_up(&q->waitQueue);
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfQueueRelease --
+ *
+ *      Free an extra receive queue once the port and its file
+ *      descriptor both let go of it.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetUserIfQueueRelease(struct kref *kref) // IN
+{
+   VNetUserIfQueue *q = container_of(kref, VNetUserIfQueue, kref);
+
+   skb_queue_purge(&q->packetQueue);
+   kfree(q);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfQueueFileRead --
+ * VNetUserIfQueueFilePoll --
+ * VNetUserIfQueueFileClose --
+ *
+ *      File operations of an extra receive queue descriptor.  Reads
+ *      return one frame at a time like the port itself, -EMSGSIZE
+ *      without dequeuing it if the frame does not fit, and end of file
+ *      once the port is closed and the queue is drained.
+ *
+ * Results:
+ *      See read(2), poll(2) and close(2).
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static ssize_t
+VNetUserIfQueueFileRead(struct file *filp,  // IN
+                        char *buf,          // OUT
+                        size_t count,       // IN
+                        loff_t *ppos)       // IN: (unused)
+{
+   VNetUserIfQueue *q = filp->private_data;
+   Bool vnetHdr = READ_ONCE(q->vnetHdr);
+   size_t hdrLen = vnetHdr ? sizeof (VNet_VirtioNetHdr) : 0;
+   struct sk_buff_head dropped;
+   struct sk_buff *skb;
+   unsigned long flags;
+   int ret;
+
+   __skb_queue_head_init(&dropped);
+   for (;;) {
+      ret = 0;
+      spin_lock_irqsave(&q->packetQueue.lock, flags);
+      skb = VNetUserIfBacklogPeek(&q->backlog, &q->packetQueue, &dropped);
+      if (skb != NULL) {
+         if (hdrLen + skb->len > count) {
+            skb = NULL;
+            ret = -EMSGSIZE;
+         } else {
+            VNetUserIfBacklogUnlink(&q->backlog, &q->packetQueue, skb);
+            VNetUserIfBacklogSojourn(&q->backlog, skb);
+         }
+      }
+      spin_unlock_irqrestore(&q->packetQueue.lock, flags);
+      __skb_queue_purge(&dropped);
+      if (skb != NULL) {
+         break;
+      }
+      if (ret != 0) {
+         return ret;
+      }
+      if (READ_ONCE(q->detached)) {
+         return 0;
+      }
+      if (filp->f_flags & O_NONBLOCK) {
+         return -EAGAIN;
+      }
+      ret = wait_event_interruptible(q->waitQueue,
+                                     !skb_queue_empty(&q->packetQueue) ||
+                                     READ_ONCE(q->detached));
+      if (ret) {
+         return -EINTR;
+      }
+   }
+
+   ret = VNetCopyFrameToUser(skb, buf, count, vnetHdr);
+   dev_kfree_skb(skb);
+   return ret;
+}
+
+static unsigned int
+VNetUserIfQueueFilePoll(struct file *filp, // IN
+                        poll_table *wait)  // IN
+{
+   VNetUserIfQueue *q = filp->private_data;
+   unsigned int mask = 0;
+
+   poll_wait(filp, &q->waitQueue, wait);
+   if (!skb_queue_empty(&q->packetQueue)) {
+      mask |= POLLIN | POLLRDNORM;
+   }
+   if (READ_ONCE(q->detached)) {
+      mask |= POLLHUP;
+   }
+   return mask;
+}
+
+static int
+VNetUserIfQueueFileClose(struct inode *inode, // IN: (unused)
+                         struct file *filp)   // IN
+{
+   VNetUserIfQueue *q = filp->private_data;
+   unsigned long flags;
+
+   spin_lock_irqsave(&q->packetQueue.lock, flags);
+   q->closed = TRUE;
+   spin_unlock_irqrestore(&q->packetQueue.lock, flags);
+   skb_queue_purge(&q->packetQueue);
+
+   kref_put(&q->kref, VNetUserIfQueueRelease);
+   return 0;
+}
+
+static const struct file_operations vnetUserIfQueueFileOps = {
+   .owner = THIS_MODULE,
+   .read = VNetUserIfQueueFileRead,
+   .poll = VNetUserIfQueueFilePoll,
+   .release = VNetUserIfQueueFileClose,
+};
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfGetQueueFd --
+ *
+ *      Create an extra receive queue and return a file descriptor for
+ *      it.  A queue whose descriptor was closed may be opened again.
+ *
+ * Results:
+ *      File descriptor on success, negative errno on failure.
+ *
+ * Side effects:
+ *      Frames start flowing to the new queue.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VNetUserIfGetQueueFd(VNetUserIF *userIf, // IN
+                     uint32 index)       // IN: queue index
+{
+   VNetUserIfQueue *q;
+   VNetUserIfQueue *old;
+   int fd;
+
+   q = kzalloc(sizeof *q, GFP_KERNEL);
+   if (q == NULL) {
+      return -ENOMEM;
+   }
+   skb_queue_head_init(&q->packetQueue);
+   init_waitqueue_head(&q->waitQueue);
+   kref_init(&q->kref);   // reference from userIf->queues[]
+   kref_get(&q->kref);    // reference from the file
+
+   mutex_lock(&userIf->queueMutex);
+   if (index == 0 || index >= userIf->numQueues) {
+      fd = -EINVAL;
+      goto fail;
+   }
+   old = userIf->queues[index];
+   if (old != NULL && !READ_ONCE(old->closed)) {
+      fd = -EBUSY;
+      goto fail;
+   }
+   VNetUserIfBacklogSetLimits(&q->backlog, &userIf->queueLimits);
+   q->backlog.portId = userIf->port.id;
+   q->backlog.queueIndex = index;
+   q->vnetHdr = READ_ONCE(userIf->vnetHdr);
+   fd = anon_inode_getfd("[vmnet-queue]", &vnetUserIfQueueFileOps, q,
+                         O_RDONLY | O_CLOEXEC);
+   if (fd < 0) {
+      goto fail;
+   }
+   rcu_assign_pointer(userIf->queues[index], q);
+   mutex_unlock(&userIf->queueMutex);
+
+   if (old != NULL) {
+      synchronize_rcu();
+      kref_put(&old->kref, VNetUserIfQueueRelease);
+   }
+   return fd;
+
+fail:
+   mutex_unlock(&userIf->queueMutex);
+   kfree(q);
+   return fd;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfFreeQueues --
+ *
+ *      Detach all extra receive queues from a port that is going away.
+ *      Their descriptors see end of file.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Drops frames still queued.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetUserIfFreeQueues(VNetUserIF *userIf) // IN
+{
+   unsigned i;
+
+   for (i = 1; i < VNET_MAX_QUEUES; i++) {
+      VNetUserIfQueue *q = userIf->queues[i];
+      unsigned long flags;
+
+      if (q == NULL) {
+         continue;
+      }
+      userIf->queues[i] = NULL;
+
+      spin_lock_irqsave(&q->packetQueue.lock, flags);
+      q->detached = TRUE;
+      spin_unlock_irqrestore(&q->packetQueue.lock, flags);
+      skb_queue_purge(&q->packetQueue);
+      wake_up(&q->waitQueue);
+
+      kref_put(&q->kref, VNetUserIfQueueRelease);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfFree --
+ *
+ *      Free the user interface port.
+ *
+ * Results: 
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetUserIfFree(VNetJack *this) // IN
+{
+   VNetUserIF *userIf = (VNetUserIF*)this;
+   struct sk_buff *skb;
+
+   hrtimer_cancel(&userIf->wakeTimer);
+
+   for (;;) {
+      skb = skb_dequeue(&userIf->packetQueue);
+      if (skb == NULL) {
+	 break;
+      }
+      dev_kfree_skb(skb);
+   }
+   
+   if (userIf->pollPtr) {
+      VNetUserIfUnsetupNotify(userIf);
+   }
+
+   if (userIf->ring) {
+      VNetUserIfUnsetupRing(userIf);
+   }
+
+   VNetUserIfFreeQueues(userIf);
+
+   if (userIf->eventSender) {
+      VNetEvent_DestroySender(userIf->eventSender);
+   }
+
+   if (this->procEntry) {
+      VNetProc_RemoveEntry(this->procEntry);
+   }
+
+   VNetStats_Free(&userIf->instr);
+   VNetStats_Free(&userIf->stats);
+   kfree(userIf);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfReceive --
+ *
+ *      This jack is receiving a packet. Take appropriate action.
+ *
+ * Results: 
+ *      None.
+ *
+ * Side effects:
+ *      Frees skb.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetUserIfReceive(VNetJack       *this, // IN
+                  struct sk_buff *skb)  // IN
+{
+   VNetUserIF *userIf = (VNetUserIF*)this->private;
+   uint8 *dest = SKB_2_DESTMAC(skb);
+   VNetUserIfRing *ring;
+   unsigned long flags;
+   Bool vnetHdr = FALSE;
+   uint32 prod = 0;
+   Bool wake;
+   int retval;
+
+   /*
+    * A GSO packet is passed up whole only with a partial checksum the
+    * reader can complete per segment.  Others, e.g. LRO packets from a
+    * bridged NIC, are segmented here, which fills in their checksums.
+    */
+   if (skb_is_gso(skb) && skb->ip_summed != VM_TX_CHECKSUM_PARTIAL) {
+      VNetSendSegments(this, skb);
+      return;
+   }
+
+   if (!UP_AND_RUNNING(userIf->port.flags)) {
+      VNetStats_Inc(&userIf->stats, USERIF_STAT_DROPPED_DOWN);
+      goto drop_packet;
+   }
+
+   if (!VNetPortPacketMatch(&userIf->port, dest)) {
+      VNetStats_Inc(&userIf->stats, USERIF_STAT_DROPPED_MISMATCH);
+      goto drop_packet;
+   }
+
+   /*
+    * The check would be more accurate if based on the current MTU value
+    * of the corresponding vmnet interface. PR 2267716 is filed to track this.
+    */
+   if (skb->len > ETHER_MAX_JUMBO_FRAME_LEN && !skb_is_gso(skb)) {
+      VNetStats_Inc(&userIf->stats, USERIF_STAT_DROPPED_LARGE_PACKET);
+      goto drop_packet;
+   }
+
+   if (userIf->instr.counters != NULL) {
+      VNetStats_Inc(&userIf->instr,
+                    USERIF_INSTR_RX_ETYPE + VNetStats_EtherType(skb));
+   }
+
+   if (userIf->numQueues > 1 && VNetUserIfRssReceive(userIf, skb)) {
+      return;
+   }
+
+   spin_lock_irqsave(&userIf->packetQueue.lock, flags);
+   ring = userIf->ring;
+   if (ring) {
+      vnetHdr = READ_ONCE(userIf->vnetHdr);
+      retval = VNetUserIfRingReserve(ring, skb, vnetHdr, &prod);
+   } else {
+      retval = VNetUserIfBacklogEnqueue(&userIf->backlog,
+                                        &userIf->packetQueue, skb);
+   }
+   if (retval < 0) {
+      spin_unlock_irqrestore(&userIf->packetQueue.lock, flags);
+      if (retval == -EMSGSIZE) {
+         VNetStats_Inc(&userIf->stats, USERIF_STAT_DROPPED_LARGE_PACKET);
+      } else if (retval == -ENOSPC) {
+         VNetStats_Inc(&userIf->stats, USERIF_STAT_DROPPED_BYTES);
+      } else {
+         VNetStats_Inc(&userIf->stats, USERIF_STAT_DROPPED_OVERFLOW);
+      }
+      goto drop_packet;
+   }
+   if (ring) {
+      spin_unlock_irqrestore(&userIf->packetQueue.lock, flags);
+      VNetUserIfRingFill(ring, prod, skb, vnetHdr);
+      spin_lock_irqsave(&userIf->packetQueue.lock, flags);
+      VNetUserIfRingPublish(ring, prod);
+   }
+   VNetStats_Inc(&userIf->stats, USERIF_STAT_QUEUED);
+   VNetStats_Add(&userIf->stats, USERIF_STAT_QUEUED_BYTES, skb->len);
+   if (userIf->pollPtr) {
+      Atomic_Or(userIf->pollPtr, userIf->pollMask);
+   }
+   wake = VNetUserIfShouldWake(userIf);
+   spin_unlock_irqrestore(&userIf->packetQueue.lock, flags);
+
+   if (ring) {
+      dev_kfree_skb(skb);
+   }
+   if (wake) {
+      VNetStats_Inc(&userIf->stats, USERIF_STAT_WAKEUPS);
+      wake_up(&userIf->waitQueue);
+   }
+   return;
+   
+ drop_packet:
+   dev_kfree_skb(skb);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfProcRead --
+ *
+ *      Callback for read operation on this userif entry in vnets proc fs.
+ *
+ * Results: 
+ *      Length of read operation.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VNetUserIfProcRead(char    *page,  // IN/OUT: buffer to write into
+                   char   **start, // OUT: 0 if file < 4k, else offset into
+                                   //      page
+                   off_t    off,   // IN: offset of read into the file
+                   int      count, // IN: maximum number of bytes to read
+                   int     *eof,   // OUT: TRUE if there is nothing more to
+                                   //      read
+                   void    *data)  // IN: client data - not used
+{
+   VNetUserIF *userIf = (VNetUserIF*)data; 
+   unsigned long flags;
+   unsigned i;
+   int len = 0;
+   
+   if (!userIf) {
+      return len;
+   }
+   
+   len += VNetPrintPort(&userIf->port, page+len);
+   
+   len += sprintf(page+len, "read %llu written %llu queued %llu ",
+                  VNetStats_Read(&userIf->stats, USERIF_STAT_READ),
+                  VNetStats_Read(&userIf->stats, USERIF_STAT_WRITTEN),
+                  VNetStats_Read(&userIf->stats, USERIF_STAT_QUEUED));
+   
+   len += sprintf(page+len, 
+		  "dropped.down %llu dropped.mismatch %llu "
+		  "dropped.overflow %llu dropped.largePacket %llu ",
+                  VNetStats_Read(&userIf->stats, USERIF_STAT_DROPPED_DOWN),
+                  VNetStats_Read(&userIf->stats, USERIF_STAT_DROPPED_MISMATCH),
+                  VNetStats_Read(&userIf->stats, USERIF_STAT_DROPPED_OVERFLOW),
+		  VNetStats_Read(&userIf->stats,
+                                 USERIF_STAT_DROPPED_LARGE_PACKET));
+
+   len += sprintf(page+len, "dropped.bytes %llu ",
+                  VNetStats_Read(&userIf->stats, USERIF_STAT_DROPPED_BYTES));
+
+   len += sprintf(page+len, "read.batches %llu written.batches %llu ",
+                  VNetStats_Read(&userIf->stats, USERIF_STAT_READ_BATCHES),
+                  VNetStats_Read(&userIf->stats, USERIF_STAT_WRITTEN_BATCHES));
+
+   len += sprintf(page+len, "wakeups %llu coalesce.frames %u coalesce.usecs %u",
+                  VNetStats_Read(&userIf->stats, USERIF_STAT_WAKEUPS),
+                  userIf->coalesceFrames,
+                  userIf->coalesceUs);
+
+   len += sprintf(page+len, " queues %u ", userIf->numQueues);
+
+   spin_lock_irqsave(&userIf->packetQueue.lock, flags);
+   len += VNetUserIfBacklogPrint(&userIf->backlog, &userIf->packetQueue,
+                                 page+len);
+   spin_unlock_irqrestore(&userIf->packetQueue.lock, flags);
+
+   mutex_lock(&userIf->queueMutex);
+   for (i = 1; i < userIf->numQueues; i++) {
+      VNetUserIfQueue *q = userIf->queues[i];
+
+      if (q != NULL) {
+         len += sprintf(page+len, "q%u ", i);
+         spin_lock_irqsave(&q->packetQueue.lock, flags);
+         len += VNetUserIfBacklogPrint(&q->backlog, &q->packetQueue, page+len);
+         spin_unlock_irqrestore(&q->packetQueue.lock, flags);
+      }
+   }
+   mutex_unlock(&userIf->queueMutex);
+
+   len += sprintf(page+len, "\n");
+   
+   *start = 0;
+   *eof   = 1;
+   return len;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetCopyDatagram --
+ *
+ *      Copy part of datagram to userspace.
+ *
+ * Results: 
+ *	zero    on success,
+ *	-EFAULT if buffer is an invalid area
+ *
+ * Side effects:
+ *      Data copied to the buffer.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VNetCopyDatagram(const struct sk_buff *skb,	// IN: skb to copy
+		 char *buf,			// OUT: where to copy data
+		 int len)			// IN: length
+{
+   struct iovec iov = {
+      .iov_base = buf,
+      .iov_len  = len,
+   };
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 19, 0)
+   return skb_copy_datagram_iovec(skb, 0, &iov, len);
+#else
+   struct iov_iter ioviter;
+
+   iov_iter_init(&ioviter, READ, &iov, 1, len);
+   return skb_copy_datagram_iter(skb, 0, &ioviter, len);
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetCsumCopyDatagram --
+ *
+ *      Copy part of datagram to userspace doing checksum at same time.
+ *
+ *	Do not mark this function INLINE, it is recursive! With all gcc's 
+ *	released up to now (<= gcc-3.3.1) inlining this function just
+ *	consumes 120 more bytes of code and goes completely mad on
+ *	register allocation, storing almost everything in the memory.
+ *
+ * Results: 
+ *	folded checksum (non-negative value) on success,
+ *	-EINVAL if offset is too big,
+ *	-EFAULT if buffer is an invalid area
+ *
+ * Side effects:
+ *      Data copied to the buffer.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VNetCsumCopyDatagram(const struct sk_buff *skb,	// IN: skb to copy
+		     unsigned int offset,	// IN: how many bytes skip
+		     char *buf)			// OUT: where to copy data
+{
+   unsigned int csum;
+   int err = 0;
+   int len = skb_headlen(skb) - offset;
+   char *curr = buf;
+   const skb_frag_t *frag;
+
+   /* 
+    * Something bad happened. We skip only up to skb->nh.raw, and skb->nh.raw
+    * must be in the header, otherwise we are in the big troubles.
+    */
+   if (len < 0) {
+      return -EINVAL;
+   }
+
+   csum = csum_and_copy_to_user(skb->data + offset, curr, len, 0, &err);
+   if (err) {
+      return err;
+   }
+   curr += len;
+
+   for (frag = skb_shinfo(skb)->frags;
+	frag != skb_shinfo(skb)->frags + skb_shinfo(skb)->nr_frags;
 	frag++) {
       if (skb_frag_size(frag) > 0) {
 	 unsigned int tmpCsum;
 	 const void *vaddr;
 
-	 vaddr = kmap(skb_frag_page(frag));
-	 tmpCsum = csum_and_copy_to_user(vaddr + skb_frag_off(frag),
-					 curr, skb_frag_size(frag), 0, &err);
-	 kunmap(skb_frag_page(frag));
+	 vaddr = kmap(skb_frag_page(frag));
+	 tmpCsum = csum_and_copy_to_user(vaddr + skb_frag_off(frag),
+					 curr, skb_frag_size(frag), 0, &err);
+	 kunmap(skb_frag_page(frag));
+
+	 if (err) {
+	    return err;
+	 }
+	 csum = csum_block_add(csum, tmpCsum, curr - buf);
+	 curr += skb_frag_size(frag);
+      }
+   }
+
+   for (skb = skb_shinfo(skb)->frag_list; skb != NULL; skb = skb->next) {
+      int tmpCsum;
+
+      tmpCsum = VNetCsumCopyDatagram(skb, 0, curr);
+      if (tmpCsum < 0) {
+	 return tmpCsum;
+      }
+      /* Folded checksum must be inverted before we can use it */
+      csum = csum_block_add(csum, tmpCsum ^ 0xFFFF, curr - buf);
+      curr += skb->len;
+   }
+   return csum_fold(csum);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetCopyDatagramToUser --
+ *
+ *      Copy complete datagram to the user space. Fill correct checksum
+ *	into the copied datagram if nobody did it yet.
+ *
+ * Results: 
+ *      On success byte count, on failure -EFAULT.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE int
+VNetCopyDatagramToUser(const struct sk_buff *skb,	// IN
+		       char *buf,			// OUT
+		       size_t count)			// IN
+{
+   if (count > skb->len) {
+      count = skb->len;
+   }
+   /*
+    * If truncation occurs, we do not bother with checksumming - caller cannot
+    * verify checksum anyway in such case, and copy without checksum is
+    * faster.
+    */
+   if (skb->pkt_type == PACKET_OUTGOING && 	/* Packet must be outgoing */
+       skb->ip_summed == VM_TX_CHECKSUM_PARTIAL &&	/* Without checksum */
+       compat_skb_network_header_len(skb) &&    /* We must know where header is */
+       skb->len == count) {			/* No truncation may occur */
+      size_t skl;
+      int csum;
+      u_int16_t csum16;
+     
+      skl = compat_skb_csum_start(skb);
+      if (VNetCopyDatagram(skb, buf, skl)) {
+	 return -EFAULT;
+      }
+      csum = VNetCsumCopyDatagram(skb, skl, buf + skl);
+      if (csum < 0) {
+	 return csum;
+      }
+      csum16 = csum;
+      if (copy_to_user(buf + skl + compat_skb_csum_offset(skb),
+                       &csum16, sizeof csum16)) {
+	 return -EFAULT;
+      }
+   } else {
+      if (VNetCopyDatagram(skb, buf, count)) {
+	 return -EFAULT;
+      }
+   }
+   return count;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfFillVnetHdr --
+ *
+ *      Describe the GSO and checksum state of a frame for the reader.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetUserIfFillVnetHdr(const struct sk_buff *skb, // IN
+                      VNet_VirtioNetHdr *hdr)    // OUT
+{
+   memset(hdr, 0, sizeof *hdr);
+
+   if (skb_is_gso(skb)) {
+      const struct skb_shared_info *sinfo = skb_shinfo(skb);
+
+      /* Only VNET_USERIF_GSO_TYPES get here unsegmented. */
+      hdr->gsoType = (sinfo->gso_type & SKB_GSO_TCPV4) ? VNET_HDR_GSO_TCPV4 :
+                                                         VNET_HDR_GSO_TCPV6;
+      if (sinfo->gso_type & SKB_GSO_TCP_ECN) {
+         hdr->gsoType |= VNET_HDR_GSO_ECN;
+      }
+      hdr->gsoSize = sinfo->gso_size;
+      hdr->hdrLen = compat_skb_transport_offset(skb) + tcp_hdrlen(skb);
+   }
+
+   if (skb->ip_summed == VM_TX_CHECKSUM_PARTIAL) {
+      hdr->flags = VNET_HDR_F_NEEDS_CSUM;
+      hdr->csumStart = compat_skb_csum_start(skb);
+      hdr->csumOffset = compat_skb_csum_offset(skb);
+   } else if (skb->ip_summed == CHECKSUM_UNNECESSARY && !skb_is_gso(skb)) {
+      /* Validated by the NIC or the stack that handed us the frame. */
+      hdr->flags = VNET_HDR_F_DATA_VALID;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetCopyFrameToUser --
+ *
+ *      Copy a frame to the user space, preceded by a VNet_VirtioNetHdr
+ *      if the reader asked for one.  With the header, checksums are
+ *      left to the reader.
+ *
+ * Results: 
+ *      On success byte count including the header, on failure -errno.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VNetCopyFrameToUser(const struct sk_buff *skb, // IN
+                    char *buf,                 // OUT
+                    size_t count,              // IN
+                    Bool vnetHdr)              // IN: prepend header
+{
+   VNet_VirtioNetHdr hdr;
 
-	 if (err) {
-	    return err;
-	 }
-	 csum = csum_block_add(csum, tmpCsum, curr - buf);
-	 curr += skb_frag_size(frag);
-      }
+   if (!vnetHdr) {
+      return VNetCopyDatagramToUser(skb, buf, count);
+   }
+   if (count < sizeof hdr) {
+      return -EMSGSIZE;
    }
 
-   for (skb = skb_shinfo(skb)->frag_list; skb != NULL; skb = skb->next) {
-      int tmpCsum;
+   VNetUserIfFillVnetHdr(skb, &hdr);
+   if (copy_to_user(buf, &hdr, sizeof hdr)) {
+      return -EFAULT;
+   }
+   count -= sizeof hdr;
+   if (count > skb->len) {
+      count = skb->len;
+   }
+   if (VNetCopyDatagram(skb, buf + sizeof hdr, count)) {
+      return -EFAULT;
+   }
+   return sizeof hdr + count;
+}
 
-      tmpCsum = VNetCsumCopyDatagram(skb, 0, curr);
-      if (tmpCsum < 0) {
-	 return tmpCsum;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfRead --
+ *
+ *      The virtual network's read file operation. Reads the next pending
+ *      packet for this network connection.
+ *
+ * Results: 
+ *      On success the len of the packet received,
+ *      else if no packet waiting and nonblocking 0,
+ *      else -errno.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int 
+VNetUserIfRead(VNetPort    *port, // IN
+               struct file *filp, // IN
+               char        *buf,  // OUT
+               size_t      count) // IN
+{
+   VNetUserIF *userIf = (VNetUserIF*)port->jack.private;
+   Bool vnetHdr = READ_ONCE(userIf->vnetHdr);
+   size_t hdrLen = vnetHdr ? sizeof (VNet_VirtioNetHdr) : 0;
+   struct sk_buff_head dropped;
+   struct sk_buff *skb;
+   int ret;
+   unsigned long flags;
+   DECLARE_WAITQUEUE(wait, current);
+
+   __skb_queue_head_init(&dropped);
+   add_wait_queue(&userIf->waitQueue, &wait);
+   for (;;) {
+      set_current_state(TASK_INTERRUPTIBLE);
+      ret = -EAGAIN;
+
+      spin_lock_irqsave(&userIf->packetQueue.lock, flags);
+      skb = VNetUserIfBacklogPeek(&userIf->backlog, &userIf->packetQueue,
+                                  &dropped);
+      if (skb == NULL) {
+         if (userIf->pollPtr) {
+            /* List empty */
+            Atomic_And(userIf->pollPtr, ~userIf->pollMask);
+         }
+      } else if (hdrLen + skb->len > count) {
+         skb = NULL;
+         ret = -EMSGSIZE;
+      } else {
+         VNetUserIfBacklogUnlink(&userIf->backlog, &userIf->packetQueue, skb);
+         VNetUserIfBacklogSojourn(&userIf->backlog, skb);
       }
-      /* Folded checksum must be inverted before we can use it */
-      csum = csum_block_add(csum, tmpCsum ^ 0xFFFF, curr - buf);
-      curr += skb->len;
+      spin_unlock_irqrestore(&userIf->packetQueue.lock, flags);
+      __skb_queue_purge(&dropped);
+
+      if (skb != NULL || ret == -EMSGSIZE || filp->f_flags & O_NONBLOCK) {
+         break;
+      }
+      ret = -EINTR;
+      if (signal_pending(current)) {
+         break;
+      }
+      schedule();
    }
-   return csum_fold(csum);
+   __set_current_state(TASK_RUNNING);
+   remove_wait_queue(&userIf->waitQueue, &wait);
+   if (! skb) {
+      return ret;
+   }
+
+   count = VNetCopyFrameToUser(skb, buf, count, vnetHdr);
+   dev_kfree_skb(skb);
+
+   if ((int)count >= 0) {
+      VNetStats_Inc(&userIf->stats, USERIF_STAT_READ);
+      VNetStats_Add(&userIf->stats, USERIF_STAT_READ_BYTES, count);
+      VNetUserIfCountBatch(userIf, USERIF_INSTR_READ_BATCH, 1);
+   }
+   return count;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * VNetCopyDatagramToUser --
+ * VNetUserIfWrite --
  *
- *      Copy complete datagram to the user space. Fill correct checksum
- *	into the copied datagram if nobody did it yet.
+ *      The virtual network's write file operation. Send the raw packet
+ *      to the network.
  *
  * Results: 
- *      On success byte count, on failure -EFAULT.
+ *      On success the count of bytes written else errno.
  *
  * Side effects:
  *      None.
@@ -617,61 +2497,221 @@ VNetCsumCopyDatagram(const struct sk_buff *skb,	// IN: skb to copy
  *----------------------------------------------------------------------
  */
 
-static INLINE_SINGLE_CALLER int
-VNetCopyDatagramToUser(const struct sk_buff *skb,	// IN
-		       char *buf,			// OUT
-		       size_t count)			// IN
+static int
+VNetUserIfWrite(VNetPort    *port, // IN
+                struct file *filp, // IN
+                const char  *buf,  // IN
+                size_t      count) // IN
 {
-   if (count > skb->len) {
-      count = skb->len;
+   VNetUserIF *userIf = (VNetUserIF*)port->jack.private;
+   struct sk_buff *skb;
+
+   /*
+    * Check size.
+    *
+    * Regarding the upper count limit the check would be more accurate
+    * if based on the current MTU value of the corresponding vmnet interface.
+    * PR 2267716 is filed to track this.
+    */
+   if (count < sizeof (struct ethhdr) ||
+       count > ETHER_MAX_JUMBO_FRAME_LEN) {
+      return -EINVAL;
    }
+
    /*
-    * If truncation occurs, we do not bother with checksumming - caller cannot
-    * verify checksum anyway in such case, and copy without checksum is
-    * faster.
+    * Required to enforce the downWhenAddrMismatch policy in the MAC
+    * layer. --hpreg
     */
-   if (skb->pkt_type == PACKET_OUTGOING && 	/* Packet must be outgoing */
-       skb->ip_summed == VM_TX_CHECKSUM_PARTIAL &&	/* Without checksum */
-       compat_skb_network_header_len(skb) &&    /* We must know where header is */
-       skb->len == count) {			/* No truncation may occur */
-      size_t skl;
-      int csum;
-      u_int16_t csum16;
-     
-      skl = compat_skb_csum_start(skb);
-      if (VNetCopyDatagram(skb, buf, skl)) {
-	 return -EFAULT;
+   if (!UP_AND_RUNNING(userIf->port.flags)) {
+      VNetStats_Inc(&userIf->stats, USERIF_STAT_DROPPED_DOWN);
+      return count;
+   }
+
+   /*
+    * Allocate an sk_buff.
+    */
+   
+   skb = dev_alloc_skb(count + 7);
+   if (skb == NULL) {
+      // XXX obey O_NONBLOCK?
+      return -ENOBUFS;
+   }
+   
+   skb_reserve(skb, 2);
+   
+   /*
+    * Copy the data and send it.
+    */
+   
+   if (copy_from_user(skb_put(skb, count), buf, count)) {
+      dev_kfree_skb(skb);
+      return -EFAULT;
+   }
+   VNetStats_Inc(&userIf->stats, USERIF_STAT_WRITTEN);
+   VNetStats_Add(&userIf->stats, USERIF_STAT_WRITTEN_BYTES, count);
+   
+   VNetUserIfSend(userIf, skb);
+   if (filp != NULL) {
+      /* Not called from VNetUserIfWriteBatch, which counts itself. */
+      VNetUserIfCountBatch(userIf, USERIF_INSTR_WRITE_BATCH, 1);
+   }
+
+   return count;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfReadBatch --
+ *
+ *      Read as many pending packets as fit into the user buffer
+ *      described by 'batch'.  The packets are pulled off the queue
+ *      under a single acquisition of the queue lock and copied out
+ *      afterwards.  Blocks until at least one packet is available
+ *      unless the file is non-blocking.  If copying out fails, the
+ *      packets not yet copied are put back at the head of the queue.
+ *
+ * Results:
+ *      0 on success, with numFrames and usedLen updated to the packets
+ *      copied out, -EMSGSIZE if the first pending packet does not fit,
+ *      else -errno.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VNetUserIfReadBatch(VNetUserIF  *userIf, // IN
+                    struct file *filp,   // IN
+                    VNet_Batch  *batch)  // IN/OUT
+{
+   struct sk_buff_head *q = &userIf->packetQueue;
+   struct sk_buff_head frames;
+   struct sk_buff_head dropped;
+   struct sk_buff *skb;
+   char *buf = (char *)(VA)batch->buf;
+   uint32 maxFrames = batch->numFrames;
+   uint32 numFrames = 0;
+   size_t used = 0;
+   Bool vnetHdr = READ_ONCE(userIf->vnetHdr);
+   size_t hdrLen = vnetHdr ? sizeof (VNet_VirtioNetHdr) : 0;
+   unsigned long flags;
+   int ret;
+   DECLARE_WAITQUEUE(wait, current);
+
+   if (maxFrames == 0 || maxFrames > VNET_BATCH_MAX_FRAMES) {
+      maxFrames = VNET_BATCH_MAX_FRAMES;
+   }
+   __skb_queue_head_init(&frames);
+   __skb_queue_head_init(&dropped);
+
+   add_wait_queue(&userIf->waitQueue, &wait);
+   for (;;) {
+      set_current_state(TASK_INTERRUPTIBLE);
+
+      spin_lock_irqsave(&q->lock, flags);
+      while (numFrames < maxFrames &&
+             (skb = VNetUserIfBacklogPeek(&userIf->backlog, q,
+                                          &dropped)) != NULL &&
+             used + VNET_BATCH_FRAME_SIZE(hdrLen + skb->len) <=
+             batch->bufLen) {
+         VNetUserIfBacklogUnlink(&userIf->backlog, q, skb);
+         VNetUserIfBacklogSojourn(&userIf->backlog, skb);
+         __skb_queue_tail(&frames, skb);
+         used += VNET_BATCH_FRAME_SIZE(hdrLen + skb->len);
+         numFrames++;
       }
-      csum = VNetCsumCopyDatagram(skb, skl, buf + skl);
-      if (csum < 0) {
-	 return csum;
+      skb = skb_peek(q);
+      if (userIf->pollPtr && !skb) {
+         /* List empty */
+         Atomic_And(userIf->pollPtr, ~userIf->pollMask);
       }
-      csum16 = csum;
-      if (copy_to_user(buf + skl + compat_skb_csum_offset(skb),
-                       &csum16, sizeof csum16)) {
-	 return -EFAULT;
+      spin_unlock_irqrestore(&q->lock, flags);
+      __skb_queue_purge(&dropped);
+
+      if (numFrames > 0) {
+         break;
       }
-   } else {
-      if (VNetCopyDatagram(skb, buf, count)) {
-	 return -EFAULT;
+      if (skb != NULL) {
+         ret = -EMSGSIZE;
+         break;
+      }
+      ret = -EAGAIN;
+      if (filp->f_flags & O_NONBLOCK) {
+         break;
+      }
+      ret = -EINTR;
+      if (signal_pending(current)) {
+         break;
       }
+      schedule();
    }
-   return count;
+   __set_current_state(TASK_RUNNING);
+   remove_wait_queue(&userIf->waitQueue, &wait);
+   if (numFrames == 0) {
+      return ret;
+   }
+
+   numFrames = 0;
+   used = 0;
+   while ((skb = skb_peek(&frames)) != NULL) {
+      VNet_BatchFrameHeader hdr;
+      int len;
+
+      len = VNetCopyFrameToUser(skb, buf + used + sizeof hdr,
+                                hdrLen + skb->len, vnetHdr);
+      if (len < 0) {
+         ret = len;
+         break;
+      }
+      hdr.len = len;
+      if (copy_to_user(buf + used, &hdr, sizeof hdr)) {
+         ret = -EFAULT;
+         break;
+      }
+      __skb_unlink(skb, &frames);
+      dev_kfree_skb(skb);
+      used += VNET_BATCH_FRAME_SIZE(len);
+      numFrames++;
+      VNetStats_Add(&userIf->stats, USERIF_STAT_READ_BYTES, len);
+   }
+
+   if (!skb_queue_empty(&frames)) {
+      spin_lock_irqsave(&q->lock, flags);
+      VNetUserIfBacklogRequeue(&userIf->backlog, q, &frames);
+      if (userIf->pollPtr) {
+         Atomic_Or(userIf->pollPtr, userIf->pollMask);
+      }
+      spin_unlock_irqrestore(&q->lock, flags);
+   }
+   if (numFrames == 0) {
+      return ret;
+   }
+
+   VNetStats_Add(&userIf->stats, USERIF_STAT_READ, numFrames);
+   VNetStats_Inc(&userIf->stats, USERIF_STAT_READ_BATCHES);
+   VNetUserIfCountBatch(userIf, USERIF_INSTR_READ_BATCH, numFrames);
+
+   batch->numFrames = numFrames;
+   batch->usedLen = used;
+   return 0;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * VNetUserIfRead --
+ * VNetUserIfWriteBatch --
  *
- *      The virtual network's read file operation. Reads the next pending
- *      packet for this network connection.
+ *      Send the packets packed in the user buffer described by 'batch'
+ *      to the network.
  *
- * Results: 
- *      On success the len of the packet received,
- *      else if no packet waiting and nonblocking 0,
- *      else -errno.
+ * Results:
+ *      0 if at least one packet was consumed, with numFrames and
+ *      usedLen updated, else -errno.
  *
  * Side effects:
  *      None.
@@ -679,76 +2719,67 @@ VNetCopyDatagramToUser(const struct sk_buff *skb,	// IN
  *----------------------------------------------------------------------
  */
 
-static int 
-VNetUserIfRead(VNetPort    *port, // IN
-               struct file *filp, // IN
-               char        *buf,  // OUT
-               size_t      count) // IN
+static int
+VNetUserIfWriteBatch(VNetUserIF *userIf, // IN
+                     VNet_Batch *batch)  // IN/OUT
 {
-   VNetUserIF *userIf = (VNetUserIF*)port->jack.private;
-   struct sk_buff *skb;
-   int ret;
-   unsigned long flags;
-   DECLARE_WAITQUEUE(wait, current);
+   const char *buf = (const char *)(VA)batch->buf;
+   uint32 numFrames = 0;
+   size_t used = 0;
+   int ret = 0;
 
-   add_wait_queue(&userIf->waitQueue, &wait);
-   for (;;) {
-      set_current_state(TASK_INTERRUPTIBLE);
-      skb = skb_peek(&userIf->packetQueue);
-      if (skb && (skb->len > count)) {
-         skb = NULL;
-         ret = -EMSGSIZE;
+   if (batch->numFrames > VNET_BATCH_MAX_FRAMES) {
+      return -EINVAL;
+   }
+
+   while (numFrames < batch->numFrames) {
+      VNet_BatchFrameHeader hdr;
+
+      if (batch->bufLen - used < sizeof hdr) {
+         ret = -EINVAL;
          break;
       }
-      ret = -EAGAIN;
-
-      spin_lock_irqsave(&userIf->packetQueue.lock, flags);
-      /*
-       * __skb_dequeue does not take any locks so must be used with
-       * appropriate locks held only.
-       */
-      skb = __skb_dequeue(&userIf->packetQueue);
-      if (userIf->pollPtr) {
-         if (!skb) {
-            /* List empty */
-            Atomic_And(userIf->pollPtr, ~userIf->pollMask);
-         }
+      if (copy_from_user(&hdr, buf + used, sizeof hdr)) {
+         ret = -EFAULT;
+         break;
       }
-      spin_unlock_irqrestore(&userIf->packetQueue.lock, flags);
-
-      if (skb != NULL || filp->f_flags & O_NONBLOCK) {
+      if (hdr.len > ETHER_MAX_JUMBO_FRAME_LEN ||
+          VNET_BATCH_FRAME_SIZE(hdr.len) > batch->bufLen - used) {
+         ret = -EINVAL;
          break;
       }
-      ret = -EINTR;
-      if (signal_pending(current)) {
+
+      ret = VNetUserIfWrite(&userIf->port, NULL, buf + used + sizeof hdr,
+                            hdr.len);
+      if (ret < 0) {
          break;
       }
-      schedule();
+      used += VNET_BATCH_FRAME_SIZE(hdr.len);
+      numFrames++;
    }
-   __set_current_state(TASK_RUNNING);
-   remove_wait_queue(&userIf->waitQueue, &wait);
-   if (! skb) {
+   if (numFrames == 0 && ret < 0) {
       return ret;
    }
 
-   userIf->stats.read++;
+   VNetStats_Inc(&userIf->stats, USERIF_STAT_WRITTEN_BATCHES);
+   VNetUserIfCountBatch(userIf, USERIF_INSTR_WRITE_BATCH, numFrames);
 
-   count = VNetCopyDatagramToUser(skb, buf, count);
-   dev_kfree_skb(skb);
-   return count;
+   batch->numFrames = numFrames;
+   batch->usedLen = used;
+   return 0;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * VNetUserIfWrite --
+ * VNetUserIfReadInstr --
  *
- *      The virtual network's write file operation. Send the raw packet
- *      to the network.
+ *      Sum 'num' instrumentation counters over all CPUs into a possibly
+ *      unaligned field of VNet_PortStats.
  *
- * Results: 
- *      On success the count of bytes written else errno.
+ * Results:
+ *      None.
  *
  * Side effects:
  *      None.
@@ -756,61 +2787,79 @@ VNetUserIfRead(VNetPort    *port, // IN
  *----------------------------------------------------------------------
  */
 
-static int
-VNetUserIfWrite(VNetPort    *port, // IN
-                struct file *filp, // IN
-                const char  *buf,  // IN
-                size_t      count) // IN
+static void
+VNetUserIfReadInstr(const VNetUserIF *userIf, // IN
+                    unsigned base,            // IN: USERIF_INSTR_xxx
+                    void *dst,                // OUT: num uint64s
+                    unsigned num)             // IN: <= VNET_HIST_BUCKETS
 {
-   VNetUserIF *userIf = (VNetUserIF*)port->jack.private;
-   struct sk_buff *skb;
+   uint64 sums[VNET_HIST_BUCKETS] = { 0 };
 
-   /*
-    * Check size.
-    *
-    * Regarding the upper count limit the check would be more accurate
-    * if based on the current MTU value of the corresponding vmnet interface.
-    * PR 2267716 is filed to track this.
-    */
-   if (count < sizeof (struct ethhdr) ||
-       count > ETHER_MAX_JUMBO_FRAME_LEN) {
-      return -EINVAL;
-   }
+   VNetStats_ReadRange(&userIf->instr, base, sums, num);
+   memcpy(dst, sums, num * sizeof sums[0]);
+}
 
-   /*
-    * Required to enforce the downWhenAddrMismatch policy in the MAC
-    * layer. --hpreg
-    */
-   if (!UP_AND_RUNNING(userIf->port.flags)) {
-      userIf->stats.droppedDown++;
-      return count;
-   }
 
-   /*
-    * Allocate an sk_buff.
-    */
-   
-   skb = dev_alloc_skb(count + 7);
-   if (skb == NULL) {
-      // XXX obey O_NONBLOCK?
-      return -ENOBUFS;
-   }
-   
-   skb_reserve(skb, 2);
-   
-   /*
-    * Copy the data and send it.
-    */
-   
-   userIf->stats.written++;
-   if (copy_from_user(skb_put(skb, count), buf, count)) {
-      dev_kfree_skb(skb);
-      return -EFAULT;
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetUserIfGetPortStats --
+ *
+ *      Take a snapshot of the instrumentation counters of the port and
+ *      of all its receive queues.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetUserIfGetPortStats(VNetUserIF *userIf,  // IN
+                       VNet_PortStats *ps)  // OUT: zeroed by the caller
+{
+   uint64 sums[VNET_HIST_BUCKETS];
+   unsigned long flags;
+   unsigned i;
+   unsigned j;
+
+   ps->enabled = userIf->instr.counters != NULL;
+   if (!ps->enabled) {
+      return;
    }
-   
-   VNetSend(&userIf->port.jack, skb);
 
-   return count;
+   /* ps is packed, so sum into an aligned array and copy. */
+   spin_lock_irqsave(&userIf->packetQueue.lock, flags);
+   memcpy(sums, userIf->backlog.sojournNs, sizeof sums);
+   spin_unlock_irqrestore(&userIf->packetQueue.lock, flags);
+   mutex_lock(&userIf->queueMutex);
+   for (i = 1; i < VNET_MAX_QUEUES; i++) {
+      VNetUserIfQueue *q = userIf->queues[i];
+
+      if (q != NULL) {
+         spin_lock_irqsave(&q->packetQueue.lock, flags);
+         for (j = 0; j < VNET_HIST_BUCKETS; j++) {
+            sums[j] += q->backlog.sojournNs[j];
+         }
+         spin_unlock_irqrestore(&q->packetQueue.lock, flags);
+      }
+   }
+   mutex_unlock(&userIf->queueMutex);
+   memcpy(ps->sojournNs, sums, sizeof sums);
+
+   VNetUserIfReadInstr(userIf, USERIF_INSTR_FANOUT_NS, ps->fanoutNs,
+                       VNET_HIST_BUCKETS);
+   VNetUserIfReadInstr(userIf, USERIF_INSTR_READ_BATCH, ps->readBatch,
+                       VNET_HIST_BUCKETS);
+   VNetUserIfReadInstr(userIf, USERIF_INSTR_WRITE_BATCH, ps->writeBatch,
+                       VNET_HIST_BUCKETS);
+   VNetUserIfReadInstr(userIf, USERIF_INSTR_RX_ETYPE, ps->rxEtherType,
+                       VNET_ETYPE_NUM);
+   VNetUserIfReadInstr(userIf, USERIF_INSTR_TX_ETYPE, ps->txEtherType,
+                       VNET_ETYPE_NUM);
 }
 
 
@@ -867,6 +2916,33 @@ VNetUserIfIoctl(VNetPort      *port,  // IN
 
       break;
    }
+   case SIOCREADBATCH:
+   case SIOCWRITEBATCH:
+   {
+      int retval;
+      VNet_Batch vb;
+
+      if (copy_from_user(&vb, (void *)ioarg, sizeof vb)) {
+         return -EFAULT;
+      }
+      if (vb.version != VNET_BATCH_VERSION) {
+         return -EINVAL;
+      }
+
+      if (iocmd == SIOCREADBATCH) {
+         retval = VNetUserIfReadBatch(userIf, filp, &vb);
+      } else {
+         retval = VNetUserIfWriteBatch(userIf, &vb);
+      }
+      if (retval < 0) {
+         return retval;
+      }
+
+      if (copy_to_user((void *)ioarg, &vb, sizeof vb)) {
+         return -EFAULT;
+      }
+      break;
+   }
    case SIOCUNSETNOTIFY:
       if (!userIf->pollPtr) {
          return -EINVAL;
@@ -874,6 +2950,168 @@ VNetUserIfIoctl(VNetPort      *port,  // IN
       VNetUserIfUnsetupNotify(userIf);
       break;
 
+   case SIOCSETRING:
+   {
+      VNet_Ring vr;
+
+      if (copy_from_user(&vr, (void *)ioarg, sizeof vr)) {
+         return -EFAULT;
+      }
+      if (vr.version != VNET_RING_VERSION) {
+         return -ENOTTY;
+      }
+      return VNetUserIfSetupRing(userIf, &vr);
+   }
+   case SIOCUNSETRING:
+      return VNetUserIfUnsetupRing(userIf);
+
+   case SIOCSETCOALESCE:
+   {
+      VNet_Coalesce vc;
+      unsigned long flags;
+
+      if (copy_from_user(&vc, (void *)ioarg, sizeof vc)) {
+         return -EFAULT;
+      }
+      if (vc.version != VNET_COALESCE_VERSION) {
+         return -ENOTTY;
+      }
+      if (vc.maxFrames > VNET_COALESCE_MAX_FRAMES ||
+          vc.timeoutUs > VNET_COALESCE_MAX_USECS) {
+         return -EINVAL;
+      }
+
+      spin_lock_irqsave(&userIf->packetQueue.lock, flags);
+      userIf->coalesceFrames = vc.maxFrames;
+      userIf->coalesceUs = vc.timeoutUs;
+      spin_unlock_irqrestore(&userIf->packetQueue.lock, flags);
+
+      /* Don't leave a reader waiting for a deadline that was just removed. */
+      if (vc.timeoutUs == 0) {
+         hrtimer_cancel(&userIf->wakeTimer);
+         wake_up(&userIf->waitQueue);
+      }
+      break;
+   }
+
+   case SIOCRINGKICK:
+      return VNetUserIfRingKick(userIf);
+
+   case SIOCSETQUEUES:
+   {
+      VNet_Queues vq;
+
+      if (copy_from_user(&vq, (void *)ioarg, sizeof vq)) {
+         return -EFAULT;
+      }
+      if (vq.version != VNET_QUEUES_VERSION) {
+         return -ENOTTY;
+      }
+      if (vq.numQueues == 0 || vq.numQueues > VNET_MAX_QUEUES) {
+         return -EINVAL;
+      }
+      mutex_lock(&userIf->queueMutex);
+      userIf->numQueues = vq.numQueues;
+      mutex_unlock(&userIf->queueMutex);
+      break;
+   }
+
+   case SIOCSETQLIMITS:
+   {
+      VNet_QueueLimits ql;
+      unsigned long flags;
+      unsigned i;
+
+      if (copy_from_user(&ql, (void *)ioarg, sizeof ql)) {
+         return -EFAULT;
+      }
+      if (ql.version != VNET_QLIMITS_VERSION) {
+         return -ENOTTY;
+      }
+      if (ql.maxPackets > VNET_QLIMITS_MAX_PACKETS ||
+          ql.codelTargetUs > VNET_QLIMITS_MAX_USECS ||
+          ql.codelIntervalUs > VNET_QLIMITS_MAX_USECS) {
+         return -EINVAL;
+      }
+
+      mutex_lock(&userIf->queueMutex);
+      userIf->queueLimits = ql;
+      spin_lock_irqsave(&userIf->packetQueue.lock, flags);
+      VNetUserIfBacklogSetLimits(&userIf->backlog, &ql);
+      spin_unlock_irqrestore(&userIf->packetQueue.lock, flags);
+      for (i = 1; i < VNET_MAX_QUEUES; i++) {
+         VNetUserIfQueue *q = userIf->queues[i];
+
+         if (q != NULL) {
+            spin_lock_irqsave(&q->packetQueue.lock, flags);
+            VNetUserIfBacklogSetLimits(&q->backlog, &ql);
+            spin_unlock_irqrestore(&q->packetQueue.lock, flags);
+         }
+      }
+      mutex_unlock(&userIf->queueMutex);
+      break;
+   }
+
+   case SIOCSETVNETHDR:
+   {
+      uint32 enable;
+      unsigned i;
+
+      if (get_user(enable, (uint32 *)ioarg)) {
+         return -EFAULT;
+      }
+
+      mutex_lock(&userIf->ringMutex);
+      WRITE_ONCE(userIf->vnetHdr, enable != 0);
+      VNetUserIfUpdateGso(userIf);
+      mutex_unlock(&userIf->ringMutex);
+
+      mutex_lock(&userIf->queueMutex);
+      for (i = 1; i < VNET_MAX_QUEUES; i++) {
+         if (userIf->queues[i] != NULL) {
+            WRITE_ONCE(userIf->queues[i]->vnetHdr, enable != 0);
+         }
+      }
+      mutex_unlock(&userIf->queueMutex);
+      break;
+   }
+
+   case SIOCGPORTSTATS:
+   {
+      VNet_PortStats *ps;
+      uint32 version;
+      int retval = 0;
+
+      if (get_user(version, (uint32 *)ioarg)) {
+         return -EFAULT;
+      }
+      if (version != VNET_PORTSTATS_VERSION) {
+         return -ENOTTY;
+      }
+
+      ps = kzalloc(sizeof *ps, GFP_KERNEL);
+      if (ps == NULL) {
+         return -ENOMEM;
+      }
+      ps->version = version;
+      VNetUserIfGetPortStats(userIf, ps);
+      if (copy_to_user((void *)ioarg, ps, sizeof *ps)) {
+         retval = -EFAULT;
+      }
+      kfree(ps);
+      return retval;
+   }
+
+   case SIOCGETQUEUEFD:
+   {
+      uint32 index;
+
+      if (get_user(index, (uint32 *)ioarg)) {
+         return -EFAULT;
+      }
+      return VNetUserIfGetQueueFd(userIf, index);
+   }
+
    case SIOCSIFFLAGS:
       /* 
        * Drain queue when interface is no longer active. We drain the queue to 
@@ -881,14 +3119,20 @@ VNetUserIfIoctl(VNetPort      *port,  // IN
        */
       
       if (!UP_AND_RUNNING(userIf->port.flags)) {
-         struct sk_buff *skb;
-         unsigned long flags;
          struct sk_buff_head *q = &userIf->packetQueue;
-         
-         while ((skb = skb_dequeue(q)) != NULL) {
-            dev_kfree_skb(skb);
+         unsigned long flags;
+         unsigned i;
+
+         VNetUserIfBacklogPurge(&userIf->backlog, q);
+         mutex_lock(&userIf->queueMutex);
+         for (i = 1; i < VNET_MAX_QUEUES; i++) {
+            if (userIf->queues[i] != NULL) {
+               VNetUserIfBacklogPurge(&userIf->queues[i]->backlog,
+                                      &userIf->queues[i]->packetQueue);
+            }
          }
-         
+         mutex_unlock(&userIf->queueMutex);
+
          spin_lock_irqsave(&q->lock, flags);
          if (userIf->pollPtr) {
             if (skb_queue_empty(q)) {
@@ -955,6 +3199,21 @@ VNetUserIfPoll(VNetPort     *port, // IN
       return POLLIN;
    }
 
+   if (userIf->ring) {
+      unsigned long flags;
+      Bool pending = FALSE;
+
+      spin_lock_irqsave(&userIf->packetQueue.lock, flags);
+      if (userIf->ring) {
+         pending = userIf->ring->rxProd !=
+                   READ_ONCE(userIf->ring->hdr->rxCons);
+      }
+      spin_unlock_irqrestore(&userIf->packetQueue.lock, flags);
+      if (pending) {
+         return POLLIN;
+      }
+   }
+
    return 0;
 }
 
@@ -1073,6 +3332,8 @@ VNetUserIf_Create(VNetPort **ret) // OUT
    userIf->port.jack.cycleDetect = NULL;
    userIf->port.jack.portsChanged = NULL;
    userIf->port.jack.isBridged = NULL;
+   userIf->port.jack.gsoTypes = 0;
+   userIf->vnetHdr = FALSE;
    userIf->pollPtr = NULL;
    userIf->recvClusterCount = NULL;
    userIf->pollPage = NULL;
@@ -1080,6 +3341,43 @@ VNetUserIf_Create(VNetPort **ret) // OUT
    userIf->pollMask = 0;
    userIf->port.exactFilterLen = 0;
    userIf->eventSender = NULL;
+   userIf->ring = NULL;
+   mutex_init(&userIf->ringMutex);
+   userIf->numQueues = 1;
+   get_random_bytes(&userIf->rssSeed, sizeof userIf->rssSeed);
+   memset(userIf->queues, 0, sizeof userIf->queues);
+   mutex_init(&userIf->queueMutex);
+   memset(&userIf->queueLimits, 0, sizeof userIf->queueLimits);
+   memset(&userIf->backlog, 0, sizeof userIf->backlog);
+   VNetUserIfBacklogSetLimits(&userIf->backlog, &userIf->queueLimits);
+   userIf->backlog.portId = userIf->port.id;
+   userIf->coalesceFrames = 0;
+   userIf->coalesceUs = 0;
+#if COMPAT_LINUX_VERSION_CHECK_LT(6, 13, 0)
+   hrtimer_init(&userIf->wakeTimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+   userIf->wakeTimer.function = VNetUserIfWakeTimer;
+#else
+   hrtimer_setup(&userIf->wakeTimer, VNetUserIfWakeTimer, CLOCK_MONOTONIC,
+                 HRTIMER_MODE_REL);
+#endif
+
+   retval = VNetStats_Alloc(&userIf->stats, vnetUserIfStatNames,
+                            USERIF_STAT_NUM);
+   if (retval) {
+      kfree(userIf);
+      return retval;
+   }
+
+   userIf->instr.counters = NULL;
+   if (vnet_instrument) {
+      /* Not registered, so the counters need no names. */
+      retval = VNetStats_Alloc(&userIf->instr, NULL, USERIF_INSTR_NUM);
+      if (retval) {
+         VNetStats_Free(&userIf->stats);
+         kfree(userIf);
+         return retval;
+      }
+   }
 
    /*
     * Make proc entry for this jack.
@@ -1092,6 +3390,8 @@ VNetUserIf_Create(VNetPort **ret) // OUT
       if (retval == -ENXIO) {
          userIf->port.jack.procEntry = NULL;
       } else {
+         VNetStats_Free(&userIf->instr);
+         VNetStats_Free(&userIf->stats);
          kfree(userIf);
          return retval;
       }
@@ -1102,6 +3402,7 @@ VNetUserIf_Create(VNetPort **ret) // OUT
     */
    
    userIf->port.flags = IFF_RUNNING;
+   userIf->port.devPromisc = FALSE;
 
    memset(userIf->port.paddr, 0, sizeof userIf->port.paddr);
    memset(userIf->port.ladrf, 0, sizeof userIf->port.ladrf);
@@ -1117,7 +3418,7 @@ VNetUserIf_Create(VNetPort **ret) // OUT
    skb_queue_head_init(&(userIf->packetQueue));
    init_waitqueue_head(&userIf->waitQueue);
 
-   memset(&userIf->stats, 0, sizeof userIf->stats);
+   VNetStats_Register(&userIf->stats, userIf->port.jack.name);
    
    *ret = &userIf->port;
    return 0;
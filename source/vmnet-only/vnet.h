@@ -87,6 +87,11 @@ typedef struct VNet_Bind {
 
 #if defined __linux__
 #define VNET_BRFLAG_FORCE_SMAC    0x00000001
+/*
+ * Hand GSO packets received on the bridged device to the vnet intact.
+ * They are segmented only on the way to ports that cannot take them.
+ */
+#define VNET_BRFLAG_GSO           0x00000002
 
 #pragma pack(push, 1)
 typedef struct VNet_BridgeParams {
@@ -96,6 +101,240 @@ typedef struct VNet_BridgeParams {
 #pragma pack(pop)
 
 #define SIOCSPEER3         _IOW(0x99, 0xE4, VNet_BridgeParams)
+
+/*
+ * Batched frame transfer.  The buffer at 'buf' holds a sequence of
+ * frames, each preceded by a VNet_BatchFrameHeader and padded so the
+ * next header is VNET_BATCH_ALIGN aligned.
+ *
+ * SIOCREADBATCH:  numFrames IN: max frames to read (0 means
+ *                 VNET_BATCH_MAX_FRAMES), OUT: frames read.
+ * SIOCWRITEBATCH: numFrames IN: frames in buf, OUT: frames sent.
+ *
+ * bufLen is the size of buf, usedLen returns the bytes consumed.
+ */
+
+#define VNET_BATCH_VERSION        1
+#define VNET_BATCH_MAX_FRAMES     64
+#define VNET_BATCH_ALIGN          4
+#define VNET_BATCH_FRAME_SIZE(len) \
+   (sizeof (VNet_BatchFrameHeader) + \
+    (((len) + VNET_BATCH_ALIGN - 1) & ~(VNET_BATCH_ALIGN - 1)))
+
+#pragma pack(push, 1)
+typedef struct VNet_BatchFrameHeader {
+   uint32 len;                     // frame length in bytes
+} VNet_BatchFrameHeader;
+
+typedef struct VNet_Batch {
+   uint32 version;                 // VNET_BATCH_VERSION
+   uint32 numFrames;
+   VA64   buf;                     // user VA of the frame buffer
+   uint32 bufLen;
+   uint32 usedLen;
+} VNet_Batch;
+#pragma pack(pop)
+
+#define SIOCREADBATCH      _IOWR(0x99, 0xE5, VNet_Batch)
+#define SIOCWRITEBATCH     _IOWR(0x99, 0xE6, VNet_Batch)
+
+/*
+ * Shared memory rings.  The user registers a page aligned area laid
+ * out as a VNet_RingHeader, numRxSlots RX descriptors, numTxSlots TX
+ * descriptors and then, starting at VNET_RING_DATA_OFFSET, the RX and
+ * TX slots of slotSize bytes each.  Descriptor and slot i belong
+ * together; indices are free running and wrap modulo the slot count.
+ *
+ * RX: the driver copies each received frame into slot rxProd, fills
+ *     in its descriptor and advances rxProd.  The user consumes frames
+ *     and advances rxCons.  If SIOCSETNOTIFY2 is active, pollMask is
+ *     ORed into the poll word whenever frames are produced; the user
+ *     must clear it and then recheck rxProd before going to sleep.
+ * TX: the user fills slots, advances txProd and issues SIOCRINGKICK.
+ *     The driver sends every posted frame and advances txCons.
+ */
+
+#define VNET_RING_VERSION         1
+#define VNET_RING_MAX_SLOTS       4096
+#define VNET_RING_MAX_SIZE        (64 << 20)
+#define VNET_RING_SLOT_ALIGN      64
+
+#pragma pack(push, 1)
+typedef struct VNet_Ring {
+   uint32 version;                 // VNET_RING_VERSION
+   uint32 numRxSlots;              // power of 2
+   uint32 numTxSlots;              // power of 2
+   uint32 slotSize;                // multiple of VNET_RING_SLOT_ALIGN
+   VA64   addr;                    // page aligned user VA of the area
+   uint64 len;                     // size of the area
+} VNet_Ring;
+
+typedef struct VNet_RingHeader {
+   uint32 rxProd;                  // written by driver
+   uint32 _pad0[15];
+   uint32 rxCons;                  // written by user
+   uint32 _pad1[15];
+   uint32 txProd;                  // written by user
+   uint32 _pad2[15];
+   uint32 txCons;                  // written by driver
+   uint32 _pad3[15];
+} VNet_RingHeader;
+
+typedef struct VNet_RingDesc {
+   uint32 len;                     // frame length in bytes
+   uint32 flags;                   // reserved, must be 0
+} VNet_RingDesc;
+#pragma pack(pop)
+
+#define VNET_RING_DESC_OFFSET     sizeof (VNet_RingHeader)
+#define VNET_RING_DATA_OFFSET(nRx, nTx) \
+   ((VNET_RING_DESC_OFFSET + ((nRx) + (nTx)) * sizeof (VNet_RingDesc) + \
+     VNET_RING_SLOT_ALIGN - 1) & ~(VNET_RING_SLOT_ALIGN - 1))
+#define VNET_RING_AREA_SIZE(nRx, nTx, slotSize) \
+   (VNET_RING_DATA_OFFSET(nRx, nTx) + ((nRx) + (nTx)) * (uint64)(slotSize))
+
+#define SIOCSETRING        _IOW(0x99, 0xE7, VNet_Ring)
+#define SIOCUNSETRING      _IO(0x99, 0xE8)
+#define SIOCRINGKICK       _IO(0x99, 0xE9)
+
+/*
+ * Receive wakeup coalescing.  When timeoutUs is non-zero, a reader is
+ * only woken once maxFrames packets are pending or timeoutUs has
+ * passed since the first packet was queued.  maxFrames of 0 means the
+ * count published through VNet_Notify.recvClusterPtr.  A timeoutUs of
+ * 0 wakes the reader for every packet.
+ */
+
+#define VNET_COALESCE_VERSION     1
+#define VNET_COALESCE_MAX_FRAMES  1024
+#define VNET_COALESCE_MAX_USECS   100000
+
+#pragma pack(push, 1)
+typedef struct VNet_Coalesce {
+   uint32 version;                 // VNET_COALESCE_VERSION
+   uint32 maxFrames;
+   uint32 timeoutUs;
+} VNet_Coalesce;
+#pragma pack(pop)
+
+#define SIOCSETCOALESCE    _IOW(0x99, 0xEA, VNet_Coalesce)
+
+/*
+ * Receive side scaling.  With numQueues > 1, received IPv4/IPv6 frames
+ * are spread over numQueues queues by a hash of their addresses and
+ * TCP/UDP ports.  Queue 0 is the port's own descriptor (or its ring).
+ * SIOCGETQUEUEFD takes a queue index 1 .. numQueues - 1 and returns a
+ * new read-only descriptor for that queue.  Non-IP frames, and frames
+ * hashing to a queue without an open descriptor, go to queue 0.
+ */
+
+#define VNET_QUEUES_VERSION  1
+#define VNET_MAX_QUEUES      16
+
+#pragma pack(push, 1)
+typedef struct VNet_Queues {
+   uint32 version;                 // VNET_QUEUES_VERSION
+   uint32 numQueues;
+} VNet_Queues;
+#pragma pack(pop)
+
+#define SIOCSETQUEUES      _IOW(0x99, 0xEB, VNet_Queues)
+#define SIOCGETQUEUEFD     _IOW(0x99, 0xEC, uint32)
+
+/*
+ * Receive backlog limits, applied to every receive queue of the port.
+ * maxPackets of 0 means the vnet_max_qlen module parameter, maxBytes
+ * of 0 means no byte limit.  A non-zero codelTargetUs enables CoDel
+ * (RFC 8289): once frames have waited longer than the target for a
+ * whole interval, frames are dropped from the head of the queue at an
+ * increasing rate until the delay falls below the target again.
+ * codelIntervalUs of 0 means VNET_QLIMITS_DEFAULT_INTERVAL_US.
+ */
+
+#define VNET_QLIMITS_VERSION              1
+#define VNET_QLIMITS_MAX_PACKETS          16384
+#define VNET_QLIMITS_MAX_USECS            10000000
+#define VNET_QLIMITS_DEFAULT_INTERVAL_US  100000
+
+#pragma pack(push, 1)
+typedef struct VNet_QueueLimits {
+   uint32 version;                 // VNET_QLIMITS_VERSION
+   uint32 maxPackets;
+   uint32 maxBytes;
+   uint32 codelTargetUs;
+   uint32 codelIntervalUs;
+} VNet_QueueLimits;
+#pragma pack(pop)
+
+#define SIOCSETQLIMITS     _IOW(0x99, 0xED, VNet_QueueLimits)
+
+/*
+ * Frame metadata header.  After SIOCSETVNETHDR with a non-zero
+ * argument, every frame read from the port (read, SIOCREADBATCH,
+ * extra RSS queues and the shared memory ring) starts with a
+ * VNet_VirtioNetHdr, laid out like struct virtio_net_hdr.  The port
+ * then receives frames whose checksum is left to be filled in
+ * (VNET_HDR_F_NEEDS_CSUM at csumStart + csumOffset) instead of having
+ * it computed while they are copied.  Without a ring it also receives
+ * TCP GSO frames of up to 64KB unsegmented, with gsoType/gsoSize/hdrLen
+ * describing them.  In a ring slot the header precedes the frame and
+ * the descriptor's len includes it.  Frames written to the port carry
+ * no header.
+ */
+
+#define VNET_HDR_F_NEEDS_CSUM     0x01
+#define VNET_HDR_F_DATA_VALID     0x02
+
+#define VNET_HDR_GSO_NONE         0x00
+#define VNET_HDR_GSO_TCPV4        0x01
+#define VNET_HDR_GSO_TCPV6        0x04
+#define VNET_HDR_GSO_ECN          0x80
+
+#pragma pack(push, 1)
+typedef struct VNet_VirtioNetHdr {
+   uint8  flags;                   // VNET_HDR_F_xxx
+   uint8  gsoType;                 // VNET_HDR_GSO_xxx
+   uint16 hdrLen;                  // bytes of headers to replicate
+   uint16 gsoSize;                 // payload bytes per segment
+   uint16 csumStart;
+   uint16 csumOffset;
+} VNet_VirtioNetHdr;
+#pragma pack(pop)
+
+#define SIOCSETVNETHDR     _IOW(0x99, 0xEE, uint32)
+
+/*
+ * Port instrumentation snapshot.  Only ports opened while the module
+ * parameter vnet_instrument is set collect it; 'enabled' tells whether
+ * this one does.  Histogram bucket 0 counts zero values and bucket i
+ * counts values in [2^(i-1), 2^i); the last bucket also takes anything
+ * larger.
+ */
+
+#define VNET_PORTSTATS_VERSION    1
+#define VNET_HIST_BUCKETS         32
+
+#define VNET_ETYPE_IPV4           0
+#define VNET_ETYPE_IPV6           1
+#define VNET_ETYPE_ARP            2
+#define VNET_ETYPE_VLAN           3
+#define VNET_ETYPE_OTHER          4
+#define VNET_ETYPE_NUM            5
+
+#pragma pack(push, 1)
+typedef struct VNet_PortStats {
+   uint32 version;                        // IN: VNET_PORTSTATS_VERSION
+   uint32 enabled;                        // OUT: port is instrumented
+   uint64 sojournNs[VNET_HIST_BUCKETS];   // time frames waited to be read
+   uint64 fanoutNs[VNET_HIST_BUCKETS];    // time to deliver written frames
+   uint64 readBatch[VNET_HIST_BUCKETS];   // frames per read call
+   uint64 writeBatch[VNET_HIST_BUCKETS];  // frames per write call or kick
+   uint64 rxEtherType[VNET_ETYPE_NUM];    // frames accepted by the port
+   uint64 txEtherType[VNET_ETYPE_NUM];    // frames written by the port
+} VNet_PortStats;
+#pragma pack(pop)
+
+#define SIOCGPORTSTATS     _IOWR(0x99, 0xEF, VNet_PortStats)
 #endif
 
 #ifdef __APPLE__
@@ -0,0 +1,1477 @@
+/*********************************************************
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation version 2 and no later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ *********************************************************/
+
+/*
+ * vnetFilter.c --
+ *
+ *    IPv4/IPv6 packet filter for bridged traffic, configured through
+ *    SIOCSFILTERRULES (see vnetFilter.h).
+ *
+ *    Rule sets are kept in the order their rules were added, and the
+ *    first matching rule decides.  Activating a rule set compiles it:
+ *    for each direction and address family, rules are grouped by IP
+ *    protocol, and for TCP and UDP further by local port into a table
+ *    of port intervals.  Each group lists, in rule order, only the rules
+ *    that can match a packet falling into it, so a packet is checked
+ *    against a handful of candidates instead of every rule.
+ *
+ *    The compiled rule set is published with RCU and used by the bridge
+ *    receive paths without locks.  Rule sets are changed under
+ *    vnetFilterMutex; any change to the active set recompiles it.
+ */
+
+#include "driver-config.h"
+
+#include <linux/kernel.h>
+#include <linux/bitmap.h>
+#include <linux/capability.h>
+#include <linux/if_ether.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/mutex.h>
+#include <linux/netdevice.h>
+#include <linux/proc_fs.h>
+#include <linux/rcupdate.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <net/ipv6.h>
+#include <asm/uaccess.h>
+#include "compat_version.h"
+
+#include "vnetInt.h"
+#include "vnetFilter.h"
+
+#define VNET_FILTER_MAX_RULE_SETS  32
+#define VNET_FILTER_MAX_RULES      1024   // per rule set, fits in uint16
+#define VNET_FILTER_MAX_LIST       256    // addresses or ports per rule
+#define VNET_FILTER_MAX_CMD_LEN    (sizeof (VNet_AddIPv6Rule) +              \
+                                    VNET_FILTER_MAX_LIST *                   \
+                                    (sizeof (VNet_IPv6Address) +             \
+                                     sizeof (VNet_IPv6Port)))
+
+/* Indices of the compiled tables. */
+#define VNET_FILTER_IN             0
+#define VNET_FILTER_OUT            1
+#define VNET_FILTER_IPV4           0
+#define VNET_FILTER_IPV6           1
+
+#define VNET_FILTER_PROTO_ANY      (-1)
+#define VNET_FILTER_ANY            (~0U)
+
+typedef struct VNetFilterAddr {
+   uint32         addr[4];        // network byte order, IPv4 in [0]
+   uint32         mask[4];
+} VNetFilterAddr;
+
+typedef struct VNetFilterPortRange {
+   uint16         localLow;
+   uint16         localHigh;
+   uint16         remoteLow;
+   uint16         remoteHigh;
+} VNetFilterPortRange;
+
+typedef struct VNetFilterRule {
+   uint32               action;     // VNET_FILTER_RULE_BLOCK or _ALLOW
+   uint32               direction;  // VNET_FILTER_DIRECTION_xxx
+   unsigned             family;     // VNET_FILTER_IPV4 or _IPV6
+   int                  proto;      // VNET_FILTER_PROTO_ANY or IP protocol
+   Bool                 anyPort;    // some port range covers all ports
+   uint32               numAddrs;
+   uint32               numPorts;
+   VNetFilterAddr      *addrs;      // allocated with the rule
+   VNetFilterPortRange *ports;
+} VNetFilterRule;
+
+/* A run of rule indices in VNetFilterProg.pool, in rule order. */
+typedef struct VNetFilterList {
+   uint32         off;
+   uint32         len;
+} VNetFilterList;
+
+typedef struct VNetFilterPortTable {
+   uint32          numIntervals;
+   uint16         *start;         // first local port of each interval
+   VNetFilterList *lists;         // candidate rules of each interval
+} VNetFilterPortTable;
+
+typedef struct VNetFilterTable {
+   VNetFilterList      byProto[256]; // TCP/UDP: rules ignoring ports only
+   VNetFilterPortTable byPort[2];    // TCP and UDP, by local port
+} VNetFilterTable;
+
+typedef struct VNetFilterProg {
+   uint32           defaultAction;
+   uint32           numRules;
+   VNetFilterRule **rules;
+   VNetFilterTable  tables[2][2];   // [VNET_FILTER_IN/OUT][VNET_FILTER_IPVx]
+   uint16          *pool;
+   uint32           poolLen;
+   uint32           poolSize;
+   VNetStats        hits;           // per rule, default action last
+} VNetFilterProg;
+
+typedef struct VNetFilterRuleSet {
+   struct list_head links;
+   uint32           id;
+   uint32           defaultAction;
+   uint32           numRules;
+   uint32           maxRules;
+   VNetFilterRule **rules;
+   uint64          *hits;           // hits folded in from retired programs
+   uint64           defaultHits;
+} VNetFilterRuleSet;
+
+typedef struct VNetFilterPacket {
+   unsigned         family;
+   uint8            proto;
+   Bool             hasPorts;       // FALSE for non-first fragments
+   uint16           localPort;
+   uint16           remotePort;
+   uint32           remote[4];      // as VNetFilterAddr.addr
+} VNetFilterPacket;
+
+static DEFINE_MUTEX(vnetFilterMutex);      // protects everything below
+static LIST_HEAD(vnetFilterRuleSets);
+static unsigned vnetFilterNumRuleSets;
+static VNetFilterRuleSet *vnetFilterActiveSet;
+static VNetFilterProg *vnetFilterProg;     // compiled active set, RCU
+static uint32 vnetFilterLogLevel;
+static VNetProcEntry *vnetFilterProcEntry;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetFilterIsPortProto --
+ *
+ *      Check whether port ranges apply to an IP protocol.
+ *
+ * Results:
+ *      TRUE for TCP and UDP.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static INLINE Bool
+VNetFilterIsPortProto(int proto) // IN
+{
+   return proto == IPPROTO_TCP || proto == IPPROTO_UDP;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetFilterRuleApplies --
+ *
+ *      Check whether a rule belongs to the table of a direction and
+ *      address family.
+ *
+ * Results:
+ *      TRUE if it does.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+VNetFilterRuleApplies(const VNetFilterRule *rule, // IN
+                      unsigned dir,               // IN: VNET_FILTER_IN/OUT
+                      unsigned family)            // IN: VNET_FILTER_IPVx
+{
+   if (rule->family != family) {
+      return FALSE;
+   }
+   return rule->direction == VNET_FILTER_DIRECTION_BOTH ||
+          rule->direction == (dir == VNET_FILTER_IN ?
+                              VNET_FILTER_DIRECTION_IN :
+                              VNET_FILTER_DIRECTION_OUT);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetFilterLocalPortMatch --
+ *
+ *      Check whether a rule can match a TCP or UDP packet with the
+ *      given local port.
+ *
+ * Results:
+ *      TRUE if it can.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+VNetFilterLocalPortMatch(const VNetFilterRule *rule, // IN
+                         int port)                   // IN: -1 if unknown
+{
+   uint32 i;
+
+   if (rule->anyPort) {
+      return TRUE;
+   }
+   if (port < 0) {
+      return FALSE;
+   }
+   for (i = 0; i < rule->numPorts; i++) {
+      if (port >= rule->ports[i].localLow && port <= rule->ports[i].localHigh) {
+         return TRUE;
+      }
+   }
+   return FALSE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetFilterRuleMatch --
+ *
+ *      Check a packet against a candidate rule.  The protocol and
+ *      direction have already been matched by the compiled tables.
+ *
+ * Results:
+ *      TRUE if the rule matches.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+VNetFilterRuleMatch(const VNetFilterRule *rule,  // IN
+                    const VNetFilterPacket *pkt) // IN
+{
+   uint32 i;
+
+   for (i = 0; i < rule->numAddrs; i++) {
+      const VNetFilterAddr *a = &rule->addrs[i];
+
+      if ((pkt->remote[0] & a->mask[0]) == a->addr[0] &&
+          (pkt->remote[1] & a->mask[1]) == a->addr[1] &&
+          (pkt->remote[2] & a->mask[2]) == a->addr[2] &&
+          (pkt->remote[3] & a->mask[3]) == a->addr[3]) {
+         break;
+      }
+   }
+   if (i == rule->numAddrs) {
+      return FALSE;
+   }
+
+   if (!VNetFilterIsPortProto(pkt->proto) || rule->anyPort) {
+      return TRUE;
+   }
+   if (!pkt->hasPorts) {
+      return FALSE;
+   }
+   for (i = 0; i < rule->numPorts; i++) {
+      const VNetFilterPortRange *p = &rule->ports[i];
+
+      if (pkt->localPort >= p->localLow && pkt->localPort <= p->localHigh &&
+          pkt->remotePort >= p->remoteLow && pkt->remotePort <= p->remoteHigh) {
+         return TRUE;
+      }
+   }
+   return FALSE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetFilterBuildList --
+ *
+ *      Append to the program's pool, in rule order, the rules of a
+ *      table that can match packets of protocol 'proto' (only rules
+ *      for any protocol if VNET_FILTER_PROTO_ANY) with local port
+ *      'port'.  If the result equals 'prev', the pool space is given
+ *      back and 'prev' is reused.
+ *
+ * Results:
+ *      0 on success, -ENOMEM on failure.
+ *
+ * Side effects:
+ *      May grow the pool.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VNetFilterBuildList(VNetFilterProg *prog,       // IN/OUT
+                    unsigned dir,               // IN
+                    unsigned family,            // IN
+                    int proto,                  // IN
+                    int port,                   // IN: -1 if unknown
+                    const VNetFilterList *prev, // IN: or NULL
+                    VNetFilterList *list)       // OUT
+{
+   uint32 i;
+
+   list->off = prog->poolLen;
+   for (i = 0; i < prog->numRules; i++) {
+      const VNetFilterRule *rule = prog->rules[i];
+
+      if (!VNetFilterRuleApplies(rule, dir, family) ||
+          (rule->proto != VNET_FILTER_PROTO_ANY && rule->proto != proto) ||
+          (VNetFilterIsPortProto(proto) &&
+           !VNetFilterLocalPortMatch(rule, port))) {
+         continue;
+      }
+      if (prog->poolLen == prog->poolSize) {
+         uint32 size = prog->poolSize ? 2 * prog->poolSize : 256;
+         uint16 *pool = krealloc(prog->pool, size * sizeof *pool, GFP_KERNEL);
+
+         if (pool == NULL) {
+            return -ENOMEM;
+         }
+         prog->pool = pool;
+         prog->poolSize = size;
+      }
+      prog->pool[prog->poolLen++] = i;
+   }
+   list->len = prog->poolLen - list->off;
+
+   if (prev != NULL && prev->len == list->len &&
+       memcmp(prog->pool + prev->off, prog->pool + list->off,
+              list->len * sizeof *prog->pool) == 0) {
+      prog->poolLen = list->off;
+      *list = *prev;
+   }
+   return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetFilterCmpPort --
+ *
+ *      sort() comparison function for port interval boundaries.
+ *
+ * Results:
+ *      <0, 0, >0.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VNetFilterCmpPort(const void *a, // IN
+                  const void *b) // IN
+{
+   return (int)*(const uint32 *)a - (int)*(const uint32 *)b;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetFilterBuildPortTable --
+ *
+ *      Split the local port space of a TCP or UDP table into intervals
+ *      in which the same rules can match, and list those rules for
+ *      each interval.  Adjacent intervals with the same rules are
+ *      merged.
+ *
+ * Results:
+ *      0 on success, -ENOMEM on failure.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VNetFilterBuildPortTable(VNetFilterProg *prog,       // IN/OUT
+                         unsigned dir,               // IN
+                         unsigned family,            // IN
+                         int proto,                  // IN: TCP or UDP
+                         VNetFilterPortTable *table) // OUT
+{
+   uint32 *bounds;
+   uint32 numBounds = 1;
+   uint32 i;
+   uint32 j;
+   int retval = -ENOMEM;
+
+   for (i = 0; i < prog->numRules; i++) {
+      const VNetFilterRule *rule = prog->rules[i];
+
+      if (VNetFilterRuleApplies(rule, dir, family) && !rule->anyPort) {
+         numBounds += 2 * rule->numPorts;
+      }
+   }
+   bounds = kmalloc(numBounds * sizeof *bounds, GFP_KERNEL);
+   if (bounds == NULL) {
+      return -ENOMEM;
+   }
+
+   numBounds = 0;
+   bounds[numBounds++] = 0;
+   for (i = 0; i < prog->numRules; i++) {
+      const VNetFilterRule *rule = prog->rules[i];
+
+      if (!VNetFilterRuleApplies(rule, dir, family) || rule->anyPort ||
+          (rule->proto != VNET_FILTER_PROTO_ANY && rule->proto != proto)) {
+         continue;
+      }
+      for (j = 0; j < rule->numPorts; j++) {
+         bounds[numBounds++] = rule->ports[j].localLow;
+         if (rule->ports[j].localHigh < 0xffff) {
+            bounds[numBounds++] = rule->ports[j].localHigh + 1;
+         }
+      }
+   }
+   sort(bounds, numBounds, sizeof *bounds, VNetFilterCmpPort, NULL);
+
+   table->start = kmalloc(numBounds * sizeof *table->start, GFP_KERNEL);
+   table->lists = kmalloc(numBounds * sizeof *table->lists, GFP_KERNEL);
+   if (table->start == NULL || table->lists == NULL) {
+      goto out;
+   }
+
+   table->numIntervals = 0;
+   for (i = 0; i < numBounds; i++) {
+      const VNetFilterList *prev = NULL;
+      uint32 n = table->numIntervals;
+
+      if (i > 0 && bounds[i] == bounds[i - 1]) {
+         continue;
+      }
+      if (n > 0) {
+         prev = &table->lists[n - 1];
+      }
+      if (VNetFilterBuildList(prog, dir, family, proto, bounds[i], prev,
+                              &table->lists[n]) < 0) {
+         goto out;
+      }
+      if (prev != NULL && prev->off == table->lists[n].off &&
+          prev->len == table->lists[n].len) {
+         continue;   // same rules as the previous interval
+      }
+      table->start[n] = bounds[i];
+      table->numIntervals++;
+   }
+   retval = 0;
+
+out:
+   kfree(bounds);
+   return retval;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetFilterBuildTable --
+ *
+ *      Compile the rules of one direction and address family.
+ *
+ * Results:
+ *      0 on success, -ENOMEM on failure.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VNetFilterBuildTable(VNetFilterProg *prog, // IN/OUT
+                     unsigned dir,         // IN
+                     unsigned family)      // IN
+{
+   VNetFilterTable *table = &prog->tables[dir][family];
+   VNetFilterList anyList;
+   DECLARE_BITMAP(hasRules, 256);
+   uint32 i;
+   int retval;
+
+   bitmap_zero(hasRules, 256);
+   for (i = 0; i < prog->numRules; i++) {
+      const VNetFilterRule *rule = prog->rules[i];
+
+      if (VNetFilterRuleApplies(rule, dir, family) &&
+          rule->proto != VNET_FILTER_PROTO_ANY) {
+         __set_bit(rule->proto, hasRules);
+      }
+   }
+
+   /* Protocols without rules of their own share the list of the others. */
+   retval = VNetFilterBuildList(prog, dir, family, VNET_FILTER_PROTO_ANY, -1,
+                                NULL, &anyList);
+   if (retval < 0) {
+      return retval;
+   }
+   for (i = 0; i < 256; i++) {
+      if (VNetFilterIsPortProto(i) || test_bit(i, hasRules)) {
+         retval = VNetFilterBuildList(prog, dir, family, i, -1, NULL,
+                                      &table->byProto[i]);
+         if (retval < 0) {
+            return retval;
+         }
+      } else {
+         table->byProto[i] = anyList;
+      }
+   }
+
+   retval = VNetFilterBuildPortTable(prog, dir, family, IPPROTO_TCP,
+                                     &table->byPort[0]);
+   if (retval == 0) {
+      retval = VNetFilterBuildPortTable(prog, dir, family, IPPROTO_UDP,
+                                        &table->byPort[1]);
+   }
+   return retval;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetFilterFreeProg --
+ *
+ *      Free a compiled rule set.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetFilterFreeProg(VNetFilterProg *prog) // IN
+{
+   unsigned dir;
+   unsigned family;
+   unsigned k;
+
+   for (dir = 0; dir < 2; dir++) {
+      for (family = 0; family < 2; family++) {
+         for (k = 0; k < 2; k++) {
+            kfree(prog->tables[dir][family].byPort[k].start);
+            kfree(prog->tables[dir][family].byPort[k].lists);
+         }
+      }
+   }
+   VNetStats_Free(&prog->hits);
+   kfree(prog->pool);
+   kfree(prog->rules);
+   kfree(prog);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetFilterCompile --
+ *
+ *      Compile a rule set.  The rules themselves are shared with the
+ *      rule set, which must not be deleted while the program is in use.
+ *
+ * Results:
+ *      The program, or NULL if out of memory.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static VNetFilterProg *
+VNetFilterCompile(const VNetFilterRuleSet *set) // IN
+{
+   VNetFilterProg *prog;
+   unsigned dir;
+   unsigned family;
+
+   prog = kzalloc(sizeof *prog, GFP_KERNEL);
+   if (prog == NULL) {
+      return NULL;
+   }
+   prog->defaultAction = set->defaultAction;
+   prog->numRules = set->numRules;
+   prog->rules = kmalloc((set->numRules + 1) * sizeof *prog->rules,
+                         GFP_KERNEL);
+   if (prog->rules == NULL ||
+       VNetStats_Alloc(&prog->hits, NULL, set->numRules + 1) < 0) {
+      goto fail;
+   }
+   memcpy(prog->rules, set->rules, set->numRules * sizeof *prog->rules);
+
+   for (dir = 0; dir < 2; dir++) {
+      for (family = 0; family < 2; family++) {
+         if (VNetFilterBuildTable(prog, dir, family) < 0) {
+            goto fail;
+         }
+      }
+   }
+   return prog;
+
+fail:
+   VNetFilterFreeProg(prog);
+   return NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetFilterPublish --
+ *
+ *      Make 'prog', compiled from 'set', the active filter, or turn
+ *      filtering off if both are NULL.  vnetFilterMutex must be held.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Waits for readers of the previous program, adds its hit counts
+ *      to its rule set and frees it.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetFilterPublish(VNetFilterRuleSet *set, // IN: or NULL
+                  VNetFilterProg *prog)   // IN: or NULL
+{
+   VNetFilterProg *old = vnetFilterProg;
+   VNetFilterRuleSet *oldSet = vnetFilterActiveSet;
+
+   rcu_assign_pointer(vnetFilterProg, prog);
+   vnetFilterActiveSet = set;
+   if (old == NULL) {
+      return;
+   }
+
+   synchronize_rcu();
+   VNetStats_ReadRange(&old->hits, 0, oldSet->hits, old->numRules);
+   oldSet->defaultHits += VNetStats_Read(&old->hits, old->numRules);
+   VNetFilterFreeProg(old);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetFilterActivate --
+ *
+ *      (Re)compile a rule set and make it the active filter.
+ *      vnetFilterMutex must be held.
+ *
+ * Results:
+ *      0 on success, -ENOMEM on failure.
+ *
+ * Side effects:
+ *      The previously active rule set, if any, is deactivated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VNetFilterActivate(VNetFilterRuleSet *set) // IN
+{
+   VNetFilterProg *prog = VNetFilterCompile(set);
+
+   if (prog == NULL) {
+      return -ENOMEM;
+   }
+   VNetFilterPublish(set, prog);
+   return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetFilterFindRuleSet --
+ *
+ *      Look up a rule set by id.  vnetFilterMutex must be held.
+ *
+ * Results:
+ *      The rule set, or NULL.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static VNetFilterRuleSet *
+VNetFilterFindRuleSet(uint32 id) // IN
+{
+   VNetFilterRuleSet *set;
+
+   list_for_each_entry(set, &vnetFilterRuleSets, links) {
+      if (set->id == id) {
+         return set;
+      }
+   }
+   return NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetFilterFreeRuleSet --
+ *
+ *      Free an inactive rule set and its rules.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VNetFilterFreeRuleSet(VNetFilterRuleSet *set) // IN
+{
+   uint32 i;
+
+   for (i = 0; i < set->numRules; i++) {
+      kfree(set->rules[i]);
+   }
+   kfree(set->rules);
+   kfree(set->hits);
+   kfree(set);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetFilterCreateRuleSet --
+ * VNetFilterDeleteRuleSet --
+ * VNetFilterChangeRuleSet --
+ *
+ *      Handle the rule set subcommands.  vnetFilterMutex must be held.
+ *
+ * Results:
+ *      0 on success, -errno on failure.
+ *
+ * Side effects:
+ *      May change the active filter.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VNetFilterCreateRuleSet(const VNet_CreateRuleSet *cmd) // IN
+{
+   VNetFilterRuleSet *set;
+
+   if (cmd->header.len != sizeof *cmd || cmd->ruleSetId == 0 ||
+       (cmd->defaultAction != VNET_FILTER_RULE_BLOCK &&
+        cmd->defaultAction != VNET_FILTER_RULE_ALLOW)) {
+      return -EINVAL;
+   }
+   if (VNetFilterFindRuleSet(cmd->ruleSetId) != NULL) {
+      return -EEXIST;
+   }
+   if (vnetFilterNumRuleSets >= VNET_FILTER_MAX_RULE_SETS) {
+      return -ENOSPC;
+   }
+
+   set = kzalloc(sizeof *set, GFP_KERNEL);
+   if (set == NULL) {
+      return -ENOMEM;
+   }
+   set->id = cmd->ruleSetId;
+   set->defaultAction = cmd->defaultAction;
+   list_add_tail(&set->links, &vnetFilterRuleSets);
+   vnetFilterNumRuleSets++;
+   return 0;
+}
+
+static int
+VNetFilterDeleteRuleSet(const VNet_DeleteRuleSet *cmd) // IN
+{
+   VNetFilterRuleSet *set;
+
+   if (cmd->header.len != sizeof *cmd) {
+      return -EINVAL;
+   }
+   set = VNetFilterFindRuleSet(cmd->ruleSetId);
+   if (set == NULL) {
+      return -ENOENT;
+   }
+   if (set == vnetFilterActiveSet) {
+      return -EBUSY;
+   }
+   list_del(&set->links);
+   vnetFilterNumRuleSets--;
+   VNetFilterFreeRuleSet(set);
+   return 0;
+}
+
+static int
+VNetFilterChangeRuleSet(const VNet_ChangeRuleSet *cmd) // IN
+{
+   VNetFilterRuleSet *set;
+   uint32 oldDefault;
+   int retval = 0;
+
+   if (cmd->header.len != sizeof *cmd ||
+       (cmd->defaultAction != VNET_FILTER_RULE_NO_CHANGE &&
+        cmd->defaultAction != VNET_FILTER_RULE_BLOCK &&
+        cmd->defaultAction != VNET_FILTER_RULE_ALLOW) ||
+       (cmd->activate != VNET_FILTER_STATE_NO_CHANGE &&
+        cmd->activate != VNET_FILTER_STATE_ENABLE &&
+        cmd->activate != VNET_FILTER_STATE_DISABLE)) {
+      return -EINVAL;
+   }
+   set = VNetFilterFindRuleSet(cmd->ruleSetId);
+   if (set == NULL) {
+      return -ENOENT;
+   }
+
+   oldDefault = set->defaultAction;
+   if (cmd->defaultAction != VNET_FILTER_RULE_NO_CHANGE) {
+      set->defaultAction = cmd->defaultAction;
+   }
+
+   if (cmd->activate == VNET_FILTER_STATE_DISABLE) {
+      if (set == vnetFilterActiveSet) {
+         VNetFilterPublish(NULL, NULL);
+      }
+   } else if (cmd->activate == VNET_FILTER_STATE_ENABLE ||
+              (set == vnetFilterActiveSet &&
+               set->defaultAction != oldDefault)) {
+      retval = VNetFilterActivate(set);
+      if (retval < 0) {
+         set->defaultAction = oldDefault;
+      }
+   }
+   return retval;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetFilterGetPort --
+ *
+ *      Convert a port bound of the ioctl interface.
+ *
+ * Results:
+ *      TRUE if valid, with *port set; ~0 (don't care) becomes 'dflt'.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+VNetFilterGetPort(uint32 val,   // IN
+                  uint16 dflt,  // IN
+                  uint16 *port) // OUT
+{
+   if (val == VNET_FILTER_ANY) {
+      *port = dflt;
+      return TRUE;
+   }
+   if (val > 0xffff) {
+      return FALSE;
+   }
+   *port = val;
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetFilterAddRule --
+ *
+ *      Handle VNET_FILTER_CMD_ADD_IPV4_RULE and _ADD_IPV6_RULE, whose
+ *      fixed parts have the same layout.  vnetFilterMutex must be held.
+ *
+ * Results:
+ *      0 on success, -errno on failure.
+ *
+ * Side effects:
+ *      Recompiles the rule set if it is active.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VNetFilterAddRule(const VNet_AddIPv4Rule *cmd, // IN: IPv4 or IPv6 rule
+                  unsigned family)             // IN: VNET_FILTER_IPVx
+{
+   size_t addrSize = family == VNET_FILTER_IPV4 ? sizeof (VNet_IPv4Address) :
+                                                  sizeof (VNet_IPv6Address);
+   const uint8 *addrList = (const uint8 *)(cmd + 1);
+   const VNet_IPv4Port *portList;
+   VNetFilterRuleSet *set;
+   VNetFilterRule *rule;
+   uint32 i;
+   int retval;
+
+   ASSERT_ON_COMPILE(sizeof (VNet_AddIPv4Rule) == sizeof (VNet_AddIPv6Rule));
+
+   if (cmd->addressListLen == 0 || cmd->addressListLen > VNET_FILTER_MAX_LIST ||
+       cmd->portListLen == 0 || cmd->portListLen > VNET_FILTER_MAX_LIST ||
+       cmd->header.len != sizeof *cmd + cmd->addressListLen * addrSize +
+                          cmd->portListLen * sizeof (VNet_IPv4Port) ||
+       (cmd->action != VNET_FILTER_RULE_BLOCK &&
+        cmd->action != VNET_FILTER_RULE_ALLOW) ||
+       (cmd->direction != VNET_FILTER_DIRECTION_IN &&
+        cmd->direction != VNET_FILTER_DIRECTION_OUT &&
+        cmd->direction != VNET_FILTER_DIRECTION_BOTH) ||
+       (cmd->proto != VNET_FILTER_ANY && cmd->proto > 0xff)) {
+      return -EINVAL;
+   }
+   set = VNetFilterFindRuleSet(cmd->ruleSetId);
+   if (set == NULL) {
+      return -ENOENT;
+   }
+   if (set->numRules >= VNET_FILTER_MAX_RULES) {
+      return -ENOSPC;
+   }
+
+   rule = kzalloc(sizeof *rule +
+                  cmd->addressListLen * sizeof (VNetFilterAddr) +
+                  cmd->portListLen * sizeof (VNetFilterPortRange), GFP_KERNEL);
+   if (rule == NULL) {
+      return -ENOMEM;
+   }
+   rule->action = cmd->action;
+   rule->direction = cmd->direction;
+   rule->family = family;
+   rule->proto = cmd->proto == VNET_FILTER_ANY ? VNET_FILTER_PROTO_ANY :
+                                                 cmd->proto;
+   rule->numAddrs = cmd->addressListLen;
+   rule->numPorts = cmd->portListLen;
+   rule->addrs = (VNetFilterAddr *)(rule + 1);
+   rule->ports = (VNetFilterPortRange *)(rule->addrs + rule->numAddrs);
+
+   for (i = 0; i < rule->numAddrs; i++) {
+      VNetFilterAddr *a = &rule->addrs[i];
+      unsigned k;
+
+      if (family == VNET_FILTER_IPV4) {
+         const VNet_IPv4Address *v4 =
+            (const VNet_IPv4Address *)(addrList + i * addrSize);
+
+         a->addr[0] = v4->ipv4RemoteAddr;
+         a->mask[0] = v4->ipv4RemoteMask;
+      } else {
+         const VNet_IPv6Address *v6 =
+            (const VNet_IPv6Address *)(addrList + i * addrSize);
+
+         memcpy(a->addr, v6->ipv6RemoteAddr, sizeof a->addr);
+         memcpy(a->mask, v6->ipv6RemoteMask, sizeof a->mask);
+      }
+      for (k = 0; k < 4; k++) {
+         a->addr[k] &= a->mask[k];
+      }
+   }
+
+   portList = (const VNet_IPv4Port *)(addrList +
+                                      cmd->addressListLen * addrSize);
+   for (i = 0; i < rule->numPorts; i++) {
+      VNetFilterPortRange *p = &rule->ports[i];
+
+      if (!VNetFilterGetPort(portList[i].localPortLow, 0, &p->localLow) ||
+          !VNetFilterGetPort(portList[i].localPortHigh, 0xffff,
+                             &p->localHigh) ||
+          !VNetFilterGetPort(portList[i].remotePortLow, 0, &p->remoteLow) ||
+          !VNetFilterGetPort(portList[i].remotePortHigh, 0xffff,
+                             &p->remoteHigh) ||
+          p->localLow > p->localHigh || p->remoteLow > p->remoteHigh) {
+         kfree(rule);
+         return -EINVAL;
+      }
+      if (p->localLow == 0 && p->localHigh == 0xffff &&
+          p->remoteLow == 0 && p->remoteHigh == 0xffff) {
+         rule->anyPort = TRUE;
+      }
+   }
+
+   if (set->numRules == set->maxRules) {
+      uint32 maxRules = set->maxRules ? 2 * set->maxRules : 16;
+      VNetFilterRule **rules;
+      uint64 *hits;
+
+      rules = krealloc(set->rules, maxRules * sizeof *rules, GFP_KERNEL);
+      if (rules == NULL) {
+         kfree(rule);
+         return -ENOMEM;
+      }
+      set->rules = rules;
+      hits = krealloc(set->hits, maxRules * sizeof *hits, GFP_KERNEL);
+      if (hits == NULL) {
+         kfree(rule);
+         return -ENOMEM;
+      }
+      set->hits = hits;
+      set->maxRules = maxRules;
+   }
+   set->rules[set->numRules] = rule;
+   set->hits[set->numRules] = 0;
+   set->numRules++;
+
+   if (set == vnetFilterActiveSet) {
+      retval = VNetFilterActivate(set);
+      if (retval < 0) {
+         set->numRules--;
+         kfree(rule);
+         return retval;
+      }
+   }
+   return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetFilter_Ioctl --
+ *
+ *      Handle SIOCSFILTERRULES.  The argument starts with a
+ *      VNet_RuleHeader that selects the subcommand.
+ *
+ * Results:
+ *      0 on success, -errno on failure.
+ *
+ * Side effects:
+ *      May change the rule sets and the active filter.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+VNetFilter_Ioctl(unsigned long ioarg) // IN: user pointer to command
+{
+   VNet_RuleHeader hdr;
+   void *cmd;
+   int retval;
+
+   if (!capable(CAP_NET_ADMIN)) {
+      return -EPERM;
+   }
+   if (copy_from_user(&hdr, (void *)ioarg, sizeof hdr)) {
+      return -EFAULT;
+   }
+   if (hdr.type < VNET_FILTER_CMD_MIN || hdr.type > VNET_FILTER_CMD_MAX ||
+       hdr.ver != 1 || hdr.len < sizeof hdr ||
+       hdr.len > VNET_FILTER_MAX_CMD_LEN) {
+      return -EINVAL;
+   }
+
+   cmd = kmalloc(hdr.len, GFP_KERNEL);
+   if (cmd == NULL) {
+      return -ENOMEM;
+   }
+   if (copy_from_user(cmd, (void *)ioarg, hdr.len)) {
+      kfree(cmd);
+      return -EFAULT;
+   }
+   memcpy(cmd, &hdr, sizeof hdr);   // what was validated
+
+   mutex_lock(&vnetFilterMutex);
+   switch (hdr.type) {
+   case VNET_FILTER_CMD_CREATE_RULE_SET:
+      retval = hdr.len < sizeof (VNet_CreateRuleSet) ? -EINVAL :
+               VNetFilterCreateRuleSet(cmd);
+      break;
+   case VNET_FILTER_CMD_DELETE_RULE_SET:
+      retval = hdr.len < sizeof (VNet_DeleteRuleSet) ? -EINVAL :
+               VNetFilterDeleteRuleSet(cmd);
+      break;
+   case VNET_FILTER_CMD_ADD_IPV4_RULE:
+      retval = hdr.len < sizeof (VNet_AddIPv4Rule) ? -EINVAL :
+               VNetFilterAddRule(cmd, VNET_FILTER_IPV4);
+      break;
+   case VNET_FILTER_CMD_ADD_IPV6_RULE:
+      retval = hdr.len < sizeof (VNet_AddIPv6Rule) ? -EINVAL :
+               VNetFilterAddRule(cmd, VNET_FILTER_IPV6);
+      break;
+   case VNET_FILTER_CMD_CHANGE_RULE_SET:
+      retval = hdr.len < sizeof (VNet_ChangeRuleSet) ? -EINVAL :
+               VNetFilterChangeRuleSet(cmd);
+      break;
+   case VNET_FILTER_CMD_SET_LOG_LEVEL:
+      if (hdr.len != sizeof (VNet_SetLogLevel) ||
+          ((VNet_SetLogLevel *)cmd)->logLevel > VNET_FILTER_LOGLEVEL_MAXIMUM) {
+         retval = -EINVAL;
+      } else {
+         WRITE_ONCE(vnetFilterLogLevel, ((VNet_SetLogLevel *)cmd)->logLevel);
+         retval = 0;
+      }
+      break;
+   default:
+      retval = -EINVAL;
+      break;
+   }
+   mutex_unlock(&vnetFilterMutex);
+
+   kfree(cmd);
+   return retval;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetFilterParse --
+ *
+ *      Extract what the filter looks at from an Ethernet frame.  One
+ *      802.1Q tag is skipped.  Works on nonlinear skbs.
+ *
+ * Results:
+ *      TRUE for IPv4 and IPv6 packets, FALSE for anything else.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+VNetFilterParse(const struct sk_buff *skb, // IN: data at the MAC header
+                uint32 direction,          // IN: VNET_FILTER_DIRECTION_xxx
+                VNetFilterPacket *pkt)     // OUT
+{
+   unsigned int off = ETH_HLEN;
+   const __be16 *protoPtr;
+   const __be16 *ports;
+   __be16 buf[2];
+   __be16 proto;
+   Bool in = direction == VNET_FILTER_DIRECTION_IN;
+
+   protoPtr = skb_header_pointer(skb, offsetof(struct ethhdr, h_proto),
+                                 sizeof proto, &proto);
+   if (protoPtr == NULL) {
+      return FALSE;
+   }
+   proto = *protoPtr;
+   if (proto == htons(ETH_P_8021Q)) {
+      protoPtr = skb_header_pointer(skb, ETH_HLEN + 2, sizeof proto, &proto);
+      if (protoPtr == NULL) {
+         return FALSE;
+      }
+      proto = *protoPtr;
+      off += 4;
+   }
+
+   memset(pkt, 0, sizeof *pkt);
+   if (proto == htons(ETH_P_IP)) {
+      struct iphdr _iph;
+      const struct iphdr *iph;
+
+      iph = skb_header_pointer(skb, off, sizeof _iph, &_iph);
+      if (iph == NULL || iph->version != 4 || iph->ihl < 5) {
+         return FALSE;
+      }
+      pkt->family = VNET_FILTER_IPV4;
+      pkt->proto = iph->protocol;
+      pkt->remote[0] = in ? iph->saddr : iph->daddr;
+      pkt->hasPorts = (iph->frag_off & htons(IP_OFFSET)) == 0;
+      off += iph->ihl * 4;
+   } else if (proto == htons(ETH_P_IPV6)) {
+      struct ipv6hdr _ip6h;
+      const struct ipv6hdr *ip6h;
+      uint8 nexthdr;
+
+      ip6h = skb_header_pointer(skb, off, sizeof _ip6h, &_ip6h);
+      if (ip6h == NULL) {
+         return FALSE;
+      }
+      pkt->family = VNET_FILTER_IPV6;
+      memcpy(pkt->remote, in ? &ip6h->saddr : &ip6h->daddr,
+             sizeof pkt->remote);
+      nexthdr = ip6h->nexthdr;
+      off += sizeof *ip6h;
+      pkt->hasPorts = TRUE;
+#if IS_ENABLED(CONFIG_IPV6)
+      {
+         int end;
+#   if COMPAT_LINUX_VERSION_CHECK_LT(3, 3, 0)
+         end = ipv6_skip_exthdr(skb, off, &nexthdr);
+#   else
+         __be16 fragOff;
+
+         end = ipv6_skip_exthdr(skb, off, &nexthdr, &fragOff);
+         if (fragOff & htons(IP6_OFFSET)) {
+            pkt->hasPorts = FALSE;
+         }
+#   endif
+         if (end < 0) {
+            pkt->hasPorts = FALSE;
+         } else {
+            off = end;
+         }
+      }
+#endif
+      pkt->proto = nexthdr;
+   } else {
+      return FALSE;
+   }
+
+   if (pkt->hasPorts && VNetFilterIsPortProto(pkt->proto)) {
+      ports = skb_header_pointer(skb, off, sizeof buf, buf);
+      if (ports == NULL) {
+         pkt->hasPorts = FALSE;
+      } else {
+         pkt->localPort = ntohs(ports[in ? 1 : 0]);
+         pkt->remotePort = ntohs(ports[in ? 0 : 1]);
+      }
+   }
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetFilter_Drop --
+ *
+ *      Run a bridged frame through the active rule set, if any.  Safe
+ *      in any context.
+ *
+ * Results:
+ *      TRUE if the frame must be dropped.
+ *
+ * Side effects:
+ *      Counts the hit of the deciding rule.
+ *
+ *----------------------------------------------------------------------
+ */
+
+Bool
+VNetFilter_Drop(const struct sk_buff *skb, // IN: data at the MAC header
+                uint32 direction)          // IN: VNET_FILTER_DIRECTION_xxx
+{
+   VNetFilterProg *prog;
+   const VNetFilterTable *table;
+   const VNetFilterList *list;
+   VNetFilterPacket pkt;
+   uint32 action;
+   uint32 hit;
+   uint32 i;
+
+   if (READ_ONCE(vnetFilterProg) == NULL ||
+       !VNetFilterParse(skb, direction, &pkt)) {
+      return FALSE;
+   }
+
+   rcu_read_lock();
+   prog = rcu_dereference(vnetFilterProg);
+   if (prog == NULL) {
+      rcu_read_unlock();
+      return FALSE;
+   }
+
+   table = &prog->tables[direction == VNET_FILTER_DIRECTION_IN ?
+                         VNET_FILTER_IN : VNET_FILTER_OUT][pkt.family];
+   if (VNetFilterIsPortProto(pkt.proto) && pkt.hasPorts) {
+      const VNetFilterPortTable *pt =
+         &table->byPort[pkt.proto == IPPROTO_UDP];
+      uint32 lo = 0;
+      uint32 hi = pt->numIntervals - 1;
+
+      while (lo < hi) {
+         uint32 mid = (lo + hi + 1) / 2;
+
+         if (pt->start[mid] <= pkt.localPort) {
+            lo = mid;
+         } else {
+            hi = mid - 1;
+         }
+      }
+      list = &pt->lists[lo];
+   } else {
+      list = &table->byProto[pkt.proto];
+   }
+
+   hit = prog->numRules;
+   action = prog->defaultAction;
+   for (i = 0; i < list->len; i++) {
+      uint16 idx = prog->pool[list->off + i];
+
+      if (VNetFilterRuleMatch(prog->rules[idx], &pkt)) {
+         hit = idx;
+         action = prog->rules[idx]->action;
+         break;
+      }
+   }
+   VNetStats_Inc(&prog->hits, hit);
+   if (hit == prog->numRules) {
+      hit = -1;
+   }
+   rcu_read_unlock();
+
+   if (action != VNET_FILTER_RULE_BLOCK) {
+      return FALSE;
+   }
+   if (READ_ONCE(vnetFilterLogLevel) >= VNET_FILTER_LOGLEVEL_NORMAL &&
+       net_ratelimit()) {
+      LOG(0, (KERN_INFO "vmnet: filter blocked %s IPv%c packet, "
+              "protocol %u, rule %d\n",
+              direction == VNET_FILTER_DIRECTION_IN ? "inbound" : "outbound",
+              pkt.family == VNET_FILTER_IPV4 ? '4' : '6', pkt.proto,
+              (int)hit));
+   }
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetFilterProcShow --
+ *
+ *      Print the rule sets and per-rule hit counts to /proc/vmnet/filter.
+ *
+ * Results:
+ *      0.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VNetFilterProcShow(struct seq_file *p, // IN:
+                   void *v)            // IN: unused
+{
+   static const char * const dirNames[] = { "in", "out", "both" };
+   VNetFilterRuleSet *set;
+   uint32 i;
+
+   mutex_lock(&vnetFilterMutex);
+   seq_printf(p, "loglevel %u\n", vnetFilterLogLevel);
+   list_for_each_entry(set, &vnetFilterRuleSets, links) {
+      VNetFilterProg *prog = set == vnetFilterActiveSet ? vnetFilterProg :
+                                                          NULL;
+      uint64 hits = set->defaultHits;
+
+      if (prog != NULL) {
+         hits += VNetStats_Read(&prog->hits, prog->numRules);
+      }
+      seq_printf(p, "ruleset %u default %s%s hits %llu\n", set->id,
+                 set->defaultAction == VNET_FILTER_RULE_BLOCK ? "block" :
+                                                                "allow",
+                 prog != NULL ? " active" : "", (unsigned long long)hits);
+
+      for (i = 0; i < set->numRules; i++) {
+         const VNetFilterRule *rule = set->rules[i];
+
+         hits = set->hits[i];
+         if (prog != NULL && i < prog->numRules) {
+            hits += VNetStats_Read(&prog->hits, i);
+         }
+         seq_printf(p, "  rule %u ipv%c %s %s proto ", i,
+                    rule->family == VNET_FILTER_IPV4 ? '4' : '6',
+                    dirNames[rule->direction - VNET_FILTER_DIRECTION_IN],
+                    rule->action == VNET_FILTER_RULE_BLOCK ? "block" :
+                                                             "allow");
+         if (rule->proto == VNET_FILTER_PROTO_ANY) {
+            seq_printf(p, "any");
+         } else {
+            seq_printf(p, "%d", rule->proto);
+         }
+         seq_printf(p, " addrs %u ports %u hits %llu\n", rule->numAddrs,
+                    rule->anyPort ? 0 : rule->numPorts,
+                    (unsigned long long)hits);
+      }
+   }
+   mutex_unlock(&vnetFilterMutex);
+   return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetFilter_Init --
+ * VNetFilter_Cleanup --
+ *
+ *      Create /proc/vmnet/filter, or turn filtering off and free all
+ *      rule sets.
+ *
+ * Results:
+ *      errno.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+VNetFilter_Init(void)
+{
+   int retval;
+
+   retval = VNetProc_MakeSeqEntry("filter", S_IFREG, NULL, VNetFilterProcShow,
+                                  &vnetFilterProcEntry);
+   if (retval == -ENXIO) {
+      vnetFilterProcEntry = NULL;
+      return 0;
+   }
+   return retval;
+}
+
+void
+VNetFilter_Cleanup(void)
+{
+   VNetFilterRuleSet *set;
+   VNetFilterRuleSet *next;
+
+   if (vnetFilterProcEntry) {
+      VNetProc_RemoveEntry(vnetFilterProcEntry);
+      vnetFilterProcEntry = NULL;
+   }
+
+   mutex_lock(&vnetFilterMutex);
+   VNetFilterPublish(NULL, NULL);
+   list_for_each_entry_safe(set, next, &vnetFilterRuleSets, links) {
+      list_del(&set->links);
+      VNetFilterFreeRuleSet(set);
+   }
+   vnetFilterNumRuleSets = 0;
+   mutex_unlock(&vnetFilterMutex);
+}
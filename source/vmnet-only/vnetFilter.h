@@ -39,6 +39,12 @@
  * Call:
  *      Windows vmnet driver using IOCTL_VNET_FILTERHOST2.
  *      Linux vmnet driver using SIOCSFILTERRULES.
+ *
+ * On Linux the active rule set applies to the IP traffic of bridges:
+ * inbound is from the host network device to the virtual network,
+ * outbound the reverse, and "local" ports are those of the VM side.
+ * Port ranges only apply to TCP and UDP.  Per-rule hit counts are
+ * shown in /proc/vmnet/filter.
  */
 
 
@@ -47,7 +53,7 @@
 #define VNET_FILTER_CMD_CREATE_RULE_SET     0x1000
 #define VNET_FILTER_CMD_DELETE_RULE_SET     0x1001
 #define VNET_FILTER_CMD_ADD_IPV4_RULE       0x1002
-#define VNET_FILTER_CMD_ADD_IPV6_RULE       0x1003 /* not implemented */
+#define VNET_FILTER_CMD_ADD_IPV6_RULE       0x1003
 #define VNET_FILTER_CMD_CHANGE_RULE_SET     0x1004
 #define VNET_FILTER_CMD_SET_LOG_LEVEL       0x1005
 #define VNET_FILTER_CMD_MAX                 0x1005 /* equal to largest sub-command */
@@ -162,7 +168,37 @@ typedef struct VNet_IPv4Port {
 } VNet_IPv4Port;
 #pragma pack(pop)
 
-// typedef struct VNet_IPv4Port VNet_IPv6Port;
+typedef struct VNet_IPv4Port VNet_IPv6Port;
+
+#pragma pack(push, 1)
+typedef struct VNet_AddIPv6Rule {
+   VNet_RuleHeader header; /* type = VNET_FILTER_CMD_ADD_IPV6_RULE, ver = 1,
+                              len = sizeof(VNet_AddIPv6Rule) +
+                              addrListLen  * sizeof(VNet_IPv6Address) +
+                              protoListLen * sizeof(VNet_IPv6Port) */
+
+   uint32 ruleSetId;       /* same as VNet_AddIPv4Rule */
+   uint32 action;
+   uint32 direction;
+   uint32 addressListLen;  /* Number of VNet_IPv6Address's that follow. */
+   uint32 proto;           /* ~0 is don't care, otherwise the upper layer
+                              protocol after any extension headers */
+   uint32 portListLen;     /* Number of VNet_IPv6Port's that follow the
+                              VNet_IPv6Address's. */
+} VNet_AddIPv6Rule;
+#pragma pack(pop)
+
+/*
+ * VNet_AddIPv6Rule is immediately followed by 1 or more VNet_IPv6Address.
+ * The last VNet_IPv6Address is immediately followed by 1 or more VNet_IPv6Port.
+ */
+
+#pragma pack(push, 1)
+typedef struct VNet_IPv6Address {
+   uint8 ipv6RemoteAddr[16]; /* remote entity's address (dst on outbound, src on inbound) */
+   uint8 ipv6RemoteMask[16]; /* remote entity's mask, all 0 for don't care */
+} VNet_IPv6Address;
+#pragma pack(pop)
 
 #pragma pack(push, 1)
 typedef struct VNet_ChangeRuleSet {
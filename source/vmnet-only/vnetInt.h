@@ -25,10 +25,12 @@
 #include "vm_oui.h"
 #include "net.h"
 #include "vnetEvent.h"
+#include "vnetStats.h"
 
 #include <asm/page.h>
 
 #include <linux/mutex.h>
+#include <linux/rcupdate.h>
 
 #define INLINE inline
 
@@ -80,6 +82,8 @@
 #define VNET_MAX_JACK_NAME_LEN 16
 
 #define VNET_LADRF_LEN         8
+#define VNET_MCAST_HASH_SIZE   (VNET_LADRF_LEN * 8)   // one bucket per ladrf bit
+#define VNET_EXACT_FILTER_NONE 0xff
 
 #if ( defined(IFNAMSIZ) && (IFNAMSIZ >= 16) )
 #define VNET_NAME_LEN          IFNAMSIZ
@@ -97,11 +101,14 @@
  */
 typedef int (VNetProcReadFn)(char *page, char **start, off_t off,
                              int count, int *eof, void *data);
+struct seq_file;
+typedef int (VNetProcShowFn)(struct seq_file *p, void *data);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 10, 0)
 typedef struct VNetProcEntry {
    struct proc_dir_entry *pde;   /* Procfs node entry. */
    void *data;                   /* User data. */
    VNetProcReadFn *fn;           /* Callback fuction to read node. */
+   VNetProcShowFn *show;         /* Or seq_file callback, for large nodes. */
 } VNetProcEntry;
 #else
 typedef struct proc_dir_entry VNetProcEntry;
@@ -126,6 +133,7 @@ struct VNetJack {
    VNetProcEntry *procEntry;   // private field for containing object
    Bool           state;       // TRUE for enabled
    struct kref    kref;        // ref count
+   unsigned int   gsoTypes;    // SKB_GSO_xxx rcv accepts unsegmented
 
    void         (*free)(VNetJack *this);
    void         (*rcv)(VNetJack *this, struct sk_buff *skb);
@@ -146,10 +154,18 @@ struct VNetPort {
    unsigned    id;
    unsigned    hubNum;
    uint32      flags;
+   Bool        devPromisc;   // netif: host interface is promiscuous
    uint8       paddr[ETH_ALEN];
    uint8       ladrf[VNET_LADRF_LEN];
    uint8       exactFilter[VNET_MAX_EXACT_FILTER_LEN][ETHER_ADDR_LEN];
    uint32      exactFilterLen;
+   /*
+    * exactFilter entries chained by their ladrf hash; built by
+    * VNetSetMulticastFilter().  Both hold exactFilter indices, or
+    * VNET_EXACT_FILTER_NONE.
+    */
+   uint8       exactFilterHash[VNET_MCAST_HASH_SIZE];
+   uint8       exactFilterNext[VNET_MAX_EXACT_FILTER_LEN];
    
    VNetPort   *next;
    
@@ -180,14 +196,23 @@ int VNetConnect(VNetJack *jack1, VNetJack *jack2);
 VNetJack *VNetDisconnect(VNetJack *jack);
 
 void VNetSend(VNetJack *jack, struct sk_buff *skb);
+void VNetSendSegments(VNetJack *peer, struct sk_buff *skb);
 
 int VNetProc_MakeEntry(char *name, int mode, void *data,
                        VNetProcReadFn *fn, VNetProcEntry **ret);
 
+int VNetProc_MakeSeqEntry(char *name, int mode, void *data,
+                          VNetProcShowFn *fn, VNetProcEntry **ret);
+
 void VNetProc_RemoveEntry(VNetProcEntry *node);
 
 int VNetPrintJack(const VNetJack *jack, char *buf);
 
+int VNetFilter_Init(void);
+void VNetFilter_Cleanup(void);
+int VNetFilter_Ioctl(unsigned long ioarg);
+Bool VNetFilter_Drop(const struct sk_buff *skb, uint32 direction);
+
 int VNet_MakeMACAddress(VNetPort *port);
 
 int VNetSetMACUnique(VNetPort *port, const uint8 mac[ETH_ALEN]);
@@ -200,10 +225,14 @@ int VNetSetMACUnique(VNetPort *port, const uint8 mac[ETH_ALEN]);
 extern const uint8 allMultiFilter[VNET_LADRF_LEN];
 extern const uint8 broadcast[ETH_ALEN];
  
-Bool VNetPacketMatch(const uint8 *destAddr, const uint8 *ifAddr, 
-                     const uint8 *exactFilter, const uint32 exactFilterLen,
+Bool VNetPacketMatch(const uint8 *destAddr, const uint8 *ifAddr,
 		     const uint8 *ladrf, uint32 flags);
 
+Bool VNetPortPacketMatch(const VNetPort *port, const uint8 *destAddr);
+
+void VNetSetMulticastFilter(VNetPort *port, const uint8 *ladrf,
+                            const uint8 *exactFilter, uint32 exactFilterLen);
+
 Bool VNetCycleDetectIf(const char *name, int generation);
 
 int VNetPrintPort(const VNetPort *port, char *buf);
@@ -279,7 +308,7 @@ VNetPortsChanged(VNetJack *jack) // IN:
  * VNetIsBridged --
  *
  *      Check whether we are bridged.
- *      vnetPeerLock must be held.
+ *      Must be called under rcu_read_lock() or vnetStructureMutex.
  *
  * Results:
  *      0 - not bridged
@@ -296,9 +325,13 @@ VNetPortsChanged(VNetJack *jack) // IN:
 static INLINE int
 VNetIsBridged(VNetJack *jack) // IN: jack
 {
-   if (jack && jack->state && jack->peer && jack->peer->state &&
-       jack->peer->isBridged) {
-      return jack->peer->isBridged(jack->peer);
+   VNetJack *peer;
+
+   if (jack && jack->state) {
+      peer = rcu_dereference(jack->peer);
+      if (peer && peer->state && peer->isBridged) {
+         return peer->isBridged(peer);
+      }
    }
 
    return 0;
@@ -0,0 +1,300 @@
+/*********************************************************
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation version 2 and no later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ *********************************************************/
+
+/*
+ * vnetStats.c --
+ *
+ *    Per-CPU statistics for the vmnet module.
+ *
+ *    Every hub jack, userif and bridge owns a VNetStats with an array of
+ *    64-bit counters per CPU.  The packet paths bump the local CPU's copy
+ *    without locks or shared cache lines; readers add up all CPUs.
+ *
+ *    Registered statistics are also exported together through
+ *    /proc/vmnet/stats, one line per owner:
+ *
+ *       <owner> <counter>=<value> <counter>=<value> ...
+ *
+ *    The per-object procfs entries keep their historical text format.
+ *
+ *    The module's tracepoints (vnetTrace.h) are instantiated here too.
+ */
+
+#include "driver-config.h"
+
+#include <linux/kernel.h>
+#include <linux/version.h>
+#include <linux/netdevice.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+
+#include "vnetInt.h"
+
+#define CREATE_TRACE_POINTS
+#include "vnetTrace.h"
+
+static LIST_HEAD(vnetStatsList);
+static DEFINE_SPINLOCK(vnetStatsLock);
+static VNetProcEntry *vnetStatsProcEntry;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetStats_Alloc --
+ *
+ *      Allocate zeroed per-CPU counters.
+ *
+ * Results:
+ *      0 on success, -ENOMEM on failure.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+VNetStats_Alloc(VNetStats *stats,          // OUT
+                const char * const *names, // IN: counter names
+                unsigned numCounters)      // IN: number of counters
+{
+   stats->counters = __alloc_percpu(numCounters * sizeof (uint64),
+                                    __alignof__(uint64));
+   if (stats->counters == NULL) {
+      return -ENOMEM;
+   }
+   stats->names = names;
+   stats->numCounters = numCounters;
+   stats->owner = NULL;
+   INIT_LIST_HEAD(&stats->links);
+   return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetStats_Free --
+ *
+ *      Unregister the statistics if needed and free the counters.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+VNetStats_Free(VNetStats *stats) // IN
+{
+   if (stats->counters == NULL) {
+      return;
+   }
+   VNetStats_Unregister(stats);
+   free_percpu(stats->counters);
+   stats->counters = NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetStats_Register --
+ * VNetStats_Unregister --
+ *
+ *      Add or remove the statistics from /proc/vmnet/stats.  The owner
+ *      string must stay valid while registered.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+VNetStats_Register(VNetStats *stats,  // IN
+                   const char *owner) // IN: name to export under
+{
+   spin_lock_bh(&vnetStatsLock);
+   stats->owner = owner;
+   if (list_empty(&stats->links)) {
+      list_add_tail(&stats->links, &vnetStatsList);
+   }
+   spin_unlock_bh(&vnetStatsLock);
+}
+
+void
+VNetStats_Unregister(VNetStats *stats) // IN
+{
+   spin_lock_bh(&vnetStatsLock);
+   list_del_init(&stats->links);
+   spin_unlock_bh(&vnetStatsLock);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetStats_Read --
+ *
+ *      Sum a counter over all CPUs.
+ *
+ * Results:
+ *      Counter value.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+uint64
+VNetStats_Read(const VNetStats *stats, // IN
+               unsigned idx)           // IN: counter index
+{
+   uint64 sum = 0;
+   int cpu;
+
+   for_each_possible_cpu(cpu) {
+      sum += per_cpu_ptr(stats->counters, cpu)[idx];
+   }
+   return sum;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetStats_ReadRange --
+ *
+ *      Sum 'num' consecutive counters over all CPUs and add them to
+ *      'vals', e.g. to snapshot a histogram.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+VNetStats_ReadRange(const VNetStats *stats, // IN
+                    unsigned base,          // IN: first counter
+                    uint64 *vals,           // IN/OUT: num sums
+                    unsigned num)           // IN: number of counters
+{
+   int cpu;
+   unsigned i;
+
+   for_each_possible_cpu(cpu) {
+      const uint64 *counters = per_cpu_ptr(stats->counters, cpu) + base;
+
+      for (i = 0; i < num; i++) {
+         vals[i] += counters[i];
+      }
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetStatsProcShow --
+ *
+ *      Print all registered statistics to /proc/vmnet/stats.
+ *
+ * Results:
+ *      0.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VNetStatsProcShow(struct seq_file *p, // IN:
+                  void *v)            // IN: unused
+{
+   VNetStats *stats;
+   unsigned i;
+
+   spin_lock_bh(&vnetStatsLock);
+   list_for_each_entry(stats, &vnetStatsList, links) {
+      seq_printf(p, "%s", stats->owner);
+      for (i = 0; i < stats->numCounters; i++) {
+         seq_printf(p, " %s=%llu", stats->names[i],
+                    (unsigned long long)VNetStats_Read(stats, i));
+      }
+      seq_putc(p, '\n');
+   }
+   spin_unlock_bh(&vnetStatsLock);
+   return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetStats_ProcInit --
+ * VNetStats_ProcCleanup --
+ *
+ *      Create or remove /proc/vmnet/stats.
+ *
+ * Results:
+ *      errno.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+VNetStats_ProcInit(void)
+{
+   int retval;
+
+   retval = VNetProc_MakeSeqEntry("stats", S_IFREG, NULL, VNetStatsProcShow,
+                                  &vnetStatsProcEntry);
+   if (retval == -ENXIO) {
+      vnetStatsProcEntry = NULL;
+      return 0;
+   }
+   return retval;
+}
+
+void
+VNetStats_ProcCleanup(void)
+{
+   if (vnetStatsProcEntry) {
+      VNetProc_RemoveEntry(vnetStatsProcEntry);
+      vnetStatsProcEntry = NULL;
+   }
+}
@@ -0,0 +1,167 @@
+/*********************************************************
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation version 2 and no later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ *********************************************************/
+
+/*
+ * vnetStats.h --
+ *
+ *    Per-CPU packet statistics for hubs, ports and bridges.  Updates only
+ *    touch the local CPU's counters; readers sum over all CPUs.
+ *
+ *    The same counters back the optional instrumentation (vnet_instrument):
+ *    a log2 histogram is VNET_HIST_BUCKETS consecutive counters.
+ */
+
+#ifndef _VNETSTATS_H_
+#define _VNETSTATS_H_
+
+#include <linux/bitops.h>
+#include <linux/if_ether.h>
+#include <linux/list.h>
+#include <linux/percpu.h>
+#include <linux/skbuff.h>
+
+#include "vm_basic_types.h"
+#include "vnet.h"
+
+typedef struct VNetStats {
+   uint64 __percpu     *counters;     // numCounters counters per CPU
+   const char * const  *names;        // counter names
+   unsigned             numCounters;
+   const char          *owner;        // name shown in /proc/vmnet/stats
+   struct list_head     links;        // on the registered list
+} VNetStats;
+
+int VNetStats_Alloc(VNetStats *stats, const char * const *names,
+                    unsigned numCounters);
+void VNetStats_Free(VNetStats *stats);
+void VNetStats_Register(VNetStats *stats, const char *owner);
+void VNetStats_Unregister(VNetStats *stats);
+uint64 VNetStats_Read(const VNetStats *stats, unsigned idx);
+void VNetStats_ReadRange(const VNetStats *stats, unsigned base,
+                         uint64 *vals, unsigned num);
+
+int VNetStats_ProcInit(void);
+void VNetStats_ProcCleanup(void);
+
+extern uint vnet_instrument;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetStats_Add --
+ * VNetStats_Inc --
+ *
+ *      Bump a counter on the local CPU.  Safe from any context.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static inline void
+VNetStats_Add(VNetStats *stats, // IN
+              unsigned idx,     // IN: counter index
+              uint64 val)       // IN: amount
+{
+   this_cpu_add(stats->counters[idx], val);
+}
+
+static inline void
+VNetStats_Inc(VNetStats *stats, // IN
+              unsigned idx)     // IN: counter index
+{
+   this_cpu_inc(stats->counters[idx]);
+}
+
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetStats_HistBucket --
+ * VNetStats_Hist --
+ *
+ *      Find the log2 histogram bucket of a value, or count the value in
+ *      the histogram starting at counter 'base'.
+ *
+ * Results:
+ *      Bucket index 0 .. VNET_HIST_BUCKETS - 1; none.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static inline unsigned
+VNetStats_HistBucket(uint64 val) // IN
+{
+   unsigned bucket = fls64(val);
+
+   return bucket < VNET_HIST_BUCKETS ? bucket : VNET_HIST_BUCKETS - 1;
+}
+
+static inline void
+VNetStats_Hist(VNetStats *stats, // IN
+               unsigned base,    // IN: first bucket
+               uint64 val)       // IN: value to count
+{
+   VNetStats_Inc(stats, base + VNetStats_HistBucket(val));
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VNetStats_EtherType --
+ *
+ *      Classify an Ethernet frame for the per-EtherType counters.
+ *
+ * Results:
+ *      VNET_ETYPE_xxx.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static inline unsigned
+VNetStats_EtherType(const struct sk_buff *skb) // IN: frame, data at MAC header
+{
+   switch (((const struct ethhdr *)skb->data)->h_proto) {
+   case htons(ETH_P_IP):
+      return VNET_ETYPE_IPV4;
+   case htons(ETH_P_IPV6):
+      return VNET_ETYPE_IPV6;
+   case htons(ETH_P_ARP):
+      return VNET_ETYPE_ARP;
+   case htons(ETH_P_8021Q):
+   case htons(ETH_P_8021AD):
+      return VNET_ETYPE_VLAN;
+   default:
+      return VNET_ETYPE_OTHER;
+   }
+}
+
+#endif // _VNETSTATS_H_
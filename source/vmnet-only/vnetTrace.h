@@ -0,0 +1,125 @@
+/*********************************************************
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation version 2 and no later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ *********************************************************/
+
+/*
+ * vnetTrace.h --
+ *
+ *    Tracepoints of the vmnet module (events/vmnet/ in tracefs).  They
+ *    cost a static branch while disabled.  vnetStats.c instantiates them.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM vmnet
+
+#if !defined(_VNETTRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _VNETTRACE_H_
+
+#include <linux/tracepoint.h>
+#include "compat_version.h"
+
+/* Since 6.10 __assign_str() takes the source from __string(). */
+#if COMPAT_LINUX_VERSION_CHECK_LT(6, 10, 0)
+#define VNET_TRACE_ASSIGN_STR(dst, src) __assign_str(dst, src)
+#else
+#define VNET_TRACE_ASSIGN_STR(dst, src) __assign_str(dst)
+#endif
+
+/*
+ * A frame was taken off a userif receive queue by the reader.
+ */
+
+TRACE_EVENT(vmnet_userif_dequeue,
+   TP_PROTO(unsigned int portId, unsigned int queue, unsigned int len,
+            s64 sojournNs),
+   TP_ARGS(portId, queue, len, sojournNs),
+   TP_STRUCT__entry(
+      __field(unsigned int, portId)
+      __field(unsigned int, queue)
+      __field(unsigned int, len)
+      __field(s64, sojournNs)
+   ),
+   TP_fast_assign(
+      __entry->portId = portId;
+      __entry->queue = queue;
+      __entry->len = len;
+      __entry->sojournNs = sojournNs;
+   ),
+   TP_printk("userif%u queue %u len %u sojourn %lld ns",
+             __entry->portId, __entry->queue, __entry->len,
+             (long long)__entry->sojournNs)
+);
+
+/*
+ * A hub delivered a frame from one of its jacks to 'numDest' jacks.
+ */
+
+TRACE_EVENT(vmnet_hub_fanout,
+   TP_PROTO(const char *hub, int jack, unsigned int len, int numDest,
+            s64 ns),
+   TP_ARGS(hub, jack, len, numDest, ns),
+   TP_STRUCT__entry(
+      __string(hub, hub)
+      __field(int, jack)
+      __field(unsigned int, len)
+      __field(int, numDest)
+      __field(s64, ns)
+   ),
+   TP_fast_assign(
+      VNET_TRACE_ASSIGN_STR(hub, hub);
+      __entry->jack = jack;
+      __entry->len = len;
+      __entry->numDest = numDest;
+      __entry->ns = ns;
+   ),
+   TP_printk("%s jack %d len %u dest %d took %lld ns",
+             __get_str(hub), __entry->jack, __entry->len,
+             __entry->numDest, (long long)__entry->ns)
+);
+
+/*
+ * A bridge segmented a GSO frame from the host device in software.
+ */
+
+TRACE_EVENT(vmnet_bridge_segment,
+   TP_PROTO(const char *dev, unsigned int len, unsigned int gsoSize,
+            unsigned int numSegs),
+   TP_ARGS(dev, len, gsoSize, numSegs),
+   TP_STRUCT__entry(
+      __string(dev, dev)
+      __field(unsigned int, len)
+      __field(unsigned int, gsoSize)
+      __field(unsigned int, numSegs)
+   ),
+   TP_fast_assign(
+      VNET_TRACE_ASSIGN_STR(dev, dev);
+      __entry->len = len;
+      __entry->gsoSize = gsoSize;
+      __entry->numSegs = numSegs;
+   ),
+   TP_printk("bridge-%s len %u gso_size %u segs %u",
+             __get_str(dev), __entry->len, __entry->gsoSize,
+             __entry->numSegs)
+);
+
+#endif // _VNETTRACE_H_
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE vnetTrace
+#include <trace/define_trace.h>
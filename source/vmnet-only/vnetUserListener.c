@@ -109,10 +109,12 @@ VNetUserListener_Create(uint32 classMask,  // IN: the listener's class mask
    userListener->port.jack.cycleDetect = NULL;
    userListener->port.jack.portsChanged = NULL;
    userListener->port.jack.isBridged = NULL;
+   userListener->port.jack.gsoTypes = 0;
 
    /* initialize port */
    userListener->port.id = id++;
    userListener->port.flags = 0;
+   userListener->port.devPromisc = FALSE;
    memset(userListener->port.paddr, 0, sizeof userListener->port.paddr);
    memset(userListener->port.ladrf, 0, sizeof userListener->port.ladrf);
    userListener->port.next = NULL;